@@ -7,6 +7,8 @@
 #define NAMESPACE_HANDLER_ROOT (3) // Acts as a container handler where needed.
 #define NAMESPACE_HANDLER_INVALID (4) // For when a folder does not exist.
 
+#define FS_DIR_ENUMERATE_PAGE_COUNT (256)
+
 Array<Folder *> loadedFolders;
 
 #define MAXIMUM_FOLDERS_WITH_NO_ATTACHED_INSTANCES (20)
@@ -74,17 +76,36 @@ EsError FSDirEnumerate(Folder *folder) {
 		folder->readOnly = volume.flags & ES_VOLUME_READ_ONLY;
 	}
 
-	uintptr_t _entryCount;
-	EsError error;
-	EsDirectoryChild *buffer = EsDirectoryEnumerate(STRING(folder->path), &_entryCount, &error);
+	EsFileInformation directory = EsFileOpen(STRING(folder->path), ES_NODE_DIRECTORY | ES_NODE_FAIL_IF_NOT_FOUND);
+
+	if (directory.error != ES_SUCCESS) {
+		return directory.error;
+	}
+
+	// Read the directory a page at a time, so we don't need a buffer large enough for the whole directory.
+	EsDirectoryChild *buffer = (EsDirectoryChild *) EsHeapAllocate(sizeof(EsDirectoryChild) * FS_DIR_ENUMERATE_PAGE_COUNT, false);
+	EsDirectoryEnumerateCookie cookie = {};
+	EsError error = buffer ? ES_SUCCESS : ES_ERROR_INSUFFICIENT_RESOURCES;
+
+	while (buffer) {
+		ptrdiff_t result = EsDirectoryEnumeratePage(directory.handle, buffer, FS_DIR_ENUMERATE_PAGE_COUNT, &cookie);
 
-	if (error == ES_SUCCESS) {
-		for (uintptr_t i = 0; i < _entryCount; i++) {
+		if (ES_CHECK_ERROR(result)) {
+			error = result;
+			break;
+		}
+
+		for (intptr_t i = 0; i < result; i++) {
 			FolderAddEntry(folder, buffer[i].name, buffer[i].nameBytes, &buffer[i]);
 		}
+
+		if (result < FS_DIR_ENUMERATE_PAGE_COUNT) {
+			break;
+		}
 	}
 
 	EsHeapFree(buffer);
+	EsHandleClose(directory.handle);
 	return error;
 }
 
@@ -294,6 +294,10 @@ void UpdateDisplay(Instance *instance, int index) {
 		ADD_MEMORY_STATISTIC_DISPLAY("Core heap total size:", "%D (%d B)", statistics.coreHeapTotalSize, statistics.coreHeapTotalSize);
 		ADD_MEMORY_STATISTIC_DISPLAY("Cached boot FS nodes:", "%d", statistics.cachedNodes);
 		ADD_MEMORY_STATISTIC_DISPLAY("Cached boot FS directory entries:", "%d", statistics.cachedDirectoryEntries);
+		ADD_MEMORY_STATISTIC_DISPLAY("Loaded nodes:", "%d", statistics.loadedNodes);
+		ADD_MEMORY_STATISTIC_DISPLAY("Loaded directory entries:", "%d", statistics.loadedDirectoryEntries);
+		ADD_MEMORY_STATISTIC_DISPLAY("File system objects size:", "%D (maximum %D)", statistics.fileSystemObjectBytes, 
+				statistics.maximumFileSystemObjectBytes);
 		ADD_MEMORY_STATISTIC_DISPLAY("Maximum object cache size:", "%D (%d pages)", statistics.maximumObjectCachePages * ES_PAGE_SIZE, 
 				statistics.maximumObjectCachePages);
 		ADD_MEMORY_STATISTIC_DISPLAY("Approximate object cache size:", "%D (%d pages)", statistics.approximateObjectCacheSize, 
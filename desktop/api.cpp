@@ -213,6 +213,11 @@ struct {
 	Array<_EsMessageWithObject> postBox;
 	EsMutex postBoxMutex;
 
+#define RECEIVED_MESSAGES_BATCH_SIZE (32)
+	_EsMessageWithObject receivedMessages[RECEIVED_MESSAGES_BATCH_SIZE]; // Messages received from the kernel, not yet processed.
+	uintptr_t receivedMessagesPosition, receivedMessagesCount;
+	_EsMessageRing *messageRing; // Shared with the kernel; see ES_SYSCALL_MESSAGE_RING_CREATE.
+
 	Array<Timer> timers;
 	EsMutex timersMutex;
 	EsHandle timersThread;
@@ -884,6 +889,27 @@ void InstanceSendOpenMessage(EsInstance *instance, bool update) {
 	EsAssert(m.instanceOpen.file->operationComplete);
 }
 
+bool MessageRingGet(_EsMessageWithObject *message) {
+	_EsMessageRing *ring = api.messageRing;
+	uint32_t position = ring->readPosition;
+
+	if (position == __atomic_load_n(&ring->writePosition, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	_EsMessageRingEntry *entry = (_EsMessageRingEntry *) ((uint8_t *) ring + ring->entriesOffset) + (position & (ring->capacity - 1));
+
+	// The kernel might be merging a newer message into the entry.
+	while (!__sync_bool_compare_and_swap(&entry->state, ES_MESSAGE_RING_ENTRY_READY, ES_MESSAGE_RING_ENTRY_READING)) {
+		EsSchedulerYield();
+	}
+
+	*message = entry->message;
+	entry->state = ES_MESSAGE_RING_ENTRY_EMPTY;
+	__atomic_store_n(&ring->readPosition, position + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
 EsError GetMessage(_EsMessageWithObject *message) {
 	// Process posted messages first,
 	// so that messages like ES_MSG_WINDOW_DESTROYED are received last.
@@ -900,7 +926,23 @@ EsError GetMessage(_EsMessageWithObject *message) {
 	EsMutexRelease(&api.postBoxMutex);
 	if (gotMessage) return ES_SUCCESS;
 
-	return EsSyscall(ES_SYSCALL_MESSAGE_GET, (uintptr_t) message, 0, 0, 0);
+	// Receive messages from the kernel in batches, to reduce the number of system calls during bursts of input.
+	// Messages already received must be processed before those in the message ring,
+	// since the kernel only switches back to the ring once its message queue has been emptied.
+
+	if (api.receivedMessagesPosition == api.receivedMessagesCount) {
+		if (api.messageRing && MessageRingGet(message)) {
+			return ES_SUCCESS;
+		}
+
+		intptr_t count = EsSyscall(ES_SYSCALL_MESSAGE_GET, (uintptr_t) api.receivedMessages, RECEIVED_MESSAGES_BATCH_SIZE, 0, 0);
+		if (count < 0) return count;
+		api.receivedMessagesPosition = 0;
+		api.receivedMessagesCount = count;
+	}
+
+	*message = api.receivedMessages[api.receivedMessagesPosition++];
+	return ES_SUCCESS;
 }
 
 EsMessage *EsMessageReceive() {
@@ -1356,6 +1398,9 @@ extern "C" void _start(EsProcessStartupInformation *_startupInformation) {
 			0, sizeof(GlobalData), isDesktop ? ES_MEMORY_MAP_OBJECT_READ_WRITE : ES_MEMORY_MAP_OBJECT_READ_ONLY);
 	theming.scale = api.global->uiScale; // We'll receive ES_MSG_UI_SCALE_CHANGED when this changes.
 
+	intptr_t messageRing = EsSyscall(ES_SYSCALL_MESSAGE_RING_CREATE, 0, 0, 0, 0);
+	if (messageRing > 0) api.messageRing = (_EsMessageRing *) messageRing;
+
 #ifdef PROFILE_DESKTOP_FUNCTIONS
 	size_t profilingBufferSize = 64 * 1024 * 1024;
 	GfProfilingInitialise((ProfilingEntry *) EsHeapAllocate(profilingBufferSize, true), 
@@ -1126,6 +1126,462 @@ bool PipeTests() {
 
 //////////////////////////////////////////////////////////////
 
+#define KERNEL_MUTEX_BENCHMARK_ITERATIONS (100000)
+
+void KernelMutexBenchmarkThread(EsGeneric) {
+	// Reserving and unreserving address space each take the process's reserveMutex.
+	// The region is not committed, so that the physical memory manager's locks are not involved.
+	for (uintptr_t i = 0; i < KERNEL_MUTEX_BENCHMARK_ITERATIONS; i++) {
+		void *pointer = EsMemoryReserve(ES_PAGE_SIZE, ES_MEMORY_PROTECTION_READ_WRITE, ES_FLAGS_DEFAULT);
+		if (pointer) EsMemoryUnreserve(pointer, ES_PAGE_SIZE);
+	}
+}
+
+bool KernelMutexBenchmark() {
+	int checkIndex = 0;
+	size_t maximumThreads = EsSystemGetOptimalWorkQueueThreadCount();
+	if (maximumThreads > ES_MAX_WAIT_COUNT) maximumThreads = ES_MAX_WAIT_COUNT;
+
+	for (size_t threadCount = 1; threadCount <= maximumThreads; threadCount *= 2) {
+		EsHandle threads[ES_MAX_WAIT_COUNT];
+		EsPerformanceTimerPush();
+
+		for (uintptr_t i = 0; i < threadCount; i++) {
+			EsThreadInformation information;
+			CHECK(EsThreadCreate(KernelMutexBenchmarkThread, &information, nullptr) == ES_SUCCESS);
+			threads[i] = information.handle;
+		}
+
+		for (uintptr_t i = 0; i < threadCount; i++) {
+			EsWait(&threads[i], 1, ES_WAIT_NO_TIMEOUT);
+			EsHandleClose(threads[i]);
+		}
+
+		double time = EsPerformanceTimerPop();
+		EsPrint("Kernel mutex: %d thread(s), %d acquisitions in %F s (%d per second per thread).\n", threadCount, 
+				threadCount * KERNEL_MUTEX_BENCHMARK_ITERATIONS * 2, time, (int) (KERNEL_MUTEX_BENCHMARK_ITERATIONS * 2 / time));
+	}
+
+	return true;
+}
+
+//////////////////////////////////////////////////////////////
+
+#define HANDLE_RESOLVE_BENCHMARK_ITERATIONS (100000)
+
+EsHandle handleResolveBenchmarkSharedBuffer;
+
+void HandleResolveBenchmarkThread(EsGeneric argument) {
+	// Each thread either uses its own handle, or they all use the same handle.
+	EsHandle buffer = argument.u ? handleResolveBenchmarkSharedBuffer : EsConstantBufferCreate("a", 1, ES_CURRENT_PROCESS);
+
+	for (uintptr_t i = 0; i < HANDLE_RESOLVE_BENCHMARK_ITERATIONS; i++) {
+		EsConstantBufferGetSize(buffer);
+	}
+
+	if (!argument.u) EsHandleClose(buffer);
+}
+
+bool HandleResolveBenchmark() {
+	int checkIndex = 0;
+	handleResolveBenchmarkSharedBuffer = EsConstantBufferCreate("a", 1, ES_CURRENT_PROCESS);
+	CHECK(EsConstantBufferGetSize(handleResolveBenchmarkSharedBuffer) == 1);
+	size_t maximumThreads = EsSystemGetOptimalWorkQueueThreadCount();
+	if (maximumThreads > ES_MAX_WAIT_COUNT) maximumThreads = ES_MAX_WAIT_COUNT;
+
+	for (uintptr_t shared = 0; shared < 2; shared++) {
+		for (size_t threadCount = 1; threadCount <= maximumThreads; threadCount *= 2) {
+			EsHandle threads[ES_MAX_WAIT_COUNT];
+			EsPerformanceTimerPush();
+
+			for (uintptr_t i = 0; i < threadCount; i++) {
+				EsThreadInformation information;
+				CHECK(EsThreadCreate(HandleResolveBenchmarkThread, &information, shared) == ES_SUCCESS);
+				threads[i] = information.handle;
+			}
+
+			for (uintptr_t i = 0; i < threadCount; i++) {
+				EsWait(&threads[i], 1, ES_WAIT_NO_TIMEOUT);
+				EsHandleClose(threads[i]);
+			}
+
+			double time = EsPerformanceTimerPop();
+			EsPrint("Handle resolution: %d thread(s), %z handle, %d system calls in %F s (%d per second per thread).\n", threadCount, 
+					shared ? "shared" : "separate", threadCount * HANDLE_RESOLVE_BENCHMARK_ITERATIONS, time, 
+					(int) (HANDLE_RESOLVE_BENCHMARK_ITERATIONS / time));
+		}
+	}
+
+	EsHandleClose(handleResolveBenchmarkSharedBuffer);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////
+
+#define CONNECTION_BENCHMARK_BUFFER_BYTES (256 * 1024)
+#define CONNECTION_BENCHMARK_BYTES (64 * 1024 * 1024)
+#define CONNECTION_BENCHMARK_CHUNK (64 * 1024)
+#define CONNECTION_BENCHMARK_ROUND_TRIPS (10000)
+
+EsConnection connectionBenchmarkClient;
+
+void ConnectionBenchmarkWriterThread(EsGeneric) {
+	uint8_t *buffer = (uint8_t *) EsHeapAllocate(CONNECTION_BENCHMARK_CHUNK, false);
+	for (uintptr_t i = 0; i < CONNECTION_BENCHMARK_CHUNK; i++) buffer[i] = i;
+
+	for (uintptr_t i = 0; i < CONNECTION_BENCHMARK_BYTES / CONNECTION_BENCHMARK_CHUNK; i++) {
+		if (ES_SUCCESS != EsConnectionWriteSync(&connectionBenchmarkClient, buffer, CONNECTION_BENCHMARK_CHUNK)) break;
+	}
+
+	EsHeapFree(buffer);
+}
+
+bool ConnectionBenchmarkRead(EsConnection *connection, uint8_t *buffer, size_t bytes) {
+	while (bytes) {
+		size_t bytesRead;
+		if (ES_SUCCESS != EsConnectionRead(connection, buffer, bytes, &bytesRead)) return false;
+		buffer += bytesRead, bytes -= bytesRead;
+	}
+
+	return true;
+}
+
+bool ConnectionBenchmark() {
+	int checkIndex = 0;
+	EsConnection *client = &connectionBenchmarkClient;
+	EsConnection server = {};
+
+	// Listen on the loopback interface, and connect to it.
+
+	server.address.d[0] = 127, server.address.d[3] = 1;
+	server.sendBufferBytes = server.receiveBufferBytes = CONNECTION_BENCHMARK_BUFFER_BYTES;
+	CHECK(ES_SUCCESS == EsConnectionOpen(&server, ES_CONNECTION_OPEN_LISTEN));
+	CHECK(server.address.port);
+
+	client->address = server.address;
+	client->sendBufferBytes = client->receiveBufferBytes = CONNECTION_BENCHMARK_BUFFER_BYTES;
+	CHECK(ES_SUCCESS == EsConnectionOpen(client, ES_CONNECTION_OPEN_WAIT));
+
+	while (!server.open && server.error == ES_SUCCESS) {
+		EsConnectionPoll(&server);
+	}
+
+	CHECK(server.open);
+
+	// Measure the round-trip latency, by sending a byte back and forth.
+
+	EsPerformanceTimerPush();
+
+	for (uintptr_t i = 0; i < CONNECTION_BENCHMARK_ROUND_TRIPS; i++) {
+		uint8_t ping = i, pong = 0;
+		CHECK(ES_SUCCESS == EsConnectionWriteSync(client, &ping, 1));
+		CHECK(ConnectionBenchmarkRead(&server, &pong, 1) && pong == ping);
+		CHECK(ES_SUCCESS == EsConnectionWriteSync(&server, &pong, 1));
+		CHECK(ConnectionBenchmarkRead(client, &ping, 1) && pong == ping);
+	}
+
+	double time = EsPerformanceTimerPop();
+	EsPrint("Loopback connection: %d round trips in %F s (%d us per round trip).\n", 
+			CONNECTION_BENCHMARK_ROUND_TRIPS, time, (int) (time * 1000000 / CONNECTION_BENCHMARK_ROUND_TRIPS));
+
+	// Measure the throughput.
+
+	EsThreadInformation information;
+	uint8_t *buffer = (uint8_t *) EsHeapAllocate(CONNECTION_BENCHMARK_CHUNK, false);
+	size_t totalRead = 0;
+	bool correct = true;
+
+	EsPerformanceTimerPush();
+	CHECK(EsThreadCreate(ConnectionBenchmarkWriterThread, &information, nullptr) == ES_SUCCESS);
+
+	while (totalRead < CONNECTION_BENCHMARK_BYTES) {
+		size_t bytesRead;
+		if (ES_SUCCESS != EsConnectionRead(&server, buffer, CONNECTION_BENCHMARK_CHUNK, &bytesRead)) break;
+
+		for (uintptr_t i = 0; i < bytesRead; i++) {
+			if (buffer[i] != (uint8_t) (totalRead + i)) correct = false;
+		}
+
+		totalRead += bytesRead;
+	}
+
+	time = EsPerformanceTimerPop();
+	EsWait(&information.handle, 1, ES_WAIT_NO_TIMEOUT);
+	EsHandleClose(information.handle);
+	EsHeapFree(buffer);
+	EsPrint("Loopback connection: %d bytes in %F s (%d MB/s).\n", totalRead, time, (int) (totalRead / time / 1000000));
+	CHECK(totalRead == CONNECTION_BENCHMARK_BYTES);
+	CHECK(correct);
+
+	EsConnectionClose(client);
+	EsConnectionClose(&server);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////
+
+#define CONDITION_VARIABLE_TEST_ITERATIONS (100000)
+
+struct {
+	EsMutex mutex;
+	EsConditionVariable changed;
+	uintptr_t counter, turn;
+} conditionVariableTest;
+
+void ConditionVariableTestThread(EsGeneric argument) {
+	// Each thread waits for its turn, so every increment hands the mutex over to another thread.
+	for (uintptr_t i = 0; i < CONDITION_VARIABLE_TEST_ITERATIONS; i++) {
+		EsMutexAcquire(&conditionVariableTest.mutex);
+
+		while (conditionVariableTest.turn != argument.u) {
+			EsConditionVariableWait(&conditionVariableTest.changed, &conditionVariableTest.mutex);
+		}
+
+		conditionVariableTest.counter++;
+		conditionVariableTest.turn ^= 1;
+		EsConditionVariableNotify(&conditionVariableTest.changed, true);
+		EsMutexRelease(&conditionVariableTest.mutex);
+	}
+}
+
+bool ConditionVariableTest() {
+	int checkIndex = 0;
+	EsHandle threads[2];
+
+	EsMutexAcquire(&conditionVariableTest.mutex);
+	EsPerformanceTimerPush();
+	CHECK(!EsConditionVariableWait(&conditionVariableTest.changed, &conditionVariableTest.mutex, 100));
+	CHECK(EsPerformanceTimerPop() >= 0.09);
+	EsMutexRelease(&conditionVariableTest.mutex);
+
+	EsPerformanceTimerPush();
+
+	for (uintptr_t i = 0; i < 2; i++) {
+		EsThreadInformation information;
+		CHECK(EsThreadCreate(ConditionVariableTestThread, &information, i) == ES_SUCCESS);
+		threads[i] = information.handle;
+	}
+
+	for (uintptr_t i = 0; i < 2; i++) {
+		EsWait(&threads[i], 1, ES_WAIT_NO_TIMEOUT);
+		EsHandleClose(threads[i]);
+	}
+
+	double time = EsPerformanceTimerPop();
+	EsPrint("Condition variable: %d handoffs in %F s.\n", conditionVariableTest.counter, time);
+	CHECK(conditionVariableTest.counter == 2 * CONDITION_VARIABLE_TEST_ITERATIONS);
+	EsMutexDestroy(&conditionVariableTest.mutex);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////
+
+#define PIPE_BENCHMARK_BYTES (64 * 1024 * 1024)
+#define PIPE_BENCHMARK_CHUNK (64 * 1024)
+#define PIPE_SPLICE_TEST_BYTES (4 * 1024 * 1024)
+
+EsHandle pipeBenchmarkWriteEnd;
+EsHandle pipeSpliceTestFile;
+
+void PipeBenchmarkWriterThread(EsGeneric) {
+	uint8_t *buffer = (uint8_t *) EsHeapAllocate(PIPE_BENCHMARK_CHUNK, false);
+	for (uintptr_t i = 0; i < PIPE_BENCHMARK_CHUNK; i++) buffer[i] = i;
+
+	for (uintptr_t i = 0; i < PIPE_BENCHMARK_BYTES / PIPE_BENCHMARK_CHUNK; i++) {
+		// Split each chunk over two vectors, to check they are joined correctly.
+		EsPipeVector vectors[2] = { { buffer, 1000 }, { buffer + 1000, PIPE_BENCHMARK_CHUNK - 1000 } };
+		if (PIPE_BENCHMARK_CHUNK != EsPipeWriteVectored(pipeBenchmarkWriteEnd, vectors, 2)) break;
+	}
+
+	EsHandleClose(pipeBenchmarkWriteEnd);
+	EsHeapFree(buffer);
+}
+
+void PipeSpliceTestWriterThread(EsGeneric) {
+	EsPipeSplice(pipeBenchmarkWriteEnd, pipeSpliceTestFile, 0, PIPE_SPLICE_TEST_BYTES);
+	EsHandleClose(pipeBenchmarkWriteEnd);
+}
+
+bool PipeBenchmark() {
+	int checkIndex = 0;
+	EsHandle readEnd;
+	EsThreadInformation information;
+	uint8_t *buffer = (uint8_t *) EsHeapAllocate(PIPE_BENCHMARK_CHUNK, false);
+	size_t totalRead = 0;
+	bool correct = true;
+
+	// Measure the throughput of the pipe.
+
+	EsPipeCreate(&readEnd, &pipeBenchmarkWriteEnd);
+	EsPerformanceTimerPush();
+	CHECK(EsThreadCreate(PipeBenchmarkWriterThread, &information, nullptr) == ES_SUCCESS);
+
+	while (true) {
+		size_t bytesRead = EsPipeRead(readEnd, buffer, PIPE_BENCHMARK_CHUNK, true);
+		if (!bytesRead) break;
+
+		for (uintptr_t i = 0; i < bytesRead; i++) {
+			if (buffer[i] != (uint8_t) (totalRead + i)) correct = false;
+		}
+
+		totalRead += bytesRead;
+	}
+
+	double time = EsPerformanceTimerPop();
+	EsWait(&information.handle, 1, ES_WAIT_NO_TIMEOUT);
+	EsHandleClose(information.handle);
+	EsHandleClose(readEnd);
+	EsPrint("Pipe: %d bytes in %F s (%d MB/s).\n", totalRead, time, (int) (totalRead / time / 1000000));
+	CHECK(totalRead == PIPE_BENCHMARK_BYTES);
+	CHECK(correct);
+
+	// Splice a file into a pipe, and then the pipe into another file.
+
+	uint8_t *fileData = (uint8_t *) EsHeapAllocate(PIPE_SPLICE_TEST_BYTES, false);
+	for (uintptr_t i = 0; i < PIPE_SPLICE_TEST_BYTES; i++) fileData[i] = EsRandomU8();
+	CHECK(ES_SUCCESS == EsFileWriteAll(EsLiteral("|Settings:/splice1.dat"), fileData, PIPE_SPLICE_TEST_BYTES));
+
+	EsFileInformation source = EsFileOpen(EsLiteral("|Settings:/splice1.dat"), ES_FILE_READ);
+	EsFileInformation destination = EsFileOpen(EsLiteral("|Settings:/splice2.dat"), ES_FILE_WRITE | ES_NODE_FAIL_IF_FOUND);
+	CHECK(source.error == ES_SUCCESS && destination.error == ES_SUCCESS);
+	CHECK(ES_SUCCESS == EsFileResize(destination.handle, PIPE_SPLICE_TEST_BYTES));
+
+	EsPipeCreate(&readEnd, &pipeBenchmarkWriteEnd);
+	pipeSpliceTestFile = source.handle;
+	EsPerformanceTimerPush();
+	CHECK(EsThreadCreate(PipeSpliceTestWriterThread, &information, nullptr) == ES_SUCCESS);
+	totalRead = 0;
+
+	while (totalRead < PIPE_SPLICE_TEST_BYTES) {
+		EsFileOffsetDifference moved = EsPipeSplice(readEnd, destination.handle, totalRead, PIPE_SPLICE_TEST_BYTES - totalRead);
+		if (moved <= 0) break;
+		totalRead += moved;
+	}
+
+	time = EsPerformanceTimerPop();
+	EsWait(&information.handle, 1, ES_WAIT_NO_TIMEOUT);
+	EsHandleClose(information.handle);
+	EsHandleClose(readEnd);
+	EsHandleClose(source.handle);
+	EsHandleClose(destination.handle);
+	EsPrint("Pipe splice: %d bytes in %F s.\n", totalRead, time);
+	CHECK(totalRead == PIPE_SPLICE_TEST_BYTES);
+
+	size_t readSize;
+	void *readData = EsFileReadAll(EsLiteral("|Settings:/splice2.dat"), &readSize);
+	CHECK(readSize == PIPE_SPLICE_TEST_BYTES && 0 == EsMemoryCompare(readData, fileData, PIPE_SPLICE_TEST_BYTES));
+	EsHeapFree(readData);
+	EsHeapFree(fileData);
+	EsHeapFree(buffer);
+	CHECK(ES_SUCCESS == EsPathDelete(EsLiteral("|Settings:/splice1.dat")));
+	CHECK(ES_SUCCESS == EsPathDelete(EsLiteral("|Settings:/splice2.dat")));
+
+	return true;
+}
+
+//////////////////////////////////////////////////////////////
+
+#define IO_RING_TEST_BLOCK_SIZE (64 * 1024)
+#define IO_RING_TEST_BLOCK_COUNT (64)
+
+bool IORingTest() {
+	int checkIndex = 0;
+	EsIORing ring;
+	CHECK(ES_SUCCESS == EsIORingCreate(&ring, 16));
+
+	// Read a file in blocks, with many reads in progress at once.
+
+	uint8_t *fileData = (uint8_t *) EsHeapAllocate(IO_RING_TEST_BLOCK_SIZE * IO_RING_TEST_BLOCK_COUNT, false);
+	uint8_t *readData = (uint8_t *) EsHeapAllocate(IO_RING_TEST_BLOCK_SIZE * IO_RING_TEST_BLOCK_COUNT, true);
+	for (uintptr_t i = 0; i < IO_RING_TEST_BLOCK_SIZE * IO_RING_TEST_BLOCK_COUNT; i++) fileData[i] = EsRandomU8();
+	CHECK(ES_SUCCESS == EsFileWriteAll(EsLiteral("|Settings:/temp.dat"), fileData, IO_RING_TEST_BLOCK_SIZE * IO_RING_TEST_BLOCK_COUNT));
+	EsFileInformation file = EsFileOpen(EsLiteral("|Settings:/temp.dat"), ES_FILE_READ);
+	CHECK(file.error == ES_SUCCESS);
+
+	uintptr_t submitted = 0, completed = 0;
+	bool blockCompleted[IO_RING_TEST_BLOCK_COUNT] = {};
+	EsPerformanceTimerPush();
+
+	while (completed != IO_RING_TEST_BLOCK_COUNT) {
+		while (submitted != IO_RING_TEST_BLOCK_COUNT) {
+			EsIORequest request = {};
+			request.type = ES_IO_REQUEST_FILE_READ;
+			request.handle = file.handle;
+			request.offset = submitted * IO_RING_TEST_BLOCK_SIZE;
+			request.buffer = readData + submitted * IO_RING_TEST_BLOCK_SIZE;
+			request.bytes = IO_RING_TEST_BLOCK_SIZE;
+			request.context = submitted;
+			if (!EsIORingSubmit(&ring, &request)) break;
+			submitted++;
+		}
+
+		EsIOCompletion completion;
+		CHECK(EsIORingWait(&ring, &completion, 10000));
+		CHECK(completion.result == IO_RING_TEST_BLOCK_SIZE);
+		CHECK(completion.context.u < IO_RING_TEST_BLOCK_COUNT && !blockCompleted[completion.context.u]);
+		blockCompleted[completion.context.u] = true;
+		completed++;
+	}
+
+	EsPrint("IO ring: read %d blocks in %F s.\n", IO_RING_TEST_BLOCK_COUNT, EsPerformanceTimerPop());
+	CHECK(0 == EsMemoryCompare(fileData, readData, IO_RING_TEST_BLOCK_SIZE * IO_RING_TEST_BLOCK_COUNT));
+	EsHandleClose(file.handle);
+	EsHeapFree(fileData);
+	EsHeapFree(readData);
+	CHECK(ES_SUCCESS == EsPathDelete(EsLiteral("|Settings:/temp.dat")));
+
+	// Write to a pipe and read it back, with the read submitted first.
+
+	EsHandle readEnd, writeEnd;
+	EsPipeCreate(&readEnd, &writeEnd);
+	char pipeOutput[16] = {}, pipeInput[16] = "hello, world!";
+	EsIORequest requests[2] = {};
+	requests[0].type = ES_IO_REQUEST_PIPE_READ;
+	requests[0].handle = readEnd;
+	requests[0].buffer = pipeOutput;
+	requests[0].bytes = sizeof(pipeOutput);
+	requests[0].context = 1;
+	requests[1].type = ES_IO_REQUEST_PIPE_WRITE;
+	requests[1].handle = writeEnd;
+	requests[1].buffer = pipeInput;
+	requests[1].bytes = sizeof(pipeInput);
+	requests[1].context = 2;
+	CHECK(EsIORingSubmit(&ring, &requests[0]));
+	CHECK(EsIORingSubmit(&ring, &requests[1]));
+	CHECK(EsIORingFlush(&ring) == 2);
+
+	for (uintptr_t i = 0; i < 2; i++) {
+		EsIOCompletion completion;
+		CHECK(EsIORingWait(&ring, &completion, 10000));
+		CHECK(completion.result == sizeof(pipeInput));
+	}
+
+	CHECK(0 == EsMemoryCompare(pipeInput, pipeOutput, sizeof(pipeInput)));
+	EsHandleClose(readEnd);
+	EsHandleClose(writeEnd);
+
+	// Enumerate a directory.
+
+	EsFileInformation directory = EsFileOpen(EsLiteral("|Settings:"), ES_NODE_DIRECTORY);
+	CHECK(directory.error == ES_SUCCESS);
+	EsDirectoryChild children[16];
+	EsIORequest request = {};
+	request.type = ES_IO_REQUEST_DIRECTORY_ENUMERATE;
+	request.handle = directory.handle;
+	request.buffer = children;
+	request.bytes = sizeof(children);
+	CHECK(EsIORingSubmit(&ring, &request));
+	EsIOCompletion completion;
+	CHECK(EsIORingWait(&ring, &completion, 10000));
+	CHECK(completion.result >= 0 && completion.result <= 16);
+	EsHandleClose(directory.handle);
+
+	EsIORingDestroy(&ring);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////
+
 #include <bits/syscall.h>
 
 #define _exit(x)          EsPOSIXSystemCall(SYS_exit_group, (intptr_t) x, 0, 0, 0, 0, 0)
@@ -1343,6 +1799,413 @@ bool FileContentTypeTest() {
 
 //////////////////////////////////////////////////////////////
 
+#define FILE_ALLOCATION_BENCHMARK_FILES (8)
+#define FILE_ALLOCATION_BENCHMARK_CHUNK (64 * 1024)
+#define FILE_ALLOCATION_BENCHMARK_CHUNKS (64)
+
+bool FileAllocationBenchmark() {
+	int checkIndex = 0;
+	EsHandle files[FILE_ALLOCATION_BENCHMARK_FILES];
+	char paths[FILE_ALLOCATION_BENCHMARK_FILES][64];
+	size_t pathBytes[FILE_ALLOCATION_BENCHMARK_FILES];
+	uint8_t *chunk = (uint8_t *) EsHeapAllocate(FILE_ALLOCATION_BENCHMARK_CHUNK, false);
+	uint8_t *readData = (uint8_t *) EsHeapAllocate(FILE_ALLOCATION_BENCHMARK_CHUNK, false);
+	for (uintptr_t i = 0; i < FILE_ALLOCATION_BENCHMARK_CHUNK; i++) chunk[i] = EsRandomU8();
+
+	for (uintptr_t i = 0; i < FILE_ALLOCATION_BENCHMARK_FILES; i++) {
+		pathBytes[i] = EsStringFormat(paths[i], sizeof(paths[i]), "|Settings:/allocation%d.dat", i);
+		EsFileInformation file = EsFileOpen(paths[i], pathBytes[i], ES_FILE_WRITE | ES_NODE_FAIL_IF_FOUND);
+		CHECK(file.error == ES_SUCCESS);
+		files[i] = file.handle;
+	}
+
+	// Grow all the files at the same time, so that their allocations are interleaved.
+	// The allocator should still keep each file's extents together.
+
+	EsPerformanceTimerPush();
+
+	for (uintptr_t j = 0; j < FILE_ALLOCATION_BENCHMARK_CHUNKS; j++) {
+		for (uintptr_t i = 0; i < FILE_ALLOCATION_BENCHMARK_FILES; i++) {
+			CHECK(FILE_ALLOCATION_BENCHMARK_CHUNK == EsFileWriteSync(files[i], j * FILE_ALLOCATION_BENCHMARK_CHUNK, FILE_ALLOCATION_BENCHMARK_CHUNK, chunk));
+		}
+	}
+
+	for (uintptr_t i = 0; i < FILE_ALLOCATION_BENCHMARK_FILES; i++) {
+		CHECK(ES_SUCCESS == EsFileControl(files[i], ES_FILE_CONTROL_FLUSH, nullptr, 0));
+	}
+
+	double writeTime = EsPerformanceTimerPop();
+
+	// Measure the fragmentation: a file in one contiguous run of blocks has one extent.
+
+	uint64_t totalExtents = 0, maximumExtents = 0;
+	bool countedExtents = true;
+
+	for (uintptr_t i = 0; i < FILE_ALLOCATION_BENCHMARK_FILES; i++) {
+		uint64_t extentCount = 0;
+		EsError error = EsFileControl(files[i], ES_FILE_CONTROL_GET_EXTENT_COUNT, &extentCount, sizeof(extentCount));
+		CHECK(error == ES_SUCCESS || error == ES_ERROR_UNSUPPORTED);
+		if (error != ES_SUCCESS) countedExtents = false;
+		totalExtents += extentCount;
+		if (extentCount > maximumExtents) maximumExtents = extentCount;
+		EsHandleClose(files[i]);
+	}
+
+	// Read the files back one after another.
+
+	EsPerformanceTimerPush();
+
+	for (uintptr_t i = 0; i < FILE_ALLOCATION_BENCHMARK_FILES; i++) {
+		EsFileInformation file = EsFileOpen(paths[i], pathBytes[i], ES_FILE_READ);
+		CHECK(file.error == ES_SUCCESS);
+		CHECK(file.size == FILE_ALLOCATION_BENCHMARK_CHUNK * FILE_ALLOCATION_BENCHMARK_CHUNKS);
+
+		for (uintptr_t j = 0; j < FILE_ALLOCATION_BENCHMARK_CHUNKS; j++) {
+			CHECK(FILE_ALLOCATION_BENCHMARK_CHUNK == EsFileReadSync(file.handle, j * FILE_ALLOCATION_BENCHMARK_CHUNK, FILE_ALLOCATION_BENCHMARK_CHUNK, readData));
+			CHECK(0 == EsMemoryCompare(chunk, readData, FILE_ALLOCATION_BENCHMARK_CHUNK));
+		}
+
+		EsHandleClose(file.handle);
+	}
+
+	double readTime = EsPerformanceTimerPop();
+	size_t totalBytes = FILE_ALLOCATION_BENCHMARK_FILES * FILE_ALLOCATION_BENCHMARK_CHUNK * FILE_ALLOCATION_BENCHMARK_CHUNKS;
+	EsPrint("File allocation: wrote %d bytes across %d files in %F s (%d MB/s), read back in %F s (%d MB/s).\n", 
+			totalBytes, FILE_ALLOCATION_BENCHMARK_FILES, writeTime, (int) (totalBytes / writeTime / 1000000), readTime, (int) (totalBytes / readTime / 1000000));
+
+	if (countedExtents) {
+		EsPrint("File allocation: %F extents per file on average, at most %d (%d chunks written to each).\n", 
+				(double) totalExtents / FILE_ALLOCATION_BENCHMARK_FILES, maximumExtents, FILE_ALLOCATION_BENCHMARK_CHUNKS);
+	} else {
+		EsPrint("File allocation: the file system cannot report extent counts.\n");
+	}
+
+	for (uintptr_t i = 0; i < FILE_ALLOCATION_BENCHMARK_FILES; i++) {
+		CHECK(ES_SUCCESS == EsPathDelete(paths[i], pathBytes[i]));
+	}
+
+	EsHeapFree(chunk);
+	EsHeapFree(readData);
+
+	return true;
+}
+
+//////////////////////////////////////////////////////////////
+
+#define PATH_LOOKUP_BENCHMARK_ITERATIONS (20000)
+
+bool PathLookupBenchmark() {
+	int checkIndex = 0;
+
+	const char *folders[] = {
+		"|Settings:/lookup",
+		"|Settings:/lookup/a",
+		"|Settings:/lookup/a/b",
+		"|Settings:/lookup/a/b/c",
+		"|Settings:/lookup/a/b/c/d",
+		"|Settings:/lookup/a/b/c/d/e",
+		"|Settings:/lookup/a/b/c/d/e/f",
+		"|Settings:/lookup/a/b/c/d/e/f/g",
+	};
+
+	const char *deepPath = "|Settings:/lookup/a/b/c/d/e/f/g/file.txt";
+	const char *missingPath = "|Settings:/lookup/a/b/c/d/e/f/g/missing.h";
+
+	EsFileInformation file = EsFileOpen(deepPath, -1, ES_FILE_WRITE | ES_NODE_CREATE_DIRECTORIES);
+	CHECK(file.error == ES_SUCCESS);
+	EsHandleClose(file.handle);
+
+	// Look up a file at the end of a deep path.
+
+	EsPerformanceTimerPush();
+
+	for (uintptr_t i = 0; i < PATH_LOOKUP_BENCHMARK_ITERATIONS; i++) {
+		CHECK(EsPathExists(deepPath, -1));
+	}
+
+	double deepTime = EsPerformanceTimerPop();
+
+	// Probe for a file that doesn't exist, like a compiler searching its include paths.
+
+	EsPerformanceTimerPush();
+
+	for (uintptr_t i = 0; i < PATH_LOOKUP_BENCHMARK_ITERATIONS; i++) {
+		CHECK(!EsPathExists(missingPath, -1));
+	}
+
+	double missingTime = EsPerformanceTimerPop();
+
+	EsPrint("Path lookup: %d deep lookups/s, %d missing file probes/s.\n", 
+			(int) (PATH_LOOKUP_BENCHMARK_ITERATIONS / deepTime), (int) (PATH_LOOKUP_BENCHMARK_ITERATIONS / missingTime));
+
+	// Creating the missing file must make it visible, even though it was remembered as not existing.
+
+	file = EsFileOpen(missingPath, -1, ES_FILE_WRITE | ES_NODE_FAIL_IF_FOUND);
+	CHECK(file.error == ES_SUCCESS);
+	EsHandleClose(file.handle);
+	CHECK(EsPathExists(missingPath, -1));
+
+	CHECK(ES_SUCCESS == EsPathDelete(missingPath, -1));
+	CHECK(!EsPathExists(missingPath, -1));
+	CHECK(ES_SUCCESS == EsPathDelete(deepPath, -1));
+
+	for (intptr_t i = sizeof(folders) / sizeof(folders[0]) - 1; i >= 0; i--) {
+		CHECK(ES_SUCCESS == EsPathDelete(folders[i], -1));
+	}
+
+	return true;
+}
+
+//////////////////////////////////////////////////////////////
+
+bool DirectoryEnumeratePages() {
+	int checkIndex = 0;
+
+	const size_t fileCount = 50;
+	bool seen[fileCount] = {};
+	char path[64];
+
+	CHECK(ES_SUCCESS == EsPathCreate("|Settings:/pages", -1, ES_NODE_DIRECTORY, false));
+
+	for (uintptr_t i = 0; i < fileCount; i++) {
+		size_t pathBytes = EsStringFormat(path, sizeof(path), "|Settings:/pages/%d.txt", i);
+		CHECK(ES_SUCCESS == EsPathCreate(path, pathBytes, ES_NODE_FILE, false));
+	}
+
+	EsFileInformation directory = EsFileOpen("|Settings:/pages", -1, ES_NODE_DIRECTORY | ES_NODE_FAIL_IF_NOT_FOUND);
+	CHECK(directory.error == ES_SUCCESS);
+
+	// Enumerate the directory in small pages, deleting a file that has already been returned between pages.
+	// Every child must be returned exactly once.
+
+	EsDirectoryChild children[7];
+	EsDirectoryEnumerateCookie cookie = {};
+	size_t total = 0;
+	bool deleted = false;
+
+	while (true) {
+		ptrdiff_t result = EsDirectoryEnumeratePage(directory.handle, children, 7, &cookie, ES_DIRECTORY_ENUMERATE_NAMES_ONLY);
+		CHECK(result >= 0 && result <= 7);
+
+		for (intptr_t i = 0; i < result; i++) {
+			int64_t index = EsIntegerParse(children[i].name, children[i].nameBytes);
+			CHECK(index >= 0 && index < (int64_t) fileCount && !seen[index]);
+			CHECK(children[i].type == ES_NODE_FILE);
+			seen[index] = true;
+			total++;
+		}
+
+		if (!deleted && result) {
+			size_t pathBytes = EsStringFormat(path, sizeof(path), "|Settings:/pages/%s", children[0].nameBytes, children[0].name);
+			CHECK(ES_SUCCESS == EsPathDelete(path, pathBytes));
+			deleted = true;
+		}
+
+		if (result < 7) break;
+	}
+
+	CHECK(total == fileCount);
+	EsHandleClose(directory.handle);
+
+	// EsDirectoryEnumerate should return the remaining children.
+
+	size_t count;
+	EsError error;
+	EsDirectoryChild *buffer = EsDirectoryEnumerate("|Settings:/pages", -1, &count, &error);
+	CHECK(error == ES_SUCCESS && count == fileCount - 1);
+
+	for (uintptr_t i = 0; i < count; i++) {
+		size_t pathBytes = EsStringFormat(path, sizeof(path), "|Settings:/pages/%s", buffer[i].nameBytes, buffer[i].name);
+		CHECK(ES_SUCCESS == EsPathDelete(path, pathBytes));
+	}
+
+	EsHeapFree(buffer);
+	CHECK(ES_SUCCESS == EsPathDelete("|Settings:/pages", -1));
+
+	return true;
+}
+
+//////////////////////////////////////////////////////////////
+
+#define INDEX_COLLISION_GROUPS (200)
+#define INDEX_COLLISION_PLAIN_FILES (200)
+#define INDEX_COLLISION_SUFFIX_BYTES (16)
+
+uint8_t indexCollisionDifferences[2][INDEX_COLLISION_SUFFIX_BYTES];
+
+bool IndexCollisionFindDifferences() {
+	// For names of a fixed length, CRC-64 is affine: the hashes of S and S ^ D only differ by a linear function of D.
+	// Find two differences D in the kernel of that function which only change the low 5 bits of each byte,
+	// so that names ending in the suffixes '@@..@' ^ D all have the same hash and stay printable.
+
+	struct { uint64_t value; uint8_t combination[INDEX_COLLISION_SUFFIX_BYTES]; } basis[64] = {};
+	uint8_t base[INDEX_COLLISION_SUFFIX_BYTES];
+	EsMemoryFill(base, base + sizeof(base), '@');
+	uint64_t baseHash = CalculateCRC64(base, sizeof(base), 0);
+	uintptr_t found = 0;
+
+	for (uintptr_t i = 0; i < INDEX_COLLISION_SUFFIX_BYTES * 5 && found < 2; i++) {
+		uint8_t combination[INDEX_COLLISION_SUFFIX_BYTES] = {};
+		combination[i / 5] = 1 << (i % 5);
+		base[i / 5] ^= combination[i / 5];
+		uint64_t value = CalculateCRC64(base, sizeof(base), 0) ^ baseHash;
+		base[i / 5] ^= combination[i / 5];
+		bool independent = false;
+
+		for (int bit = 63; bit >= 0; bit--) {
+			if (~value & ((uint64_t) 1 << bit)) continue;
+
+			if (!basis[bit].value) {
+				basis[bit].value = value;
+				EsMemoryCopy(basis[bit].combination, combination, sizeof(combination));
+				independent = true;
+				break;
+			}
+
+			value ^= basis[bit].value;
+			for (uintptr_t j = 0; j < INDEX_COLLISION_SUFFIX_BYTES; j++) combination[j] ^= basis[bit].combination[j];
+		}
+
+		if (!independent) {
+			EsMemoryCopy(indexCollisionDifferences[found++], combination, sizeof(combination));
+		}
+	}
+
+	return found == 2;
+}
+
+size_t IndexCollisionName(char *buffer, size_t bufferBytes, uintptr_t group, uintptr_t member) {
+	// Members 0 to 3 of a group all have the same hash. Member 3 is never created.
+	// Groups of INDEX_COLLISION_GROUPS and above are plain files, with a name of their own.
+
+	if (group >= INDEX_COLLISION_GROUPS) {
+		return EsStringFormat(buffer, bufferBytes, "plain %d", group - INDEX_COLLISION_GROUPS);
+	}
+
+	char suffix[INDEX_COLLISION_SUFFIX_BYTES];
+
+	for (uintptr_t i = 0; i < INDEX_COLLISION_SUFFIX_BYTES; i++) {
+		suffix[i] = '@' ^ ((member & 1) ? indexCollisionDifferences[0][i] : 0) ^ ((member & 2) ? indexCollisionDifferences[1][i] : 0);
+	}
+
+	return EsStringFormat(buffer, bufferBytes, "%d-%s", group, INDEX_COLLISION_SUFFIX_BYTES, suffix);
+}
+
+bool IndexCollisionDeleted(uintptr_t group, uintptr_t member) {
+	// Which files are deleted in the second phase. This removes the entry the index key refers to from some groups,
+	// another entry from others, and leaves a single entry in the rest, so that the key is no longer marked.
+	// Half of the plain files are also deleted, so that vertices of the index are merged.
+
+	if (group >= INDEX_COLLISION_GROUPS) return group & 1;
+	if (group % 3 == 0) return member == 0;
+	if (group % 3 == 1) return member == 1;
+	return member != 2;
+}
+
+bool IndexCollisionCheckFiles(bool afterDelete) {
+	int checkIndex = 0;
+	char name[64], path[96];
+
+	for (uintptr_t group = 0; group < INDEX_COLLISION_GROUPS + INDEX_COLLISION_PLAIN_FILES; group++) {
+		for (uintptr_t member = 0; member < (group < INDEX_COLLISION_GROUPS ? 4 : 1); member++) {
+			size_t nameBytes = IndexCollisionName(name, sizeof(name), group, member);
+			size_t pathBytes = EsStringFormat(path, sizeof(path), "|Settings:/collisions/%s", nameBytes, name);
+			bool exists = member != 3 && (!afterDelete || !IndexCollisionDeleted(group, member));
+
+			if (exists) {
+				size_t fileBytes;
+				char *file = (char *) EsFileReadAll(path, pathBytes, &fileBytes);
+				CHECK(file && fileBytes == nameBytes && 0 == EsMemoryCompare(file, name, nameBytes));
+				EsHeapFree(file);
+			} else {
+				CHECK(!EsPathExists(path, pathBytes));
+			}
+		}
+	}
+
+	return true;
+}
+
+bool IndexHashCollisions() {
+	// Create and remove files whose names have the same CRC-64, in a directory large enough to split the index.
+	// The system is restarted between the phases, so that the lookups go through the file system driver
+	// rather than the kernel's cache of directory entries.
+
+	int checkIndex = 0;
+	char name[64], path[96];
+
+	size_t phaseBytes;
+	uint32_t *phaseData = (uint32_t *) EsFileReadAll(EsLiteral("|Settings:/collisions_phase.dat"), &phaseBytes);
+	uint32_t phase = phaseBytes == sizeof(uint32_t) ? *phaseData : 0;
+	EsHeapFree(phaseData);
+
+	CHECK(IndexCollisionFindDifferences());
+
+	for (uintptr_t member = 1; member < 4; member++) {
+		size_t nameBytes0 = IndexCollisionName(path, sizeof(path), 0, 0);
+		size_t nameBytes = IndexCollisionName(name, sizeof(name), 0, member);
+		CHECK(nameBytes == nameBytes0 && EsMemoryCompare(name, path, nameBytes));
+		CHECK(CalculateCRC64(name, nameBytes, 0) == CalculateCRC64(path, nameBytes0, 0));
+	}
+
+	if (phase == 0) {
+		CHECK(ES_SUCCESS == EsPathCreate("|Settings:/collisions", -1, ES_NODE_DIRECTORY, false));
+
+		for (uintptr_t member = 0; member < 3; member++) {
+			for (uintptr_t group = 0; group < INDEX_COLLISION_GROUPS + INDEX_COLLISION_PLAIN_FILES; group++) {
+				if (member && group >= INDEX_COLLISION_GROUPS) continue;
+				size_t nameBytes = IndexCollisionName(name, sizeof(name), group, member);
+				size_t pathBytes = EsStringFormat(path, sizeof(path), "|Settings:/collisions/%s", nameBytes, name);
+				CHECK(ES_SUCCESS == EsFileWriteAll(path, pathBytes, name, nameBytes));
+			}
+		}
+
+		CHECK(IndexCollisionCheckFiles(false));
+	} else if (phase == 1) {
+		CHECK(IndexCollisionCheckFiles(false));
+
+		for (uintptr_t group = 0; group < INDEX_COLLISION_GROUPS + INDEX_COLLISION_PLAIN_FILES; group++) {
+			for (uintptr_t member = 0; member < 3; member++) {
+				if (!IndexCollisionDeleted(group, member)) continue;
+				size_t nameBytes = IndexCollisionName(name, sizeof(name), group, member);
+				size_t pathBytes = EsStringFormat(path, sizeof(path), "|Settings:/collisions/%s", nameBytes, name);
+				CHECK(ES_SUCCESS == EsPathDelete(path, pathBytes));
+			}
+		}
+
+		CHECK(IndexCollisionCheckFiles(true));
+	} else {
+		CHECK(IndexCollisionCheckFiles(true));
+
+		size_t count;
+		EsError error;
+		EsDirectoryChild *buffer = EsDirectoryEnumerate("|Settings:/collisions", -1, &count, &error);
+		CHECK(error == ES_SUCCESS);
+
+		for (uintptr_t i = 0; i < count; i++) {
+			size_t pathBytes = EsStringFormat(path, sizeof(path), "|Settings:/collisions/%s", buffer[i].nameBytes, buffer[i].name);
+			CHECK(ES_SUCCESS == EsPathDelete(path, pathBytes));
+		}
+
+		EsHeapFree(buffer);
+		buffer = EsDirectoryEnumerate("|Settings:/collisions", -1, &count, &error);
+		CHECK(error == ES_SUCCESS && count == 0);
+		EsHeapFree(buffer);
+		CHECK(ES_SUCCESS == EsPathDelete("|Settings:/collisions", -1));
+		CHECK(ES_SUCCESS == EsPathDelete(EsLiteral("|Settings:/collisions_phase.dat")));
+		return true;
+	}
+
+	phase++;
+	CHECK(ES_SUCCESS == EsFileWriteAll(EsLiteral("|Settings:/collisions_phase.dat"), &phase, sizeof(uint32_t)));
+	EsPrint("Restarting for phase %d of the index collision test...\n", phase);
+	EsSyscall(ES_SYSCALL_SHUTDOWN, ES_SHUTDOWN_ACTION_RESTART, 0, 0, 0);
+	while (EsMessageReceive());
+	return false;
+}
+
+//////////////////////////////////////////////////////////////
+
 #endif
 
 const Test tests[] = {
@@ -1362,6 +2225,16 @@ const Test tests[] = {
 	TEST(RestartTest, 1200),
 	TEST(ResizeFileTest, 600),
 	TEST(FileContentTypeTest, 60),
+	TEST(KernelMutexBenchmark, 120),
+	TEST(ConditionVariableTest, 120),
+	TEST(PipeBenchmark, 300),
+	TEST(IORingTest, 120),
+	TEST(HandleResolveBenchmark, 120),
+	TEST(ConnectionBenchmark, 300),
+	TEST(FileAllocationBenchmark, 300),
+	TEST(PathLookupBenchmark, 300),
+	TEST(DirectoryEnumeratePages, 60),
+	TEST(IndexHashCollisions, 300),
 };
 
 #ifndef API_TESTS_FOR_RUNNER
@@ -28,6 +28,7 @@
 #define APPLICATION_PERMISSION_VIEW_FILE_TYPES           (1 << 5)
 #define APPLICATION_PERMISSION_ALL_DEVICES               (1 << 6)
 #define APPLICATION_PERMISSION_START_APPLICATION         (1 << 7)
+#define APPLICATION_PERMISSION_NETWORKING                (1 << 8)
 
 #define APPLICATION_ID_DESKTOP_BLANK_TAB (-0x70000000)
 #define APPLICATION_ID_DESKTOP_SETTINGS  (-0x70000001)
@@ -1887,6 +1888,10 @@ bool ApplicationInstanceStart(_EsApplicationStartupInformation *startupInformati
 			arguments.permissions |= ES_PERMISSION_SHUTDOWN;
 		}
 
+		if (application->permissions & APPLICATION_PERMISSION_NETWORKING) {
+			arguments.permissions |= ES_PERMISSION_NETWORKING;
+		}
+
 		if (application->permissions & APPLICATION_PERMISSION_ALL_FILES) {
 			arguments.permissions |= ES_PERMISSION_GET_VOLUME_INFORMATION;
 		} 
@@ -2534,6 +2539,7 @@ void ConfigurationLoadApplications() {
 		READ_PERMISSION("permission_shutdown", APPLICATION_PERMISSION_SHUTDOWN);
 		READ_PERMISSION("permission_view_file_types", APPLICATION_PERMISSION_VIEW_FILE_TYPES);
 		READ_PERMISSION("permission_start_application", APPLICATION_PERMISSION_START_APPLICATION);
+		READ_PERMISSION("permission_networking", APPLICATION_PERMISSION_NETWORKING);
 
 		desktop.installedApplications.Add(application);
 
@@ -99,9 +99,14 @@ EsError EsFileControl(EsHandle file, EsFileControlOperation operation, void *dat
 	return EsSyscall(ES_SYSCALL_FILE_CONTROL, file, operation, (uintptr_t) data, dataBytes);
 }
 
-ptrdiff_t DirectoryEnumerateFromHandle(EsHandle directory, EsDirectoryChild *buffer, size_t size) {
-	if (!size) return 0;
-	return EsSyscall(ES_SYSCALL_DIRECTORY_ENUMERATE, directory, (uintptr_t) buffer, size, 0);
+ptrdiff_t EsDirectoryEnumeratePage(EsHandle directory, EsDirectoryChild *buffer, size_t bufferCount, EsDirectoryEnumerateCookie *cookie, uint32_t flags) {
+	if (!bufferCount) return 0;
+	_EsDirectoryEnumeratePage page;
+	page.cookie = *cookie;
+	page.flags = flags;
+	ptrdiff_t result = EsSyscall(ES_SYSCALL_DIRECTORY_ENUMERATE, directory, (uintptr_t) buffer, bufferCount, (uintptr_t) &page);
+	if (!ES_CHECK_ERROR(result)) *cookie = page.cookie;
+	return result;
 }
 
 EsDirectoryChild *EsDirectoryEnumerate(const char *path, ptrdiff_t pathBytes, size_t *countOut, EsError *errorOut) {
@@ -118,32 +123,53 @@ EsDirectoryChild *EsDirectoryEnumerate(const char *path, ptrdiff_t pathBytes, si
 		return nullptr;
 	}
 
-	if (node.directoryChildren == ES_DIRECTORY_CHILDREN_UNKNOWN) {
-		// TODO Grow the buffer until all entries fit.
-		node.directoryChildren = 4194304 / sizeof(EsDirectoryChild);
-	}
-
 	if (node.directoryChildren == 0) {
 		// Empty directory.
+		EsHandleClose(node.handle);
 		*errorOut = ES_SUCCESS;
 		return nullptr;
 	}
 
-	EsDirectoryChild *buffer = (EsDirectoryChild *) EsHeapAllocate(sizeof(EsDirectoryChild) * node.directoryChildren, true);
+	// If we know how many children there are, leave space for one extra,
+	// so that we can tell we've reached the end without making another system call.
+	// Otherwise, grow the buffer until all the children fit.
+	size_t allocated = node.directoryChildren == ES_DIRECTORY_CHILDREN_UNKNOWN ? 64 : node.directoryChildren + 1;
+	EsDirectoryChild *buffer = (EsDirectoryChild *) EsHeapAllocate(sizeof(EsDirectoryChild) * allocated, true);
+	EsDirectoryEnumerateCookie cookie = {};
+	size_t count = 0;
+	*errorOut = buffer ? ES_SUCCESS : ES_ERROR_INSUFFICIENT_RESOURCES;
 
-	if (buffer) {
-		ptrdiff_t result = DirectoryEnumerateFromHandle(node.handle, buffer, node.directoryChildren);
+	while (buffer) {
+		ptrdiff_t result = EsDirectoryEnumeratePage(node.handle, buffer + count, allocated - count, &cookie, ES_FLAGS_DEFAULT);
 
 		if (ES_CHECK_ERROR(result)) { 
 			EsHeapFree(buffer); 
 			buffer = nullptr; 
 			*errorOut = result;
+			break;
+		}
+
+		count += result;
+
+		if (count < allocated) {
+			// A partially filled page means there are no more children.
+			break;
+		}
+
+		allocated *= 2;
+		EsDirectoryChild *newBuffer = (EsDirectoryChild *) EsHeapReallocate(buffer, sizeof(EsDirectoryChild) * allocated, true);
+
+		if (!newBuffer) {
+			EsHeapFree(buffer);
+			buffer = nullptr;
+			*errorOut = ES_ERROR_INSUFFICIENT_RESOURCES;
 		} else {
-			*errorOut = ES_SUCCESS;
-			*countOut = result;
+			buffer = newBuffer;
 		}
-	} else {
-		*errorOut = ES_ERROR_INSUFFICIENT_RESOURCES;
+	}
+
+	if (buffer) {
+		*countOut = count;
 	}
 
 	EsHandleClose(node.handle);
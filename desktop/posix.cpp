@@ -703,6 +703,33 @@ long EsPOSIXSystemCall(long n, long a1, long a2, long a3, long a4, long a5, long
 			else if (error != ES_SUCCESS) returnValue = -EACCES;
 		} break;
 
+		case SYS_futex: {
+			// Only the operations used by musl's pthread implementation are supported.
+			// FUTEX_REQUEUE is treated as a wake, since spurious wakeups are permitted.
+#define POSIX_FUTEX_WAIT (0)
+#define POSIX_FUTEX_WAKE (1)
+#define POSIX_FUTEX_REQUEUE (3)
+#define POSIX_FUTEX_PRIVATE_FLAG (128)
+#define POSIX_FUTEX_CLOCK_REALTIME (256)
+			// FUTEX_WAIT's timeout is relative whichever clock is selected, so the clock flag can be ignored.
+			int operation = a2 & ~(POSIX_FUTEX_PRIVATE_FLAG | POSIX_FUTEX_CLOCK_REALTIME);
+
+			if (operation == POSIX_FUTEX_WAIT) {
+				// Round the timeout up, so that the wait does not end before it has elapsed.
+				const struct timespec *timeout = (const struct timespec *) a4;
+				uintptr_t timeoutMs = timeout ? (uintptr_t) (timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000) : ES_WAIT_NO_TIMEOUT;
+				EsError error = EsSyscall(ES_SYSCALL_FUTEX_WAIT, a1, (uint32_t) a3, timeoutMs, 0);
+				if (error == ES_ERROR_FUTEX_VALUE_CHANGED) returnValue = -EAGAIN;
+				else if (error == ES_ERROR_TIMEOUT_REACHED) returnValue = -ETIMEDOUT;
+			} else if (operation == POSIX_FUTEX_WAKE) {
+				returnValue = EsSyscall(ES_SYSCALL_FUTEX_WAKE, a1, a3 < 0 ? 0 : a3, 0, 0);
+			} else if (operation == POSIX_FUTEX_REQUEUE) {
+				returnValue = EsSyscall(ES_SYSCALL_FUTEX_WAKE, a1, (uintptr_t) -1, 0, 0);
+			} else {
+				returnValue = -ENOSYS;
+			}
+		} break;
+
 		case -1000: {
 			// Update thread local storage:
 			void *apiTLS = ProcessorTLSRead(tlsStorageOffset);
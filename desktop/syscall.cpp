@@ -278,8 +278,9 @@ EsError EsConnectionWriteSync(EsConnection *connection, const void *_data, size_
 			return connection->error;
 		}
 
+		// Leave a byte free, so that a full buffer isn't mistaken for an empty one.
 		size_t space = connection->sendWritePointer >= connection->sendReadPointer 
-			? connection->sendBufferBytes - connection->sendWritePointer
+			? connection->sendBufferBytes - connection->sendWritePointer - (connection->sendReadPointer ? 0 : 1)
 			: connection->sendReadPointer - connection->sendWritePointer - 1;
 
 		if (!space) {
@@ -513,6 +514,81 @@ size_t EsPipeWrite(EsHandle pipe, const void *buffer, size_t bytes) {
 	}
 }
 
+size_t EsPipeReadVectored(EsHandle pipe, const EsPipeVector *vectors, size_t vectorCount) {
+	return EsSyscall(ES_SYSCALL_PIPE_READ_VECTORED, pipe, (uintptr_t) vectors, vectorCount, 0);
+}
+
+size_t EsPipeWriteVectored(EsHandle pipe, const EsPipeVector *vectors, size_t vectorCount) {
+	return EsSyscall(ES_SYSCALL_PIPE_WRITE_VECTORED, pipe, (uintptr_t) vectors, vectorCount, 0);
+}
+
+EsFileOffsetDifference EsPipeSplice(EsHandle pipe, EsHandle file, EsFileOffset offset, size_t bytes) {
+	return EsSyscall(ES_SYSCALL_PIPE_SPLICE, pipe, file, offset, bytes);
+}
+
+EsError EsIORingCreate(EsIORing *ring, size_t entries) {
+	return EsSyscall(ES_SYSCALL_IO_RING_CREATE, entries, (uintptr_t) ring, 0, 0);
+}
+
+void EsIORingDestroy(EsIORing *ring) {
+	EsObjectUnmap(ring->header);
+	EsHandleClose(ring->event);
+	EsHandleClose(ring->handle);
+}
+
+bool EsIORingSubmit(EsIORing *ring, const EsIORequest *request) {
+	_EsIORingHeader *header = ring->header;
+	uint32_t tail = header->submissionTail;
+
+	if (tail - header->submissionHead == header->submissionCapacity) {
+		return false;
+	}
+
+	ring->submissions[tail & (header->submissionCapacity - 1)] = *request;
+	__sync_synchronize();
+	header->submissionTail = tail + 1;
+	return true;
+}
+
+size_t EsIORingFlush(EsIORing *ring) {
+	uintptr_t result = EsSyscall(ES_SYSCALL_IO_RING_ENTER, ring->handle, 0, 0, 0);
+	return ES_CHECK_ERROR(result) ? 0 : result;
+}
+
+bool EsIORingGetCompletion(EsIORing *ring, EsIOCompletion *completion) {
+	_EsIORingHeader *header = ring->header;
+	uint32_t head = header->completionHead;
+
+	if (head == header->completionTail) {
+		return false;
+	}
+
+	__sync_synchronize();
+	*completion = ring->completions[head & (header->completionCapacity - 1)];
+	__sync_synchronize();
+	header->completionHead = head + 1;
+	return true;
+}
+
+bool EsIORingWait(EsIORing *ring, EsIOCompletion *completion, uintptr_t timeoutMs) {
+	if (ring->header->submissionHead != ring->header->submissionTail) {
+		EsIORingFlush(ring);
+	}
+
+	while (!EsIORingGetCompletion(ring, completion)) {
+		if (EsWait(&ring->event, 1, timeoutMs) == (uintptr_t) ES_ERROR_TIMEOUT_REACHED) {
+			return false;
+		}
+
+		if (ring->header->submissionHead != ring->header->submissionTail) {
+			// Requests that didn't fit before may now be started, since a completion has been added.
+			EsIORingFlush(ring);
+		}
+	}
+
+	return true;
+}
+
 EsError EsDeviceControl(EsHandle handle, EsDeviceControlType type, void *dp, void *dq) {
 	return EsSyscall(ES_SYSCALL_DEVICE_CONTROL, handle, type, (uintptr_t) dp, (uintptr_t) dq);
 }
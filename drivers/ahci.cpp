@@ -12,6 +12,7 @@
 #define RECEIVED_FIS_SIZE  (0x100)
 #define PRDT_ENTRY_COUNT   (0x48) // If one page each, this covers more than CC_ACTIVE_SECTION_SIZE. This must be a multiple of 8.
 #define COMMAND_TABLE_SIZE (0x80 + PRDT_ENTRY_COUNT * 0x10) 
+#define TRIM_RANGES_OFFSET (0x100) // A TRIM command only uses the first PRDT entry, so its range list goes in the space after it.
 
 // Global registers.
 #define RD_REGISTER_CAP()         pci->ReadBAR32(5, 0x00)                   // HBA capababilities.
@@ -51,9 +52,11 @@
 
 struct AHCIPort {
 	bool connected, atapi, ssd;
+	bool trimSupported, trimReadsZeroes;
 
 	uint32_t *commandList;
 	uint8_t *commandTables;
+	uintptr_t commandTablesPhysical;
 
 	size_t sectorBytes;
 	uint64_t sectorCount;
@@ -277,7 +280,28 @@ bool AHCIController::Access(uintptr_t portIndex, uint64_t offsetBytes, size_t co
 	size_t prdtEntryCount = 0;
 	uint32_t *prdt = (uint32_t *) (port->commandTables + COMMAND_TABLE_SIZE * commandIndex + 0x80);
 
-	while (!KDMABufferIsComplete(buffer)) {
+	if (operation == K_ACCESS_ZERO || operation == K_ACCESS_DISCARD) {
+		// Send a DATA SET MANAGEMENT command with the TRIM bit set, with a single LBA range.
+		// Zeroing is only supported if the drive reads trimmed sectors as zeroes.
+
+		uint64_t *ranges = (uint64_t *) (port->commandTables + COMMAND_TABLE_SIZE * commandIndex + TRIM_RANGES_OFFSET);
+		EsMemoryZero(ranges, 0x200);
+		ranges[0] = offsetSectors | ((uint64_t) countSectors << 48);
+
+		commandFIS[0] = 0x27 /* H2D */ | (1 << 15) /* command */ | (0x06 /* data set management */ << 16) | (1 << 24) /* TRIM */;
+		commandFIS[1] = 1 << 30;
+		commandFIS[2] = 0;
+		commandFIS[3] = 1 /* one block of ranges */;
+
+		uintptr_t rangesPhysical = port->commandTablesPhysical + COMMAND_TABLE_SIZE * commandIndex + TRIM_RANGES_OFFSET;
+		prdt[0] = ES_PTR64_LS32(rangesPhysical);
+		prdt[1] = ES_PTR64_MS32(rangesPhysical);
+		prdt[2] = 0;
+		prdt[3] = (0x200 - 1) | (1 << 31) /* IRQ when done */;
+		prdtEntryCount = 1;
+	}
+
+	while (buffer && !KDMABufferIsComplete(buffer)) {
 		if (prdtEntryCount == PRDT_ENTRY_COUNT) {
 			KernelPanic("AHCIController::Access - Too many PRDT entries.\n");
 		}
@@ -294,7 +318,7 @@ bool AHCIController::Access(uintptr_t portIndex, uint64_t offsetBytes, size_t co
 
 	// Setup the command list entry, and issue the command.
 
-	port->commandList[commandIndex * 8 + 0] = 5 /* FIS is 5 DWORDs */ | (prdtEntryCount << 16) | (operation == K_ACCESS_WRITE ? (1 << 6) : 0);
+	port->commandList[commandIndex * 8 + 0] = 5 /* FIS is 5 DWORDs */ | (prdtEntryCount << 16) | (operation != K_ACCESS_READ ? (1 << 6) : 0);
 	port->commandList[commandIndex * 8 + 1] = 0;
 
 	// Setup SCSI command if ATAPI.
@@ -572,6 +596,7 @@ void AHCIController::Initialise() {
 
 		ports[i].commandList = (uint32_t *) virtualAddress;
 		ports[i].commandTables = virtualAddress + COMMAND_LIST_SIZE + RECEIVED_FIS_SIZE;
+		ports[i].commandTablesPhysical = physicalAddress + COMMAND_LIST_SIZE + RECEIVED_FIS_SIZE;
 
 		// Set the registers to the physical addresses.
 
@@ -808,6 +833,8 @@ void AHCIController::Initialise() {
 		}
 
 		ports[i].ssd = identifyData[217] == 1;
+		ports[i].trimSupported = !ports[i].atapi && (identifyData[169] & (1 << 0));
+		ports[i].trimReadsZeroes = ports[i].trimSupported && (identifyData[69] & (1 << 14)) && (identifyData[69] & (1 << 5));
 
 		for (uintptr_t i = 10; i < 20; i++) identifyData[i] = (identifyData[i] >> 8) | (identifyData[i] << 8);
 		for (uintptr_t i = 23; i < 27; i++) identifyData[i] = (identifyData[i] >> 8) | (identifyData[i] << 8);
@@ -848,6 +875,8 @@ void AHCIController::Initialise() {
 		EsMemoryCopy(device->information.model, ports[i].model, sizeof(ports[i].model));
 		device->information.modelBytes = sizeof(ports[i].model);
 		device->information.driveType = ports[i].atapi ? ES_DRIVE_TYPE_CDROM : ports[i].ssd ? ES_DRIVE_TYPE_SSD : ES_DRIVE_TYPE_HDD;
+		device->canZero = ports[i].trimReadsZeroes;
+		device->canDiscard = ports[i].trimSupported;
 
 		device->access = [] (KBlockDeviceAccessRequest request) {
 			AHCIDrive *drive = (AHCIDrive *) request.device;
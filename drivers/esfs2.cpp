@@ -7,6 +7,8 @@
 // Filesystem structures and constant definitions.
 #include <shared/esfs2.h>
 
+#include <shared/avl_tree.cpp>
+
 // TODO Calling FSDirectoryEntryFound on all directory entries seen during scanning, even if they're not the target.
 // TODO Informing the block cache when a directory is truncated and its extents are freed.
 // TODO ESFS_CHECK_XXX are used to report out of memory errors, which shouldn't report KERNEL_PROBLEM_DAMAGED_FILESYSTEM.
@@ -21,12 +23,26 @@
 #define ESFS_CHECK_READ_ONLY(x, y)       if (!(x)) { KernelLog(LOG_ERROR, "EsFS", "mount read only", "Mount - " y " Mounting as read only.\n"); volume->readOnly = true; }
 #define ESFS_CHECK_ERROR_READ_ONLY(x, y) if ((x) != ES_SUCCESS) { KernelLog(LOG_ERROR, "EsFS", "mount read only", "Mount - " y " Mounting as read only.\n"); volume->readOnly = true; }
 
+#define ENUMERATE_READ_BYTES (65536) // Directories are enumerated in batches of up to this many bytes.
+
+struct FreeSpace {
+	AVLItem<FreeSpace> itemStart, itemCount; // Keyed by the first block, and by the number of blocks.
+	uint64_t start, count; // The start is relative to the beginning of the group.
+};
+
+struct GroupFreeSpace {
+	// Built from the block bitmap the first time the group is used for allocation.
+	AVLTree<FreeSpace> byStart, byCount;
+	bool loaded;
+};
+
 struct Volume : KFileSystem {
 	Superblock superblock;
 	struct FSNode *root;
 	bool readOnly;
-	KWriterLock blockBitmapLock; 
+	KWriterLock blockBitmapLock; // Also protects groupFreeSpace.
 	GroupDescriptor *groupDescriptorTable;
+	GroupFreeSpace *groupFreeSpace;
 	KMutex nextIdentifierMutex;
 };
 
@@ -62,52 +78,52 @@ static bool ValidateIndexVertex(Superblock *superblock, IndexVertex *vertex) {
 	return true;
 }
 
-static EsError FindDirectoryEntryReferenceFromIndex(Volume *volume, uint8_t *buffer /* superblock->blockSize */, 
-		DirectoryEntryReference *entry, const char *name, size_t nameLength, uint64_t rootBlock) {
-	// EsPrint("FindDirectoryEntryReferenceFromIndex: %s (%d)\n", nameLength, name, rootBlock);
-	if (!rootBlock) return ES_ERROR_FILE_DOES_NOT_EXIST; // No index - the directory is empty?
-	
-	Superblock *superblock = &volume->superblock;
+static uintptr_t FindKeyPositionInVertex(IndexVertex *vertex, uint64_t key) {
+	// Binary search for the first key in the vertex that is not less than the given key.
+	// If every key is less, this returns vertex->count, the position of the +1 key.
 
-	// Get the root vertex.
-	uint64_t nameHash = CalculateCRC64(name, nameLength, 0);
-	IndexVertex *vertex = (IndexVertex *) buffer;
+	uintptr_t low = 0, high = vertex->count;
 
-	if (!AccessBlock(volume, rootBlock, 1, vertex, FS_BLOCK_ACCESS_CACHED, K_ACCESS_READ)) {
-		return ES_ERROR_HARDWARE_FAILURE;
+	while (low < high) {
+		uintptr_t middle = low + (high - low) / 2;
+		if (ESFS_VERTEX_KEY(vertex, middle)->value < key) low = middle + 1;
+		else high = middle;
 	}
 
-	int depth = 0;
+	return low;
+}
 
-	while (true) {
-		ESFS_CHECK(depth++ < ESFS_INDEX_MAX_DEPTH - 1, "FindDirectoryEntryReferenceFromIndex - Reached tree max depth.");
+static EsError IndexFindKey(Volume *volume, uint8_t *buffer /* superblock->blockSize */, uint64_t findKey, uint64_t rootBlock, 
+		IndexKey **key /* points into buffer */, uint64_t *block /* the block containing the key's vertex */) {
+	if (!rootBlock) return ES_ERROR_FILE_DOES_NOT_EXIST; // No index - the directory is empty?
+	
+	Superblock *superblock = &volume->superblock;
+	IndexVertex *vertex = (IndexVertex *) buffer;
+	*block = rootBlock;
 
+	for (int depth = 0; depth < ESFS_INDEX_MAX_DEPTH; depth++) {
+		if (!AccessBlock(volume, *block, 1, vertex, FS_BLOCK_ACCESS_CACHED, K_ACCESS_READ)) return ES_ERROR_HARDWARE_FAILURE;
 		if (!ValidateIndexVertex(superblock, vertex)) return ES_ERROR_CORRUPT_DATA;
-		IndexKey *keys = (IndexKey *) ((uint8_t *) vertex + vertex->offset);
-
-		// For every key...
-		for (int i = 0; i <= vertex->count; i++) {
-			if (i == vertex->count || keys[i].value > nameHash) {
-				if (keys[i].child) {
-					// The directory is in the child.
-					if (!AccessBlock(volume, keys[i].child, 1, vertex, FS_BLOCK_ACCESS_CACHED, K_ACCESS_READ)) return ES_ERROR_HARDWARE_FAILURE;
-					else goto nextVertex;
-				} else {
-					// We couldn't find the entry.
-					return ES_ERROR_FILE_DOES_NOT_EXIST;
-				}
-			} else if (keys[i].value == nameHash) {
-				// We've found the directory.
-				ESFS_CHECK_CORRUPT(keys[i].data.block < superblock->blockCount 
-						&& keys[i].data.offsetIntoBlock + sizeof(DirectoryEntry) <= superblock->blockSize, 
-						"FindDirectoryEntryReferenceFromIndex - Invalid key entry.");
-				if (entry) *entry = keys[i].data;
-				return ES_SUCCESS;
-			}
+
+		uintptr_t position = FindKeyPositionInVertex(vertex, findKey);
+		IndexKey *found = ESFS_VERTEX_KEY(vertex, position);
+
+		if (position != vertex->count && found->value == findKey) {
+			ESFS_CHECK_CORRUPT(found->data.block < superblock->blockCount 
+					&& found->data.offsetIntoBlock + sizeof(DirectoryEntry) <= superblock->blockSize, 
+					"IndexFindKey - Invalid key entry.");
+			*key = found;
+			return ES_SUCCESS;
+		} else if (!found->child) {
+			// We couldn't find the entry.
+			return ES_ERROR_FILE_DOES_NOT_EXIST;
 		}
 
-		nextVertex:;
+		*block = found->child;
 	}
+
+	KernelLog(LOG_ERROR, "EsFS", "damaged file system", "IndexFindKey - Reached tree max depth.\n");
+	return ES_ERROR_CORRUPT_DATA;
 }
 
 static bool ValidateDirectoryEntry(Volume *volume, DirectoryEntry *entry) {
@@ -169,6 +185,108 @@ static Attribute *FindAttribute(DirectoryEntry *entry, uint16_t type) {
 	return attribute;
 }
 
+static bool MarkBlocksWritten(Volume *volume, AttributeData *data, uint64_t fromBlock, uint64_t toBlock) {
+	// Called after the blocks [fromBlock, toBlock) of the file have been written.
+	// Split the unwritten extents covering them so that the rest of each extent stays unwritten,
+	// and merge the written parts with any contiguous written extents, so that the extent list doesn't grow on every write.
+
+	uint8_t *extentList = (uint8_t *) data + data->dataOffset;
+	size_t extentListSize = data->size - data->dataOffset;
+	uint8_t *newList = (uint8_t *) EsHeapAllocate(extentListSize, true, K_FIXED);
+	EsDefer(EsHeapFree(newList, extentListSize, K_FIXED));
+	ESFS_CHECK(newList, "MarkBlocksWritten - Could not allocate extent list buffer.");
+
+	uint64_t previousExtentStart = 0, extentCount = 0, position = 0, blockInFile = 0;
+	uint64_t newPosition = 0, newCount = 0, newPreviousExtentStart = 0;
+	uint64_t runStart = 0, runCount = 0;
+	bool runUnwritten = false, fits = true;
+
+	for (uintptr_t i = 0; i <= data->count; i++) {
+		struct { uint64_t start, count; bool unwritten; } pieces[3];
+		uintptr_t pieceCount = 0;
+
+		if (i == data->count) {
+			// An empty piece, to output the last run.
+			pieces[pieceCount++] = { 0, 0, false };
+		} else {
+			uint64_t headerPosition = position;
+			ESFS_CHECK(DecodeExtent(&previousExtentStart, &extentCount, extentList, &position, extentListSize), "MarkBlocksWritten - Invalid extent.");
+			bool unwritten = extentList[headerPosition] & ESFS_EXTENT_UNWRITTEN;
+			uint64_t from = fromBlock > blockInFile ? fromBlock : blockInFile;
+			uint64_t to = toBlock < blockInFile + extentCount ? toBlock : blockInFile + extentCount;
+
+			if (!unwritten || from >= to) {
+				pieces[pieceCount++] = { previousExtentStart, extentCount, unwritten };
+			} else {
+				if (from != blockInFile) pieces[pieceCount++] = { previousExtentStart, from - blockInFile, true };
+				pieces[pieceCount++] = { previousExtentStart + from - blockInFile, to - from, false };
+				if (to != blockInFile + extentCount) pieces[pieceCount++] = { previousExtentStart + to - blockInFile, blockInFile + extentCount - to, true };
+			}
+
+			blockInFile += extentCount;
+		}
+
+		for (uintptr_t j = 0; j < pieceCount; j++) {
+			if (runCount && runStart + runCount == pieces[j].start && runUnwritten == pieces[j].unwritten) {
+				runCount += pieces[j].count;
+				continue;
+			}
+
+			if (runCount) {
+				uint8_t encode[32];
+				uint64_t length = EncodeExtent(runStart, newPreviousExtentStart, runCount, encode);
+				if (runUnwritten) encode[0] |= ESFS_EXTENT_UNWRITTEN;
+
+				if (newPosition + length > extentListSize) {
+					fits = false;
+					break;
+				}
+
+				EsMemoryCopy(newList + newPosition, encode, length);
+				newPosition += length;
+				newPreviousExtentStart = runStart;
+				newCount++;
+			}
+
+			runStart = pieces[j].start, runCount = pieces[j].count, runUnwritten = pieces[j].unwritten;
+		}
+
+		if (!fits) break;
+	}
+
+	if (fits) {
+		EsMemoryCopy(extentList, newList, extentListSize);
+		data->count = newCount;
+		return true;
+	}
+
+	// The split extents don't fit in the data attribute.
+	// Instead, zero the rest of each unwritten extent that was written to, and mark the whole extent as written.
+
+	previousExtentStart = 0, position = 0, blockInFile = 0;
+
+	for (uintptr_t i = 0; i < data->count; i++) {
+		uint64_t headerPosition = position;
+		ESFS_CHECK(DecodeExtent(&previousExtentStart, &extentCount, extentList, &position, extentListSize), "MarkBlocksWritten - Invalid extent.");
+		uint64_t from = fromBlock > blockInFile ? fromBlock : blockInFile;
+		uint64_t to = toBlock < blockInFile + extentCount ? toBlock : blockInFile + extentCount;
+
+		if ((extentList[headerPosition] & ESFS_EXTENT_UNWRITTEN) && from < to) {
+			if ((from != blockInFile && !AccessBlock(volume, previousExtentStart, from - blockInFile, nullptr, ES_FLAGS_DEFAULT, K_ACCESS_ZERO))
+					|| (to != blockInFile + extentCount && !AccessBlock(volume, previousExtentStart + to - blockInFile, 
+							blockInFile + extentCount - to, nullptr, ES_FLAGS_DEFAULT, K_ACCESS_ZERO))) {
+				return false;
+			}
+
+			extentList[headerPosition] &= ~ESFS_EXTENT_UNWRITTEN;
+		}
+
+		blockInFile += extentCount;
+	}
+
+	return true;
+}
+
 static bool ReadWrite(FSNode *file, uint64_t offset, uint64_t count, uint8_t *buffer, bool needBlockBuffer, bool write, 
 		DirectoryEntryReference *reference = nullptr /* Returns the position of a directory just accessed */) {
 	// TODO Return EsError.
@@ -208,13 +326,15 @@ static bool ReadWrite(FSNode *file, uint64_t offset, uint64_t count, uint8_t *bu
 	} else if (data->indirection == ESFS_INDIRECTION_L1) {
 		uint64_t offsetBlock = offset / superblock->blockSize;
 		uint64_t offsetIntoCurrentBlock = offset % superblock->blockSize;
+		uint64_t endBlock = (offset + count + superblock->blockSize - 1) / superblock->blockSize;
 		uint8_t *extentList = (uint8_t *) data + data->dataOffset;
 		uint64_t previousExtentStart = 0, positionInExtentList = 0, blockInFile = 0, extentIndex = 0;
+		bool wroteUnwritten = false;
 
 		while (count) {
 			// Find the extent containing offsetBlock.
 
-			uint64_t extentStart = 0, extentCount = 0;
+			uint64_t extentStart = 0, extentCount = 0, extentHeaderPosition = 0;
 
 			while (!extentStart) {
 				if (extentIndex == data->count) {
@@ -222,6 +342,7 @@ static bool ReadWrite(FSNode *file, uint64_t offset, uint64_t count, uint8_t *bu
 				}
 
 				uint64_t count = 0;
+				extentHeaderPosition = positionInExtentList;
 
 				if (!DecodeExtent(&previousExtentStart, &count, extentList, &positionInExtentList, data->size - data->dataOffset) 
 						|| !count || !previousExtentStart) {
@@ -241,6 +362,11 @@ static bool ReadWrite(FSNode *file, uint64_t offset, uint64_t count, uint8_t *bu
 				extentIndex++;
 			}
 
+			// When writing to an unwritten extent, partially written blocks are zeroed in the block buffer,
+			// and the extent list is updated once all the data has been written.
+			bool unwritten = extentList[extentHeaderPosition] & ESFS_EXTENT_UNWRITTEN;
+			if (unwritten && write) wroteUnwritten = true;
+
 			// Read the data.  
 
 			repeatExtent:;
@@ -255,7 +381,9 @@ static bool ReadWrite(FSNode *file, uint64_t offset, uint64_t count, uint8_t *bu
 
 				// EsPrint("\tCopying %d bytes through block buffer.\n", copyCount);
 
-				if (!AccessBlock(volume, extentStart, 1, blockBuffer, accessBlockFlags, K_ACCESS_READ)) {
+				if (unwritten) {
+					EsMemoryZero(blockBuffer, superblock->blockSize);
+				} else if (!AccessBlock(volume, extentStart, 1, blockBuffer, accessBlockFlags, K_ACCESS_READ)) {
 				     return false;
 				}
 
@@ -294,7 +422,9 @@ static bool ReadWrite(FSNode *file, uint64_t offset, uint64_t count, uint8_t *bu
 					reference->offsetIntoBlock = 0;
 				}
 
-				if (!AccessBlock(volume, extentStart, blocksRead, buffer, accessBlockFlags, 
+				if (unwritten && !write) {
+					EsMemoryZero(buffer, bytesToRead);
+				} else if (!AccessBlock(volume, extentStart, blocksRead, buffer, accessBlockFlags, 
 							write ? K_ACCESS_WRITE : K_ACCESS_READ)) {
 					return false;
 				}
@@ -309,6 +439,10 @@ static bool ReadWrite(FSNode *file, uint64_t offset, uint64_t count, uint8_t *bu
 				}
 			}
 		}
+
+		if (wroteUnwritten && !MarkBlocksWritten(volume, data, offset / superblock->blockSize, endBlock)) {
+			return false;
+		}
 	} else {
 		ESFS_CHECK(data, "Read - Unrecognised indirection mode.");
 		return false;
@@ -374,28 +508,154 @@ static void Sync(KNode *_directory, KNode *node) {
 	}
 }
 
-static EsError Enumerate(KNode *node) {
-	// TODO Support KWorkGroup.
+static bool ReadDirectoryBlocks(FSNode *directory, uint64_t firstBlock, uint64_t count, 
+		uint8_t *buffer /* count * superblock->blockSize */, uint64_t *blocks /* count; returns where each block is on the volume */) {
+	Volume *volume = directory->volume;
+	Superblock *superblock = &volume->superblock;
+
+	AttributeData *data = (AttributeData *) FindAttribute(&directory->entry, ESFS_ATTRIBUTE_DATA);
+	ESFS_CHECK(data && data->indirection == ESFS_INDIRECTION_L1, "ReadDirectoryBlocks - Expected L1 data attribute.");
+
+	uint8_t *extentList = (uint8_t *) data + data->dataOffset;
+	uint64_t previousExtentStart = 0, position = 0, blockInFile = 0, blocksRead = 0;
+
+	for (uintptr_t i = 0; i < data->count && blocksRead < count; i++) {
+		uint64_t extentCount = 0;
+
+		ESFS_CHECK(DecodeExtent(&previousExtentStart, &extentCount, extentList, &position, data->size - data->dataOffset) 
+				&& extentCount && previousExtentStart, "ReadDirectoryBlocks - Invalid extent.");
+
+		if (firstBlock + blocksRead < blockInFile + extentCount) {
+			// Read the part of the extent we need with a single access.
+			// The block cache loads any pages it doesn't have with one read per contiguous run.
+
+			uint64_t offsetIntoExtent = firstBlock + blocksRead - blockInFile;
+			uint64_t runBlocks = extentCount - offsetIntoExtent;
+			if (runBlocks > count - blocksRead) runBlocks = count - blocksRead;
+
+			if (!AccessBlock(volume, previousExtentStart + offsetIntoExtent, runBlocks, 
+						buffer + blocksRead * superblock->blockSize, FS_BLOCK_ACCESS_CACHED, K_ACCESS_READ)) {
+				return false;
+			}
+
+			for (uintptr_t j = 0; j < runBlocks; j++) {
+				blocks[blocksRead + j] = previousExtentStart + offsetIntoExtent + j;
+			}
+
+			blocksRead += runBlocks;
+		}
+
+		blockInFile += extentCount;
+	}
+
+	ESFS_CHECK(blocksRead == count, "ReadDirectoryBlocks - Directory has fewer blocks than expected.");
+	return true;
+}
+
+static EsError SearchDirectoryForHash(FSNode *directory, uint64_t nameHash, const char *name, size_t nameLength, 
+		DirectoryEntryReference *firstMatch, uint64_t *matchCount) {
+	// Used when an index key is marked with ESFS_INDEX_KEY_COLLISION, to find the entries that share its hash.
+	// If a name is given, only the entry with that name matches, and the search stops there.
+
+	Volume *volume = directory->volume;
+	Superblock *superblock = &volume->superblock;
+	AttributeDirectory *attribute = (AttributeDirectory *) FindAttribute(&directory->entry, ESFS_ATTRIBUTE_DIRECTORY);
+	uint64_t blocksInDirectory = (attribute->childNodes + superblock->directoryEntriesPerBlock - 1) / superblock->directoryEntriesPerBlock;
+	*matchCount = 0;
+	if (!blocksInDirectory) return ES_SUCCESS;
+
+	uint64_t blocksPerRead = ENUMERATE_READ_BYTES / superblock->blockSize;
+	if (!blocksPerRead) blocksPerRead = 1;
+	if (blocksPerRead > blocksInDirectory) blocksPerRead = blocksInDirectory;
+
+	uint8_t *directoryBuffer = (uint8_t *) EsHeapAllocate(blocksPerRead * superblock->blockSize, false, K_FIXED);
+	if (!directoryBuffer) return ES_ERROR_INSUFFICIENT_RESOURCES;
+	EsDefer(EsHeapFree(directoryBuffer, 0, K_FIXED));
+
+	uint64_t *blocks = (uint64_t *) EsHeapAllocate(blocksPerRead * sizeof(uint64_t), false, K_FIXED);
+	if (!blocks) return ES_ERROR_INSUFFICIENT_RESOURCES;
+	EsDefer(EsHeapFree(blocks, 0, K_FIXED));
+
+	for (uint64_t i = 0; i < blocksInDirectory; i++) {
+		if (i % blocksPerRead == 0) {
+			uint64_t count = blocksInDirectory - i > blocksPerRead ? blocksPerRead : blocksInDirectory - i;
 
+			if (!ReadDirectoryBlocks(directory, i, count, directoryBuffer, blocks)) {
+				return ES_ERROR_UNKNOWN;
+			}
+		}
+
+		uint8_t *blockBuffer = directoryBuffer + (i % blocksPerRead) * superblock->blockSize;
+		DirectoryEntryReference reference = {};
+		reference.block = blocks[i % blocksPerRead];
+
+		uint64_t entriesInThisBlock = superblock->directoryEntriesPerBlock;
+
+		if (i == blocksInDirectory - 1 && attribute->childNodes % superblock->directoryEntriesPerBlock) {
+			entriesInThisBlock = attribute->childNodes % superblock->directoryEntriesPerBlock;
+		}
+
+		for (uint64_t j = 0; j < entriesInThisBlock; j++, reference.offsetIntoBlock += sizeof(DirectoryEntry)) {
+			DirectoryEntry *entry = (DirectoryEntry *) blockBuffer + j;
+
+			if (!ValidateDirectoryEntry(volume, entry)) {
+				// Try the entries in the next block.
+				break;
+			}
+
+			AttributeFilename *filename = (AttributeFilename *) FindAttribute(entry, ESFS_ATTRIBUTE_FILENAME);
+			if (!filename) continue;
+
+			if (name) {
+				if (filename->length != nameLength || EsMemoryCompare(filename->filename, name, nameLength)) continue;
+			} else {
+				if (CalculateCRC64(filename->filename, filename->length, 0) != nameHash) continue;
+			}
+
+			if (!(*matchCount)++) *firstMatch = reference;
+			if (name) return ES_SUCCESS;
+		}
+	}
+
+	return ES_SUCCESS;
+}
+
+static EsError Enumerate(KNode *node) {
 	FSNode *file = (FSNode *) node->driverNode;
 	if (file->corrupt) return ES_ERROR_CORRUPT_DATA;
 	Volume *volume = file->volume;
 	Superblock *superblock = &volume->superblock;
 	DirectoryEntry *entry = &file->entry;
 
-	uint8_t *blockBuffer = (uint8_t *) EsHeapAllocate(superblock->blockSize, false, K_FIXED);
-	if (!blockBuffer) return ES_ERROR_INSUFFICIENT_RESOURCES;
-	EsDefer(EsHeapFree(blockBuffer, 0, K_FIXED));
-
-	DirectoryEntryReference reference = {};
 	AttributeDirectory *directory = (AttributeDirectory *) FindAttribute(entry, ESFS_ATTRIBUTE_DIRECTORY);
 	uint64_t blocksInDirectory = (directory->childNodes + superblock->directoryEntriesPerBlock - 1) / superblock->directoryEntriesPerBlock;
+	if (!blocksInDirectory) return ES_SUCCESS;
+
+	uint64_t blocksPerRead = ENUMERATE_READ_BYTES / superblock->blockSize;
+	if (!blocksPerRead) blocksPerRead = 1;
+	if (blocksPerRead > blocksInDirectory) blocksPerRead = blocksInDirectory;
+
+	uint8_t *directoryBuffer = (uint8_t *) EsHeapAllocate(blocksPerRead * superblock->blockSize, false, K_FIXED);
+	if (!directoryBuffer) return ES_ERROR_INSUFFICIENT_RESOURCES;
+	EsDefer(EsHeapFree(directoryBuffer, 0, K_FIXED));
+
+	uint64_t *blocks = (uint64_t *) EsHeapAllocate(blocksPerRead * sizeof(uint64_t), false, K_FIXED);
+	if (!blocks) return ES_ERROR_INSUFFICIENT_RESOURCES;
+	EsDefer(EsHeapFree(blocks, 0, K_FIXED));
 
 	for (uint64_t i = 0; i < blocksInDirectory; i++) {
-		if (!ReadWrite(file, i * superblock->blockSize, superblock->blockSize, blockBuffer, false, false, &reference)) {
-			return ES_ERROR_UNKNOWN;
+		if (i % blocksPerRead == 0) {
+			uint64_t count = blocksInDirectory - i > blocksPerRead ? blocksPerRead : blocksInDirectory - i;
+
+			if (!ReadDirectoryBlocks(file, i, count, directoryBuffer, blocks)) {
+				return ES_ERROR_UNKNOWN;
+			}
 		}
 
+		uint8_t *blockBuffer = directoryBuffer + (i % blocksPerRead) * superblock->blockSize;
+		DirectoryEntryReference reference = {};
+		reference.block = blocks[i % blocksPerRead];
+
 		uint64_t entriesInThisBlock = superblock->directoryEntriesPerBlock;
 
 		if (i == blocksInDirectory - 1 && directory->childNodes % superblock->directoryEntriesPerBlock) {
@@ -441,33 +701,11 @@ static EsError Enumerate(KNode *node) {
 	return ES_SUCCESS;
 }
 
-static uint64_t FindLargestExtent(uint8_t *bitmap, Superblock *superblock) {
-	uint64_t largestExtentCount = 0, i = 0;
-
-	while (i < superblock->blocksPerGroup) {
-		if (bitmap[i / 8] & (1 << (i % 8))) {
-			i++;
-		} else {
-			uint64_t count = 0;
-
-			while (i < superblock->blocksPerGroup) {
-				if (bitmap[i / 8] & (1 << (i % 8))) break;
-				else count++, i++;
-			}
-
-			if (largestExtentCount < count) {
-				largestExtentCount = count;
-			}
-		}
-	}
-
-	return largestExtentCount;
-}
-
 static bool ValidateGroupDescriptor(GroupDescriptor *descriptor) {
 	uint32_t checksum = descriptor->checksum;
 	descriptor->checksum = 0;
 	uint32_t calculated = CalculateCRC32(descriptor, sizeof(GroupDescriptor), 0);
+	descriptor->checksum = checksum;
 	ESFS_CHECK(checksum == calculated, "ValidateGroupDescriptor - Invalid checksum.");
 	ESFS_CHECK(0 == EsMemoryCompare(descriptor->signature, ESFS_GROUP_DESCRIPTOR_SIGNATURE, 4), "ValidateGroupDescriptor - Invalid signature.");
 	return true;
@@ -490,41 +728,222 @@ static bool ValidateBlockBitmap(GroupDescriptor *descriptor, uint8_t *bitmap, Su
 	return true;
 }
 
-static bool AllocateExtent(Volume *volume, uint64_t nearby, uint64_t increaseBlocks, uint64_t *extentStart, uint64_t *extentCount, bool zero) {
+static void FreeSpaceInsert(GroupFreeSpace *group, FreeSpace *space) {
+	TreeInsert(&group->byStart, &space->itemStart, space, MakeShortKey(space->start));
+	TreeInsert(&group->byCount, &space->itemCount, space, MakeShortKey(space->count), AVL_DUPLICATE_KEYS_ALLOW);
+}
+
+static void FreeSpaceRemove(GroupFreeSpace *group, FreeSpace *space) {
+	TreeRemove(&group->byStart, &space->itemStart);
+	TreeRemove(&group->byCount, &space->itemCount);
+}
+
+static bool FreeSpaceAdd(GroupFreeSpace *group, uint64_t start, uint64_t count) {
+	FreeSpace *space = (FreeSpace *) EsHeapAllocate(sizeof(FreeSpace), true, K_FIXED);
+	if (!space) return false;
+	space->start = start;
+	space->count = count;
+	FreeSpaceInsert(group, space);
+	return true;
+}
+
+static void FreeSpaceUnload(GroupFreeSpace *group) {
+	while (group->byStart.root) {
+		FreeSpace *space = group->byStart.root->thisItem;
+		FreeSpaceRemove(group, space);
+		EsHeapFree(space, sizeof(FreeSpace), K_FIXED);
+	}
+
+	group->loaded = false;
+}
+
+static uint64_t FreeSpaceLargest(Volume *volume, uintptr_t groupIndex) {
+	Superblock *superblock = &volume->superblock;
+	GroupFreeSpace *group = volume->groupFreeSpace + groupIndex;
+	GroupDescriptor *descriptor = volume->groupDescriptorTable + groupIndex;
+
+	if (group->loaded) {
+		AVLItem<FreeSpace> *item = TreeFind(&group->byCount, MakeShortKey(superblock->blocksPerGroup), TREE_SEARCH_LARGEST_BELOW_OR_EQUAL);
+		return item ? item->thisItem->count : 0;
+	} else if (!descriptor->blockBitmap) {
+		// The group has never been used.
+		return superblock->blocksPerGroup - superblock->blocksPerGroupBlockBitmap;
+	} else {
+		return descriptor->largestExtent;
+	}
+}
+
+static bool FreeSpaceLoad(Volume *volume, uintptr_t groupIndex) {
 	Superblock *superblock = &volume->superblock;
+	GroupFreeSpace *group = volume->groupFreeSpace + groupIndex;
+	GroupDescriptor *descriptor = volume->groupDescriptorTable + groupIndex;
 	KWriterLockAssertExclusive(&volume->blockBitmapLock);
 
-	(void) nearby;
-	// TODO Smarter extent allocation.
+	if (group->loaded) {
+		return true;
+	}
 
-	uint8_t *zeroBuffer = nullptr;
-	EsDefer(EsHeapFree(zeroBuffer, 0, K_FIXED));
-	size_t zeroBufferSize = superblock->blockSize * (increaseBlocks > 16 ? 16 : increaseBlocks);
+	ESFS_CHECK(ValidateGroupDescriptor(descriptor), "FreeSpaceLoad - Invalid group descriptor.");
 
-	if (zero) {
-		zeroBuffer = (uint8_t *) EsHeapAllocate(zeroBufferSize, true, K_FIXED);
-		ESFS_CHECK(zeroBuffer, "AllocateExtent - Could not allocate buffer for zeroing extent.");
+	if (!descriptor->blockBitmap) {
+		// The group has never been used, so everything after the space reserved for its bitmap is free.
+		ESFS_CHECK(FreeSpaceAdd(group, superblock->blocksPerGroupBlockBitmap, superblock->blocksPerGroup - superblock->blocksPerGroupBlockBitmap), 
+				"FreeSpaceLoad - Could not allocate free space entry.");
+		group->loaded = true;
+		return true;
 	}
 
-	// Find a group to allocate the next extent from.
+	uint8_t *bitmap = (uint8_t *) EsHeapAllocate(superblock->blocksPerGroupBlockBitmap * superblock->blockSize, false, K_FIXED);
+	EsDefer(EsHeapFree(bitmap, 0, K_FIXED));
+	ESFS_CHECK(bitmap, "FreeSpaceLoad - Could not allocate buffer for block bitmap.");
+	ESFS_CHECK(AccessBlock(volume, descriptor->blockBitmap, superblock->blocksPerGroupBlockBitmap, bitmap, FS_BLOCK_ACCESS_CACHED, K_ACCESS_READ), 
+			"FreeSpaceLoad - Could not read block bitmap.");
+	ESFS_CHECK(ValidateBlockBitmap(descriptor, bitmap, superblock), "FreeSpaceLoad - Invalid block bitmap.");
 
-	GroupDescriptor *target = nullptr;
+	uint64_t i = 0;
 
-	{
-		for (uint64_t i = 0; !target && i < superblock->groupCount; i++) {
-			GroupDescriptor *group = volume->groupDescriptorTable + i;
-			if (!group->blocksUsed) group->largestExtent = superblock->blocksPerGroup - superblock->blocksPerGroupBlockBitmap;
-			if (group->largestExtent >= increaseBlocks) target = group;
+	while (i < superblock->blocksPerGroup) {
+		if (bitmap[i / 8] == 0xFF && (i % 8) == 0) {
+			i += 8;
+		} else if (bitmap[i / 8] & (1 << (i % 8))) {
+			i++;
+		} else {
+			uint64_t start = i;
+
+			while (i < superblock->blocksPerGroup && (~bitmap[i / 8] & (1 << (i % 8)))) {
+				i++;
+			}
+
+			if (!FreeSpaceAdd(group, start, i - start)) {
+				FreeSpaceUnload(group);
+				ESFS_CHECK(false, "FreeSpaceLoad - Could not allocate free space entry.");
+			}
 		}
+	}
 
-		for (uint64_t i = 0; !target && i < superblock->groupCount; i++) {
-			GroupDescriptor *group = volume->groupDescriptorTable + i;
-			if (superblock->blocksPerGroup - group->blocksUsed >= increaseBlocks) target = group;
+	group->loaded = true;
+	return true;
+}
+
+static FreeSpace *FreeSpaceFind(Volume *volume, uintptr_t groupIndex, uint64_t nearby, uint64_t increaseBlocks, uint64_t *start) {
+	// If the nearby block is free, allocate from there. When nearby is the end of the file's last extent, this lets the extent grow.
+	// Otherwise, use the smallest extent that fits all the blocks, or the largest extent if none do.
+
+	GroupFreeSpace *group = volume->groupFreeSpace + groupIndex;
+	Superblock *superblock = &volume->superblock;
+
+	if (nearby / superblock->blocksPerGroup == groupIndex) {
+		uint64_t nearbyInGroup = nearby % superblock->blocksPerGroup;
+		AVLItem<FreeSpace> *item = TreeFind(&group->byStart, MakeShortKey(nearbyInGroup), TREE_SEARCH_LARGEST_BELOW_OR_EQUAL);
+
+		if (item && item->thisItem->start + item->thisItem->count > nearbyInGroup) {
+			*start = nearbyInGroup;
+			return item->thisItem;
+		}
+	}
+
+	AVLItem<FreeSpace> *item = TreeFind(&group->byCount, MakeShortKey(increaseBlocks), TREE_SEARCH_SMALLEST_ABOVE_OR_EQUAL);
+	if (!item) item = TreeFind(&group->byCount, MakeShortKey(superblock->blocksPerGroup), TREE_SEARCH_LARGEST_BELOW_OR_EQUAL);
+	if (!item) return nullptr;
+	*start = item->thisItem->start;
+	return item->thisItem;
+}
+
+static void FreeSpaceTake(GroupFreeSpace *group, FreeSpace *space, uint64_t start, uint64_t count) {
+	FreeSpaceRemove(group, space);
+
+	if (start != space->start && start + count != space->start + space->count) {
+		// Split the extent in two.
+		FreeSpace *after = (FreeSpace *) EsHeapAllocate(sizeof(FreeSpace), true, K_FIXED);
+
+		if (after) {
+			after->start = start + count;
+			after->count = space->start + space->count - after->start;
+			FreeSpaceInsert(group, after);
+			space->count = start - space->start;
+			FreeSpaceInsert(group, space);
+		} else {
+			// Rebuild the tree from the bitmap when the group is next used.
+			EsHeapFree(space, sizeof(FreeSpace), K_FIXED);
+			FreeSpaceUnload(group);
+		}
+	} else if (start != space->start) {
+		space->count -= count;
+		FreeSpaceInsert(group, space);
+	} else if (count != space->count) {
+		space->start += count;
+		space->count -= count;
+		FreeSpaceInsert(group, space);
+	} else {
+		EsHeapFree(space, sizeof(FreeSpace), K_FIXED);
+	}
+}
+
+static bool FreeSpaceReturn(GroupFreeSpace *group, uint64_t start, uint64_t count) {
+	// Merge with the free extents on either side.
+
+	AVLItem<FreeSpace> *before = TreeFind(&group->byStart, MakeShortKey(start), TREE_SEARCH_LARGEST_BELOW_OR_EQUAL);
+	AVLItem<FreeSpace> *after = TreeFind(&group->byStart, MakeShortKey(start + count), TREE_SEARCH_EXACT);
+	FreeSpace *space = nullptr;
+
+	if (before && before->thisItem->start + before->thisItem->count == start) {
+		space = before->thisItem;
+		FreeSpaceRemove(group, space);
+		space->count += count;
+	}
+
+	if (after) {
+		FreeSpace *merge = after->thisItem;
+		FreeSpaceRemove(group, merge);
+
+		if (space) {
+			space->count += merge->count;
+			EsHeapFree(merge, sizeof(FreeSpace), K_FIXED);
+		} else {
+			space = merge;
+			space->start = start;
+			space->count += count;
 		}
+	}
+
+	if (space) {
+		FreeSpaceInsert(group, space);
+		return true;
+	} else {
+		return FreeSpaceAdd(group, start, count);
+	}
+}
+
+static bool AllocateExtent(Volume *volume, uint64_t nearby, uint64_t increaseBlocks, uint64_t *extentStart, uint64_t *extentCount, bool zero) {
+	Superblock *superblock = &volume->superblock;
+	KWriterLockAssertExclusive(&volume->blockBitmapLock);
 
-		for (uint64_t i = 0; !target && i < superblock->groupCount; i++) {
-			GroupDescriptor *group = volume->groupDescriptorTable + i;
-			if (superblock->blocksPerGroup != group->blocksUsed) target = group;
+	// Find a group to allocate the next extent from.
+	// Start at the group containing the nearby block, and first look for a group that can fit all the blocks.
+
+	GroupDescriptor *target = nullptr;
+	GroupFreeSpace *targetFreeSpace = nullptr;
+	FreeSpace *space = nullptr;
+	uintptr_t firstGroup = nearby < superblock->blockCount ? nearby / superblock->blocksPerGroup : 0;
+
+	for (uintptr_t pass = 0; !target && pass < 2; pass++) {
+		for (uintptr_t i = 0; !target && i < superblock->groupCount; i++) {
+			uintptr_t groupIndex = (firstGroup + i) % superblock->groupCount;
+
+			if (FreeSpaceLargest(volume, groupIndex) < (pass ? 1 : increaseBlocks)) {
+				continue;
+			}
+
+			if (!FreeSpaceLoad(volume, groupIndex)) {
+				return false;
+			}
+
+			space = FreeSpaceFind(volume, groupIndex, nearby, increaseBlocks, extentStart);
+
+			if (space) {
+				target = volume->groupDescriptorTable + groupIndex;
+				targetFreeSpace = volume->groupFreeSpace + groupIndex;
+			}
 		}
 	}
 
@@ -532,9 +951,15 @@ static bool AllocateExtent(Volume *volume, uint64_t nearby, uint64_t increaseBlo
 		return false;
 	}
 
+	*extentCount = space->start + space->count - *extentStart;
+
+	if (*extentCount > increaseBlocks) {
+		*extentCount = increaseBlocks;
+	}
+
 	ESFS_CHECK(ValidateGroupDescriptor(target), "AllocateExtent - Invalid group descriptor.");
 
-	// Load the bitmap, find the largest extent, and mark it as in use.
+	// Load the bitmap and mark the extent as in use.
 
 	uint8_t *bitmap = (uint8_t *) EsHeapAllocate(superblock->blocksPerGroupBlockBitmap * superblock->blockSize, false, K_FIXED);
 	EsDefer(EsHeapFree(bitmap, 0, K_FIXED));
@@ -546,7 +971,9 @@ static bool AllocateExtent(Volume *volume, uint64_t nearby, uint64_t increaseBlo
 				return false;
 			}
 
-			ESFS_CHECK(ValidateBlockBitmap(target, bitmap, superblock), "AllocateExtent - Invalid block bitmap.");
+			// The bitmap was fully validated when the free space tree was built.
+			ESFS_CHECK(target->bitmapChecksum == CalculateCRC32(bitmap, superblock->blocksPerGroupBlockBitmap * superblock->blockSize, 0), 
+					"AllocateExtent - Invalid block bitmap checksum.");
 		} else {
 			EsMemoryZero(bitmap, superblock->blocksPerGroupBlockBitmap * superblock->blockSize);
 			for (uint64_t i = 0; i < superblock->blocksPerGroupBlockBitmap; i++) bitmap[i / 8] |= 1 << (i % 8);
@@ -554,34 +981,8 @@ static bool AllocateExtent(Volume *volume, uint64_t nearby, uint64_t increaseBlo
 			target->blocksUsed = superblock->blocksPerGroupBlockBitmap;
 		}
 
-		uint64_t largestExtentStart = 0, largestExtentCount = 0, i = 0;
-
-		while (i < superblock->blocksPerGroup) {
-			if (bitmap[i / 8] & (1 << (i % 8))) {
-				i++;
-			} else {
-				uint64_t start = i, count = 0;
-
-				while (i < superblock->blocksPerGroup) {
-					if (bitmap[i / 8] & (1 << (i % 8))) break;
-					else count++, i++;
-				}
-
-				if (largestExtentCount < count) {
-					largestExtentStart = start;
-					largestExtentCount = count;
-				}
-			}
-		}
-
-		*extentStart = largestExtentStart;
-		*extentCount = largestExtentCount;
-
-		if (*extentCount > increaseBlocks) {
-			*extentCount = increaseBlocks;
-		}
-
 		for (uint64_t i = *extentStart; i < *extentStart + *extentCount; i++) {
+			ESFS_CHECK(~bitmap[i / 8] & (1 << (i % 8)), "AllocateExtent - Free space tree does not match block bitmap.");
 			bitmap[i / 8] |= 1 << (i % 8);
 		}
 
@@ -589,7 +990,9 @@ static bool AllocateExtent(Volume *volume, uint64_t nearby, uint64_t increaseBlo
 			return false;
 		}
 
-		target->largestExtent = FindLargestExtent(bitmap, superblock);
+		FreeSpaceTake(targetFreeSpace, space, *extentStart, *extentCount);
+
+		target->largestExtent = FreeSpaceLargest(volume, target - volume->groupDescriptorTable);
 		target->blocksUsed += *extentCount;
 		target->bitmapChecksum = CalculateCRC32(bitmap, superblock->blocksPerGroupBlockBitmap * superblock->blockSize, 0);
 		target->checksum = 0;
@@ -601,25 +1004,10 @@ static bool AllocateExtent(Volume *volume, uint64_t nearby, uint64_t increaseBlo
 	volume->spaceUsed += *extentCount * superblock->blockSize;
 
 	if (zero) {
-		// TODO This is really slow - introduce K_ACCESS_ZERO?
 		// TODO Support KWorkGroup.
 
-		for (uint64_t i = 0; i < *extentCount * superblock->blockSize; i += zeroBufferSize) {
-#if 0
-			if ((i / zeroBufferSize) % 100 == 0) {
-				EsPrint("AllocateExtent zeroing %d/%d\n", i / zeroBufferSize, extentCount * superblock->blockSize / zeroBufferSize);
-			}
-#endif
-
-			uint64_t count = zeroBufferSize;
-
-			if (i + count >= *extentCount * superblock->blockSize) {
-				count = *extentCount * superblock->blockSize - i;
-			}
-
-			if (!AccessBlock(volume, *extentStart + i / superblock->blockSize, count / superblock->blockSize, zeroBuffer, ES_FLAGS_DEFAULT, K_ACCESS_WRITE)) {
-				return false;
-			}
+		if (!AccessBlock(volume, *extentStart, *extentCount, nullptr, ES_FLAGS_DEFAULT, K_ACCESS_ZERO)) {
+			return false;
 		}
 	}
 
@@ -639,7 +1027,7 @@ static bool FreeExtent(Volume *volume, uint64_t extentStart, uint64_t extentCoun
 	ESFS_CHECK(extentCount < superblock->blocksUsed, "FreeExtent - Extent is larged than the number of used blocks.");
 	ESFS_CHECK(extentStart + extentCount < superblock->blockCount, "FreeExtent - Extent goes past end of the volume.");
 
-	// Load the block bitmap.
+	// Load the block bitmap, and the free space tree for the group.
 
 	GroupDescriptor *target = volume->groupDescriptorTable + blockGroup;
 	ESFS_CHECK(ValidateGroupDescriptor(target), "FreeExtent - Invalid group descriptor.");
@@ -648,8 +1036,10 @@ static bool FreeExtent(Volume *volume, uint64_t extentStart, uint64_t extentCoun
 	ESFS_CHECK(bitmap, "FreeExtent - Could not allocate buffer for block bitmap.");
 	ESFS_CHECK(target->blockBitmap, "FreeExtent - Group descriptor does not have block bitmap.");
 	ESFS_CHECK(target->blocksUsed >= extentCount, "FreeExtent - Group descriptor indicates fewer blocks are used than are given in this extent.");
+	ESFS_CHECK(FreeSpaceLoad(volume, blockGroup), "FreeExtent - Could not load free space tree.");
 	ESFS_CHECK(AccessBlock(volume, target->blockBitmap, superblock->blocksPerGroupBlockBitmap, bitmap, FS_BLOCK_ACCESS_CACHED, K_ACCESS_READ), "FreeExtent - Could not read block bitmap.");
-	ESFS_CHECK(ValidateBlockBitmap(target, bitmap, superblock), "FreeExtent - Invalid block bitmap.");
+	ESFS_CHECK(target->bitmapChecksum == CalculateCRC32(bitmap, superblock->blocksPerGroupBlockBitmap * superblock->blockSize, 0), 
+			"FreeExtent - Invalid block bitmap checksum.");
 
 	// Clear the bits representing the freed blocks.
 
@@ -666,7 +1056,19 @@ static bool FreeExtent(Volume *volume, uint64_t extentStart, uint64_t extentCoun
 		return false;
 	}
 
-	target->largestExtent = FindLargestExtent(bitmap, superblock);
+	GroupFreeSpace *freeSpace = volume->groupFreeSpace + blockGroup;
+
+	if (!FreeSpaceReturn(freeSpace, extentStart % superblock->blocksPerGroup, extentCount)) {
+		// Rebuild the tree from the bitmap when the group is next used.
+		FreeSpaceUnload(freeSpace);
+	}
+
+	if (freeSpace->loaded) {
+		target->largestExtent = FreeSpaceLargest(volume, blockGroup);
+	} else if (target->largestExtent < extentCount) {
+		target->largestExtent = extentCount;
+	}
+
 	target->bitmapChecksum = CalculateCRC32(bitmap, superblock->blocksPerGroupBlockBitmap * superblock->blockSize, 0);
 	target->blocksUsed -= extentCount;
 	target->checksum = 0;
@@ -677,6 +1079,26 @@ static bool FreeExtent(Volume *volume, uint64_t extentStart, uint64_t extentCoun
 	return true;
 }
 
+static bool RaiseRequiredVersions(Volume *volume, uint16_t readVersion, uint16_t writeVersion) {
+	// Make sure drivers older than the given versions won't read or write the volume.
+	// The versions are never lowered, since other features may already have raised them further.
+
+	Superblock *superblock = &volume->superblock;
+	KWriterLockAssertExclusive(&volume->blockBitmapLock);
+
+	if (superblock->requiredReadVersion >= readVersion && superblock->requiredWriteVersion >= writeVersion) {
+		return true;
+	}
+
+	if (superblock->requiredReadVersion < readVersion) superblock->requiredReadVersion = readVersion;
+	if (superblock->requiredWriteVersion < writeVersion) superblock->requiredWriteVersion = writeVersion;
+	superblock->checksum = 0;
+	superblock->checksum = CalculateCRC32(superblock, sizeof(Superblock), 0);
+
+	return ES_SUCCESS == volume->Access(ESFS_BOOT_SUPER_BLOCK_SIZE, ESFS_BOOT_SUPER_BLOCK_SIZE, 
+			K_ACCESS_WRITE, (uint8_t *) superblock, ES_FLAGS_DEFAULT);
+}
+
 static uint64_t ResizeInternal(FSNode *file, uint64_t newSize, EsError *error, uint64_t newDataAttributeSize = 0) {
 	if (file->corrupt) return *error = ES_ERROR_CORRUPT_DATA, 0;
 
@@ -796,21 +1218,37 @@ static uint64_t ResizeInternal(FSNode *file, uint64_t newSize, EsError *error, u
 				return entry->fileSize;
 			}
 
+			// Instead of zeroing the new blocks of a file, mark them as unwritten.
+			// Directories are always zeroed, since they are accessed through the block cache.
+
+			bool unwritten = entry->nodeType != ESFS_NODE_TYPE_DIRECTORY;
+			bool previousUnwritten = data->count && (dataBuffer[previousPosition] & ESFS_EXTENT_UNWRITTEN);
+
+			// Older drivers would return the stale contents of unwritten extents.
+			if (unwritten && !RaiseRequiredVersions(volume, ESFS_UNWRITTEN_EXTENTS_VERSION, ESFS_UNWRITTEN_EXTENTS_VERSION)) {
+				*error = ES_ERROR_HARDWARE_FAILURE;
+				return entry->fileSize;
+			}
+
 			while (remaining) {
 				uint64_t allocatedStart, allocatedCount;
 
-				bool success = AllocateExtent(volume, 
-						previousExtentStart + extentCount /* Attempt to allocate near the end of the last extent */, 
+				// Attempt to allocate near the end of the last extent, or if this is the first extent, near the directory entry.
+				uint64_t nearby = data->count ? previousExtentStart + extentCount : file->reference.block;
+
+				bool success = AllocateExtent(volume, nearby, 
 						remaining /* Attempt to get an extent covering all the remaining blocks */,
-						&allocatedStart, &allocatedCount, true /* Zero the blocks */);
+						&allocatedStart, &allocatedCount, !unwritten /* Zero the blocks */);
 
 				if (!success) {
 					*error = ES_ERROR_HARDWARE_FAILURE;
 					return entry->fileSize;
 				}
 
-				if (previousExtentStart + extentCount == allocatedStart) {
+				if (previousExtentStart + extentCount == allocatedStart && previousUnwritten == unwritten) {
 					// We need to grow the previous extent.
+					// If it has been written, then the new blocks get their own extent for now;
+					// MarkBlocksWritten merges the two once the new blocks are written.
 
 					allocatedStart = previousExtentStart;
 					previousExtentStart = oldPreviousExtentStart;
@@ -823,6 +1261,7 @@ static uint64_t ResizeInternal(FSNode *file, uint64_t newSize, EsError *error, u
 				oldPreviousExtentStart = previousExtentStart;
 				uint8_t encode[32];
 				uint64_t length = EncodeExtent(allocatedStart, previousExtentStart, allocatedCount, encode);
+				if (unwritten) encode[0] |= ESFS_EXTENT_UNWRITTEN;
 
 				if (length + position > newDataBufferSize) {
 					// The data buffer is full.
@@ -836,6 +1275,8 @@ static uint64_t ResizeInternal(FSNode *file, uint64_t newSize, EsError *error, u
 					remaining -= allocatedCount;
 					entry->fileSize += allocatedCount * superblock->blockSize;
 					previousExtentStart = allocatedStart;
+					extentCount = allocatedCount;
+					previousUnwritten = unwritten;
 				}
 			}
 		} else if (oldBlocks > newBlocks) {
@@ -867,6 +1308,12 @@ static uint64_t ResizeInternal(FSNode *file, uint64_t newSize, EsError *error, u
 					if (!FreeExtent(volume, extentStart, extentCount2)) {
 						return 0;
 					}
+
+					if (entry->nodeType != ESFS_NODE_TYPE_DIRECTORY) {
+						// Let the drive know it doesn't need to keep the data.
+						// This must be done before the blocks can be reallocated, so the block bitmap lock is still held.
+						AccessBlock(volume, extentStart, extentCount2, nullptr, ES_FLAGS_DEFAULT, K_ACCESS_DISCARD);
+					}
 				}
 
 				blockInFile += extentCount;
@@ -889,6 +1336,7 @@ static uint64_t ResizeInternal(FSNode *file, uint64_t newSize, EsError *error, u
 					if (blockInFile < newBlocks) {
 						uint8_t encode[32];
 						uint64_t length = EncodeExtent(extentStart, lastExtentStart, newBlocks - blockInFile, encode);
+						encode[0] |= dataBuffer[previousPosition] & ESFS_EXTENT_UNWRITTEN;
 						EsMemoryCopy(dataBuffer + previousPosition, encode, length);
 						data->count = i + 1;
 						break;
@@ -924,6 +1372,38 @@ static uint64_t ResizeInternal(FSNode *file, uint64_t newSize, EsError *error, u
 	return (entry->fileSize = newSize);
 }
 
+static EsError CountExtents(KNode *node, uint64_t *extentCount) {
+	FSNode *file = (FSNode *) node->driverNode;
+	AttributeData *data = (AttributeData *) FindAttribute(&file->entry, ESFS_ATTRIBUTE_DATA);
+	*extentCount = 0;
+
+	if (file->corrupt || !data) {
+		return ES_ERROR_CORRUPT_DATA;
+	} else if (data->indirection == ESFS_INDIRECTION_DIRECT) {
+		// The data is stored in the directory entry.
+		return ES_SUCCESS;
+	} else if (data->indirection != ESFS_INDIRECTION_L1) {
+		return ES_ERROR_UNSUPPORTED;
+	}
+
+	// Count the runs of contiguous blocks, rather than the extents in the list,
+	// since an extent may be split into adjacent written and unwritten parts.
+
+	uint8_t *dataBuffer = (uint8_t *) data + data->dataOffset;
+	uint64_t previousExtentStart = 0, count = 0, position = 0, previousExtentEnd = 0;
+
+	for (uintptr_t i = 0; i < data->count; i++) {
+		if (!DecodeExtent(&previousExtentStart, &count, dataBuffer, &position, data->size - data->dataOffset)) {
+			return ES_ERROR_CORRUPT_DATA;
+		}
+
+		if (!i || previousExtentStart != previousExtentEnd) *extentCount += 1;
+		previousExtentEnd = previousExtentStart + count;
+	}
+
+	return ES_SUCCESS;
+}
+
 static uint64_t Resize(KNode *node, uint64_t newSize, EsError *error) {
 	// EsPrint("Resize %s to %d\n", node->name.bytes, node->name.buffer, newSize);
 	return ResizeInternal((FSNode *) node->driverNode, newSize, error);
@@ -931,14 +1411,9 @@ static uint64_t Resize(KNode *node, uint64_t newSize, EsError *error) {
 
 static IndexKey *InsertKeyIntoVertex(uint64_t newKey, IndexVertex *vertex) {
 	// Find where in this vertex we should insert the key.
+	// The key is not already in the vertex, so this is the position of the first greater key.
 
-	int position;
-
-	for (position = 0; position < vertex->count; position++) {
-		if (newKey < ESFS_VERTEX_KEY(vertex, position)->value) {
-			break;
-		}
-	}
+	uintptr_t position = FindKeyPositionInVertex(vertex, newKey);
 
 	// Insert the key.
 
@@ -952,50 +1427,21 @@ static IndexKey *InsertKeyIntoVertex(uint64_t newKey, IndexVertex *vertex) {
 
 static bool IndexModifyKey(Volume *volume, uint64_t newKey, DirectoryEntryReference reference, uint64_t rootBlock, uint8_t *buffer /* superblock->blockSize */) {
 	// TODO Return EsError.
-	if (!rootBlock) return false; // No index - the directory is empty?
-	
-	Superblock *superblock = &volume->superblock;
+	// If the key is marked with ESFS_INDEX_KEY_COLLISION, the mark is kept; the key only needs to refer to one of the entries with its hash.
 
-	// Get the root vertex.
+	Superblock *superblock = &volume->superblock;
 	IndexVertex *vertex = (IndexVertex *) buffer;
+	IndexKey *key;
 	uint64_t block;
 
-	if (!AccessBlock(volume, (block = rootBlock), 1, vertex, FS_BLOCK_ACCESS_CACHED, K_ACCESS_READ)) {
+	if (ES_SUCCESS != IndexFindKey(volume, buffer, newKey, rootBlock, &key, &block)) {
 		return false;
 	}
 
-	int depth = 0;
-
-	while (true) {
-		ESFS_CHECK(depth++ < ESFS_INDEX_MAX_DEPTH - 1, "IndexModifyKey - Reached tree max depth.");
-
-		if (!ValidateIndexVertex(superblock, vertex)) return false;
-		IndexKey *keys = (IndexKey *) ((uint8_t *) vertex + vertex->offset);
-
-		// For every key...
-		for (int i = 0; i <= vertex->count; i++) {
-			if (i == vertex->count || keys[i].value > newKey) {
-				if (keys[i].child) {
-					// The directory is in the child.
-					if (!AccessBlock(volume, (block = keys[i].child), 1, vertex, FS_BLOCK_ACCESS_CACHED, K_ACCESS_READ)) return false;
-					else goto nextVertex;
-				} else {
-					// We couldn't find the entry.
-					return false;
-				}
-			} else if (keys[i].value == newKey) {
-				// We've found the key.
-				ESFS_CHECK_CORRUPT(keys[i].data.block < superblock->blockCount 
-						&& keys[i].data.offsetIntoBlock + sizeof(DirectoryEntry) <= superblock->blockSize, 
-						"IndexModifyKey - Invalid key entry.");
-				keys[i].data = reference;
-				vertex->checksum = 0; vertex->checksum = CalculateCRC32(vertex, superblock->blockSize, 0);
-				return AccessBlock(volume, block, 1, vertex, FS_BLOCK_ACCESS_CACHED, K_ACCESS_WRITE);
-			}
-		}
-
-		nextVertex:;
-	}
+	key->data.block = reference.block;
+	key->data.offsetIntoBlock = reference.offsetIntoBlock;
+	vertex->checksum = 0; vertex->checksum = CalculateCRC32(vertex, superblock->blockSize, 0);
+	return AccessBlock(volume, block, 1, vertex, FS_BLOCK_ACCESS_CACHED, K_ACCESS_WRITE);
 }
 
 static bool IndexAddKey(Volume *volume, uint64_t newKey, DirectoryEntryReference reference, uint64_t *rootBlock) {
@@ -1042,23 +1488,31 @@ static bool IndexAddKey(Volume *volume, uint64_t newKey, DirectoryEntryReference
 			}
 		}
 
-		for (int i = 0; i < vertex->count; i++) {
-			if (ESFS_VERTEX_KEY(vertex, i)->value == newKey) {
-				// The key is already in the tree.
-				// TODO Hash collisions.
-				ESFS_CHECK(false, "IndexAddKey - Possible hash collision?");
+		uintptr_t position = FindKeyPositionInVertex(vertex, newKey);
+		IndexKey *key = ESFS_VERTEX_KEY(vertex, position);
+
+		if (position != vertex->count && key->value == newKey) {
+			// Another entry in the directory has the same hash.
+			// Mark the key, so that lookups which find the other entry search the directory instead.
+
+			{
+				// Older drivers would remove the key when either entry is removed. They can still read the volume.
+				KWriterLockTake(&volume->blockBitmapLock, K_LOCK_EXCLUSIVE);
+				EsDefer(KWriterLockReturn(&volume->blockBitmapLock, K_LOCK_EXCLUSIVE));
+				ESFS_CHECK(RaiseRequiredVersions(volume, 0, ESFS_INDEX_COLLISIONS_VERSION), "IndexAddKey - Could not update superblock.");
 			}
-		}
 
-		for (int i = 0; i <= vertex->count; i++) {
-			IndexKey *key = ESFS_VERTEX_KEY(vertex, i);
+			key->data.indexFlags |= ESFS_INDEX_KEY_COLLISION;
+			vertex->checksum = 0; vertex->checksum = CalculateCRC32(vertex, superblock->blockSize, 0);
+			ESFS_CHECK(AccessBlock(volume, blocks[depth], 1, vertex, FS_BLOCK_ACCESS_CACHED, K_ACCESS_WRITE), "IndexAddKey - Could not update index.");
+			return true;
+		}
 
-			if ((i == vertex->count || newKey < key->value) && key->child) {
-				ESFS_CHECK(depth < ESFS_INDEX_MAX_DEPTH - 1, "IndexAddKey - Reached tree max depth.");
+		if (key->child) {
+			ESFS_CHECK(depth < ESFS_INDEX_MAX_DEPTH - 1, "IndexAddKey - Reached tree max depth.");
 
-				blocks[++depth] = key->child;
-				goto next;
-			}
+			blocks[++depth] = key->child;
+			goto next;
 		}
 	}
 
@@ -1146,18 +1600,9 @@ static bool IndexAddKey(Volume *volume, uint64_t newKey, DirectoryEntryReference
 		// If this makes the parent full we'll fix it next iteration.
 
 		uint64_t median = (vertex->maxCount - 1) / 2; 
-		uint64_t newKey = vertexKeys[median].value;
-
-		for (uint64_t i = 0; i <= parent->count; i++) {
-			if (i == parent->count || newKey < parentKeys[i].value) {
-				parent->count++;
-				EsMemoryMove(parentKeys + i, parentKeys + parent->count, sizeof(IndexKey), true);
-				parentKeys[i].value = newKey;
-				parentKeys[i].data = vertexKeys[median].data;
-				parentKeys[i].child = blocks[depth];
-				break;
-			}
-		}
+		IndexKey *promoted = InsertKeyIntoVertex(vertexKeys[median].value, parent);
+		promoted->data = vertexKeys[median].data;
+		promoted->child = blocks[depth];
 
 		// Move all keys above the median key to the new sibling.
 
@@ -1201,32 +1646,24 @@ static bool IndexRemoveKey(Volume *volume, uint64_t removeKey, uint64_t *rootBlo
 	IndexVertex *vertex = (IndexVertex *) buffer;
 	uint64_t depth = 0, blocks[ESFS_INDEX_MAX_DEPTH] = { *rootBlock };
 	ESFS_CHECK(blocks[0], "IndexRemoveKey - Index has no root.");
-	int position = 0;
-
-	{
-		next:;
-		int i;
+	uintptr_t position = 0;
 
+	while (true) {
 		ESFS_CHECK(AccessBlock(volume, blocks[depth], 1, vertex, FS_BLOCK_ACCESS_CACHED, K_ACCESS_READ), "IndexRemoveKey - Could not read index.");
 		if (!ValidateIndexVertex(superblock, vertex)) return false;
 
-		for (i = 0; i <= vertex->count; i++) {
-			IndexKey *key = ESFS_VERTEX_KEY(vertex, i);
+		position = FindKeyPositionInVertex(vertex, removeKey);
+		IndexKey *key = ESFS_VERTEX_KEY(vertex, position);
 
-			if (i != vertex->count && key->value == removeKey) {
-				// EsPrint("found key %x at depth %d block %d position %d\n", removeKey, depth, blocks[depth], i);
-				goto done;
-			} else if ((i == vertex->count || removeKey < key->value) && key->child) {
-				ESFS_CHECK(depth < ESFS_INDEX_MAX_DEPTH - 1, "IndexRemoveKey - Reached tree max depth.");
-				blocks[++depth] = key->child;
-				// EsPrint("recurse into block %d at depth %d position %d\n", blocks[depth], depth, i);
-				goto next;
-			}
+		if (position != vertex->count && key->value == removeKey) {
+			// EsPrint("found key %x at depth %d block %d position %d\n", removeKey, depth, blocks[depth], position);
+			break;
 		}
 
-		ESFS_CHECK(false, "IndexRemoveKey - The key was not in the tree.");
-		done:;
-		position = i;
+		ESFS_CHECK(key->child, "IndexRemoveKey - The key was not in the tree.");
+		ESFS_CHECK(depth < ESFS_INDEX_MAX_DEPTH - 1, "IndexRemoveKey - Reached tree max depth.");
+		blocks[++depth] = key->child;
+		// EsPrint("recurse into block %d at depth %d position %d\n", blocks[depth], depth, position);
 	}
 
 	if (ESFS_VERTEX_KEY(vertex, position)->child) {
@@ -1243,7 +1680,7 @@ static bool IndexRemoveKey(Volume *volume, uint64_t removeKey, uint64_t *rootBlo
 
 			if (ESFS_VERTEX_KEY(search, 0)->child) {
 				ESFS_CHECK(depth < ESFS_INDEX_MAX_DEPTH - 1, "IndexRemoveKey - Reached tree max depth.");
-				blocks[++depth] = ESFS_VERTEX_KEY(vertex, 1)->child;
+				blocks[++depth] = ESFS_VERTEX_KEY(search, 0)->child;
 			} else break;
 		}
 
@@ -1481,6 +1918,31 @@ static EsError RemoveDirectoryEntry(FSNode *file, uint8_t *blockBuffers /* super
 
 	if (filename) {
 		uint64_t removeKey = CalculateCRC64(filename->filename, filename->length, 0);
+		IndexVertex *vertex = (IndexVertex *) blockBuffers;
+		IndexKey *key;
+		uint64_t keyBlock;
+
+		error = IndexFindKey(volume, blockBuffers, removeKey, directoryAttribute->indexRootBlock, &key, &keyBlock);
+		ESFS_CHECK_ERROR(error, "Remove - Could not find the entry in the index.");
+
+		if (key->data.indexFlags & ESFS_INDEX_KEY_COLLISION) {
+			// Other entries may share the key. If so, point the key at one of them instead of removing it.
+
+			DirectoryEntryReference firstMatch = {};
+			uint64_t matchCount;
+			error = SearchDirectoryForHash(directory, removeKey, nullptr, 0, &firstMatch, &matchCount);
+			if (error != ES_SUCCESS) return error;
+
+			if (matchCount) {
+				key->data = firstMatch;
+				key->data.indexFlags = matchCount > 1 ? ESFS_INDEX_KEY_COLLISION : 0;
+				vertex->checksum = 0; vertex->checksum = CalculateCRC32(vertex, superblock->blockSize, 0);
+				ESFS_CHECK_TO_ERROR(AccessBlock(volume, keyBlock, 1, vertex, FS_BLOCK_ACCESS_CACHED, K_ACCESS_WRITE), 
+						"Remove - Could not update index.", ES_ERROR_HARDWARE_FAILURE);
+				return ES_SUCCESS;
+			}
+		}
+
 		ESFS_CHECK_TO_ERROR(IndexRemoveKey(volume, removeKey, &directoryAttribute->indexRootBlock), "Remove - Could not update index.", ES_ERROR_HARDWARE_FAILURE);
 	}
 
@@ -1790,22 +2252,50 @@ static EsError Scan(const char *name, size_t nameLength, KNode *_directory) {
 	EsDefer(EsHeapFree(blockBuffer, 0, K_FIXED));
 
 	AttributeDirectory *attributeDirectory = (AttributeDirectory *) FindAttribute(&directory->entry, ESFS_ATTRIBUTE_DIRECTORY);
-	EsError error = FindDirectoryEntryReferenceFromIndex(volume, blockBuffer, &reference, name, nameLength, attributeDirectory->indexRootBlock);
+	uint64_t nameHash = CalculateCRC64(name, nameLength, 0);
+	IndexKey *key;
+	uint64_t keyBlock;
+	EsError error = IndexFindKey(volume, blockBuffer, nameHash, attributeDirectory->indexRootBlock, &key, &keyBlock);
 
 	if (error != ES_SUCCESS) {
 		// EsPrint("\tCould not find in directory. (%d - %s)\n", error, nameLength, name);
 		return error;
 	}
 
-	// EsPrint("\t%d/%d\n", reference.block, reference.offsetIntoBlock);
+	reference = key->data;
+	bool collision = reference.indexFlags & ESFS_INDEX_KEY_COLLISION;
+	reference.indexFlags = 0;
+	DirectoryEntry *entry;
 
-	if (!AccessBlock(volume, reference.block, 1, blockBuffer, FS_BLOCK_ACCESS_CACHED, K_ACCESS_READ)) {
-		KernelLog(LOG_ERROR, "EsFS", "drive access failure", "Scan - Could not load directory entry.\n");
-		return ES_ERROR_UNKNOWN;
-	}
+	while (true) {
+		// EsPrint("\t%d/%d\n", reference.block, reference.offsetIntoBlock);
 
-	DirectoryEntry *entry = (DirectoryEntry *) (blockBuffer + reference.offsetIntoBlock);
-	if (!ValidateDirectoryEntry(volume, entry)) return ES_ERROR_CORRUPT_DATA;
+		if (!AccessBlock(volume, reference.block, 1, blockBuffer, FS_BLOCK_ACCESS_CACHED, K_ACCESS_READ)) {
+			KernelLog(LOG_ERROR, "EsFS", "drive access failure", "Scan - Could not load directory entry.\n");
+			return ES_ERROR_UNKNOWN;
+		}
+
+		entry = (DirectoryEntry *) (blockBuffer + reference.offsetIntoBlock);
+		if (!ValidateDirectoryEntry(volume, entry)) return ES_ERROR_CORRUPT_DATA;
+
+		// The index only stores the hash of the name, so check that this is the entry we want.
+
+		AttributeFilename *filename = (AttributeFilename *) FindAttribute(entry, ESFS_ATTRIBUTE_FILENAME);
+
+		if (filename && filename->length == nameLength && 0 == EsMemoryCompare(filename->filename, name, nameLength)) {
+			break;
+		} else if (!collision) {
+			return ES_ERROR_FILE_DOES_NOT_EXIST;
+		}
+
+		// Other entries share the hash, so search the directory for the name.
+
+		uint64_t matchCount;
+		error = SearchDirectoryForHash(directory, nameHash, name, nameLength, &reference, &matchCount);
+		if (error != ES_SUCCESS) return error;
+		if (!matchCount) return ES_ERROR_FILE_DOES_NOT_EXIST;
+		collision = false;
+	}
 
 	if ((entry->nodeType == ESFS_NODE_TYPE_DIRECTORY && !FindAttribute(entry, ESFS_ATTRIBUTE_DIRECTORY))
 			|| (entry->nodeType == ESFS_NODE_TYPE_FILE && !FindAttribute(entry, ESFS_ATTRIBUTE_DATA))) {
@@ -1902,6 +2392,13 @@ static bool Mount(Volume *volume, EsFileOffsetDifference *rootDirectoryChildren)
 			EsHeapFree(volume->groupDescriptorTable, 0, K_FIXED);
 			ESFS_CHECK_FATAL(false, "Could not read group descriptor table.");
 		}
+
+		volume->groupFreeSpace = (GroupFreeSpace *) EsHeapAllocate(superblock->groupCount * sizeof(GroupFreeSpace), true, K_FIXED);
+
+		if (!volume->groupFreeSpace) {
+			EsHeapFree(volume->groupDescriptorTable, 0, K_FIXED);
+			ESFS_CHECK_FATAL(false, "Could not allocate free space trees.");
+		}
 	}
 
 	// Load the root directory.
@@ -1946,6 +2443,10 @@ static bool Mount(Volume *volume, EsFileOffsetDifference *rootDirectoryChildren)
 
 		failure:;
 		if (node) EsHeapFree(node, sizeof(FSNode), K_FIXED);
+		EsHeapFree(volume->groupFreeSpace, 0, K_FIXED);
+		EsHeapFree(volume->groupDescriptorTable, 0, K_FIXED);
+		volume->groupFreeSpace = nullptr;
+		volume->groupDescriptorTable = nullptr;
 		return false;
 	}
 
@@ -1968,6 +2469,11 @@ static void Unmount(KFileSystem *fileSystem) {
 				(uint8_t *) superblock, ES_FLAGS_DEFAULT);
 	}
 
+	for (uintptr_t i = 0; i < superblock->groupCount; i++) {
+		FreeSpaceUnload(volume->groupFreeSpace + i);
+	}
+
+	EsHeapFree(volume->groupFreeSpace, 0, K_FIXED);
 	EsHeapFree(volume->groupDescriptorTable, 0, K_FIXED);
 }
 
@@ -1997,6 +2503,7 @@ static void Register(KDevice *_parent) {
 	volume->enumerate = Enumerate;
 	volume->unmount = Unmount;
 	volume->close = Close;
+	volume->countExtents = CountExtents;
 
 	if (!volume->readOnly) {
 		volume->write = Write;
@@ -3,11 +3,11 @@
 // Written by: nakst.
 
 // TODO Validation of all fields.
-// TODO Contiguous block reading in Scan and Enumerate.
-// TODO Make GetDataBlock use (not yet implemented) system block cache.
 
 #include <module.h>
 
+#define DIRECTORY_READ_BYTES (65536) // Directories are read in batches of up to this many bytes.
+
 struct SuperBlock {
 	uint32_t inodeCount;
 	uint32_t blockCount;
@@ -128,9 +128,19 @@ struct DirectoryEntry {
 	// Followed by name.
 };
 
+struct BlockRun {
+	uint32_t fileBlock, diskBlock, count; // If diskBlock is 0, the run is a hole, and reads as zeroes.
+};
+
 struct FSNode {
 	struct Volume *volume;
 	Inode inode;
+
+	// The block map of the inode, converted to runs of contiguous blocks as it is walked.
+	KMutex runsMutex;
+	BlockRun *runs;
+	size_t runCount, runsAllocated;
+	uint32_t runsNextBlock; // The first file block not covered by the runs.
 };
 
 struct Volume : KFileSystem {
@@ -237,65 +247,222 @@ static bool Mount(Volume *volume) {
 	return true;
 }
 
-static uint32_t GetDataBlock(Volume *volume, Inode *node, uint64_t blockIndex, uint8_t *blockBuffer) {
-#define CHECK_BLOCK_INDEX() if (offset == 0 || offset / volume->block->information.sectorSize > volume->block->information.sectorCount) { \
-		KernelLog(LOG_ERROR, "Ext2", "invalid block index", "GetDataBlock - Block out of bounds.\n"); return 0; }
-#define GET_DATA_BLOCK_ACCESS_FAILURE() do { KernelLog(LOG_ERROR, "Ext2", "block access failure", "GetDataBlock - Could not read block.\n"); return 0; } while (0)
+static EsError AddBlockRun(FSNode *node, uint32_t diskBlock, uint32_t count) {
+	BlockRun *last = node->runCount ? node->runs + node->runCount - 1 : nullptr;
+
+	if (last && (diskBlock ? (last->diskBlock && last->diskBlock + last->count == diskBlock) : !last->diskBlock)) {
+		last->count += count;
+	} else {
+		if (node->runCount == node->runsAllocated) {
+			size_t runsAllocated = node->runsAllocated ? node->runsAllocated * 2 : 4;
+			BlockRun *runs = (BlockRun *) EsHeapReallocate(node->runs, runsAllocated * sizeof(BlockRun), false, K_FIXED);
+			if (!runs) return ES_ERROR_INSUFFICIENT_RESOURCES;
+			node->runs = runs, node->runsAllocated = runsAllocated;
+		}
+
+		BlockRun *run = node->runs + node->runCount;
+		run->fileBlock = node->runsNextBlock;
+		run->diskBlock = diskBlock;
+		run->count = count;
+		node->runCount++;
+	}
+
+	node->runsNextBlock += count;
+	return ES_SUCCESS;
+}
+
+static EsError ExtendBlockRuns(Volume *volume, FSNode *node, uint32_t lastFileBlock) {
+#define EXTEND_FAILURE(message, error) do { KernelLog(LOG_ERROR, "Ext2", "block map failure", "ExtendBlockRuns - " message); return error; } while (0)
+
+	// Walk the block map until the runs cover lastFileBlock.
+	// Indirect blocks are read through the block cache, and each one is only walked once.
+
+	uint64_t fileBytes = node->inode.fileSizeLow;
+	if ((node->inode.type & 0xF000) == INODE_TYPE_REGULAR) fileBytes |= (uint64_t) node->inode.fileSizeHigh << 32;
+	uint64_t fileBlocks = (fileBytes + volume->blockBytes - 1) / volume->blockBytes;
+
+	if (lastFileBlock >= fileBlocks) {
+		EXTEND_FAILURE("Block beyond the end of the file.\n", ES_ERROR_CORRUPT_DATA);
+	}
 
 	size_t blockPointersPerBlock = volume->blockBytes / 4;
-	uint32_t *blockPointers = (uint32_t *) blockBuffer;
-	uint64_t offset;
+	uint32_t *blockPointers = nullptr;
+	EsDefer(EsHeapFree(blockPointers, volume->blockBytes, K_FIXED));
+
+	while (node->runsNextBlock <= lastFileBlock) {
+		uint64_t index = node->runsNextBlock;
+
+		if (index < 12) {
+			uint32_t block = node->inode.directBlockPointers[index];
+			if (block >= volume->superBlock.blockCount) EXTEND_FAILURE("Block out of bounds.\n", ES_ERROR_CORRUPT_DATA);
+			EsError error = AddBlockRun(node, block, 1);
+			if (error != ES_SUCCESS) return error;
+			continue;
+		}
+
+		// Find the indirect block pointer covering the index.
+
+		index -= 12;
+		uint64_t span = blockPointersPerBlock; // The number of blocks covered by the current pointer.
+		uintptr_t level = 0;
+
+		while (index >= span) {
+			index -= span;
+			span *= blockPointersPerBlock;
+			level++;
+
+			if (level == 3) {
+				EXTEND_FAILURE("Block index out of bounds.\n", ES_ERROR_CORRUPT_DATA);
+			}
+		}
+
+		uint32_t block = node->inode.indirectBlockPointers[level];
+
+		if (!blockPointers) {
+			blockPointers = (uint32_t *) EsHeapAllocate(volume->blockBytes, false, K_FIXED);
+			if (!blockPointers) EXTEND_FAILURE("Could not allocate buffer.\n", ES_ERROR_INSUFFICIENT_RESOURCES);
+		}
+
+		// Descend to the last level of indirect blocks, and add all its pointers in one go.
+
+		while (true) {
+			if (!block) {
+				// The rest of the subtree is a hole.
+				uint64_t count = span - index;
+				if (count > fileBlocks - node->runsNextBlock) count = fileBlocks - node->runsNextBlock;
+				EsError error = AddBlockRun(node, 0, count);
+				if (error != ES_SUCCESS) return error;
+				break;
+			}
+
+			if (block >= volume->superBlock.blockCount) {
+				EXTEND_FAILURE("Indirect block out of bounds.\n", ES_ERROR_CORRUPT_DATA);
+			}
+
+			EsError error = volume->Access((uint64_t) block * volume->blockBytes, volume->blockBytes, 
+					K_ACCESS_READ, blockPointers, FS_BLOCK_ACCESS_CACHED);
+			if (error != ES_SUCCESS) EXTEND_FAILURE("Could not read indirect block.\n", error);
+
+			span /= blockPointersPerBlock;
+
+			if (span == 1) {
+				for (uintptr_t i = index; i < blockPointersPerBlock && node->runsNextBlock < fileBlocks; i++) {
+					if (blockPointers[i] >= volume->superBlock.blockCount) EXTEND_FAILURE("Block out of bounds.\n", ES_ERROR_CORRUPT_DATA);
+					error = AddBlockRun(node, blockPointers[i], 1);
+					if (error != ES_SUCCESS) return error;
+				}
+
+				break;
+			}
 
-	if (blockIndex < 12) {
-		offset = node->directBlockPointers[blockIndex];
-		CHECK_BLOCK_INDEX();
-		return offset;
+			block = blockPointers[index / span];
+			index %= span;
+		}
 	}
 
-	blockIndex -= 12;
+	return ES_SUCCESS;
+}
 
-	if (blockIndex < blockPointersPerBlock) {
-		offset = node->indirectBlockPointers[0] * volume->blockBytes;
-		CHECK_BLOCK_INDEX();
-		if (ES_SUCCESS != volume->Access(offset, volume->blockBytes, K_ACCESS_READ, blockBuffer, ES_FLAGS_DEFAULT)) GET_DATA_BLOCK_ACCESS_FAILURE();
-		offset = blockPointers[blockIndex];
-		CHECK_BLOCK_INDEX();
-		return offset;
+static EsError FindBlockRun(Volume *volume, FSNode *node, uint32_t fileBlock, uint32_t lastFileBlock, BlockRun *run) {
+	// The caller must hold runsMutex.
+
+	if (node->runsNextBlock <= lastFileBlock) {
+		EsError error = ExtendBlockRuns(volume, node, lastFileBlock);
+		if (error != ES_SUCCESS) return error;
 	}
 
-	blockIndex -= blockPointersPerBlock;
-
-	if (blockIndex < blockPointersPerBlock * blockPointersPerBlock) {
-		offset = node->indirectBlockPointers[1] * volume->blockBytes;
-		CHECK_BLOCK_INDEX();
-		if (ES_SUCCESS != volume->Access(offset, volume->blockBytes, K_ACCESS_READ, blockBuffer, ES_FLAGS_DEFAULT)) GET_DATA_BLOCK_ACCESS_FAILURE();
-		offset = blockPointers[blockIndex / blockPointersPerBlock];
-		CHECK_BLOCK_INDEX();
-		if (ES_SUCCESS != volume->Access(offset, volume->blockBytes, K_ACCESS_READ, blockBuffer, ES_FLAGS_DEFAULT)) GET_DATA_BLOCK_ACCESS_FAILURE();
-		offset = blockPointers[blockIndex % blockPointersPerBlock];
-		CHECK_BLOCK_INDEX();
-		return offset;
+	// Binary search for the run.
+
+	uintptr_t low = 0, high = node->runCount - 1;
+
+	while (low < high) {
+		uintptr_t middle = (low + high + 1) / 2;
+		if (node->runs[middle].fileBlock <= fileBlock) low = middle;
+		else high = middle - 1;
 	}
 
-	blockIndex -= blockPointersPerBlock * blockPointersPerBlock;
-
-	if (blockIndex < blockPointersPerBlock * blockPointersPerBlock * blockPointersPerBlock) {
-		offset = node->indirectBlockPointers[2] * volume->blockBytes;
-		CHECK_BLOCK_INDEX();
-		if (ES_SUCCESS != volume->Access(offset, volume->blockBytes, K_ACCESS_READ, blockBuffer, ES_FLAGS_DEFAULT)) GET_DATA_BLOCK_ACCESS_FAILURE();
-		offset = blockPointers[blockIndex / blockPointersPerBlock / blockPointersPerBlock];
-		CHECK_BLOCK_INDEX();
-		if (ES_SUCCESS != volume->Access(offset, volume->blockBytes, K_ACCESS_READ, blockBuffer, ES_FLAGS_DEFAULT)) GET_DATA_BLOCK_ACCESS_FAILURE();
-		offset = blockPointers[(blockIndex / blockPointersPerBlock) % blockPointersPerBlock];
-		CHECK_BLOCK_INDEX();
-		if (ES_SUCCESS != volume->Access(offset, volume->blockBytes, K_ACCESS_READ, blockBuffer, ES_FLAGS_DEFAULT)) GET_DATA_BLOCK_ACCESS_FAILURE();
-		offset = blockPointers[blockIndex % blockPointersPerBlock];
-		CHECK_BLOCK_INDEX();
-		return offset;
+	*run = node->runs[low];
+	return ES_SUCCESS;
+}
+
+struct ReadDispatchGroup : KWorkGroup {
+	uint64_t extentIndex;
+	uint64_t extentCount;
+	uint8_t *extentBuffer;
+	Volume *volume;
+	uint32_t flags; // Passed to KFileSystem::Access.
+
+	void QueueExtent() {
+		if (!extentCount) return;
+
+		volume->Access(extentIndex * volume->blockBytes, 
+				volume->blockBytes * extentCount, K_ACCESS_READ, extentBuffer, flags, this);
+	}
+
+	void QueueBlocks(Volume *_volume, uint64_t index, uint64_t count, uint8_t *buffer) {
+		if (extentIndex + extentCount == index && extentCount
+				&& extentBuffer + extentCount * volume->blockBytes == buffer) {
+			extentCount += count;
+		} else {
+			QueueExtent();
+			extentIndex = index;
+			extentCount = count;
+			extentBuffer = buffer;
+			volume = _volume;
+		}
+	}
+
+	bool Read() {
+		QueueExtent();
+		return Wait();
+	}
+};
+
+static EsError QueueReadBlocks(Volume *volume, FSNode *node, uint32_t fileBlock, uint32_t count, 
+		uint8_t *buffer /* count * volume->blockBytes */, ReadDispatchGroup *dispatchGroup) {
+	// Contiguous runs are read with a single access, and discontiguous runs are read concurrently.
+	// Holes are zeroed immediately. The caller must wait for the dispatch group, even if an error is returned.
+
+	uint32_t lastFileBlock = fileBlock + count - 1;
+
+	while (count) {
+		BlockRun run;
+		KMutexAcquire(&node->runsMutex);
+		EsError error = FindBlockRun(volume, node, fileBlock, lastFileBlock, &run);
+		KMutexRelease(&node->runsMutex);
+		if (error != ES_SUCCESS) return error;
+
+		uint32_t offsetIntoRun = fileBlock - run.fileBlock;
+		uint32_t blocksFromThisRun = run.count - offsetIntoRun;
+		if (blocksFromThisRun > count) blocksFromThisRun = count;
+
+		if (run.diskBlock) {
+			dispatchGroup->QueueBlocks(volume, run.diskBlock + offsetIntoRun, blocksFromThisRun, buffer);
+		} else {
+			EsMemoryZero(buffer, (size_t) blocksFromThisRun * volume->blockBytes);
+		}
+
+		buffer += (size_t) blocksFromThisRun * volume->blockBytes;
+		fileBlock += blocksFromThisRun, count -= blocksFromThisRun;
 	}
 
-	KernelLog(LOG_ERROR, "Ext2", "invalid index in inode", "GetDataBlock - Index %d out of bounds.\n", blockIndex);
-	return 0;
+	return ES_SUCCESS;
+}
+
+static EsError ReadBlocks(Volume *volume, FSNode *node, uint32_t fileBlock, uint32_t count, uint8_t *buffer /* count * volume->blockBytes */, uint32_t flags) {
+	ReadDispatchGroup dispatchGroup = {};
+	dispatchGroup.flags = flags;
+	dispatchGroup.Initialise();
+	EsError error = QueueReadBlocks(volume, node, fileBlock, count, buffer, &dispatchGroup);
+	bool success = dispatchGroup.Read();
+	return error != ES_SUCCESS ? error : success ? ES_SUCCESS : ES_ERROR_HARDWARE_FAILURE;
+}
+
+static uint32_t DirectoryBlocksPerRead(Volume *volume, uint32_t blocksInDirectory) {
+	uint32_t blocksPerRead = DIRECTORY_READ_BYTES / volume->blockBytes;
+	if (!blocksPerRead) blocksPerRead = 1;
+	if (blocksPerRead > blocksInDirectory) blocksPerRead = blocksInDirectory;
+	return blocksPerRead;
 }
 
 static EsError Enumerate(KNode *node) {
@@ -304,39 +471,39 @@ static EsError Enumerate(KNode *node) {
 	FSNode *directory = (FSNode *) node->driverNode;
 	Volume *volume = directory->volume;
 
-	uint8_t *blockBuffer = (uint8_t *) EsHeapAllocate(volume->blockBytes, false, K_FIXED);
+	uint32_t blocksInDirectory = directory->inode.fileSizeLow / volume->blockBytes;
+	if (!blocksInDirectory) return ES_SUCCESS;
+	uint32_t blocksPerRead = DirectoryBlocksPerRead(volume, blocksInDirectory);
 
-	if (!blockBuffer) {
+	uint8_t *directoryBuffer = (uint8_t *) EsHeapAllocate(blocksPerRead * volume->blockBytes, false, K_FIXED);
+
+	if (!directoryBuffer) {
 		ENUMERATE_FAILURE("Could not allocate buffer.\n", ES_ERROR_INSUFFICIENT_RESOURCES);
 	}
 
-	EsDefer(EsHeapFree(blockBuffer, volume->blockBytes, K_FIXED));
-
-	uint32_t blocksInDirectory = directory->inode.fileSizeLow / volume->blockBytes;
+	EsDefer(EsHeapFree(directoryBuffer, blocksPerRead * volume->blockBytes, K_FIXED));
 
 	for (uintptr_t i = 0; i < blocksInDirectory; i++) {
-		uint32_t block = GetDataBlock(volume, &directory->inode, i, blockBuffer);
-
-		if (!block) {
-			return ES_ERROR_HARDWARE_FAILURE;
+		if (i % blocksPerRead == 0) {
+			uint32_t count = blocksInDirectory - i > blocksPerRead ? blocksPerRead : blocksInDirectory - i;
+			EsError error = ReadBlocks(volume, directory, i, count, directoryBuffer, FS_BLOCK_ACCESS_CACHED);
+			if (error != ES_SUCCESS) ENUMERATE_FAILURE("Could not read blocks.\n", error);
 		}
 
-		EsError error = volume->Access((uint64_t) block * volume->blockBytes, volume->blockBytes, K_ACCESS_READ, blockBuffer, ES_FLAGS_DEFAULT);
-		if (error != ES_SUCCESS) ENUMERATE_FAILURE("Could not read block.\n", error);
-
+		uint8_t *blockData = directoryBuffer + (i % blocksPerRead) * volume->blockBytes;
 		uintptr_t positionInBlock = 0;
 
 		while (positionInBlock + sizeof(DirectoryEntry) < volume->blockBytes) {
-			DirectoryEntry *entry = (DirectoryEntry *) (blockBuffer + positionInBlock);
+			DirectoryEntry *entry = (DirectoryEntry *) (blockData + positionInBlock);
 
-			if (entry->entrySize > volume->blockBytes - positionInBlock
+			if (entry->entrySize < sizeof(DirectoryEntry) || entry->entrySize > volume->blockBytes - positionInBlock
 					|| entry->nameLengthLow > volume->blockBytes - positionInBlock - sizeof(DirectoryEntry)) {
 				ENUMERATE_FAILURE("Invalid directory entry size.\n", ES_ERROR_CORRUPT_DATA);
 			}
 
 			KNodeMetadata metadata = {};
 
-			const char *name = (const char *) (blockBuffer + positionInBlock + sizeof(DirectoryEntry));
+			const char *name = (const char *) (blockData + positionInBlock + sizeof(DirectoryEntry));
 			size_t nameBytes = entry->nameLengthLow;
 
 			metadata.type = entry->type == DIRENT_TYPE_DIRECTORY ? ES_NODE_DIRECTORY : entry->type == DIRENT_TYPE_REGULAR ? ES_NODE_FILE : ES_NODE_INVALID;
@@ -372,38 +539,38 @@ static EsError Scan(const char *name, size_t nameBytes, KNode *_directory) {
 	Volume *volume = directory->volume;
 	DirectoryEntry *entry = nullptr;
 
-	uint8_t *blockBuffer = (uint8_t *) EsHeapAllocate(volume->blockBytes, false, K_FIXED);
+	uint32_t blocksInDirectory = directory->inode.fileSizeLow / volume->blockBytes;
+	if (!blocksInDirectory) return ES_ERROR_FILE_DOES_NOT_EXIST;
+	uint32_t blocksPerRead = DirectoryBlocksPerRead(volume, blocksInDirectory);
+	uint32_t inode = 0;
 
-	if (!blockBuffer) {
+	uint8_t *directoryBuffer = (uint8_t *) EsHeapAllocate(blocksPerRead * volume->blockBytes, false, K_FIXED);
+
+	if (!directoryBuffer) {
 		SCAN_FAILURE("Could not allocate buffer.\n", ES_ERROR_INSUFFICIENT_RESOURCES);
 	}
 
-	EsDefer(EsHeapFree(blockBuffer, volume->blockBytes, K_FIXED));
-
-	uint32_t blocksInDirectory = directory->inode.fileSizeLow / volume->blockBytes;
-	uint32_t inode = 0;
+	EsDefer(EsHeapFree(directoryBuffer, blocksPerRead * volume->blockBytes, K_FIXED));
 
 	for (uintptr_t i = 0; i < blocksInDirectory; i++) {
-		uint32_t block = GetDataBlock(volume, &directory->inode, i, blockBuffer);
-
-		if (!block) {
-			return ES_ERROR_HARDWARE_FAILURE;
+		if (i % blocksPerRead == 0) {
+			uint32_t count = blocksInDirectory - i > blocksPerRead ? blocksPerRead : blocksInDirectory - i;
+			EsError error = ReadBlocks(volume, directory, i, count, directoryBuffer, FS_BLOCK_ACCESS_CACHED);
+			if (error != ES_SUCCESS) SCAN_FAILURE("Could not read blocks.\n", error);
 		}
 
-		EsError error = volume->Access((uint64_t) block * volume->blockBytes, volume->blockBytes, K_ACCESS_READ, blockBuffer, ES_FLAGS_DEFAULT);
-		if (error != ES_SUCCESS) SCAN_FAILURE("Could not read block.\n", error);
-
+		uint8_t *blockData = directoryBuffer + (i % blocksPerRead) * volume->blockBytes;
 		uintptr_t positionInBlock = 0;
 
 		while (positionInBlock + sizeof(DirectoryEntry) < volume->blockBytes) {
-			entry = (DirectoryEntry *) (blockBuffer + positionInBlock);
+			entry = (DirectoryEntry *) (blockData + positionInBlock);
 
-			if (entry->entrySize > volume->blockBytes - positionInBlock
+			if (entry->entrySize < sizeof(DirectoryEntry) || entry->entrySize > volume->blockBytes - positionInBlock
 					|| entry->nameLengthLow > volume->blockBytes - positionInBlock - sizeof(DirectoryEntry)) {
 				SCAN_FAILURE("Invalid directory entry size.\n", ES_ERROR_CORRUPT_DATA);
 			}
 
-			if (entry->nameLengthLow == nameBytes && 0 == EsMemoryCompare(name, blockBuffer + positionInBlock + sizeof(DirectoryEntry), nameBytes)) {
+			if (entry->nameLengthLow == nameBytes && 0 == EsMemoryCompare(name, blockData + positionInBlock + sizeof(DirectoryEntry), nameBytes)) {
 				inode = entry->inode;
 				goto foundInode;
 			}
@@ -458,7 +625,7 @@ static EsError Load(KNode *_directory, KNode *node, KNodeMetadata *metadata, con
 	EsError error = volume->Access(blockGroupDescriptor->inodeTable * volume->blockBytes 
 			+ sectorInInodeTable * volume->block->information.sectorSize, 
 			volume->block->information.sectorSize, 
-			K_ACCESS_READ, blockBuffer, ES_FLAGS_DEFAULT);
+			K_ACCESS_READ, blockBuffer, FS_BLOCK_ACCESS_CACHED);
 	if (error != ES_SUCCESS) return error;
 
 	FSNode *data = (FSNode *) EsHeapAllocate(sizeof(FSNode), true, K_FIXED);
@@ -496,86 +663,55 @@ static EsError Load(KNode *_directory, KNode *node, KNodeMetadata *metadata, con
 	return ES_SUCCESS;
 }
 
-struct ReadDispatchGroup : KWorkGroup {
-	uint64_t extentIndex;
-	uint64_t extentCount;
-	uint8_t *extentBuffer;
-	Volume *volume;
-
-	void QueueExtent() {
-		if (!extentCount) return;
-
-		volume->Access(extentIndex * volume->blockBytes, 
-				volume->blockBytes * extentCount, K_ACCESS_READ, extentBuffer, ES_FLAGS_DEFAULT, this);
-	}
-
-	void QueueBlock(Volume *_volume, uint64_t index, uint8_t *buffer) {
-		if (extentIndex + extentCount == index && extentCount
-				&& extentBuffer + extentCount * volume->blockBytes == buffer) {
-			extentCount++;
-		} else {
-			QueueExtent();
-			extentIndex = index;
-			extentCount = 1;
-			extentBuffer = buffer;
-			volume = _volume;
-		}
-	}
-
-	bool Read() {
-		QueueExtent();
-		return Wait();
-	}
-};
-
 static size_t Read(KNode *node, void *_buffer, EsFileOffset offset, EsFileOffset count) {
 #define READ_FAILURE(message, error) do { KernelLog(LOG_ERROR, "Ext2", "read failure", "Read - " message); return error; } while (0)
 
 	FSNode *file = (FSNode *) node->driverNode;
 	Volume *volume = file->volume;
 
-	uint8_t *blockBuffer = (uint8_t *) EsHeapAllocate(volume->blockBytes, false, K_FIXED);
-
-	if (!blockBuffer) {
-		READ_FAILURE("Could not allocate sector buffer.\n", ES_ERROR_INSUFFICIENT_RESOURCES);
-	}
-
+	uint8_t *blockBuffer = nullptr;
 	EsDefer(EsHeapFree(blockBuffer, volume->blockBytes, K_FIXED));
 
 	uint8_t *outputBuffer = (uint8_t *) _buffer;
-	uintptr_t outputPosition = 0;
-
-	uint32_t firstBlock = offset / volume->blockBytes,
-		 lastBlock = (offset + count) / volume->blockBytes,
-		 currentBlock = firstBlock;
+	EsFileOffset remaining = count;
 
 	ReadDispatchGroup dispatchGroup = {};
 	dispatchGroup.Initialise();
 
-	while (currentBlock <= lastBlock) {
-		uint32_t block = GetDataBlock(volume, &file->inode, currentBlock, blockBuffer);
+	while (remaining) {
+		uintptr_t offsetIntoBlock = offset % volume->blockBytes;
+		EsFileOffset bytes;
+		EsError error;
 
-		if (!block) {
-			return false;
-		}
+		if (!offsetIntoBlock && remaining >= volume->blockBytes && ((uintptr_t) outputBuffer & 3) == 0) {
+			// Read whole blocks directly into the output buffer.
+			uint32_t blocks = remaining / volume->blockBytes;
+			bytes = (EsFileOffset) blocks * volume->blockBytes;
+			error = QueueReadBlocks(volume, file, offset / volume->blockBytes, blocks, outputBuffer, &dispatchGroup);
+		} else {
+			// Read part of a block.
 
-		uintptr_t readStart = currentBlock == firstBlock ? (offset % volume->blockBytes)           : 0;
-		uintptr_t readEnd   = currentBlock == lastBlock  ? ((offset + count) % volume->blockBytes) : volume->blockBytes;
+			if (!blockBuffer) {
+				blockBuffer = (uint8_t *) EsHeapAllocate(volume->blockBytes, false, K_FIXED);
 
-		bool readEntireBlock = readStart == 0 && readEnd == volume->blockBytes;
+				if (!blockBuffer) {
+					dispatchGroup.Read();
+					READ_FAILURE("Could not allocate block buffer.\n", ES_ERROR_INSUFFICIENT_RESOURCES);
+				}
+			}
 
-		if (readEntireBlock) {
-			dispatchGroup.QueueBlock(volume, block, outputBuffer + outputPosition);
-			outputPosition += volume->blockBytes;
-		} else {
-			EsError error = volume->Access((uint64_t) block * volume->blockBytes, volume->blockBytes, K_ACCESS_READ, blockBuffer, ES_FLAGS_DEFAULT);
-			if (error != ES_SUCCESS) READ_FAILURE("Could not read blocks from drive.\n", error);
+			bytes = volume->blockBytes - offsetIntoBlock;
+			if (bytes > remaining) bytes = remaining;
+			error = ReadBlocks(volume, file, offset / volume->blockBytes, 1, blockBuffer, ES_FLAGS_DEFAULT);
+			if (error == ES_SUCCESS) EsMemoryCopy(outputBuffer, blockBuffer + offsetIntoBlock, bytes);
+		}
 
-			EsMemoryCopy(outputBuffer + outputPosition, blockBuffer + readStart, readEnd - readStart);
-			outputPosition += readEnd - readStart;
+		if (error != ES_SUCCESS) {
+			dispatchGroup.Read();
+			READ_FAILURE("Could not read blocks.\n", error);
 		}
 
-		currentBlock++;
+		remaining -= bytes, outputBuffer += bytes, offset += bytes;
 	}
 
 	bool success = dispatchGroup.Read();
@@ -588,7 +724,9 @@ static size_t Read(KNode *node, void *_buffer, EsFileOffset offset, EsFileOffset
 }
 
 static void Close(KNode *node) {
-	EsHeapFree(node->driverNode, sizeof(FSNode), K_FIXED);
+	FSNode *driverNode = (FSNode *) node->driverNode;
+	EsHeapFree(driverNode->runs, driverNode->runsAllocated * sizeof(BlockRun), K_FIXED);
+	EsHeapFree(driverNode, sizeof(FSNode), K_FIXED);
 }
 
 static void DeviceAttach(KDevice *parent) {
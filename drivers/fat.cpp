@@ -3,14 +3,20 @@
 // Written by: nakst.
 
 // TODO Validation of all fields.
-// TODO Don't load entire FAT in memory.
-// TODO Long file names.
 
 #include <module.h>
 #include <shared/fat.cpp>
 
 #define SECTOR_SIZE (512)
 
+// The FAT is read on demand through the block cache, a window of sectors at a time.
+#define FAT_WINDOW_SECTORS (8)
+
+// Long file names can be up to 255 UCS-2 characters, stored across at most 20 entries.
+#define LONG_NAME_MAXIMUM_ENTRIES (20)
+#define LONG_NAME_MAXIMUM_CHARACTERS (LONG_NAME_MAXIMUM_ENTRIES * 13)
+#define NAME_MAXIMUM_BYTES (LONG_NAME_MAXIMUM_CHARACTERS * 3)
+
 struct Volume : KFileSystem {
 	union {
 		char _unused0[SECTOR_SIZE];
@@ -19,10 +25,10 @@ struct Volume : KFileSystem {
 		SuperBlockCommon superBlock;
 	};
 
-	KNode *root;
-	uint8_t *fat;
 	uintptr_t sectorOffset;
 	uint32_t terminateCluster;
+	uint32_t sectorsPerFAT;
+	uint32_t clusterCount; // The number of data clusters; valid cluster numbers start at 2.
 
 #define TYPE_FAT12 (12)
 #define TYPE_FAT16 (16)
@@ -30,12 +36,22 @@ struct Volume : KFileSystem {
 	int type;
 
 	FATDirectoryEntry *rootDirectoryEntries;
+
+	KMutex fatWindowMutex;
+	uint32_t fatWindowSector; // The first sector of the FAT in fatWindow, or -1 if it is empty.
+	uint8_t fatWindow[FAT_WINDOW_SECTORS * SECTOR_SIZE];
 };
 
 struct DirectoryEntryReference {
 	uint32_t cluster, offset;
 };
 
+struct ClusterRun {
+	uint32_t fileCluster; // The index of the first cluster of the run in the file.
+	uint32_t diskCluster;
+	uint32_t count;
+};
+
 struct FSNode {
 	Volume *volume;
 	FATDirectoryEntry entry;
@@ -43,47 +59,264 @@ struct FSNode {
 	// The root directory is loaded during fileSystem mount.
 	// If this is non-null, run directory data from here.
 	FATDirectoryEntry *rootDirectory;
+
+	// The cluster chain of the file, converted to runs of contiguous clusters as it is walked.
+	KMutex runsMutex;
+	ClusterRun *runs;
+	size_t runCount, runsAllocated;
+	uint32_t runsNextCluster; // The cluster after the last run in the chain.
 };
 
-static uint32_t NextCluster(Volume *volume, uint32_t currentCluster) {
-	if (volume->type == TYPE_FAT12) {
-		uint8_t byte1 = volume->fat[currentCluster * 3 / 2 + 0], 
-			byte2 = volume->fat[currentCluster * 3 / 2 + 1];
+struct LongName {
+	uint16_t characters[LONG_NAME_MAXIMUM_CHARACTERS];
+	uint8_t checksum, nextOrder, entries;
+	bool valid;
+};
+
+static EsError NextCluster(Volume *volume, uint32_t currentCluster, uint32_t *nextCluster) {
+	if (currentCluster < 2 || currentCluster >= volume->clusterCount + 2) {
+		KernelLog(LOG_ERROR, "FAT", "invalid cluster", "NextCluster - Cluster %d is out of range.\n", currentCluster);
+		return ES_ERROR_CORRUPT_DATA;
+	}
+
+	uint32_t byteOffset = volume->type == TYPE_FAT12 ? currentCluster * 3 / 2 : volume->type == TYPE_FAT16 ? currentCluster * 2 : currentCluster * 4;
+	uint32_t entryBytes = volume->type == TYPE_FAT32 ? 4 : 2;
+
+	if (byteOffset + entryBytes > volume->sectorsPerFAT * SECTOR_SIZE) {
+		KernelLog(LOG_ERROR, "FAT", "invalid cluster", "NextCluster - Cluster %d is past the end of the FAT.\n", currentCluster);
+		return ES_ERROR_CORRUPT_DATA;
+	}
+
+	KMutexAcquire(&volume->fatWindowMutex);
+	EsDefer(KMutexRelease(&volume->fatWindowMutex));
+
+	uint32_t sector = byteOffset / SECTOR_SIZE;
+
+	if (volume->fatWindowSector == (uint32_t) -1 || sector < volume->fatWindowSector 
+			|| byteOffset + entryBytes > (volume->fatWindowSector + FAT_WINDOW_SECTORS) * SECTOR_SIZE) {
+		uint32_t sectorCount = FAT_WINDOW_SECTORS;
+		if (sector + sectorCount > volume->sectorsPerFAT) sectorCount = volume->sectorsPerFAT - sector;
+		volume->fatWindowSector = -1;
+
+		EsError error = volume->Access((volume->superBlock.reservedSectors + sector) * SECTOR_SIZE, sectorCount * SECTOR_SIZE, 
+				K_ACCESS_READ, volume->fatWindow, FS_BLOCK_ACCESS_CACHED);
+		if (error != ES_SUCCESS) return error;
+
+		volume->fatWindowSector = sector;
+	}
 
-		if (currentCluster & 1) currentCluster = (byte2 << 4) + (byte1 >> 4);
-		else 			currentCluster = (byte2 << 8) + (byte1 >> 0);
+	uint8_t *entry = volume->fatWindow + byteOffset - volume->fatWindowSector * SECTOR_SIZE;
 
-		return currentCluster & 0xFFF;
+	if (volume->type == TYPE_FAT12) {
+		if (currentCluster & 1) *nextCluster = (entry[1] << 4) + (entry[0] >> 4);
+		else 			*nextCluster = (entry[1] << 8) + (entry[0] >> 0);
+		*nextCluster &= 0xFFF;
 	} else if (volume->type == TYPE_FAT16) {
-		return ((uint16_t *) volume->fat)[currentCluster];
+		*nextCluster = *(uint16_t *) entry;
 	} else if (volume->type == TYPE_FAT32) {
-		return ((uint32_t *) volume->fat)[currentCluster];
+		*nextCluster = *(uint32_t *) entry & 0x0FFFFFFF;
 	} else {
 		KernelPanic("[FAT] NextCluster - Unsupported FAT type.\n");
-		return 0;
 	}
+
+	return ES_SUCCESS;
 }
 
-static uint32_t CountUsedClusters(Volume *volume) {
-	size_t total = 0;
+static EsError CountUsedClusters(Volume *volume, uint32_t *count) {
+	*count = 0;
 
-	if (volume->type == TYPE_FAT12) {
-		 total = volume->sb16.sectorsPerFAT16 * volume->superBlock.bytesPerSector * 2 / 3;
-	} else if (volume->type == TYPE_FAT16) {
-		 total = volume->sb16.sectorsPerFAT16 * volume->superBlock.bytesPerSector / 2;
-	} else if (volume->type == TYPE_FAT32) {
-		 total = volume->sb16.sectorsPerFAT16 * volume->superBlock.bytesPerSector / 4;
+	if (volume->type == TYPE_FAT32 && volume->sb32.fsInfoSector && volume->sb32.fsInfoSector < volume->superBlock.reservedSectors) {
+		// Use the free cluster count from the FS information sector, if it is available.
+		// This avoids reading the whole FAT at mount.
+
+		uint32_t sectorBuffer[SECTOR_SIZE / sizeof(uint32_t)];
+		FATFSInformation *information = (FATFSInformation *) sectorBuffer;
+		EsError error = volume->Access(volume->sb32.fsInfoSector * SECTOR_SIZE, SECTOR_SIZE, K_ACCESS_READ, sectorBuffer, ES_FLAGS_DEFAULT);
+
+		if (error == ES_SUCCESS && information->signature1 == 0x41615252 && information->signature2 == 0x61417272 
+				&& information->freeClusters <= volume->clusterCount) {
+			*count = volume->clusterCount - information->freeClusters;
+			return ES_SUCCESS;
+		}
+	}
+
+	for (uint32_t i = 2; i < volume->clusterCount + 2; i++) {
+		uint32_t next;
+		EsError error = NextCluster(volume, i, &next);
+		if (error != ES_SUCCESS) return error;
+		if (next) (*count)++;
+	}
+
+	return ES_SUCCESS;
+}
+
+static EsError CountDirectoryChildren(Volume *volume, uint32_t firstCluster, EsFileOffsetDifference *children) {
+	// This is an upper bound, since some of the entries will be unused.
+	uint32_t currentCluster = firstCluster;
+	*children = 0;
+
+	while (currentCluster < volume->terminateCluster) {
+		EsError error = NextCluster(volume, currentCluster, &currentCluster);
+		if (error != ES_SUCCESS) return error;
+		*children += SECTOR_SIZE * volume->superBlock.sectorsPerCluster / sizeof(FATDirectoryEntry);
+	}
+
+	return ES_SUCCESS;
+}
+
+static EsError FindClusterRun(Volume *volume, FSNode *node, uint32_t fileCluster, uint32_t lastFileCluster, ClusterRun *run) {
+	// Walk the chain until the runs cover lastFileCluster, and then find the run containing fileCluster.
+	// The caller must hold runsMutex.
+
+	while (!node->runCount || node->runs[node->runCount - 1].fileCluster + node->runs[node->runCount - 1].count <= lastFileCluster) {
+		uint32_t cluster = node->runsNextCluster;
+
+		if (cluster < 2 || cluster >= volume->terminateCluster) {
+			// The chain is shorter than the file.
+			KernelLog(LOG_ERROR, "FAT", "chain too short", "FindClusterRun - Cluster chain ended before file cluster %d.\n", lastFileCluster);
+			return ES_ERROR_CORRUPT_DATA;
+		}
+
+		ClusterRun *last = node->runCount ? node->runs + node->runCount - 1 : nullptr;
+
+		if (last && last->diskCluster + last->count == cluster) {
+			last->count++;
+		} else {
+			if (node->runCount == node->runsAllocated) {
+				size_t runsAllocated = node->runsAllocated ? node->runsAllocated * 2 : 4;
+				ClusterRun *runs = (ClusterRun *) EsHeapReallocate(node->runs, runsAllocated * sizeof(ClusterRun), false, K_FIXED);
+				if (!runs) return ES_ERROR_INSUFFICIENT_RESOURCES;
+				node->runs = runs, node->runsAllocated = runsAllocated;
+			}
+
+			ClusterRun *run = node->runs + node->runCount;
+			run->fileCluster = last ? last->fileCluster + last->count : 0;
+			run->diskCluster = cluster;
+			run->count = 1;
+			node->runCount++;
+		}
+
+		EsError error = NextCluster(volume, cluster, &node->runsNextCluster);
+		if (error != ES_SUCCESS) return error;
+	}
+
+	// Binary search for the run.
+
+	uintptr_t low = 0, high = node->runCount - 1;
+
+	while (low < high) {
+		uintptr_t middle = (low + high + 1) / 2;
+		if (node->runs[middle].fileCluster <= fileCluster) low = middle;
+		else high = middle - 1;
+	}
+
+	*run = node->runs[low];
+	return ES_SUCCESS;
+}
+
+static uint8_t ShortNameChecksum(const uint8_t *name) {
+	uint8_t checksum = 0;
+	for (uintptr_t i = 0; i < 11; i++) checksum = ((checksum & 1) << 7) + (checksum >> 1) + name[i];
+	return checksum;
+}
+
+static size_t DirectoryEntryGetName(FATDirectoryEntry *entry, LongName *longName, char *name) {
+	// Returns the number of bytes in the name, or 0 if the entry should be skipped.
+	// Long name entries are accumulated into longName until the short name entry they belong to is found.
+
+	if (entry->attributes == 0x0F) {
+		FATLongNameEntry *part = (FATLongNameEntry *) entry;
+		uint8_t order = part->order & 0x1F;
+
+		if (part->order == 0xE5) {
+			// Deleted.
+			longName->valid = false;
+			return 0;
+		}
+
+		if (part->order & 0x40) {
+			longName->valid = order >= 1 && order <= LONG_NAME_MAXIMUM_ENTRIES;
+			longName->checksum = part->checksum;
+			longName->nextOrder = order;
+			longName->entries = order;
+		}
+
+		if (!longName->valid || order != longName->nextOrder || part->checksum != longName->checksum) {
+			longName->valid = false;
+			return 0;
+		}
+
+		uint16_t *characters = longName->characters + (order - 1) * 13;
+		EsMemoryCopy(characters + 0, part->name1, sizeof(part->name1));
+		EsMemoryCopy(characters + 5, part->name2, sizeof(part->name2));
+		EsMemoryCopy(characters + 11, part->name3, sizeof(part->name3));
+		longName->nextOrder--;
+		return 0;
 	}
 
-	size_t count = 0;
+	bool hasLongName = longName->valid && !longName->nextOrder && longName->checksum == ShortNameChecksum(entry->name);
+	longName->valid = false;
+
+	if (entry->name[0] == 0xE5 || (entry->attributes & 8)) {
+		return 0;
+	}
+
+	if (entry->name[0] == '.' && (entry->name[1] == '.' || entry->name[1] == ' ') && entry->name[2] == ' ') {
+		return 0;
+	}
+
+	size_t nameBytes = 0;
+
+	if (hasLongName) {
+		// Convert the name from UCS-2 to UTF-8.
 
-	for (uintptr_t i = 0; i < total; i++) {
-		if (NextCluster(volume, i)) {
-			count++;
+		for (uintptr_t i = 0; i < longName->entries * 13u; i++) {
+			uint32_t c = longName->characters[i];
+			if (c == 0x0000 || c == 0xFFFF) break;
+
+			if (c >= 0xD800 && c < 0xDC00 && i + 1 < longName->entries * 13u 
+					&& longName->characters[i + 1] >= 0xDC00 && longName->characters[i + 1] < 0xE000) {
+				c = 0x10000 + ((c - 0xD800) << 10) + (longName->characters[++i] - 0xDC00);
+			} else if (c >= 0xD800 && c < 0xE000) {
+				c = '?'; // Unpaired surrogate.
+			}
+
+			if (c < 0x80) {
+				name[nameBytes++] = c;
+			} else if (c < 0x800) {
+				name[nameBytes++] = 0xC0 | (c >> 6);
+				name[nameBytes++] = 0x80 | (c & 0x3F);
+			} else if (c < 0x10000) {
+				name[nameBytes++] = 0xE0 | (c >> 12);
+				name[nameBytes++] = 0x80 | ((c >> 6) & 0x3F);
+				name[nameBytes++] = 0x80 | (c & 0x3F);
+			} else {
+				name[nameBytes++] = 0xF0 | (c >> 18);
+				name[nameBytes++] = 0x80 | ((c >> 12) & 0x3F);
+				name[nameBytes++] = 0x80 | ((c >> 6) & 0x3F);
+				name[nameBytes++] = 0x80 | (c & 0x3F);
+			}
+		}
+
+		if (nameBytes) {
+			return nameBytes;
 		}
 	}
 
-	return count;
+	// Use the short name.
+	// Windows NT sets bits in the reserved byte to indicate the base name or extension should be shown in lowercase.
+
+	bool hasExtension = entry->name[8] != ' ' || entry->name[9] != ' ' || entry->name[10] != ' ';
+
+	for (uintptr_t i = 0; i < 11; i++) {
+		if (i == 8 && hasExtension) name[nameBytes++] = '.';
+		uint8_t c = entry->name[i];
+		if (c == ' ') continue;
+		bool lowercase = (entry->_reserved0 & (i < 8 ? 0x08 : 0x10)) && c >= 'A' && c <= 'Z';
+		name[nameBytes++] = lowercase ? c - 'A' + 'a' : c;
+	}
+
+	return nameBytes;
 }
 
 static EsError Load(KNode *_directory, KNode *_node, KNodeMetadata *, const void *entryData) {
@@ -91,19 +324,19 @@ static EsError Load(KNode *_directory, KNode *_node, KNodeMetadata *, const void
 	Volume *volume = directory->volume;
 	SuperBlockCommon *superBlock = &volume->superBlock;
 
-	uint8_t *clusterBuffer = (uint8_t *) EsHeapAllocate(superBlock->sectorsPerCluster * SECTOR_SIZE, false, K_FIXED);
-	if (!clusterBuffer) return ES_ERROR_INSUFFICIENT_RESOURCES;
-	EsDefer(EsHeapFree(clusterBuffer, 0, K_FIXED));
-
 	DirectoryEntryReference reference = *(DirectoryEntryReference *) entryData;
 	FATDirectoryEntry entry;
 
 	if (!directory->rootDirectory) {
-		EsError error = volume->Access((reference.cluster * superBlock->sectorsPerCluster + volume->sectorOffset) * SECTOR_SIZE, 
-				superBlock->sectorsPerCluster * SECTOR_SIZE, K_ACCESS_READ, (uint8_t *) clusterBuffer, ES_FLAGS_DEFAULT);
+		// Only read the sector containing the entry.
+		uint32_t sectorBuffer[SECTOR_SIZE / sizeof(uint32_t)];
+		uintptr_t entriesPerSector = SECTOR_SIZE / sizeof(FATDirectoryEntry);
+		EsError error = volume->Access((reference.cluster * superBlock->sectorsPerCluster + volume->sectorOffset 
+					+ reference.offset / entriesPerSector) * SECTOR_SIZE, 
+				SECTOR_SIZE, K_ACCESS_READ, sectorBuffer, FS_BLOCK_ACCESS_CACHED);
 		if (error != ES_SUCCESS) return error;
 
-		entry = ((FATDirectoryEntry *) clusterBuffer)[reference.offset];
+		entry = ((FATDirectoryEntry *) sectorBuffer)[reference.offset % entriesPerSector];
 	} else {
 		entry = directory->rootDirectory[reference.offset];
 	}
@@ -111,13 +344,13 @@ static EsError Load(KNode *_directory, KNode *_node, KNodeMetadata *, const void
 	FSNode *node = (FSNode *) EsHeapAllocate(sizeof(FSNode), true, K_FIXED);
 
 	if (!node) {
-		EsHeapFree(node, 0, K_FIXED);
 		return ES_ERROR_INSUFFICIENT_RESOURCES;
 	}
 
 	_node->driverNode = node;
 	node->volume = volume;
 	node->entry = entry;
+	node->runsNextCluster = entry.firstClusterLow + (entry.firstClusterHigh << 16);
 
 	return ES_SUCCESS;
 }
@@ -128,29 +361,51 @@ static size_t Read(KNode *node, void *_buffer, EsFileOffset offset, EsFileOffset
 	FSNode *file = (FSNode *) node->driverNode;
 	Volume *volume = file->volume;
 	SuperBlockCommon *superBlock = &volume->superBlock;
+	size_t clusterBytes = superBlock->sectorsPerCluster * SECTOR_SIZE;
 
-	uint8_t *clusterBuffer = (uint8_t *) EsHeapAllocate(superBlock->sectorsPerCluster * SECTOR_SIZE, false, K_FIXED);
+	if (!count) {
+		return true;
+	}
+
+	uint8_t *clusterBuffer = nullptr;
 	EsDefer(EsHeapFree(clusterBuffer, 0, K_FIXED));
-	if (!clusterBuffer) READ_FAILURE("Could not allocate cluster buffer.\n", ES_ERROR_INSUFFICIENT_RESOURCES);
 
 	uint8_t *outputBuffer = (uint8_t *) _buffer;
-	uint64_t firstCluster = offset / (SECTOR_SIZE * superBlock->sectorsPerCluster);
-	uint32_t currentCluster = file->entry.firstClusterLow + (file->entry.firstClusterHigh << 16);
-	for (uintptr_t i = 0; i < firstCluster; i++) currentCluster = NextCluster(volume, currentCluster);
-	offset %= (SECTOR_SIZE * superBlock->sectorsPerCluster);
+	uint32_t lastFileCluster = (offset + count - 1) / clusterBytes;
 
 	while (count) {
-		uint32_t bytesFromThisCluster = superBlock->sectorsPerCluster * SECTOR_SIZE - offset;
-		if (bytesFromThisCluster > count) bytesFromThisCluster = count;
+		ClusterRun run;
+		KMutexAcquire(&file->runsMutex);
+		EsError error = FindClusterRun(volume, file, offset / clusterBytes, lastFileCluster, &run);
+		KMutexRelease(&file->runsMutex);
+		if (error != ES_SUCCESS) READ_FAILURE("Could not find cluster run.\n", error);
+
+		EsFileOffset offsetIntoRun = offset - (EsFileOffset) run.fileCluster * clusterBytes;
+		EsFileOffset bytesFromThisRun = run.count * clusterBytes - offsetIntoRun;
+		if (bytesFromThisRun > count) bytesFromThisRun = count;
+		EsFileOffset runPosition = ((EsFileOffset) run.diskCluster * superBlock->sectorsPerCluster + volume->sectorOffset) * SECTOR_SIZE;
+
+		if (offsetIntoRun % SECTOR_SIZE == 0 && bytesFromThisRun >= SECTOR_SIZE && ((uintptr_t) outputBuffer & 3) == 0) {
+			// Read whole sectors from the run directly into the output buffer.
+			bytesFromThisRun -= bytesFromThisRun % SECTOR_SIZE;
+			error = volume->Access(runPosition + offsetIntoRun, bytesFromThisRun, K_ACCESS_READ, outputBuffer, ES_FLAGS_DEFAULT);
+			if (error != ES_SUCCESS) READ_FAILURE("Could not read cluster run.\n", error);
+		} else {
+			// Read part of a cluster.
 
-		EsError error = volume->Access((currentCluster * superBlock->sectorsPerCluster + volume->sectorOffset) * SECTOR_SIZE, 
-				superBlock->sectorsPerCluster * SECTOR_SIZE, K_ACCESS_READ, 
-				(uint8_t *) clusterBuffer, ES_FLAGS_DEFAULT);
-		if (error != ES_SUCCESS) READ_FAILURE("Could not read cluster.\n", error);
+			if (!clusterBuffer) {
+				clusterBuffer = (uint8_t *) EsHeapAllocate(clusterBytes, false, K_FIXED);
+				if (!clusterBuffer) READ_FAILURE("Could not allocate cluster buffer.\n", ES_ERROR_INSUFFICIENT_RESOURCES);
+			}
 
-		EsMemoryCopy(outputBuffer, clusterBuffer + offset, bytesFromThisCluster);
-		count -= bytesFromThisCluster, outputBuffer += bytesFromThisCluster, offset = 0;
-		currentCluster = NextCluster(volume, currentCluster);
+			EsFileOffset offsetIntoCluster = offsetIntoRun % clusterBytes;
+			if (bytesFromThisRun > clusterBytes - offsetIntoCluster) bytesFromThisRun = clusterBytes - offsetIntoCluster;
+			error = volume->Access(runPosition + offsetIntoRun - offsetIntoCluster, clusterBytes, K_ACCESS_READ, clusterBuffer, ES_FLAGS_DEFAULT);
+			if (error != ES_SUCCESS) READ_FAILURE("Could not read cluster.\n", error);
+			EsMemoryCopy(outputBuffer, clusterBuffer + offsetIntoCluster, bytesFromThisRun);
+		}
+
+		count -= bytesFromThisRun, outputBuffer += bytesFromThisRun, offset += bytesFromThisRun;
 	}
 
 	return true;
@@ -159,77 +414,57 @@ static size_t Read(KNode *node, void *_buffer, EsFileOffset offset, EsFileOffset
 static EsError Scan(const char *_name, size_t nameLength, KNode *node) {
 #define SCAN_FAILURE(message, error) do { KernelLog(LOG_ERROR, "FAT", "scan failure", "Scan - " message); return error; } while (0)
 
-	uint8_t name[] = "           "; 
-
-	{
-		uintptr_t i = 0, j = 0;
-		bool inExtension = false;
-
-		while (i < nameLength) {
-			if (j == 11) return ES_ERROR_FILE_DOES_NOT_EXIST; // Name too long.
-			uint8_t c = _name[i++];
-			if (c == '.' && !inExtension) j = 8, inExtension = true;
-			else name[j++] = (c >= 'a' && c <= 'z') ? (c + 'A' - 'a') : c;
-		}
-	}
-
 	FSNode *directory = (FSNode *) node->driverNode;
 	Volume *volume = directory->volume;
 	SuperBlockCommon *superBlock = &volume->superBlock;
 
 	uint8_t *clusterBuffer = (uint8_t *) EsHeapAllocate(superBlock->sectorsPerCluster * SECTOR_SIZE, false, K_FIXED);
-	EsDefer(EsHeapFree(clusterBuffer, 0, K_FIXED));
 	if (!clusterBuffer) SCAN_FAILURE("Could not allocate cluster buffer.\n", ES_ERROR_INSUFFICIENT_RESOURCES);
+	EsDefer(EsHeapFree(clusterBuffer, 0, K_FIXED));
 
 	uint32_t currentCluster = directory->entry.firstClusterLow + (directory->entry.firstClusterHigh << 16);
 	uintptr_t directoryPosition = 0;
+	uintptr_t entriesPerCluster = superBlock->sectorsPerCluster * SECTOR_SIZE / sizeof(FATDirectoryEntry);
+	LongName longName = {};
+	char name[NAME_MAXIMUM_BYTES];
 
-	while (currentCluster < volume->terminateCluster) {
+	while (directory->rootDirectory ? directoryPosition < superBlock->rootDirectoryEntries : currentCluster < volume->terminateCluster) {
 		if (!directory->rootDirectory) {
 			EsError error = volume->Access((currentCluster * superBlock->sectorsPerCluster + volume->sectorOffset) * SECTOR_SIZE, 
-					superBlock->sectorsPerCluster * SECTOR_SIZE, K_ACCESS_READ, (uint8_t *) clusterBuffer, ES_FLAGS_DEFAULT);
+					superBlock->sectorsPerCluster * SECTOR_SIZE, K_ACCESS_READ, (uint8_t *) clusterBuffer, FS_BLOCK_ACCESS_CACHED);
 			if (error != ES_SUCCESS) SCAN_FAILURE("Could not read cluster.\n", error);
 		}
 
-		for (uintptr_t i = 0; i < superBlock->sectorsPerCluster * SECTOR_SIZE / sizeof(FATDirectoryEntry); i++, directoryPosition++) {
+		for (uintptr_t i = 0; i < entriesPerCluster; i++, directoryPosition++) {
+			if (directory->rootDirectory && directoryPosition == superBlock->rootDirectoryEntries) break;
 			FATDirectoryEntry *entry = directory->rootDirectory ? (directory->rootDirectory + directoryPosition) : ((FATDirectoryEntry *) clusterBuffer + i);
-			if (entry->name[0] == 0xE5 || entry->attributes == 0x0F || (entry->attributes & 8)) goto nextEntry;
 			if (!entry->name[0]) return ES_ERROR_FILE_DOES_NOT_EXIST;
 
-			for (uintptr_t j = 0; j < 11; j++) {
-				uint8_t c = entry->name[j];
-
-				if (name[j] != ((c >= 'a' && c <= 'z') ? (c + 'A' - 'a') : c)) {
-					goto nextEntry;
-				}
-			}
+			// The entry is registered under the same name that Enumerate gives it: the long name if there is one,
+			// otherwise the short name. The directory cache has one name per entry, so only that name can match.
+			size_t nameBytes = DirectoryEntryGetName(entry, &longName, name);
+			if (!nameBytes || nameBytes != nameLength || EsMemoryCompare(name, _name, nameBytes)) continue;
 
-			{
-				KNodeMetadata metadata = {};
-				metadata.type = (entry->attributes & 0x10) ? ES_NODE_DIRECTORY : ES_NODE_FILE;
-
-				if (metadata.type == ES_NODE_FILE) {
-					metadata.totalSize = entry->fileSizeBytes;
-				} else if (metadata.type == ES_NODE_DIRECTORY) {
-					uint32_t currentCluster = entry->firstClusterLow + (entry->firstClusterHigh << 16);
+			KNodeMetadata metadata = {};
+			metadata.type = (entry->attributes & 0x10) ? ES_NODE_DIRECTORY : ES_NODE_FILE;
 
-					while (currentCluster < volume->terminateCluster) {
-						currentCluster = NextCluster(volume, currentCluster);
-						metadata.directoryChildren += SECTOR_SIZE * superBlock->sectorsPerCluster / sizeof(FATDirectoryEntry);
-					}
+			if (metadata.type == ES_NODE_FILE) {
+				metadata.totalSize = entry->fileSizeBytes;
+			} else if (metadata.type == ES_NODE_DIRECTORY) {
+				if (ES_SUCCESS != CountDirectoryChildren(volume, entry->firstClusterLow + (entry->firstClusterHigh << 16), &metadata.directoryChildren)) {
+					metadata.directoryChildren = ES_DIRECTORY_CHILDREN_UNKNOWN;
 				}
-
-				DirectoryEntryReference reference = {};
-				reference.cluster = directory->rootDirectory ? 0 : currentCluster;
-				reference.offset = directory->rootDirectory ? directoryPosition : i;
-				return FSDirectoryEntryFound(node, &metadata, &reference, _name, nameLength, false);
 			}
 
-			nextEntry:;
+			DirectoryEntryReference reference = {};
+			reference.cluster = directory->rootDirectory ? 0 : currentCluster;
+			reference.offset = directory->rootDirectory ? directoryPosition : i;
+			return FSDirectoryEntryFound(node, &metadata, &reference, name, nameBytes, false);
 		}
 
 		if (!directory->rootDirectory) {
-			currentCluster = NextCluster(volume, currentCluster);
+			EsError error = NextCluster(volume, currentCluster, &currentCluster);
+			if (error != ES_SUCCESS) SCAN_FAILURE("Could not read FAT.\n", error);
 		}
 	}
 
@@ -244,39 +479,32 @@ static EsError Enumerate(KNode *node) {
 	SuperBlockCommon *superBlock = &volume->superBlock;
 
 	uint8_t *clusterBuffer = (uint8_t *) EsHeapAllocate(superBlock->sectorsPerCluster * SECTOR_SIZE, false, K_FIXED);
-	EsDefer(EsHeapFree(clusterBuffer, 0, K_FIXED));
 	if (!clusterBuffer) ENUMERATE_FAILURE("Could not allocate cluster buffer.\n", ES_ERROR_INSUFFICIENT_RESOURCES);
+	EsDefer(EsHeapFree(clusterBuffer, 0, K_FIXED));
 
 	uint32_t currentCluster = directory->entry.firstClusterLow + (directory->entry.firstClusterHigh << 16);
 	uint64_t directoryPosition = 0;
+	uintptr_t entriesPerCluster = superBlock->sectorsPerCluster * SECTOR_SIZE / sizeof(FATDirectoryEntry);
+	LongName longName = {};
+	char name[NAME_MAXIMUM_BYTES];
 
-	while (currentCluster < volume->terminateCluster) {
+	while (directory->rootDirectory ? directoryPosition < superBlock->rootDirectoryEntries : currentCluster < volume->terminateCluster) {
 		if (!directory->rootDirectory) {
 			EsError error = volume->Access((currentCluster * superBlock->sectorsPerCluster + volume->sectorOffset) * SECTOR_SIZE, 
-					superBlock->sectorsPerCluster * SECTOR_SIZE, K_ACCESS_READ, (uint8_t *) clusterBuffer, ES_FLAGS_DEFAULT);
+					superBlock->sectorsPerCluster * SECTOR_SIZE, K_ACCESS_READ, (uint8_t *) clusterBuffer, FS_BLOCK_ACCESS_CACHED);
 			if (error != ES_SUCCESS) ENUMERATE_FAILURE("Could not read cluster.\n", error);
 		}
 
-		for (uintptr_t i = 0; i < superBlock->sectorsPerCluster * SECTOR_SIZE / sizeof(FATDirectoryEntry); i++, directoryPosition++) {
+		for (uintptr_t i = 0; i < entriesPerCluster; i++, directoryPosition++) {
+			if (directory->rootDirectory && directoryPosition == superBlock->rootDirectoryEntries) break;
 			FATDirectoryEntry *entry = directory->rootDirectory ? (directory->rootDirectory + directoryPosition) : ((FATDirectoryEntry *) clusterBuffer + i);
-			if (entry->name[0] == 0xE5 || entry->attributes == 0x0F || (entry->attributes & 8)) continue;
 
 			if (!entry->name[0]) {
 				return ES_SUCCESS;
 			}
 
-			uint8_t name[12];
-			size_t nameLength = 0;
-			bool hasExtension = entry->name[8] != ' ' || entry->name[9] != ' ' || entry->name[10] != ' ';
-
-			if (entry->name[0] == '.' && (entry->name[1] == '.' || entry->name[1] == ' ') && entry->name[2] == ' ') {
-				continue;
-			}
-
-			for (uintptr_t i = 0; i < 11; i++) {
-				if (i == 8 && hasExtension) name[nameLength++] = '.';
-				if (entry->name[i] != ' ') name[nameLength++] = entry->name[i];
-			}
+			size_t nameLength = DirectoryEntryGetName(entry, &longName, name);
+			if (!nameLength) continue;
 
 			KNodeMetadata metadata = {};
 
@@ -292,8 +520,7 @@ static EsError Enumerate(KNode *node) {
 			reference.cluster = directory->rootDirectory ? 0 : currentCluster;
 			reference.offset = directory->rootDirectory ? directoryPosition : i;
 
-			EsError error = FSDirectoryEntryFound(node, &metadata, &reference, 
-					(const char *) name, nameLength, false);
+			EsError error = FSDirectoryEntryFound(node, &metadata, &reference, name, nameLength, false);
 
 			if (error != ES_SUCCESS) {
 				return error;
@@ -301,7 +528,8 @@ static EsError Enumerate(KNode *node) {
 		}
 
 		if (!directory->rootDirectory) {
-			currentCluster = NextCluster(volume, currentCluster);
+			EsError error = NextCluster(volume, currentCluster, &currentCluster);
+			if (error != ES_SUCCESS) ENUMERATE_FAILURE("Could not read FAT.\n", error);
 		}
 	}
 
@@ -317,6 +545,8 @@ static bool Mount(Volume *volume) {
 		error = volume->Access(0, SECTOR_SIZE, K_ACCESS_READ, (uint8_t *) superBlock, ES_FLAGS_DEFAULT); 
 		if (error != ES_SUCCESS) MOUNT_FAILURE("Could not read super block.\n");
 
+		if (!superBlock->sectorsPerCluster) MOUNT_FAILURE("Invalid sectors per cluster.\n");
+
 		uint32_t sectorCount = superBlock->totalSectors ?: superBlock->largeSectorCount;
 		uint32_t clusterCount = sectorCount / superBlock->sectorsPerCluster;
 		uint32_t sectorsPerFAT = 0;
@@ -340,14 +570,18 @@ static bool Mount(Volume *volume) {
 		uint32_t rootDirectoryOffset = superBlock->reservedSectors + superBlock->fatCount * sectorsPerFAT;
 		uint32_t rootDirectorySectors = (superBlock->rootDirectoryEntries * sizeof(FATDirectoryEntry) + (SECTOR_SIZE - 1)) / SECTOR_SIZE;
 
+		if (rootDirectoryOffset + rootDirectorySectors >= sectorCount) MOUNT_FAILURE("Invalid FAT size.\n");
+
 		volume->sectorOffset = rootDirectoryOffset + rootDirectorySectors - 2 * superBlock->sectorsPerCluster;
+		volume->sectorsPerFAT = sectorsPerFAT;
+		volume->clusterCount = (sectorCount - rootDirectoryOffset - rootDirectorySectors) / superBlock->sectorsPerCluster;
+		volume->fatWindowSector = -1;
 
-		volume->fat = (uint8_t *) EsHeapAllocate(sectorsPerFAT * SECTOR_SIZE, true, K_FIXED);
-		if (!volume->fat) MOUNT_FAILURE("Could not allocate FAT.\n");
-		error = volume->Access(superBlock->reservedSectors * SECTOR_SIZE, sectorsPerFAT * SECTOR_SIZE, K_ACCESS_READ, volume->fat, ES_FLAGS_DEFAULT);
+		uint32_t usedClusters;
+		error = CountUsedClusters(volume, &usedClusters);
 		if (error != ES_SUCCESS) MOUNT_FAILURE("Could not read FAT.\n");
 
-		volume->spaceUsed = CountUsedClusters(volume) * superBlock->sectorsPerCluster * superBlock->bytesPerSector;
+		volume->spaceUsed = (EsFileOffset) usedClusters * superBlock->sectorsPerCluster * superBlock->bytesPerSector;
 		volume->spaceTotal = volume->block->information.sectorSize * volume->block->information.sectorCount;
 
 		volume->rootDirectory->driverNode = EsHeapAllocate(sizeof(FSNode), true, K_FIXED);
@@ -359,15 +593,13 @@ static bool Mount(Volume *volume) {
 		if (volume->type == TYPE_FAT32) {
 			root->entry.firstClusterLow = volume->sb32.rootDirectoryCluster & 0xFFFF;
 			root->entry.firstClusterHigh = (volume->sb32.rootDirectoryCluster >> 16) & 0xFFFF;
+			root->runsNextCluster = volume->sb32.rootDirectoryCluster;
 
-			uint32_t currentCluster = volume->sb32.rootDirectoryCluster;
-
-			while (currentCluster < volume->terminateCluster) {
-				currentCluster = NextCluster(volume, currentCluster);
-				volume->rootDirectoryInitialChildren += SECTOR_SIZE * superBlock->sectorsPerCluster / sizeof(FATDirectoryEntry);
-			}
+			error = CountDirectoryChildren(volume, volume->sb32.rootDirectoryCluster, &volume->rootDirectoryInitialChildren);
+			if (error != ES_SUCCESS) MOUNT_FAILURE("Could not read root directory cluster chain.\n");
 		} else {
 			root->rootDirectory = (FATDirectoryEntry *) EsHeapAllocate(rootDirectorySectors * SECTOR_SIZE, true, K_FIXED);
+			if (!root->rootDirectory) MOUNT_FAILURE("Could not allocate root directory.\n");
 			volume->rootDirectoryEntries = root->rootDirectory;
 
 			error = volume->Access(rootDirectoryOffset * SECTOR_SIZE, rootDirectorySectors * SECTOR_SIZE, 
@@ -385,15 +617,16 @@ static bool Mount(Volume *volume) {
 	}
 
 	failure:
-	if (volume->root && volume->root->driverNode) EsHeapFree(((FSNode *) volume->root->driverNode)->rootDirectory, 0, K_FIXED);
-	if (volume->root) EsHeapFree(volume->root->driverNode, 0, K_FIXED);
-	EsHeapFree(volume->root, 0, K_FIXED);
-	EsHeapFree(volume->fat, 0, K_FIXED);
+	if (volume->rootDirectory->driverNode) EsHeapFree(((FSNode *) volume->rootDirectory->driverNode)->rootDirectory, 0, K_FIXED);
+	EsHeapFree(volume->rootDirectory->driverNode, 0, K_FIXED);
+	volume->rootDirectory->driverNode = nullptr;
 	return false;
 }
 
 static void Close(KNode *node) {
-	EsHeapFree(node->driverNode, sizeof(FSNode), K_FIXED);
+	FSNode *driverNode = (FSNode *) node->driverNode;
+	EsHeapFree(driverNode->runs, driverNode->runsAllocated * sizeof(ClusterRun), K_FIXED);
+	EsHeapFree(driverNode, sizeof(FSNode), K_FIXED);
 }
 
 static void DeviceAttach(KDevice *parent) {
@@ -7,6 +7,7 @@
 #include <module.h>
 
 #define SECTOR_SIZE (2048)
+#define DIRECTORY_READ_SECTORS (32) // Directories are read in batches of up to this many sectors.
 
 struct LBE16 {
 #ifdef __BIG_ENDIAN__
@@ -263,26 +264,39 @@ static EsError Enumerate(KNode *node) {
 	FSNode *directory = (FSNode *) node->driverNode;
 	Volume *volume = directory->volume;
 
-	// TODO Load multiple sectors at once?
+	uint32_t currentSector = directory->record.extentStart.x;
+	uint32_t remainingBytes = directory->record.extentSize.x;
 
-	uint8_t *sectorBuffer = (uint8_t *) EsHeapAllocate(SECTOR_SIZE, false, K_FIXED);
+	// The directory is a single extent, so read it in large batches.
 
-	if (!sectorBuffer) {
+	uint32_t sectorsPerRead = (remainingBytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	if (sectorsPerRead > DIRECTORY_READ_SECTORS) sectorsPerRead = DIRECTORY_READ_SECTORS;
+	if (!sectorsPerRead) sectorsPerRead = 1;
+	uint32_t sectorsInBuffer = 0, sectorInBuffer = 0;
+
+	uint8_t *directoryBuffer = (uint8_t *) EsHeapAllocate(sectorsPerRead * SECTOR_SIZE, false, K_FIXED);
+
+	if (!directoryBuffer) {
 		ENUMERATE_FAILURE("Could not allocate sector buffer.\n", ES_ERROR_INSUFFICIENT_RESOURCES);
 	}
 
-	EsDefer(EsHeapFree(sectorBuffer, SECTOR_SIZE, K_FIXED));
-
-	uint32_t currentSector = directory->record.extentStart.x;
-	uint32_t remainingBytes = directory->record.extentSize.x;
+	EsDefer(EsHeapFree(directoryBuffer, sectorsPerRead * SECTOR_SIZE, K_FIXED));
 
 	while (remainingBytes) {
-		EsError accessResult = volume->Access(currentSector * SECTOR_SIZE, SECTOR_SIZE, K_ACCESS_READ, (uint8_t *) sectorBuffer, ES_FLAGS_DEFAULT);
+		if (sectorInBuffer == sectorsInBuffer) {
+			sectorsInBuffer = (remainingBytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+			if (sectorsInBuffer > sectorsPerRead) sectorsInBuffer = sectorsPerRead;
+			sectorInBuffer = 0;
 
-		if (accessResult != ES_SUCCESS) {
-			ENUMERATE_FAILURE("Could not read sector.\n", accessResult);
+			EsError accessResult = volume->Access((EsFileOffset) currentSector * SECTOR_SIZE, sectorsInBuffer * SECTOR_SIZE, 
+					K_ACCESS_READ, directoryBuffer, FS_BLOCK_ACCESS_CACHED);
+
+			if (accessResult != ES_SUCCESS) {
+				ENUMERATE_FAILURE("Could not read sector.\n", accessResult);
+			}
 		}
 
+		uint8_t *sectorBuffer = directoryBuffer + sectorInBuffer * SECTOR_SIZE;
 		uintptr_t positionInSector = 0;
 
 		while (positionInSector < SECTOR_SIZE && positionInSector < remainingBytes) {
@@ -342,6 +356,8 @@ static EsError Enumerate(KNode *node) {
 		} else {
 			remainingBytes -= SECTOR_SIZE;
 		}
+
+		currentSector++, sectorInBuffer++;
 	}
 
 	return ES_SUCCESS;
@@ -365,26 +381,39 @@ static EsError ScanInternal(const char *name, size_t nameBytes, KNode *_director
 	FSNode *directory = (FSNode *) _directory->driverNode;
 	Volume *volume = directory->volume;
 
-	// TODO Load multiple sectors at once?
+	uint32_t currentSector = directory->record.extentStart.x;
+	uint32_t remainingBytes = directory->record.extentSize.x;
 
-	uint8_t *sectorBuffer = (uint8_t *) EsHeapAllocate(SECTOR_SIZE, false, K_FIXED);
+	// The directory is a single extent, so read it in large batches.
 
-	if (!sectorBuffer) {
+	uint32_t sectorsPerRead = (remainingBytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	if (sectorsPerRead > DIRECTORY_READ_SECTORS) sectorsPerRead = DIRECTORY_READ_SECTORS;
+	if (!sectorsPerRead) sectorsPerRead = 1;
+	uint32_t sectorsInBuffer = 0, sectorInBuffer = 0;
+
+	uint8_t *directoryBuffer = (uint8_t *) EsHeapAllocate(sectorsPerRead * SECTOR_SIZE, false, K_FIXED);
+
+	if (!directoryBuffer) {
 		SCAN_FAILURE("Could not allocate sector buffer.\n", ES_ERROR_INSUFFICIENT_RESOURCES);
 	}
 
-	EsDefer(EsHeapFree(sectorBuffer, SECTOR_SIZE, K_FIXED));
-
-	uint32_t currentSector = directory->record.extentStart.x;
-	uint32_t remainingBytes = directory->record.extentSize.x;
+	EsDefer(EsHeapFree(directoryBuffer, sectorsPerRead * SECTOR_SIZE, K_FIXED));
 
 	while (remainingBytes) {
-		EsError accessResult = volume->Access(currentSector * SECTOR_SIZE, SECTOR_SIZE, K_ACCESS_READ, (uint8_t *) sectorBuffer, ES_FLAGS_DEFAULT);
+		if (sectorInBuffer == sectorsInBuffer) {
+			sectorsInBuffer = (remainingBytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+			if (sectorsInBuffer > sectorsPerRead) sectorsInBuffer = sectorsPerRead;
+			sectorInBuffer = 0;
 
-		if (accessResult != ES_SUCCESS) {
-			SCAN_FAILURE("Could not read sector.\n", accessResult);
+			EsError accessResult = volume->Access((EsFileOffset) currentSector * SECTOR_SIZE, sectorsInBuffer * SECTOR_SIZE, 
+					K_ACCESS_READ, directoryBuffer, FS_BLOCK_ACCESS_CACHED);
+
+			if (accessResult != ES_SUCCESS) {
+				SCAN_FAILURE("Could not read sector.\n", accessResult);
+			}
 		}
 
+		uint8_t *sectorBuffer = directoryBuffer + sectorInBuffer * SECTOR_SIZE;
 		uintptr_t positionInSector = 0;
 
 		while (positionInSector < SECTOR_SIZE && positionInSector < remainingBytes) {
@@ -442,6 +471,8 @@ static EsError ScanInternal(const char *name, size_t nameBytes, KNode *_director
 		} else {
 			remainingBytes -= SECTOR_SIZE;
 		}
+
+		currentSector++, sectorInBuffer++;
 	}
 
 	return ES_ERROR_FILE_DOES_NOT_EXIST;
@@ -464,7 +495,7 @@ static EsError Load(KNode *_directory, KNode *_node, KNodeMetadata *, const void
 
 	EsDefer(EsHeapFree(sectorBuffer, SECTOR_SIZE, K_FIXED));
 
-	EsError error = volume->Access(reference.sector * SECTOR_SIZE, SECTOR_SIZE, K_ACCESS_READ, (uint8_t *) sectorBuffer, ES_FLAGS_DEFAULT);
+	EsError error = volume->Access(reference.sector * SECTOR_SIZE, SECTOR_SIZE, K_ACCESS_READ, (uint8_t *) sectorBuffer, FS_BLOCK_ACCESS_CACHED);
 	if (error != ES_SUCCESS) return error;
 
 	FSNode *data = (FSNode *) EsHeapAllocate(sizeof(FSNode), true, K_FIXED);
@@ -50,6 +50,7 @@ struct NVMeController : KDevice {
 	uint64_t maximumDataTransferBytes;
 	uint32_t rtd3EntryLatencyUs;
 	uint16_t maximumOutstandingCommands;
+	bool writeZeroesSupported, datasetManagementSupported;
 	char model[40];
 
 	uint8_t *adminCompletionQueue, *adminSubmissionQueue;
@@ -302,12 +303,17 @@ bool NVMeController::Access(struct NVMeDrive *drive, uint64_t offsetBytes, size_
 
 	// Build the PRPs.
 
-	KDMASegment segment1 = KDMABufferNextSegment(buffer);
-	uint64_t prp1 = segment1.physicalAddress, prp2 = 0;
+	bool transfer = operation == K_ACCESS_READ || operation == K_ACCESS_WRITE;
+	uint64_t prp1 = 0, prp2 = 0;
 
-	if (!segment1.isLast) {
-		KDMASegment segment2 = KDMABufferNextSegment(buffer, true /* peek */);
-		if (segment2.isLast) prp2 = segment2.physicalAddress;
+	if (transfer) {
+		KDMASegment segment1 = KDMABufferNextSegment(buffer);
+		prp1 = segment1.physicalAddress;
+
+		if (!segment1.isLast) {
+			KDMASegment segment2 = KDMABufferNextSegment(buffer, true /* peek */);
+			if (segment2.isLast) prp2 = segment2.physicalAddress;
+		}
 	}
 
 	retry:;
@@ -327,7 +333,13 @@ bool NVMeController::Access(struct NVMeDrive *drive, uint64_t offsetBytes, size_
 
 		// Build the PRP list.
 
-		if (!prp2) {
+		if (operation == K_ACCESS_DISCARD) {
+			// The range list for the dataset management command goes in the page we'd use for the PRP list.
+			prp1 = prpListPages[ioSubmissionQueueTail];
+			MMRemapPhysical(MMGetKernelSpace(), prpListVirtual, prp1);
+			prpListVirtual[0] = (uint64_t) (countSectors & 0xFFFFFFFF) << 32 /* context attributes, length */;
+			prpListVirtual[1] = offsetSector /* starting LBA */;
+		} else if (transfer && !prp2) {
 			prp2 = prpListPages[ioSubmissionQueueTail];
 			MMRemapPhysical(MMGetKernelSpace(), prpListVirtual, prp2);
 			uintptr_t index = 0;
@@ -344,7 +356,9 @@ bool NVMeController::Access(struct NVMeDrive *drive, uint64_t offsetBytes, size_
 		// Create the command.
 
 		uint32_t *command = (uint32_t *) (ioSubmissionQueue + ioSubmissionQueueTail * SUBMISSION_QUEUE_ENTRY_BYTES);
-		command[0] = (ioSubmissionQueueTail << 16) /* command identifier */ | (operation == K_ACCESS_WRITE ? 0x01 : 0x02) /* opcode */;
+		uint8_t opcode = operation == K_ACCESS_WRITE ? 0x01 : operation == K_ACCESS_READ ? 0x02 
+			: operation == K_ACCESS_ZERO ? 0x08 /* write zeroes */ : 0x09 /* dataset management */;
+		command[0] = (ioSubmissionQueueTail << 16) /* command identifier */ | opcode;
 		command[1] = drive->nsid;
 		command[2] = command[3] = command[4] = command[5] = 0;
 		command[6] = prp1 & 0xFFFFFFFF;
@@ -356,6 +370,12 @@ bool NVMeController::Access(struct NVMeDrive *drive, uint64_t offsetBytes, size_
 		command[12] = (countSectors - 1) & 0xFFFF;
 		command[13] = command[14] = command[15] = 0;
 
+		if (operation == K_ACCESS_DISCARD) {
+			command[10] = 0; // One range.
+			command[11] = 1 << 2; // Deallocate.
+			command[12] = 0;
+		}
+
 		// Store the dispatch group, and update the queue tail.
 
 		dispatchGroups[ioSubmissionQueueTail] = dispatchGroup;
@@ -615,6 +635,9 @@ void NVMeController::Initialise() {
 		maximumDataTransferBytes = identifyData[77] ? (1 << (12 + identifyData[77] + (((capabilities >> 48) & 0xF)))) : 0;
 		rtd3EntryLatencyUs = *(uint32_t *) (identifyData + 88);
 		maximumOutstandingCommands = *(uint16_t *) (identifyData + 514);
+		uint16_t optionalCommands = *(uint16_t *) (identifyData + 520);
+		datasetManagementSupported = optionalCommands & (1 << 2);
+		writeZeroesSupported = optionalCommands & (1 << 3);
 		EsMemoryCopy(model, &identifyData[24], sizeof(model));
 
 		if (rtd3EntryLatencyUs > 250 * 1000) {
@@ -812,6 +835,8 @@ void NVMeController::Initialise() {
 			device->information.sectorCount = capacity / sectorBytes;
 			device->information.readOnly = readOnly;
 			device->information.driveType = ES_DRIVE_TYPE_SSD;
+			device->canZero = writeZeroesSupported;
+			device->canDiscard = datasetManagementSupported;
 			
 			EsAssert(sizeof(device->information.model) >= sizeof(model));
 			device->information.modelBytes = sizeof(model);
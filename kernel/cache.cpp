@@ -4,7 +4,6 @@
 
 #ifndef IMPLEMENTATION
 
-// TODO Implement read ahead in CCSpaceAccess.
 // TODO Implement dispatch groups in CCSpaceAccess and CCWriteBehindThread.
 // TODO Implement better write back algorithm.
 
@@ -75,6 +74,7 @@ void CCSpaceUncover(CCSpace *cache, EsFileOffset removeStart, EsFileOffset remov
 #define CC_ACCESS_WRITE_BACK         (1 << 3) // Wait for the write to complete before returning.
 #define CC_ACCESS_PRECISE            (1 << 4) // Do not write back bytes not touched by this write. (Usually modified tracking is to page granularity.) Requires WRITE_BACK.
 #define CC_ACCESS_USER_BUFFER_MAPPED (1 << 5) // Set if the user buffer is memory-mapped to mirror this or another cache.
+#define CC_ACCESS_READ_AHEAD         (1 << 6) // On a miss, also load up to CC_READ_AHEAD_PAGES missing pages after the accessed region. Reads only.
 
 EsError CCSpaceAccess(CCSpace *cache, K_USER_BUFFER void *buffer, EsFileOffset offset, EsFileOffset count, uint32_t flags, 
 		MMSpace *mapSpace = nullptr, unsigned mapFlags = ES_FLAGS_DEFAULT);
@@ -655,7 +655,6 @@ EsError CCSpaceAccess(CCSpace *cache, K_USER_BUFFER void *_buffer, EsFileOffset
 		MMSpace *mapSpace, unsigned mapFlags) {
 	// TODO Reading in multiple active sections at the same time - will this give better performance on AHCI/NVMe?
 	// 	- Each active section needs to be separately committed.
-	// TODO Read-ahead.
 
 	// Commit CC_ACTIVE_SECTION_SIZE bytes, since we require an active section to be active at a time.
 
@@ -674,6 +673,7 @@ EsError CCSpaceAccess(CCSpace *cache, K_USER_BUFFER void *_buffer, EsFileOffset
 
 	bool writeBack = (flags & CC_ACCESS_WRITE_BACK) && (~flags & CC_ACCESS_PRECISE);
 	bool preciseWriteBack = (flags & CC_ACCESS_WRITE_BACK) && (flags & CC_ACCESS_PRECISE);
+	bool missed = false; // Set if any of the accessed pages had to be loaded.
 
 	for (EsFileOffset sectionOffset = firstSection; sectionOffset < lastSection; sectionOffset += CC_ACTIVE_SECTION_SIZE) {
 		if (MM_AVAILABLE_PAGES() < MM_CRITICAL_AVAILABLE_PAGES_THRESHOLD && !GetCurrentThread()->isPageGenerator) {
@@ -964,6 +964,34 @@ EsError CCSpaceAccess(CCSpace *cache, K_USER_BUFFER void *_buffer, EsFileOffset
 				goto copy;
 			}
 
+			missed = true;
+
+			// If the last page of the accessed region is missing, then also load the missing pages directly after it,
+			// up to the end of the active section, so that they are read in the same access.
+
+			uintptr_t loadEnd = pageEnd;
+
+			if ((flags & CC_ACCESS_READ_AHEAD) && (~flags & CC_ACCESS_WRITE) && pagesToLoad[pageEnd - 1]) {
+				while (loadEnd < CC_ACTIVE_SECTION_SIZE / K_PAGE_SIZE && loadEnd < pageEnd + CC_READ_AHEAD_PAGES
+						&& cachedSection != cache->cachedSections.array + cache->cachedSections.Length()) {
+					KMutexAcquire(&pmm.pageFrameMutex);
+					bool present = cachedSection->data[pageInCachedSectionIndex] & MM_SHARED_ENTRY_PRESENT;
+					KMutexRelease(&pmm.pageFrameMutex);
+
+					if (present) {
+						break;
+					}
+
+					pagesToLoad[loadEnd++] = cachedSection->data + pageInCachedSectionIndex;
+					pageInCachedSectionIndex++;
+
+					if (pageInCachedSectionIndex == cachedSection->pageCount) {
+						pageInCachedSectionIndex = 0;
+						cachedSection++;
+					}
+				}
+			}
+
 			// If another thread is already trying to load pages into the active section,
 			// then wait for it to complete.
 
@@ -985,7 +1013,7 @@ EsError CCSpaceAccess(CCSpace *cache, K_USER_BUFFER void *_buffer, EsFileOffset
 
 			uintptr_t pageFrames[CC_ACTIVE_SECTION_SIZE / K_PAGE_SIZE];
 
-			for (uintptr_t i = pageStart; i < pageEnd; i++) {
+			for (uintptr_t i = pageStart; i < loadEnd; i++) {
 				if (!pagesToLoad[i]) {
 					continue;
 				}
@@ -1044,10 +1072,10 @@ EsError CCSpaceAccess(CCSpace *cache, K_USER_BUFFER void *_buffer, EsFileOffset
 					KernelPanic("CCSpaceAccess - Incorrect page left/right calculation.\n");
 				}
 			} else {
-				for (uintptr_t i = pageStart; i < pageEnd; i++) {
+				for (uintptr_t i = pageStart; i < loadEnd; i++) {
 					uintptr_t from = i, count = 0;
 
-					while (i != pageEnd && pagesToLoad[i]) {
+					while (i != loadEnd && pagesToLoad[i]) {
 						count++, i++;
 					}
 
@@ -1065,7 +1093,7 @@ EsError CCSpaceAccess(CCSpace *cache, K_USER_BUFFER void *_buffer, EsFileOffset
 			if (error != ES_SUCCESS) {
 				// Free and unmap the pages we allocated if there was an error.
 
-				for (uintptr_t i = pageStart; i < pageEnd; i++) {
+				for (uintptr_t i = pageStart; i < loadEnd; i++) {
 					if (!pagesToLoad[i]) continue;
 					MMArchUnmapPages(kernelMMSpace, (uintptr_t) sectionBase + i * K_PAGE_SIZE, 1, ES_FLAGS_DEFAULT);
 					MMPhysicalFree(pageFrames[i], false, 1);
@@ -1077,7 +1105,7 @@ EsError CCSpaceAccess(CCSpace *cache, K_USER_BUFFER void *_buffer, EsFileOffset
 			// Write the pages to the cached sections, and mark them as referenced.
 
 			if (error == ES_SUCCESS) {
-				for (uintptr_t i = pageStart; i < pageEnd; i++) {
+				for (uintptr_t i = pageStart; i < loadEnd; i++) {
 					if (pagesToLoad[i]) {
 						*pagesToLoad[i] = pageFrames[i] | MM_SHARED_ENTRY_PRESENT;
 						section->referencedPages[i >> 3] |= 1 << (i & 7);
@@ -1170,26 +1198,45 @@ EsError CCSpaceAccess(CCSpace *cache, K_USER_BUFFER void *_buffer, EsFileOffset
 		CCActiveSectionReturnToLists(section, writeBack);
 	}
 
+	if (flags & CC_ACCESS_READ) {
+		__sync_fetch_and_add(missed ? &cache->readMisses : &cache->readHits, 1);
+	}
+
 	return ES_SUCCESS;
 }
 
-bool CCWriteBehindSection() {
-	CCActiveSection *section = nullptr;
+uintptr_t CCWriteBehindSections(uintptr_t maximum) {
+	// Take a batch of sections from the modified list, and write them sorted by space and offset.
+	// For the block cache the offset is the drive offset, so its sections are written in drive order;
+	// for file caches the offset is a file offset, so this only groups together the writes to each file.
+
+	CCActiveSection *sections[CC_WRITE_BEHIND_BATCH];
+	uintptr_t count = 0;
+
 	KMutexAcquire(&activeSectionManager.mutex);
 
-	if (activeSectionManager.modifiedList.count) {
-		section = activeSectionManager.modifiedList.firstItem->thisItem;
+	while (count < maximum && count < CC_WRITE_BEHIND_BATCH && activeSectionManager.modifiedList.count) {
+		CCActiveSection *section = activeSectionManager.modifiedList.firstItem->thisItem;
 		CCWriteSectionPrepare(section);
+
+		uintptr_t i = count++;
+
+		while (i && (sections[i - 1]->cache > section->cache 
+					|| (sections[i - 1]->cache == section->cache && sections[i - 1]->offset > section->offset))) {
+			sections[i] = sections[i - 1];
+			i--;
+		}
+
+		sections[i] = section;
 	}
 
 	KMutexRelease(&activeSectionManager.mutex);
 
-	if (section) {
-		CCWriteSection(section);
-		return true;
-	} else {
-		return false;
+	for (uintptr_t i = 0; i < count; i++) {
+		CCWriteSection(sections[i]);
 	}
+
+	return count;
 }
 
 void CCWriteBehindThread() {
@@ -1204,7 +1251,7 @@ void CCWriteBehindThread() {
 			KEventWait(&pmm.availableLow, CC_WAIT_FOR_WRITE_BEHIND);
 		}
 
-		while (CCWriteBehindSection());
+		while (CCWriteBehindSections(CC_WRITE_BEHIND_BATCH));
 #else
 		// Wait until the modified list is non-empty.
 		KEventWait(&activeSectionManager.modifiedNonEmpty); 
@@ -1227,7 +1274,13 @@ void CCWriteBehindThread() {
 		KMutexAcquire(&activeSectionManager.mutex);
 		uintptr_t writeCount = (activeSectionManager.modifiedList.count + CC_WRITE_BACK_DIVISOR - 1) / CC_WRITE_BACK_DIVISOR;
 		KMutexRelease(&activeSectionManager.mutex);
-		while (writeCount && CCWriteBehindSection()) writeCount--;
+
+		while (writeCount) {
+			uintptr_t written = CCWriteBehindSections(writeCount);
+			if (!written) break;
+			writeCount -= written;
+		}
+
 		lastWriteMs = scheduler.timeMs - lastWriteMs;
 #endif
 	}
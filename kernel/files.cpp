@@ -4,7 +4,6 @@
 
 // TODO Features:
 // 	- Handling errors creating files (prevent further file system operations).
-// 	- Limiting the size of the directory/node cache.
 //
 // TODO Permissions:
 // 	- Prevent modifications to directories without write permission.
@@ -13,7 +12,6 @@
 // TODO Drivers:
 // 	- Get NTFS driver working again.
 //
-// TODO Allocate nodes/directory entries from arenas?
 // TODO Check that the MODIFIED tracking is correct.
 
 #ifndef IMPLEMENTATION
@@ -33,18 +31,53 @@
 #define FS_NODE_OPEN_HANDLE_FIRST               (1)
 #define FS_NODE_OPEN_HANDLE_DIRECTORY_TEMPORARY (2)
 
+#define FS_ZERO_BUFFER_SIZE (65536) // For block devices that can't zero sectors themselves.
+
+#define FS_DIRECTORY_HASH_INITIAL_SLOTS (16) // Must be a power of 2.
+
+// Nodes and directory entries are allocated from arenas.
+// Directory entries are grouped by the size of their driver data; entries with more driver data use the heap.
+#define FS_ARENA_BLOCK_BYTES (262144)
+#define FS_DIRECTORY_ENTRY_ARENA_GRANULARITY (16)
+#define FS_DIRECTORY_ENTRY_ARENA_COUNT (5)
+
+// The maximum number of bytes used by nodes and directory entries across all file systems.
+// Above this, the object caches are asked to trim, even if there is plenty of commit available,
+// so that walking a large directory tree doesn't take over the kernel heap.
+#define FS_OBJECT_BYTES_MAXIMUM() (pmm.commitLimit * K_PAGE_SIZE / 16)
+#define FS_DIRECTORY_NEGATIVE_ENTRIES (8) // The number of names each directory remembers as not existing.
+
 struct FSDirectoryEntry : KNodeMetadata {
 	MMObjectCacheItem cacheItem;
 	AVLItem<FSDirectoryEntry> item; // item.key.longKey contains the entry's name.
 	struct FSDirectory *parent; // The directory containing this entry.
 	KNode *volatile node; // nullptr if the node hasn't been loaded.
+	FSDirectoryEntry *hashNext; // The next entry in the parent's hash table slot.
+	uint32_t nameHash;
+	uint16_t driverDataBytes; // Used to find the arena the entry was allocated from.
 	char inlineName[16]; // Store the name of the entry inline if it is small enough.
 	// Followed by driver data.
 };
 
+struct FSNegativeEntry {
+	uint32_t nameHash;
+	uint32_t nameBytes;
+	// Followed by the name.
+};
+
 struct FSDirectory : KNode {
-	AVLTree<FSDirectoryEntry> entries;
+	AVLTree<FSDirectoryEntry> entries; // Used for enumeration.
 	size_t entryCount;
+
+	// Used for looking up entries by name. If this is nullptr, then the tree is used instead.
+	// Otherwise, all the entries in the tree are also in the hash table.
+	FSDirectoryEntry **hashTable;
+	size_t hashTableSlots;
+
+	// Names that the file system driver couldn't find in the directory, so we don't need to scan for them again.
+	// Removed when an entry with the name is added to the directory.
+	FSNegativeEntry *negativeEntries[FS_DIRECTORY_NEGATIVE_ENTRIES];
+	uintptr_t negativeEntriesNext;
 };
 
 struct FSFile : KNode {
@@ -61,12 +94,17 @@ struct KDMABuffer {
 	uintptr_t offsetBytes;
 };
 
+struct FSArena {
+	KMutex mutex; // Each arena has its own lock, so allocations of different object types do not contend.
+	Arena arena;
+};
+
 EsError FSNodeOpenHandle(KNode *node, uint32_t flags, uint8_t mode);
 void FSNodeCloseHandle(KNode *node, uint32_t flags);
 EsError FSNodeDelete(KNode *node);
 EsError FSNodeMove(KNode *node, KNode *destination, const char *newName, size_t nameNameBytes);
 EsError FSFileResize(KNode *node, EsFileOffset newSizeBytes, bool growOnly = false);
-ptrdiff_t FSDirectoryEnumerate(KNode *node, K_USER_BUFFER EsDirectoryChild *buffer, size_t bufferSize);
+ptrdiff_t FSDirectoryEnumerate(KNode *node, K_USER_BUFFER EsDirectoryChild *buffer, size_t bufferCount, EsDirectoryEnumerateCookie *cookie, uint32_t flags);
 EsError FSFileControlFlush(KNode *node);
 EsError FSFileControlSetContentType(KNode *node, EsUniqueIdentifier identifier);
 bool FSTrimCachedNode(MMObjectCache *);
@@ -82,6 +120,13 @@ struct {
 
 	KSpinlock updateNodeHandles; // Also used for node/directory entry cache operations.
 
+	FSArena fileArena, directoryArena;
+	FSArena directoryEntryArenas[FS_DIRECTORY_ENTRY_ARENA_COUNT];
+
+	// Statistics.
+	volatile size_t loadedNodes, loadedDirectoryEntries;
+	volatile size_t objectBytes; // The total size of the loaded nodes and directory entries, excluding names.
+
 	bool shutdown;
 
 	volatile uint64_t totalHandleCount;
@@ -268,6 +313,9 @@ EsError FSWriteFromCache(CCSpace *fileCache, const void *buffer, EsFileOffset of
 
 	if (ES_CHECK_ERROR(count)) {
 		node->error = count;
+	} else {
+		// The file system may have updated the node's metadata while writing, such as the state of its extents.
+		__sync_fetch_and_or(&node->flags, NODE_MODIFIED);
 	}
 
 	return ES_CHECK_ERROR(count) ? count : ES_SUCCESS;
@@ -436,10 +484,229 @@ EsError FSFileControlSetContentType(KNode *node, EsUniqueIdentifier identifier)
 	}
 }
 
+//////////////////////////////////////////
+// Allocating nodes and directory entries.
+//////////////////////////////////////////
+
+void FSObjectBytesAdd(intptr_t bytes) {
+	size_t objectBytes = __sync_add_and_fetch(&fs.objectBytes, bytes);
+
+	if (bytes > 0 && objectBytes > FS_OBJECT_BYTES_MAXIMUM()) {
+		MMObjectCacheTrimBytes(objectBytes - FS_OBJECT_BYTES_MAXIMUM());
+	}
+}
+
+FSDirectoryEntry *FSDirectoryEntryAllocate(size_t driverDataBytes) {
+	uintptr_t arenaIndex = (driverDataBytes + FS_DIRECTORY_ENTRY_ARENA_GRANULARITY - 1) / FS_DIRECTORY_ENTRY_ARENA_GRANULARITY;
+	FSDirectoryEntry *entry;
+
+	if (arenaIndex < FS_DIRECTORY_ENTRY_ARENA_COUNT) {
+		FSArena *arena = &fs.directoryEntryArenas[arenaIndex];
+		KMutexAcquire(&arena->mutex);
+		if (!arena->arena.slotSize) ArenaInitialise(&arena->arena, FS_ARENA_BLOCK_BYTES, sizeof(FSDirectoryEntry) + arenaIndex * FS_DIRECTORY_ENTRY_ARENA_GRANULARITY);
+		entry = (FSDirectoryEntry *) ArenaAllocate(&arena->arena, true);
+		KMutexRelease(&arena->mutex);
+	} else {
+		entry = (FSDirectoryEntry *) EsHeapAllocate(sizeof(FSDirectoryEntry) + driverDataBytes, true, K_FIXED);
+	}
+
+	if (!entry) {
+		return nullptr;
+	}
+
+	entry->driverDataBytes = driverDataBytes;
+	__sync_fetch_and_add(&fs.loadedDirectoryEntries, 1);
+	FSObjectBytesAdd(sizeof(FSDirectoryEntry) + driverDataBytes);
+	return entry;
+}
+
+void FSDirectoryEntryDeallocate(FSDirectoryEntry *entry) {
+	size_t driverDataBytes = entry->driverDataBytes;
+	uintptr_t arenaIndex = (driverDataBytes + FS_DIRECTORY_ENTRY_ARENA_GRANULARITY - 1) / FS_DIRECTORY_ENTRY_ARENA_GRANULARITY;
+
+	if (arenaIndex < FS_DIRECTORY_ENTRY_ARENA_COUNT) {
+		FSArena *arena = &fs.directoryEntryArenas[arenaIndex];
+		KMutexAcquire(&arena->mutex);
+		ArenaFree(&arena->arena, entry);
+		KMutexRelease(&arena->mutex);
+	} else {
+		EsHeapFree(entry, sizeof(FSDirectoryEntry) + driverDataBytes, K_FIXED);
+	}
+
+	__sync_fetch_and_sub(&fs.loadedDirectoryEntries, 1);
+	FSObjectBytesAdd(-(intptr_t) (sizeof(FSDirectoryEntry) + driverDataBytes));
+}
+
+KNode *FSNodeAllocate(EsNodeType type) {
+	bool directory = type == ES_NODE_DIRECTORY;
+	FSArena *arena = directory ? &fs.directoryArena : &fs.fileArena;
+
+	KMutexAcquire(&arena->mutex);
+	if (!arena->arena.slotSize) ArenaInitialise(&arena->arena, FS_ARENA_BLOCK_BYTES, directory ? sizeof(FSDirectory) : sizeof(FSFile));
+	KNode *node = (KNode *) ArenaAllocate(&arena->arena, true);
+	KMutexRelease(&arena->mutex);
+
+	if (node) {
+		__sync_fetch_and_add(&fs.loadedNodes, 1);
+		FSObjectBytesAdd(arena->arena.slotSize);
+	}
+
+	return node;
+}
+
+void FSNodeDeallocate(KNode *node, EsNodeType type) {
+	FSArena *arena = type == ES_NODE_DIRECTORY ? &fs.directoryArena : &fs.fileArena;
+
+	KMutexAcquire(&arena->mutex);
+	ArenaFree(&arena->arena, node);
+	KMutexRelease(&arena->mutex);
+
+	__sync_fetch_and_sub(&fs.loadedNodes, 1);
+	FSObjectBytesAdd(-(intptr_t) arena->arena.slotSize);
+}
+
 //////////////////////////////////////////
 // Directories.
 //////////////////////////////////////////
 
+uint32_t FSNameHash(const void *name, size_t nameBytes) {
+	// FNV-1a.
+	uint32_t hash = 2166136261;
+
+	for (uintptr_t i = 0; i < nameBytes; i++) {
+		hash = (hash ^ ((const uint8_t *) name)[i]) * 16777619;
+	}
+
+	return hash;
+}
+
+FSDirectoryEntry *FSDirectoryLookup(FSDirectory *directory, const void *name, size_t nameBytes, uint32_t nameHash) {
+	KWriterLockAssertLocked(&directory->writerLock);
+
+	if (!directory->hashTable) {
+		AVLItem<FSDirectoryEntry> *item = TreeFind(&directory->entries, MakeLongKey(name, nameBytes), TREE_SEARCH_EXACT);
+		return item ? item->thisItem : nullptr;
+	}
+
+	FSDirectoryEntry *entry = directory->hashTable[nameHash & (directory->hashTableSlots - 1)];
+
+	while (entry) {
+		if (entry->nameHash == nameHash && entry->item.key.longKeyBytes == nameBytes
+				&& 0 == EsMemoryCompare(entry->item.key.longKey, name, nameBytes)) {
+			return entry;
+		}
+
+		entry = entry->hashNext;
+	}
+
+	return nullptr;
+}
+
+void _FSDirectoryRehashVisit(AVLItem<FSDirectoryEntry> *item, FSDirectoryEntry **hashTable, size_t hashTableSlots) {
+	if (!item) {
+		return;
+	}
+
+	FSDirectoryEntry *entry = item->thisItem;
+	entry->hashNext = hashTable[entry->nameHash & (hashTableSlots - 1)];
+	hashTable[entry->nameHash & (hashTableSlots - 1)] = entry;
+
+	_FSDirectoryRehashVisit(item->children[0], hashTable, hashTableSlots);
+	_FSDirectoryRehashVisit(item->children[1], hashTable, hashTableSlots);
+}
+
+bool FSDirectoryIsNegativeEntry(FSDirectory *directory, const void *name, size_t nameBytes, uint32_t nameHash) {
+	KWriterLockAssertLocked(&directory->writerLock);
+
+	for (uintptr_t i = 0; i < FS_DIRECTORY_NEGATIVE_ENTRIES; i++) {
+		FSNegativeEntry *negative = directory->negativeEntries[i];
+
+		if (negative && negative->nameHash == nameHash && negative->nameBytes == nameBytes
+				&& 0 == EsMemoryCompare(negative + 1, name, nameBytes)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void FSDirectoryAddNegativeEntry(FSDirectory *directory, const void *name, size_t nameBytes, uint32_t nameHash) {
+	KWriterLockAssertExclusive(&directory->writerLock);
+
+	FSNegativeEntry *negative = (FSNegativeEntry *) EsHeapAllocate(sizeof(FSNegativeEntry) + nameBytes, false, K_FIXED);
+	if (!negative) return; // The negative entry is only an optimisation.
+	negative->nameHash = nameHash;
+	negative->nameBytes = nameBytes;
+	EsMemoryCopy(negative + 1, name, nameBytes);
+
+	// Replace the oldest negative entry.
+	uintptr_t slot = directory->negativeEntriesNext;
+	directory->negativeEntriesNext = (slot + 1) % FS_DIRECTORY_NEGATIVE_ENTRIES;
+	EsHeapFree(directory->negativeEntries[slot], 0, K_FIXED);
+	directory->negativeEntries[slot] = negative;
+}
+
+void FSDirectoryInsertEntry(FSDirectory *directory, FSDirectoryEntry *entry) {
+	KWriterLockAssertExclusive(&directory->writerLock);
+
+	TreeInsert(&directory->entries, &entry->item, entry, entry->item.key, AVL_DUPLICATE_KEYS_PANIC);
+	directory->entryCount++;
+
+	entry->nameHash = FSNameHash(entry->item.key.longKey, entry->item.key.longKeyBytes);
+
+	for (uintptr_t i = 0; i < FS_DIRECTORY_NEGATIVE_ENTRIES; i++) {
+		FSNegativeEntry *negative = directory->negativeEntries[i];
+
+		if (negative && negative->nameHash == entry->nameHash && negative->nameBytes == entry->item.key.longKeyBytes
+				&& 0 == EsMemoryCompare(negative + 1, entry->item.key.longKey, negative->nameBytes)) {
+			EsHeapFree(negative, 0, K_FIXED);
+			directory->negativeEntries[i] = nullptr;
+		}
+	}
+
+	if (directory->entryCount > directory->hashTableSlots) {
+		// Grow the hash table, and rebuild it from the tree.
+		// If we can't allocate a larger table, keep using the current one.
+
+		size_t newSlots = directory->hashTableSlots ? directory->hashTableSlots * 2 : FS_DIRECTORY_HASH_INITIAL_SLOTS;
+		FSDirectoryEntry **newTable = (FSDirectoryEntry **) EsHeapAllocate(newSlots * sizeof(FSDirectoryEntry *), true, K_FIXED);
+
+		if (newTable) {
+			EsHeapFree(directory->hashTable, 0, K_FIXED);
+			directory->hashTable = newTable;
+			directory->hashTableSlots = newSlots;
+			_FSDirectoryRehashVisit(directory->entries.root, newTable, newSlots);
+			return;
+		}
+	}
+
+	if (directory->hashTable) {
+		uintptr_t slot = entry->nameHash & (directory->hashTableSlots - 1);
+		entry->hashNext = directory->hashTable[slot];
+		directory->hashTable[slot] = entry;
+	}
+}
+
+void FSDirectoryRemoveEntry(FSDirectory *directory, FSDirectoryEntry *entry) {
+	KWriterLockAssertExclusive(&directory->writerLock);
+
+	TreeRemove(&directory->entries, &entry->item);
+	directory->entryCount--;
+
+	if (directory->hashTable) {
+		FSDirectoryEntry **link = directory->hashTable + (entry->nameHash & (directory->hashTableSlots - 1));
+
+		while (*link != entry) {
+			if (!(*link)) KernelPanic("FSDirectoryRemoveEntry - Entry %x was not in the hash table of directory %x.\n", entry, directory);
+			link = &(*link)->hashNext;
+		}
+
+		*link = entry->hashNext;
+	}
+
+	entry->hashNext = nullptr;
+}
+
 EsError FSNodeDelete(KNode *node) {
 	if (fs.shutdown) KernelPanic("FSNodeDelete - Attempting to delete a file after FSShutdown called.\n");
 
@@ -486,8 +753,7 @@ EsError FSNodeDelete(KNode *node) {
 
 	if (error == ES_SUCCESS) {
 		__sync_fetch_and_or(&node->flags, NODE_DELETED);
-		TreeRemove(&parent->entries, &entry->item);
-		parent->entryCount--;
+		FSDirectoryRemoveEntry(parent, entry);
 	}
 
 	__sync_fetch_and_or(&parent->flags, NODE_MODIFIED);
@@ -544,6 +810,7 @@ EsError FSNodeMove(KNode *node, KNode *_newParent, const char *newName, size_t n
 
 	EsError error = ES_SUCCESS;
 	bool alreadyExists = false;
+	uint32_t newNameHash = 0;
 	void *newKeyBuffer = nullptr;
 
 	KWriterLock *locks[] = { &node->writerLock, &oldParent->writerLock, &newParent->writerLock };
@@ -571,12 +838,14 @@ EsError FSNodeMove(KNode *node, KNode *_newParent, const char *newName, size_t n
 
 	// Check a node with the same name doesn't already exist in the new directory.
 
-	alreadyExists = TreeFind(&newParent->entries, MakeLongKey(newName, newNameBytes), TREE_SEARCH_EXACT);
+	newNameHash = FSNameHash(newName, newNameBytes);
+	alreadyExists = FSDirectoryLookup(newParent, newName, newNameBytes, newNameHash);
 
-	if (!alreadyExists && (~newParent->flags & NODE_ENUMERATED_ALL_DIRECTORY_ENTRIES)) {
+	if (!alreadyExists && (~newParent->flags & NODE_ENUMERATED_ALL_DIRECTORY_ENTRIES)
+			&& !FSDirectoryIsNegativeEntry(newParent, newName, newNameBytes, newNameHash)) {
 		// The entry is not cached; load it from the file system.
 		node->fileSystem->scan(newName, newNameBytes, newParent);
-		alreadyExists = TreeFind(&newParent->entries, MakeLongKey(newName, newNameBytes), TREE_SEARCH_EXACT);
+		alreadyExists = FSDirectoryLookup(newParent, newName, newNameBytes, newNameHash);
 	}
 
 	if (alreadyExists) {
@@ -611,22 +880,18 @@ EsError FSNodeMove(KNode *node, KNode *_newParent, const char *newName, size_t n
 
 	entry->parent = newParent;
 	
-	TreeRemove(&oldParent->entries, &entry->item);
+	FSDirectoryRemoveEntry(oldParent, entry);
 
 	entry->item.key.longKey = newKeyBuffer ?: entry->inlineName;
 	EsMemoryCopy(entry->item.key.longKey, newName, newNameBytes);
 	entry->item.key.longKeyBytes = newNameBytes;
 
-	TreeInsert(&newParent->entries, &entry->item, entry, entry->item.key);
-
-	oldParent->entryCount--;
+	FSDirectoryInsertEntry(newParent, entry);
 
 	if (oldParent->directoryEntry->directoryChildren != ES_DIRECTORY_CHILDREN_UNKNOWN) {
 		oldParent->directoryEntry->directoryChildren--;
 	}
 
-	newParent->entryCount++;
-
 	if (newParent->directoryEntry->directoryChildren != ES_DIRECTORY_CHILDREN_UNKNOWN) {
 		newParent->directoryEntry->directoryChildren++;
 	}
@@ -669,32 +934,27 @@ EsError FSNodeMove(KNode *node, KNode *_newParent, const char *newName, size_t n
 	return error;
 }
 
-void _FSDirectoryEnumerateVisit(AVLItem<FSDirectoryEntry> *item, K_USER_BUFFER EsDirectoryChild *buffer, size_t bufferSize, uintptr_t *position) {
-	if (!item || *position == bufferSize) {
-		return;
-	}
-
-	FSDirectoryEntry *entry = item->thisItem;
-	EsDirectoryChild *output = buffer + *position;
-	*position = *position + 1;
-
+void _FSDirectoryEnumerateCopy(FSDirectoryEntry *entry, K_USER_BUFFER EsDirectoryChild *output, size_t nameBytes, uint32_t flags) {
 	if (entry->node && (entry->node->flags & NODE_DELETED)) {
-		KernelPanic("_FSDirectoryEnumerateVisit - Deleted node %x found in directory tree.\n");
+		KernelPanic("_FSDirectoryEnumerateCopy - Deleted node %x found in directory tree.\n");
 	}
 
-	size_t nameBytes = entry->item.key.longKeyBytes > ES_MAX_DIRECTORY_CHILD_NAME_LENGTH ? ES_MAX_DIRECTORY_CHILD_NAME_LENGTH : entry->item.key.longKeyBytes;
 	EsMemoryCopy(output->name, entry->item.key.longKey, nameBytes);
-	output->type = entry->type;
-	output->fileSize = entry->totalSize;
-	output->directoryChildren = entry->directoryChildren;
 	output->nameBytes = nameBytes;
-	output->contentType = entry->contentType;
+	output->type = entry->type;
 
-	_FSDirectoryEnumerateVisit(item->children[0], buffer, bufferSize, position);
-	_FSDirectoryEnumerateVisit(item->children[1], buffer, bufferSize, position);
+	if (flags & ES_DIRECTORY_ENUMERATE_NAMES_ONLY) {
+		output->fileSize = -1;
+		output->directoryChildren = ES_DIRECTORY_CHILDREN_UNKNOWN;
+		EsMemoryZero(&output->contentType, sizeof(EsUniqueIdentifier));
+	} else {
+		output->fileSize = entry->totalSize;
+		output->directoryChildren = entry->directoryChildren;
+		output->contentType = entry->contentType;
+	}
 }
 
-ptrdiff_t FSDirectoryEnumerate(KNode *node, K_USER_BUFFER EsDirectoryChild *buffer, size_t bufferSize) {
+ptrdiff_t FSDirectoryEnumerate(KNode *node, K_USER_BUFFER EsDirectoryChild *buffer, size_t bufferCount, EsDirectoryEnumerateCookie *cookie, uint32_t flags) {
 	// uint64_t start = ProcessorReadTimeStamp();
 
 	if (node->directoryEntry->type != ES_NODE_DIRECTORY) {
@@ -704,24 +964,69 @@ ptrdiff_t FSDirectoryEnumerate(KNode *node, K_USER_BUFFER EsDirectoryChild *buff
 	FSDirectory *directory = (FSDirectory *) node;
 
 	// I think it's safe to modify the user's buffer with this lock.
-	KWriterLockTake(&directory->writerLock, K_LOCK_EXCLUSIVE);
+	KWriterLockTake(&directory->writerLock, K_LOCK_SHARED);
 
 	if (~directory->flags & NODE_ENUMERATED_ALL_DIRECTORY_ENTRIES) {
-		EsError error = directory->fileSystem->enumerate(directory);
+		// The driver adds the directory entries, so we need the exclusive lock.
+		KWriterLockReturn(&directory->writerLock, K_LOCK_SHARED);
+		KWriterLockTake(&directory->writerLock, K_LOCK_EXCLUSIVE);
 
-		if (error != ES_SUCCESS) {
-			KWriterLockReturn(&directory->writerLock, K_LOCK_EXCLUSIVE);
-			return error;
+		if (~directory->flags & NODE_ENUMERATED_ALL_DIRECTORY_ENTRIES) {
+			EsError error = directory->fileSystem->enumerate(directory);
+
+			if (error != ES_SUCCESS) {
+				KWriterLockReturn(&directory->writerLock, K_LOCK_EXCLUSIVE);
+				return error;
+			}
+
+			__sync_fetch_and_or(&directory->flags, NODE_ENUMERATED_ALL_DIRECTORY_ENTRIES);
+			directory->directoryEntry->directoryChildren = directory->entryCount;
 		}
 
-		__sync_fetch_and_or(&directory->flags, NODE_ENUMERATED_ALL_DIRECTORY_ENTRIES);
-		directory->directoryEntry->directoryChildren = directory->entryCount;
+		KWriterLockConvertExclusiveToShared(&directory->writerLock);
+	}
+
+	// Find the first entry after the ones returned in previous pages.
+	// Names longer than ES_MAX_DIRECTORY_CHILD_NAME_LENGTH are truncated in the cookie,
+	// so we skip over the entries that share the truncated name which were already returned.
+
+	AVLItem<FSDirectoryEntry> *item;
+
+	if (!cookie->lastNameBytes) {
+		item = TreeFirst(&directory->entries);
+	} else {
+		item = TreeFind(&directory->entries, MakeLongKey(cookie->lastName, cookie->lastNameBytes), TREE_SEARCH_SMALLEST_ABOVE_OR_EQUAL);
+
+		for (uintptr_t i = 0; i < cookie->lastNameCount && item; i++) {
+			if (item->key.longKeyBytes < cookie->lastNameBytes
+					|| EsMemoryCompare(item->key.longKey, cookie->lastName, cookie->lastNameBytes)
+					|| (item->key.longKeyBytes != cookie->lastNameBytes && cookie->lastNameBytes != ES_MAX_DIRECTORY_CHILD_NAME_LENGTH)) {
+				break;
+			}
+
+			item = TreeNext(item);
+		}
 	}
 
 	uintptr_t position = 0;
-	_FSDirectoryEnumerateVisit(directory->entries.root, buffer, bufferSize, &position);
 
-	KWriterLockReturn(&directory->writerLock, K_LOCK_EXCLUSIVE);
+	while (item && position < bufferCount) {
+		size_t nameBytes = item->key.longKeyBytes > ES_MAX_DIRECTORY_CHILD_NAME_LENGTH ? ES_MAX_DIRECTORY_CHILD_NAME_LENGTH : item->key.longKeyBytes;
+		_FSDirectoryEnumerateCopy(item->thisItem, buffer + position, nameBytes, flags);
+		position++;
+
+		if (nameBytes == cookie->lastNameBytes && 0 == EsMemoryCompare(item->key.longKey, cookie->lastName, nameBytes)) {
+			cookie->lastNameCount++;
+		} else {
+			EsMemoryCopy(cookie->lastName, item->key.longKey, nameBytes);
+			cookie->lastNameBytes = nameBytes;
+			cookie->lastNameCount = 1;
+		}
+
+		item = TreeNext(item);
+	}
+
+	KWriterLockReturn(&directory->writerLock, K_LOCK_SHARED);
 
 	// uint64_t end = ProcessorReadTimeStamp();
 	// EsPrint("FSDirectoryEnumerate took %dmcs for %d items.\n", (end - start) / KGetTimeStampTicksPerUs(), position);
@@ -741,9 +1046,17 @@ void FSNodeFree(KNode *node) {
 	if (entry->type == ES_NODE_FILE) {
 		CCSpaceDestroy(&((FSFile *) node)->cache);
 	} else if (entry->type == ES_NODE_DIRECTORY) {
-		if (((FSDirectory *) node)->entries.root) {
+		FSDirectory *directory = (FSDirectory *) node;
+
+		if (directory->entries.root) {
 			KernelPanic("FSNodeFree - Directory %x still had items in its tree.\n", node);
 		}
+
+		EsHeapFree(directory->hashTable, 0, K_FIXED);
+
+		for (uintptr_t i = 0; i < FS_DIRECTORY_NEGATIVE_ENTRIES; i++) {
+			EsHeapFree(directory->negativeEntries[i], 0, K_FIXED);
+		}
 	}
 
 	if (node->driverNode) {
@@ -755,7 +1068,7 @@ void FSNodeFree(KNode *node) {
 	bool deleted = node->flags & NODE_DELETED;
 
 	KFileSystem *fileSystem = node->fileSystem;
-	EsHeapFree(node, entry->type == ES_NODE_DIRECTORY ? sizeof(FSDirectory) : sizeof(FSFile), K_FIXED);
+	FSNodeDeallocate(node, entry->type);
 
 	if (!deleted) {
 		KSpinlockAcquire(&fs.updateNodeHandles);
@@ -805,7 +1118,7 @@ void FSDirectoryEntryFree(FSDirectoryEntry *entry) {
 		EsHeapFree((void *) entry->item.key.longKey, entry->item.key.longKeyBytes, K_FIXED);
 	}
 
-	EsHeapFree(entry, 0, K_FIXED);
+	FSDirectoryEntryDeallocate(entry);
 }
 
 EsError FSNodeCreate(FSDirectory *parent, const char *name, size_t nameBytes, EsNodeType type) {
@@ -872,7 +1185,7 @@ EsError FSDirectoryEntryAllocateNode(FSDirectoryEntry *entry, KFileSystem *fileS
 		}
 	}
 
-	KNode *node = (KNode *) EsHeapAllocate(entry->type == ES_NODE_DIRECTORY ? sizeof(FSDirectory) : sizeof(FSFile), true, K_FIXED);
+	KNode *node = FSNodeAllocate(entry->type);
 
 	if (!node) {
 		MMObjectCacheInsert(&fileSystem->cachedDirectoryEntries, &entry->cacheItem);
@@ -895,7 +1208,7 @@ EsError FSDirectoryEntryAllocateNode(FSDirectoryEntry *entry, KFileSystem *fileS
 
 		if (!CCSpaceInitialise(&file->cache)) {
 			MMObjectCacheInsert(&fileSystem->cachedDirectoryEntries, &entry->cacheItem);
-			EsHeapFree(node, 0, K_FIXED);
+			FSNodeDeallocate(node, entry->type);
 			return ES_ERROR_INSUFFICIENT_RESOURCES;
 		}
 	}
@@ -926,7 +1239,7 @@ EsError FSDirectoryEntryFound(KNode *_parent, KNodeMetadata *metadata,
 	size_t driverDataBytes = parent->fileSystem->directoryEntryDataBytes;
 	KWriterLockAssertExclusive(&parent->writerLock);
 
-	AVLItem<FSDirectoryEntry> *existingEntry = TreeFind(&parent->entries, MakeLongKey(name, nameBytes), TREE_SEARCH_EXACT);
+	FSDirectoryEntry *existingEntry = FSDirectoryLookup(parent, name, nameBytes, FSNameHash(name, nameBytes));
 
 	if (existingEntry) {
 		if (!driverData) {
@@ -935,28 +1248,28 @@ EsError FSDirectoryEntryFound(KNode *_parent, KNodeMetadata *metadata,
 		}
 
 		if (update) {
-			EsMemoryCopy(existingEntry->thisItem + 1, driverData, driverDataBytes);
+			EsMemoryCopy(existingEntry + 1, driverData, driverDataBytes);
 		}
 
 		if (node) {
 			if (!update) {
 				// Only try to create a node for this directory entry if update is false.
 
-				if (existingEntry->thisItem->node) {
+				if (existingEntry->node) {
 					KernelPanic("FSDirectoryEntryFound - Entry exists and is created on file system.\n");
 				}
 
-				EsError error = FSDirectoryEntryAllocateNode(existingEntry->thisItem, parent->fileSystem, true, true);
+				EsError error = FSDirectoryEntryAllocateNode(existingEntry, parent->fileSystem, true, true);
 
 				if (error != ES_SUCCESS) {
 					return error;
 				}
 			}
 
-			*node = existingEntry->thisItem->node;
+			*node = existingEntry->node;
 		} 
 		
-		if (!node && !update && EsMemoryCompare(existingEntry->thisItem + 1, driverData, driverDataBytes)) {
+		if (!node && !update && EsMemoryCompare(existingEntry + 1, driverData, driverDataBytes)) {
 			// NOTE This can be caused by a directory containing an entry with the same name multiple times.
 			KernelLog(LOG_ERROR, "FS", "directory entry driverData changed", "FSDirectoryEntryFound - 'update' is false but driverData has changed.\n");
 		}
@@ -966,7 +1279,7 @@ EsError FSDirectoryEntryFound(KNode *_parent, KNodeMetadata *metadata,
 		return ES_ERROR_FILE_DOES_NOT_EXIST;
 	}
 
-	FSDirectoryEntry *entry = (FSDirectoryEntry *) EsHeapAllocate(sizeof(FSDirectoryEntry) + driverDataBytes, true, K_FIXED);
+	FSDirectoryEntry *entry = FSDirectoryEntryAllocate(driverDataBytes);
 
 	if (!entry) {
 		return ES_ERROR_INSUFFICIENT_RESOURCES;
@@ -976,7 +1289,7 @@ EsError FSDirectoryEntryFound(KNode *_parent, KNodeMetadata *metadata,
 		entry->item.key.longKey = EsHeapAllocate(nameBytes, false, K_FIXED);
 
 		if (!entry->item.key.longKey) {
-			EsHeapFree(entry, sizeof(FSDirectoryEntry) + driverDataBytes, K_FIXED);
+			FSDirectoryEntryDeallocate(entry);
 			return ES_ERROR_INSUFFICIENT_RESOURCES;
 		}
 	} else {
@@ -990,8 +1303,7 @@ EsError FSDirectoryEntryFound(KNode *_parent, KNodeMetadata *metadata,
 	if (driverData) EsMemoryCopy(entry + 1, driverData, driverDataBytes);
 	entry->parent = parent;
 
-	TreeInsert(&parent->entries, &entry->item, entry, entry->item.key, AVL_DUPLICATE_KEYS_PANIC);
-	parent->entryCount++;
+	FSDirectoryInsertEntry(parent, entry);
 
 	if (node) {
 		if (!update) {
@@ -1053,7 +1365,8 @@ void FSUnmountFileSystem(uintptr_t argument) {
 		fileSystem->unmount(fileSystem);
 	}
 
-	KernelLog(LOG_INFO, "FS", "unmount complete", "Unmounted file system %x.\n", fileSystem);
+	KernelLog(LOG_INFO, "FS", "unmount complete", "Unmounted file system %x. Block cache reads: %d hits, %d misses.\n", 
+			fileSystem, fileSystem->cacheSpace.readHits, fileSystem->cacheSpace.readMisses);
 	KDeviceCloseHandle(fileSystem);
 	__sync_fetch_and_sub(&fs.fileSystemsUnmounting, 1);
 	KEventSet(&fs.fileSystemUnmounted, true);
@@ -1260,27 +1573,33 @@ EsError FSNodeTraverseLayer(uintptr_t *sectionEnd,
 		return ES_ERROR_PATH_NOT_TRAVERSABLE;
 	}
 
-	AVLKey key = MakeLongKey(name, nameBytes);
+	uint32_t nameHash = FSNameHash(name, nameBytes);
+	bool isFinalSection = *sectionEnd == pathBytes && isFinalPath;
 	FSDirectoryEntry *entry = nullptr;
-	AVLItem<FSDirectoryEntry> *treeItem = nullptr;
 
 	// First, try to get the cached directory entry with shared access.
 
 	{
 		KWriterLockTake(&directory->writerLock, K_LOCK_SHARED);
 
-		treeItem = TreeFind(&directory->entries, key, TREE_SEARCH_EXACT);
+		entry = FSDirectoryLookup(directory, name, nameBytes, nameHash);
 		bool needExclusiveAccess = true;
 
-		if (treeItem) {
-			error = FSDirectoryEntryOpenHandleToNode(treeItem->thisItem);
+		if (entry) {
+			error = FSDirectoryEntryOpenHandleToNode(entry);
 
 			if (error == ES_ERROR_NODE_NOT_LOADED) {
 				error = ES_SUCCESS; // Proceed to use exclusive access.
+				entry = nullptr;
 			} else {
-				entry = treeItem->thisItem;
 				needExclusiveAccess = false;
 			}
+		} else if ((~flags & ES__NODE_NO_WRITE_BASE)
+				&& (isFinalSection ? (flags & ES_NODE_FAIL_IF_NOT_FOUND) : (~flags & ES_NODE_CREATE_DIRECTORIES))
+				&& FSDirectoryIsNegativeEntry(directory, name, nameBytes, nameHash)) {
+			// We already know the node does not exist, and we aren't going to create it.
+			error = isFinalSection ? ES_ERROR_FILE_DOES_NOT_EXIST : ES_ERROR_PATH_NOT_TRAVERSABLE;
+			needExclusiveAccess = false;
 		}
 
 		KWriterLockReturn(&directory->writerLock, K_LOCK_SHARED);
@@ -1294,15 +1613,20 @@ EsError FSNodeTraverseLayer(uintptr_t *sectionEnd,
 
 	KWriterLockTake(&directory->writerLock, K_LOCK_EXCLUSIVE);
 
-	treeItem = TreeFind(&directory->entries, key, TREE_SEARCH_EXACT);
+	entry = FSDirectoryLookup(directory, name, nameBytes, nameHash);
 
-	if (!treeItem && (~directory->flags & NODE_ENUMERATED_ALL_DIRECTORY_ENTRIES)) {
+	if (!entry && (~directory->flags & NODE_ENUMERATED_ALL_DIRECTORY_ENTRIES)
+			&& !FSDirectoryIsNegativeEntry(directory, name, nameBytes, nameHash)) {
 		// The entry is not cached; load it from the file system.
-		fileSystem->scan(name, nameBytes, directory);
-		treeItem = TreeFind(&directory->entries, key, TREE_SEARCH_EXACT);
+
+		if (ES_ERROR_FILE_DOES_NOT_EXIST == fileSystem->scan(name, nameBytes, directory)) {
+			FSDirectoryAddNegativeEntry(directory, name, nameBytes, nameHash);
+		}
+
+		entry = FSDirectoryLookup(directory, name, nameBytes, nameHash);
 	}
 
-	if (!treeItem) {
+	if (!entry) {
 		// The node does not exist.
 
 		if (flags & ES__NODE_NO_WRITE_BASE) {
@@ -1310,16 +1634,16 @@ EsError FSNodeTraverseLayer(uintptr_t *sectionEnd,
 			goto failed;
 		}
 
-		if (*sectionEnd == pathBytes && isFinalPath) {
+		if (isFinalSection) {
 			if (~flags & ES_NODE_FAIL_IF_NOT_FOUND) {
 				error = FSNodeCreate(directory, name, nameBytes, flags & ES_NODE_DIRECTORY);
 				if (error != ES_SUCCESS) goto failed;
-				treeItem = TreeFind(&directory->entries, key, TREE_SEARCH_EXACT);
+				entry = FSDirectoryLookup(directory, name, nameBytes, nameHash);
 				flags &= ~ES_NODE_FAIL_IF_FOUND;
 				*createdNode = true;
 			}
 
-			if (!treeItem) {
+			if (!entry) {
 				error = ES_ERROR_FILE_DOES_NOT_EXIST;
 				goto failed;
 			}
@@ -1327,18 +1651,16 @@ EsError FSNodeTraverseLayer(uintptr_t *sectionEnd,
 			if (flags & ES_NODE_CREATE_DIRECTORIES) {
 				error = FSNodeCreate(directory, name, nameBytes, ES_NODE_DIRECTORY);
 				if (error != ES_SUCCESS) goto failed;
-				treeItem = TreeFind(&directory->entries, key, TREE_SEARCH_EXACT);
+				entry = FSDirectoryLookup(directory, name, nameBytes, nameHash);
 			}
 
-			if (!treeItem) {
+			if (!entry) {
 				error = ES_ERROR_PATH_NOT_TRAVERSABLE;
 				goto failed;
 			}
 		}
 	}
 
-	entry = treeItem->thisItem;
-
 	if (!entry->node) {
 		// The node has not be loaded; load it from the file system.
 
@@ -1483,8 +1805,7 @@ bool FSTrimCachedDirectoryEntry(MMObjectCache *cache) {
 			FSDirectoryEntryFree(entry);
 		} else if (ES_SUCCESS == FSNodeOpenHandle(entry->parent, ES_FLAGS_DEFAULT, FS_NODE_OPEN_HANDLE_DIRECTORY_TEMPORARY)) {
 			KWriterLockTake(&entry->parent->writerLock, K_LOCK_EXCLUSIVE);
-			TreeRemove(&entry->parent->entries, &entry->item);
-			entry->parent->entryCount--;
+			FSDirectoryRemoveEntry(entry->parent, entry);
 			__sync_fetch_and_and(&entry->parent->flags, ~NODE_ENUMERATED_ALL_DIRECTORY_ENTRIES);
 			KWriterLockReturn(&entry->parent->writerLock, K_LOCK_EXCLUSIVE);
 			FSNodeCloseHandle(entry->parent, ES_FLAGS_DEFAULT); // This will put the parent in the node cache if needed.
@@ -1574,6 +1895,34 @@ KDMASegment KDMABufferNextSegment(KDMABuffer *buffer, bool peek) {
 // Block devices.
 //////////////////////////////////////////
 
+EsError FSBlockDeviceZero(KBlockDeviceAccessRequest request) {
+	// The device can't zero sectors itself, so write zeroes from a buffer.
+
+	size_t zeroBufferBytes = request.count > FS_ZERO_BUFFER_SIZE ? FS_ZERO_BUFFER_SIZE : request.count;
+	void *zeroBuffer = EsHeapAllocate(zeroBufferBytes, true, K_FIXED);
+	EsError error = zeroBuffer ? ES_SUCCESS : ES_ERROR_INSUFFICIENT_RESOURCES;
+
+	KWorkGroup *dispatchGroup = request.dispatchGroup;
+	if (dispatchGroup) dispatchGroup->Start();
+
+	KBlockDeviceAccessRequest r = request;
+	r.operation = K_ACCESS_WRITE;
+	r.dispatchGroup = nullptr; // Wait for the writes to complete before freeing the buffer.
+
+	while (request.count && error == ES_SUCCESS) {
+		r.count = request.count > zeroBufferBytes ? zeroBufferBytes : request.count;
+		KDMABuffer buffer = { (uintptr_t) zeroBuffer, r.count };
+		r.buffer = &buffer;
+		error = FSBlockDeviceAccess(r);
+		r.offset += r.count;
+		request.count -= r.count;
+	}
+
+	EsHeapFree(zeroBuffer, zeroBufferBytes, K_FIXED);
+	if (dispatchGroup) dispatchGroup->End(error == ES_SUCCESS);
+	return dispatchGroup ? ES_SUCCESS : error;
+}
+
 EsError FSBlockDeviceAccess(KBlockDeviceAccessRequest request) {
 	KBlockDevice *device = request.device;
 
@@ -1581,7 +1930,7 @@ EsError FSBlockDeviceAccess(KBlockDeviceAccessRequest request) {
 		return ES_SUCCESS;
 	}
 
-	if (device->information.readOnly && request.operation == K_ACCESS_WRITE) {
+	if (device->information.readOnly && request.operation != K_ACCESS_READ) {
 		if (request.flags & FS_BLOCK_ACCESS_SOFT_ERRORS) return ES_ERROR_BLOCK_ACCESS_INVALID;
 		KernelPanic("FSBlockDeviceAccess - Drive %x is read-only.\n", device);
 	}
@@ -1597,7 +1946,16 @@ EsError FSBlockDeviceAccess(KBlockDeviceAccessRequest request) {
 		KernelPanic("FSBlockDeviceAccess - Misaligned access.\n");
 	}
 
-	KDMABuffer buffer = *request.buffer;
+	bool hasBuffer = request.operation == K_ACCESS_READ || request.operation == K_ACCESS_WRITE;
+
+	if (request.operation == K_ACCESS_DISCARD && !device->canDiscard) {
+		// Discarding is only a hint.
+		return ES_SUCCESS;
+	} else if (request.operation == K_ACCESS_ZERO && !device->canZero) {
+		return FSBlockDeviceZero(request);
+	}
+
+	KDMABuffer buffer = hasBuffer ? *request.buffer : KDMABuffer {};
 
 	if (buffer.virtualAddress & 3) {
 		if (request.flags & FS_BLOCK_ACCESS_SOFT_ERRORS) return ES_ERROR_BLOCK_ACCESS_INVALID;
@@ -1613,7 +1971,7 @@ EsError FSBlockDeviceAccess(KBlockDeviceAccessRequest request) {
 
 	KBlockDeviceAccessRequest r = {};
 	r.device = request.device;
-	r.buffer = &buffer;
+	r.buffer = hasBuffer ? &buffer : nullptr;
 	r.flags = request.flags;
 	r.dispatchGroup = request.dispatchGroup;
 	r.operation = request.operation;
@@ -1623,11 +1981,10 @@ EsError FSBlockDeviceAccess(KBlockDeviceAccessRequest request) {
 		r.count = device->maxAccessSectorCount * device->information.sectorSize;
 		if (r.count > request.count) r.count = request.count;
 		buffer.offsetBytes = 0;
-		buffer.totalByteCount = r.count;
-		r.count = r.count;
+		buffer.totalByteCount = hasBuffer ? r.count : 0;
 		device->access(r);
 		r.offset += r.count;
-		buffer.virtualAddress += r.count;
+		if (hasBuffer) buffer.virtualAddress += r.count;
 		request.count -= r.count;
 	}
 
@@ -1640,6 +1997,19 @@ EsError FSBlockDeviceAccess(KBlockDeviceAccessRequest request) {
 
 EsError FSReadIntoBlockCache(CCSpace *cache, void *buffer, EsFileOffset offset, EsFileOffset count) {
 	KFileSystem *fileSystem = EsContainerOf(KFileSystem, cacheSpace, cache);
+
+	// Pages loaded by read-ahead can extend past the end of the drive.
+
+	EsFileOffset driveBytes = fileSystem->block->information.sectorCount * fileSystem->block->information.sectorSize;
+
+	if (offset >= driveBytes) {
+		EsMemoryZero(buffer, count);
+		return ES_SUCCESS;
+	} else if (offset + count > driveBytes) {
+		EsMemoryZero((uint8_t *) buffer + (driveBytes - offset), offset + count - driveBytes);
+		count = driveBytes - offset;
+	}
+
 	return fileSystem->Access(offset, count, K_ACCESS_READ, buffer, ES_FLAGS_DEFAULT, nullptr);
 }
 
@@ -1665,6 +2035,10 @@ EsError KFileSystem::Access(EsFileOffset offset, size_t count, int operation, vo
 	
 	bool blockDeviceCachedEnabled = true;
 
+	if ((flags & FS_BLOCK_ACCESS_CACHED) && operation != K_ACCESS_READ && operation != K_ACCESS_WRITE) {
+		KernelPanic("KFileSystem::Access - Zeroing and discarding cannot go through the block cache.\n");
+	}
+
 	if (blockDeviceCachedEnabled && (flags & FS_BLOCK_ACCESS_CACHED)) {
 		if (dispatchGroup) {
 			dispatchGroup->Start();
@@ -1675,8 +2049,14 @@ EsError KFileSystem::Access(EsFileOffset offset, size_t count, int operation, vo
 		// We use the CC_ACCESS_PRECISE flag for file systems that have a block size less than the page size.
 		// Otherwise, we might end up trashing file blocks (which aren't kept in the block device cache).
 
+		// Metadata tends to be clustered, so reads that miss also load the following pages.
+		// This is only done on read-only volumes: on writable volumes the following pages may hold file data,
+		// which is written directly to the drive without going through the block cache, so the cached copy would go stale.
+
+		uint32_t readAhead = (volumeFlags & ES_VOLUME_READ_ONLY) ? CC_ACCESS_READ_AHEAD : 0;
+
 		EsError result = CCSpaceAccess(&cacheSpace, buffer, offset, count, 
-				operation == K_ACCESS_READ ? CC_ACCESS_READ : (CC_ACCESS_WRITE | CC_ACCESS_WRITE_BACK | CC_ACCESS_PRECISE));
+				operation == K_ACCESS_READ ? (CC_ACCESS_READ | readAhead) : (CC_ACCESS_WRITE | CC_ACCESS_WRITE_BACK | CC_ACCESS_PRECISE));
 
 		if (dispatchGroup) {
 			dispatchGroup->End(result == ES_SUCCESS);
@@ -1723,6 +2103,8 @@ void FSPartitionDeviceCreate(KBlockDevice *parent, EsFileOffset offset, EsFileOf
 	child->parent = parent;
 	child->information.sectorSize = parent->information.sectorSize;
 	child->maxAccessSectorCount = parent->maxAccessSectorCount;
+	child->canZero = parent->canZero;
+	child->canDiscard = parent->canDiscard;
 	child->sectorOffset = offset;
 	child->information.sectorCount = sectorCount;
 	child->information.readOnly = parent->information.readOnly;
@@ -1805,7 +2187,7 @@ bool FSCheckGPT(KBlockDevice *device) {
 }
 
 bool FSFileSystemInitialise(KFileSystem *fileSystem) {
-	FSDirectoryEntry *rootEntry = (FSDirectoryEntry *) EsHeapAllocate(sizeof(FSDirectoryEntry), true, K_FIXED);
+	FSDirectoryEntry *rootEntry = FSDirectoryEntryAllocate(0);
 	if (!rootEntry) goto error;
 
 	rootEntry->type = ES_NODE_DIRECTORY;
@@ -1821,7 +2203,7 @@ bool FSFileSystemInitialise(KFileSystem *fileSystem) {
 
 	error:;
 	if (rootEntry && rootEntry->node) FSNodeFree(rootEntry->node);
-	if (rootEntry) EsHeapFree(rootEntry, sizeof(FSDirectoryEntry), K_FIXED);
+	if (rootEntry) FSDirectoryEntryDeallocate(rootEntry);
 	KDeviceDestroy(fileSystem);
 	return false;
 }
@@ -24,6 +24,13 @@
 // Describes the virtual memory covering a section of a file.  
 #define CC_ACTIVE_SECTION_SIZE                    ((EsFileOffset) 262144)             
 
+// The maximum number of pages loaded after the accessed region when a CC_ACCESS_READ_AHEAD access misses.
+#define CC_READ_AHEAD_PAGES                       (16)
+
+// The maximum number of active sections taken from the modified list at once by the write behind thread.
+// Each batch is written in order of offset.
+#define CC_WRITE_BEHIND_BATCH                     (16)
+
 // Maximum number of active sections on the modified list. If exceeded, writers will wait for it to drop before retrying.
 // TODO This should based off the amount of physical memory.
 #define CC_MAX_MODIFIED                           (67108864 / CC_ACTIVE_SECTION_SIZE) 
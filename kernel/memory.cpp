@@ -191,8 +191,10 @@ struct PMM {
 	KEvent availableNotCritical;
 
 	// Event for when the object cache should be trimmed.
-#define MM_OBJECT_CACHE_SHOULD_TRIM() (pmm.approximateTotalObjectCacheBytes / K_PAGE_SIZE > MM_OBJECT_CACHE_PAGES_MAXIMUM())
+#define MM_OBJECT_CACHE_SHOULD_TRIM() (pmm.approximateTotalObjectCacheBytes / K_PAGE_SIZE > MM_OBJECT_CACHE_PAGES_MAXIMUM() \
+		|| pmm.approximateTotalObjectCacheBytes > pmm.objectCacheTrimTarget)
 	uintptr_t approximateTotalObjectCacheBytes;
+	volatile uintptr_t objectCacheTrimTarget; // Set by MMObjectCacheTrimBytes; -1 if there is no outstanding request.
 	KEvent trimObjectCaches;
 
 	// These variables will be cleared if the object they point to is removed.
@@ -255,6 +257,7 @@ void MMSharedDestroyRegion(MMSharedRegion *region);
 
 void *MMMapPhysical(MMSpace *space, uintptr_t address, size_t bytes, uint64_t caching);
 void *MMStandardAllocate(MMSpace *space, size_t bytes, uint32_t flags, void *baseAddress, bool commitAll);
+void *MMStandardAllocateAligned(MMSpace *space, size_t bytes, size_t alignment, uint32_t flags, void **reservation);
 bool MMFree(MMSpace *space, void *address, size_t expectedSize, bool userOnly);
 MMRegion *MMReserve(MMSpace *space, size_t bytes, unsigned flags, uintptr_t forcedAddress = 0, bool generateGuardPages = false);
 bool MMCommit(uint64_t bytes, bool fixed);
@@ -267,6 +270,8 @@ MMSharedRegion *MMSharedCreateRegion(size_t sizeBytes, bool fixed, uintptr_t bel
 MMRegion *MMFindAndPinRegion(MMSpace *space, uintptr_t address, uintptr_t size);
 void MMUnpinRegion(MMSpace *space, MMRegion *region);
 void MMSpaceDestroy(MMSpace *space);
+void MMSpaceOpenReference(MMSpace *space);
+void MMSpaceCloseReference(MMSpace *space);
 bool MMSpaceInitialise(MMSpace *space);
 void MMPhysicalFree(uintptr_t page, bool mutexAlreadyAcquired, size_t count);
 void MMUnreserve(MMSpace *space, MMRegion *remove, bool unmapPages, bool guardRegion = false);
@@ -1437,6 +1442,30 @@ void *MMStandardAllocate(MMSpace *space, size_t bytes, uint32_t flags, void *bas
 	return (void *) region->baseAddress;
 }
 
+void *MMStandardAllocateAligned(MMSpace *space, size_t bytes, size_t alignment, uint32_t flags, void **reservation) {
+	// Reserve enough space to contain an aligned range of the requested size, and only commit that range.
+	// The alignment must be a power of 2, and at least the page size.
+
+	if (!space) space = kernelMMSpace;
+
+	KMutexAcquire(&space->reserveMutex);
+	EsDefer(KMutexRelease(&space->reserveMutex));
+
+	bytes = RoundUp(bytes, (size_t) K_PAGE_SIZE);
+	MMRegion *region = MMReserve(space, bytes + alignment - K_PAGE_SIZE, flags | MM_REGION_NORMAL, 0, true);
+	if (!region) return nullptr;
+
+	uintptr_t offset = RoundUp(region->baseAddress, (uintptr_t) alignment) - region->baseAddress;
+
+	if (!MMCommitRange(space, region, offset / K_PAGE_SIZE, bytes / K_PAGE_SIZE)) {
+		MMUnreserve(space, region, false /* No pages have been mapped. */);
+		return nullptr;
+	}
+
+	*reservation = (void *) region->baseAddress;
+	return (void *) (region->baseAddress + offset);
+}
+
 bool MMFree(MMSpace *space, void *address, size_t expectedSize, bool userOnly) {
 	if (!space) space = kernelMMSpace;
 
@@ -1616,6 +1645,12 @@ void MMBalanceThread() {
 			// Wait for there to be a low number of available pages.
 			KEventWait(&pmm.availableLow);
 			targetAvailablePages = MM_LOW_AVAILABLE_PAGES_THRESHOLD + MM_PAGES_TO_FIND_BALANCE;
+
+			// Also ask for the object caches to be trimmed, since they may be holding a lot of kernel memory.
+			// This is done by the trim thread, since trimming objects can require file system operations.
+			if (MM_AVAILABLE_PAGES() < targetAvailablePages) {
+				MMObjectCacheTrimBytes((targetAvailablePages - MM_AVAILABLE_PAGES()) * K_PAGE_SIZE);
+			}
 		}
 #else
 		// Test the balance thread works correctly by running it constantly.
@@ -2119,12 +2154,33 @@ void MMObjectCacheFlush(MMObjectCache *cache) {
 	KWriterLockReturn(&cache->trimLock, K_LOCK_EXCLUSIVE);
 }
 
+void MMObjectCacheTrimBytes(size_t bytes) {
+	// Lower the target size of the object caches, even if they are below their maximum size.
+	// The target is reset once the trim thread reaches it.
+
+	while (true) {
+		uintptr_t oldTarget = pmm.objectCacheTrimTarget;
+		uintptr_t current = pmm.approximateTotalObjectCacheBytes;
+		uintptr_t newTarget = current > bytes ? current - bytes : 0;
+		if (newTarget >= oldTarget) break;
+		if (__sync_bool_compare_and_swap(&pmm.objectCacheTrimTarget, oldTarget, newTarget)) break;
+	}
+
+	KEventSet(&pmm.trimObjectCaches, true);
+}
+
 void MMObjectCacheTrimThread() {
 	MMObjectCache *cache = nullptr;
+	uintptr_t cachesWithNothingTrimmed = 0;
 
 	while (true) {
 		while (!MM_OBJECT_CACHE_SHOULD_TRIM()) {
+			// If there was a request to trim the caches, it has been satisfied.
+			uintptr_t target = pmm.objectCacheTrimTarget;
+			if (target != (uintptr_t) -1) __sync_bool_compare_and_swap(&pmm.objectCacheTrimTarget, target, (uintptr_t) -1);
+
 			KEventReset(&pmm.trimObjectCaches);
+			if (MM_OBJECT_CACHE_SHOULD_TRIM()) break; // A new request arrived before we reset the event.
 			KEventWait(&pmm.trimObjectCaches);
 		}
 
@@ -2148,6 +2204,13 @@ void MMObjectCacheTrimThread() {
 			item = item->nextItem;
 		}
 
+		if (cachesWithNothingTrimmed > pmm.objectCacheList.count) {
+			// None of the caches could trim anything, so give up on the request to reach the target size.
+			uintptr_t target = pmm.objectCacheTrimTarget;
+			if (target != (uintptr_t) -1) __sync_bool_compare_and_swap(&pmm.objectCacheTrimTarget, target, (uintptr_t) -1);
+			cachesWithNothingTrimmed = 0;
+		}
+
 		if (!cache && pmm.objectCacheList.firstItem) {
 			cache = pmm.objectCacheList.firstItem->thisItem;
 		}
@@ -2162,10 +2225,14 @@ void MMObjectCacheTrimThread() {
 			continue;
 		}
 
+		cachesWithNothingTrimmed++;
+
 		for (uintptr_t i = 0; i < MM_OBJECT_CACHE_TRIM_GROUP_COUNT; i++) {
 			if (!cache->trim(cache)) {
 				break;
 			}
+
+			cachesWithNothingTrimmed = 0;
 		}
 
 		KWriterLockReturn(&cache->trimLock, K_LOCK_SHARED);
@@ -2251,6 +2318,7 @@ void MMInitialise() {
 		// Create threads.
 
 		pmm.zeroPageEvent.autoReset = true;
+		pmm.objectCacheTrimTarget = (uintptr_t) -1;
 		MMCommit(PHYSICAL_MEMORY_MANIPULATION_REGION_PAGES * K_PAGE_SIZE, true);
 		pmm.zeroPageThread = ThreadSpawn("MMZero", (uintptr_t) MMZeroPageThread, 0, SPAWN_THREAD_LOW_PRIORITY);
 		ThreadSpawn("MMBalance", (uintptr_t) MMBalanceThread, 0, ES_FLAGS_DEFAULT)->isPageGenerator = true;
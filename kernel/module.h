@@ -188,6 +188,7 @@ enum KernelObjectType : uint32_t {
 	KERNEL_OBJECT_EMBEDDED_WINDOW	= 0x00000400, // An embedded window object, referencing its container Window.
 	KERNEL_OBJECT_CONNECTION	= 0x00004000, // A network connection.
 	KERNEL_OBJECT_DEVICE		= 0x00008000, // A device.
+	KERNEL_OBJECT_IO_RING		= 0x00010000, // A pair of queues in shared memory for submitting asynchronous I/O requests and receiving their completions.
 };
 
 // TODO Rename to KObjectReference and KObjectDereference?
@@ -244,6 +245,7 @@ void KSpinlockAssertLocked(KSpinlock *spinlock);
 struct KMutex { // Mutual exclusion. Thread-owned.
 	K_PRIVATE
 	struct Thread *volatile owner;
+	volatile size_t waiterCount; // Threads that may be blocking on the mutex; if zero, releasing does not need the scheduler.
 #ifdef DEBUG_BUILD
 	uintptr_t acquireAddress, releaseAddress, id; 
 #endif
@@ -354,6 +356,7 @@ extern MMSpace _kernelMMSpace, _coreMMSpace;
 void *MMMapPhysical(MMSpace *space, uintptr_t address, size_t bytes, uint64_t caching);
 void MMRemapPhysical(MMSpace *space, const void *virtualAddress, uintptr_t newPhysicalAddress); // Must be done with interrupts disabled; does not invalidate on other processors.
 void *MMStandardAllocate(MMSpace *space, size_t bytes, uint32_t flags, void *baseAddress = nullptr, bool commitAll = true);
+void *MMStandardAllocateAligned(MMSpace *space, size_t bytes, size_t alignment, uint32_t flags, void **reservation); // Free the reservation with MMFree.
 bool MMFree(MMSpace *space, void *address, size_t expectedSize = 0, bool userOnly = false);
 void MMAllowWriteCombiningCaching(MMSpace *space, void *virtualAddress);
 size_t MMGetRegionPageCount(MMSpace *space, void *virtualAddress);
@@ -409,6 +412,7 @@ MMObjectCacheItem *MMObjectCacheRemoveLRU(MMObjectCache *cache);
 void MMObjectCacheRegister(MMObjectCache *cache, bool (*trimCallback)(MMObjectCache *), size_t averageObjectBytes);
 void MMObjectCacheUnregister(MMObjectCache *cache);
 void MMObjectCacheFlush(MMObjectCache *cache);
+void MMObjectCacheTrimBytes(size_t bytes); // Ask for roughly this many bytes to be trimmed from the object caches.
 
 // ---------------------------------------------------------------------------------------------------------------
 // Scheduler.
@@ -600,6 +604,8 @@ void KRegisterHIDevice(KHIDevice *device);
 
 #define K_ACCESS_READ (0)
 #define K_ACCESS_WRITE (1)
+#define K_ACCESS_ZERO (2) // Fill the sectors with zeroes. There is no buffer.
+#define K_ACCESS_DISCARD (3) // The contents of the sectors are no longer needed. There is no buffer.
 
 struct KBlockDeviceAccessRequest {
 	struct KBlockDevice *device;
@@ -617,6 +623,8 @@ struct KBlockDevice : KDevice {
 	KDeviceAccessCallbackFunction access; // Don't call directly; see KFileSystem::Access.
 	EsBlockDeviceInformation information;
 	size_t maxAccessSectorCount;
+	bool canZero; // Set if access handles K_ACCESS_ZERO. Otherwise, zeroes are written from a buffer.
+	bool canDiscard; // Set if access handles K_ACCESS_DISCARD. Otherwise, discards are ignored.
 
 	K_PRIVATE
 
@@ -795,6 +803,9 @@ struct CCSpace {
 	// Used by CCSpaceFlush.
 	KEvent writeComplete;
 
+	// Number of CC_ACCESS_READ accesses that were satisfied entirely from the cache, and that had to load pages.
+	volatile uint64_t readHits, readMisses;
+
 	// Callbacks.
 	const struct CCSpaceCallbacks *callbacks;
 };
@@ -863,6 +874,7 @@ struct KFileSystem : KDevice {
 	EsError  	(*move)		(KNode *oldDirectory, KNode *file, KNode *newDirectory, const char *newName, size_t newNameLength);
 	void  		(*close)	(KNode *node);
 	void		(*unmount)	(KFileSystem *fileSystem);
+	EsError		(*countExtents)	(KNode *file, uint64_t *extentCount); // The number of contiguous runs of blocks storing the file's data.
 
 	// TODO Normalizing file names, for case-insensitive filesystems.
 	// void *       (*normalize)    (const char *name, size_t nameLength, size_t *resultLength); 
@@ -1004,6 +1016,7 @@ struct NetInterface : KDevice {
 	KWriterLock connectionLock; 
 
 	bool connected, hasIP;
+	bool loopback; // Packets never leave the computer, so they don't need checksums or ARP.
 	uint16_t ipIdentification;
 	KIPAddress serverIdentifier;
 	KIPAddress dnsServerIP;
@@ -4,21 +4,17 @@
 
 // TODO Event-based API for userland.
 
-// TODO Locking: In NetTCPReceive, lock on getting task so it can't be destroyed by NetConnectionDestroy.
-
-// TODO Limiting the size of the ARP table; LRU.
 // TODO Sending ARP requests not working in VBox.
 
 // TODO Domain name resolve button doesn't work in the test program.
-// TODO Resolved domain name cache.
 
-// TODO UDP and TCP: checking packets are received from the correct NetInterface, MAC and IP.
-// TODO UDP and TCP: checking source port matches expected value on received packets.
+// TODO UDP and TCP: checking packets are received from the correct NetInterface and MAC.
+// TODO UDP: checking source IP and port matches expected value on received packets.
 // TODO UDP and TCP (and possibly others): lock in the NetTask callback when processing a received packet, 
 // 	to allow for a NetInterface to have multiple dispatcher threads.
-// TODO TCP: merging ACK responses.
-// TODO TCP: high performance extensions.
-// TODO TCP: reducing duplication of non-reply code.
+// TODO TCP: path MTU discovery.
+// TODO TCP: pacing segments sent in a burst after the window opens.
+// TODO TCP: accepting more than one connection on a listening port.
 
 // TODO Cancelling tasks after losing connection; retrying tasks; timeout tasks.
 // TODO Retrying the NetAddressSetupTask if it completes with error.
@@ -210,6 +206,29 @@ struct TCPHeader {
 	}
 } ES_STRUCT_PACKED;
 
+#define TCP_OPTION_END (0)
+#define TCP_OPTION_NOP (1)
+#define TCP_OPTION_MAXIMUM_SEGMENT_SIZE (2)
+#define TCP_OPTION_WINDOW_SCALE (3)
+#define TCP_OPTION_SACK_PERMITTED (4)
+#define TCP_OPTION_SACK (5)
+#define TCP_OPTION_TIMESTAMP (8)
+#define TCP_MAXIMUM_OPTION_BYTES (40)
+
+#define TCP_MAXIMUM_SEGMENT_SIZE (1460) // The Ethernet MTU, minus the IP and TCP headers.
+#define TCP_DEFAULT_SEGMENT_SIZE (536) // Assumed if the server doesn't send the option.
+#define TCP_MAXIMUM_WINDOW_SCALE (14)
+#define TCP_MAXIMUM_SACK_BLOCKS (4)
+#define TCP_SCOREBOARD_SIZE (8)
+#define TCP_DUPLICATE_ACK_THRESHOLD (3)
+
+#define TCP_INITIAL_RTO_MS (1000)
+#define TCP_MINIMUM_RTO_MS (200)
+#define TCP_MAXIMUM_RTO_MS (60000)
+#define TCP_MAXIMUM_RETRANSMISSIONS (12)
+#define TCP_DELAYED_ACK_MS (40)
+#define TCP_TIMER_TICK_MS (10)
+
 struct TCPReceivedData {
 	uint16_t flags;
 	uint16_t segmentLength;
@@ -220,6 +239,14 @@ struct TCPReceivedData {
 	const IPHeader *ip;
 	const TCPHeader *tcp;
 	const void *segment;
+
+	// Options:
+	uint16_t maximumSegmentSize; // 0 if the option was not present.
+	uint8_t windowScale;
+	bool hasWindowScale, hasTimestamp, sackPermitted;
+	uint32_t timestampValue, timestampEcho;
+	uint8_t sackBlockCount;
+	uint32_t sackBlocks[TCP_MAXIMUM_SACK_BLOCKS][2];
 };
 
 // NOTE Keep these in order!
@@ -264,19 +291,12 @@ struct TCPReceivedData {
 	tcpReply->sourcePort = data->tcp->destinationPort; \
 	tcpReply->destinationPort = data->tcp->sourcePort;
 
-#define TCP_PREPARE_REPLY_2(_data1, _data1Bytes, _data2, _data2Bytes, _flags, _headerDWORDs) \
-	TCP_PREPARE_REPLY(_data1, _data1Bytes, _data2, _data2Bytes); \
-	tcpReply->flags = SwapBigEndian16((_flags) | ((_headerDWORDs) << 12 /* header is 5 DWORDs */)); \
-	tcpReply->sequenceNumber = SwapBigEndian32(task->sendNext); \
-	tcpReply->ackNumber = SwapBigEndian32(task->receiveNext); \
-	tcpReply->window = SwapBigEndian16(task->receiveWindow); \
-
 #define TCP_MAKE_STANDARD_REPLY(_flags) \
 	{ \
-		EsBuffer buffer = NetTransmitBufferGet(); \
-		if (buffer.error) { NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES); return; } \
-		TCP_PREPARE_REPLY_2(nullptr, 0, nullptr, 0, _flags, 5); \
-		if (!NetTransmit(interface, &buffer, NET_PACKET_ETHERNET)) NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES); \
+		if (!NetTCPTransmit(connection, _flags, task->sendNext, 0)) { \
+			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES); \
+			return; \
+		} \
 	}
 
 struct DHCPHeader {
@@ -354,9 +374,12 @@ struct ARPHeader {
 #define ARP_REQUEST (1)
 #define ARP_REPLY (2)
 
+#define ARP_TABLE_MAXIMUM_ENTRIES (64) // When the table is full, the least recently used entry is replaced.
+
 struct ARPEntry {
 	KIPAddress ip;
 	KMACAddress mac;
+	uint64_t lastUsedMs; // Stored atomically by lookups, which only have shared access to the table.
 };
 
 struct ARPRequest {
@@ -408,22 +431,67 @@ struct Networking {
 	uintptr_t tcpTasks[MAX_TCP_TASKS]; // If (1 << 0) set, task is in use.
 	uint16_t tcpTaskLRU, tcpTaskMRU;
 	KMutex tcpTaskListMutex;
+	KEvent tcpTimerEvent; // Set when a TCP connection arms a timer.
+
+#define TCP_CONNECTION_HASH_BITS (8)
+	struct NetConnection *tcpConnections[1 << TCP_CONNECTION_HASH_BITS]; // Hashed by the remote address and port, and the local port.
+	KWriterLock tcpConnectionsLock;
 
 	KMutex echoRequestTaskMutex;
 	NetTask *echoRequestTask;
 
+#define DNS_CACHE_ENTRIES (32)
+#define DNS_CACHE_MAXIMUM_TTL_MS (60 * 60 * 1000)
+	struct NetDomainNameCacheEntry *dnsCache;
+	KMutex dnsCacheMutex;
+
 	KMutex transmitBufferPoolMutex;
 	Arena transmitBufferPool;
+	struct NetTransmitBufferCache *transmitBufferCaches; // One per processor.
+	size_t transmitBufferCacheCount;
+
+	struct NetLoopbackInterface *loopback;
+};
+
+#define TRANSMIT_BUFFER_CACHE_SIZE (32)
+#define TRANSMIT_BUFFER_CACHE_BATCH (16) // The number of buffers moved between a cache and the pool at once.
+
+struct NetTransmitBufferCache {
+	// The spinlock is only contended if a thread is moved to another processor while it's using the cache.
+	KSpinlock spinlock;
+	uintptr_t count;
+	void *buffers[TRANSMIT_BUFFER_CACHE_SIZE];
+};
+
+struct NetLoopbackPacket {
+	void *data;
+	size_t bytes;
+};
+
+struct NetLoopbackInterface : NetInterface {
+	// Transmitted packets are queued and then received by a separate thread,
+	// so that a task never receives a packet while it's still sending one.
+	KMutex queueMutex;
+	KEvent queueEvent;
+	Array<NetLoopbackPacket, K_FIXED> queue;
 };
 
 struct NetDomainNameResolveTask : NetTask {
 	const char *name;
 	size_t nameBytes;
 	EsAddress *address;
+	uint32_t timeToLive; // In seconds, from the answer.
 	uint16_t identifier;
 	KEvent *event;
 };
 
+struct NetDomainNameCacheEntry {
+	char name[ES_DOMAIN_NAME_MAX_LENGTH];
+	uint8_t nameBytes;
+	uint32_t ipv4;
+	uint64_t expiresMs, lastUsedMs; // expiresMs is 0 if the entry is unused.
+};
+
 struct NetEchoRequestTask : NetTask {
 	uint8_t *data;
 	EsAddress *address;
@@ -433,9 +501,10 @@ struct NetEchoRequestTask : NetTask {
 struct NetTCPConnectionTask : NetTask {
 	uint32_t sendUnacknowledged; // Points at the end of the data the server has acknowledged receiving from us.
 	uint32_t sendNext; // Points at the end of data we've sent.
+	uint32_t sendMaximum; // Points at the end of the furthest data we've sent. sendNext is moved back from here after a timeout.
 	uint32_t sendWindow; // The maximum distance sendNext can be past sendUnacknowledged.
 	uint32_t receiveNext; // Points at the end of data we've acknowledged receiving from the server.
-	uint16_t receiveWindow; // The maximum distance the server can sent data past receiveNext.
+	uint32_t receiveWindow; // The maximum distance the server can sent data past receiveNext.
 
 	uint32_t initialSend, initialReceive;
 	uint32_t finSequence;
@@ -443,6 +512,46 @@ struct NetTCPConnectionTask : NetTask {
 	uint32_t sendWL2;
 
 	KMACAddress destinationMAC;
+	bool listening; // Waiting for a client's SYN, rather than sending our own.
+
+	// Negotiated options:
+	uint16_t sendMaximumSegmentSize; // The most data the server will accept in a segment. Our options take space from this.
+	uint8_t sendWindowScale, receiveWindowScale;
+	bool windowScaleEnabled, timestampsEnabled, sackEnabled; // Offered in our SYN, then cleared if the server doesn't agree.
+	uint32_t timestampRecent; // The last timestamp from the server that we'll echo back.
+	uint32_t lastACKSent;
+	uint32_t recentOutOfOrderSequence; // Reported in the first SACK block.
+
+	// Delayed ACKs:
+	uint8_t segmentsSinceACK;
+	uint32_t advertisedWindow;
+	uint64_t delayedACKTimeMs; // 0 if there's no ACK pending.
+
+	// Retransmission timer (RFC 6298):
+	bool rttMeasured, rttTiming;
+	uint32_t rttSequence;
+	uint64_t rttStartMs;
+	uint32_t smoothedRTT, rttVariance, retransmissionTimeout;
+	uint8_t retransmissions;
+	uint64_t retransmitTimeMs; // 0 if no data is outstanding.
+
+	// Persist timer (RFC 9293 3.8.6.1): while the server's window is closed, retransmitTimeMs instead times the next window probe.
+	// Probes are not retransmissions; they back off separately, and never abort the connection or reduce the congestion window.
+	bool persisting;
+	uint8_t persistProbes;
+
+	// Loss recovery (RFC 6675 when SACK is enabled, otherwise RFC 6582).
+	uint8_t duplicateACKs;
+	bool inRecovery;
+	uint32_t recoveryPoint;
+	uint32_t retransmitNext;
+	uint8_t scoreboardCount;
+	struct { uint32_t from, to; } scoreboard[TCP_SCOREBOARD_SIZE]; // Ranges the server has SACKed, sorted.
+
+	// Congestion control (CUBIC, RFC 9438):
+	uint32_t congestionWindow, slowStartThreshold;
+	uint32_t cubicMaximumWindow, cubicOrigin, cubicRenoWindow;
+	uint64_t cubicEpochStartMs, cubicK;
 };
 
 struct NetConnection {
@@ -454,7 +563,7 @@ struct NetConnection {
 	size_t sendBufferBytes;
 	size_t receiveBufferBytes;
 
-	uintptr_t sendReadPointer; // The end of the data that we've sent to the server (possibly unacknolwedged).
+	uintptr_t sendReadPointer; // The end of the data that the server has acknowledged. Data after this is kept for retransmission.
 	uintptr_t sendWritePointer; // The end of the data that the application has written for us to send.
 	uintptr_t receiveWritePointer; // The end of the data that we've received from the server with no missing segments.
 	uintptr_t receiveReadPointer; // The end of the data that the user has processed from the receive buffer.
@@ -464,14 +573,27 @@ struct NetConnection {
 	EsAddress address;
 	KMutex mutex;
 
-	volatile uintptr_t handles;
+	// The entry in networking.tcpConnections. The remote address and port are 0 while listening.
+	// Only modified with tcpConnectionsLock taken exclusively.
+	NetConnection *hashNext;
+	uint32_t hashRemoteAddress;
+	uint16_t hashRemotePort, hashLocalPort;
+	bool hashed;
+
+#define NET_CONNECTION_APPLICATION_HANDLE (1 << 0) // Handle flag.
+	volatile uintptr_t handles; // All references. The connection is destroyed when these reach zero.
+	volatile uintptr_t applicationHandles; // References with NET_CONNECTION_APPLICATION_HANDLE. The connection is closed when these reach zero.
 };
 
 void NetDomainNameResolve(NetTask *_task, void *data);
+bool NetDomainNameCacheLookup(const char *name, size_t nameBytes, EsAddress *address);
 void NetEchoRequest(NetTask *_task, void *data);
 void NetTCPConnection(NetTask *_task, void *data);
 void NetAddressSetup(NetTask *_task, void *data);
 
+bool NetTCPTransmit(NetConnection *connection, uint16_t flags, uint32_t sequenceNumber, size_t dataBytes);
+NetConnection *NetTCPConnectionFind(uint32_t remoteAddress, uint16_t remotePort, uint16_t localPort);
+
 NetConnection *NetConnectionOpen(EsAddress *address, size_t sendBufferBytes, size_t receiveBufferBytes, uint32_t flags);
 void NetConnectionClose(NetConnection *connection);
 void NetConnectionNotify(NetConnection *connection, uintptr_t sendWritePointer, uintptr_t receiveReadPointer);
@@ -496,25 +618,91 @@ void NetPrintPacket(const char *cName, const void *packet, size_t bytes) {
 	EsPrint("\n");
 }
 
-EsBuffer NetTransmitBufferGet() {
+NetTransmitBufferCache *NetTransmitBufferCacheGet() {
+	uint64_t processor = KCPUCurrentID();
+	return processor < networking.transmitBufferCacheCount ? &networking.transmitBufferCaches[processor] : nullptr;
+}
+
+void NetTransmitBufferPoolFree(void **buffers, size_t count) {
 	KMutexAcquire(&networking.transmitBufferPoolMutex);
+
+	for (uintptr_t i = 0; i < count; i++) {
+		ArenaFree(&networking.transmitBufferPool, buffers[i]);
+	}
+
+	KMutexRelease(&networking.transmitBufferPoolMutex);
+}
+
+EsBuffer NetTransmitBufferGet() {
 	EsBuffer buffer = {};
-	buffer.out = (uint8_t *) ArenaAllocate(&networking.transmitBufferPool, false);
 	buffer.bytes = networking.transmitBufferPool.slotSize;
+	NetTransmitBufferCache *cache = NetTransmitBufferCacheGet();
+
+	if (cache) {
+		KSpinlockAcquire(&cache->spinlock);
+		if (cache->count) buffer.out = (uint8_t *) cache->buffers[--cache->count];
+		KSpinlockRelease(&cache->spinlock);
+
+		if (buffer.out) {
+			return buffer;
+		}
+	}
+
+	// The cache is empty, so take a batch of buffers from the pool.
+
+	void *batch[TRANSMIT_BUFFER_CACHE_BATCH];
+	size_t batchCount = 0;
+	KMutexAcquire(&networking.transmitBufferPoolMutex);
+
+	while (batchCount < (cache ? TRANSMIT_BUFFER_CACHE_BATCH : 1)) {
+		void *data = ArenaAllocate(&networking.transmitBufferPool, false);
+		if (!data) break;
+		batch[batchCount++] = data;
+	}
+
+	KMutexRelease(&networking.transmitBufferPoolMutex);
 
-	if (!buffer.out) {
+	if (!batchCount) {
 		buffer.error = true, buffer.bytes = 0;
 		KernelLog(LOG_ERROR, "Networking", "out of memory", "Could not allocate a transmit buffer.\n");
+		return buffer;
+	}
+
+	buffer.out = (uint8_t *) batch[--batchCount];
+
+	if (batchCount) {
+		// Put the rest in the cache. If we moved processor and the cache filled up, return the extra to the pool.
+		KSpinlockAcquire(&cache->spinlock);
+		while (batchCount && cache->count < TRANSMIT_BUFFER_CACHE_SIZE) cache->buffers[cache->count++] = batch[--batchCount];
+		KSpinlockRelease(&cache->spinlock);
+		if (batchCount) NetTransmitBufferPoolFree(batch, batchCount);
 	}
 
-	KMutexRelease(&networking.transmitBufferPoolMutex);
 	return buffer;
 }
 
 void NetTransmitBufferReturn(void *data) {
-	KMutexAcquire(&networking.transmitBufferPoolMutex);
-	ArenaFree(&networking.transmitBufferPool, data);
-	KMutexRelease(&networking.transmitBufferPoolMutex);
+	NetTransmitBufferCache *cache = NetTransmitBufferCacheGet();
+
+	if (!cache) {
+		NetTransmitBufferPoolFree(&data, 1);
+		return;
+	}
+
+	// If the cache is full, move a batch of buffers back to the pool.
+	void *batch[TRANSMIT_BUFFER_CACHE_BATCH];
+	size_t batchCount = 0;
+
+	KSpinlockAcquire(&cache->spinlock);
+
+	if (cache->count == TRANSMIT_BUFFER_CACHE_SIZE) {
+		while (batchCount < TRANSMIT_BUFFER_CACHE_BATCH) batch[batchCount++] = cache->buffers[--cache->count];
+	}
+
+	cache->buffers[cache->count++] = data;
+	KSpinlockRelease(&cache->spinlock);
+
+	if (batchCount) NetTransmitBufferPoolFree(batch, batchCount);
 }
 
 bool NetTransmit(NetInterface *interface, EsBuffer *buffer, NetPacketType packetType) {
@@ -529,7 +717,7 @@ bool NetTransmit(NetInterface *interface, EsBuffer *buffer, NetPacketType packet
 
 		EthernetHeader *ethernet = (EthernetHeader *) buffer->out;
 
-		if (ethernet->type == SwapBigEndian16(ETHERNET_TYPE_IPV4)) {
+		if (ethernet->type == SwapBigEndian16(ETHERNET_TYPE_IPV4) && !interface->loopback) {
 			IPHeader *ip = (IPHeader *) (ethernet + 1);
 
 			if (ip->protocol == IP_PROTOCOL_UDP) {
@@ -566,6 +754,7 @@ bool NetARPLookup(NetTask *task, KIPAddress targetIP, KMACAddress *targetMAC) {
 	for (uintptr_t i = 0; i < interface->arpTable.Length(); i++) {
 		if (0 == EsMemoryCompare(&interface->arpTable[i].ip, &targetIP, sizeof(KIPAddress))) {
 			*targetMAC = interface->arpTable[i].mac;
+			__atomic_store_n(&interface->arpTable[i].lastUsedMs, KGetTimeInMs(), __ATOMIC_RELAXED);
 			KWriterLockReturn(&interface->arpTableLock, K_LOCK_SHARED);
 			return true;
 		}
@@ -670,8 +859,19 @@ void NetARPReceive(NetInterface *interface, EsBuffer *buffer) {
 			ARPEntry entry = {};
 			entry.ip = *senderIP;
 			entry.mac = *senderMAC;
-			
-			if (!interface->arpTable.Add(entry)) {
+			entry.lastUsedMs = KGetTimeInMs();
+
+			if (interface->arpTable.Length() >= ARP_TABLE_MAXIMUM_ENTRIES) {
+				uintptr_t leastRecentlyUsed = 0;
+
+				for (uintptr_t i = 1; i < interface->arpTable.Length(); i++) {
+					if (interface->arpTable[i].lastUsedMs < interface->arpTable[leastRecentlyUsed].lastUsedMs) {
+						leastRecentlyUsed = i;
+					}
+				}
+
+				interface->arpTable[leastRecentlyUsed] = entry;
+			} else if (!interface->arpTable.Add(entry)) {
 				KernelLog(LOG_ERROR, "Networking", "allocation error", "Could not add entry to ARP table.\n");
 			}
 
@@ -730,7 +930,7 @@ void NetICMPReceive(NetInterface *interface, EsBuffer *buffer, const IPHeader *i
 		return;
 	}
 
-	if (icmp->checksum != icmp->CalculateChecksum(buffer->bytes - buffer->position)) {
+	if (!interface->loopback && icmp->checksum != icmp->CalculateChecksum(buffer->bytes - buffer->position)) {
 		KernelLog(LOG_ERROR, "Networking", "bad packet", "Incorrect ICMP checksum.\n");
 		return;
 	}
@@ -765,6 +965,58 @@ void NetICMPReceive(NetInterface *interface, EsBuffer *buffer, const IPHeader *i
 	}
 }
 
+uint32_t NetReadBigEndian32(const uint8_t *in) {
+	return ((uint32_t) in[0] << 24) | ((uint32_t) in[1] << 16) | ((uint32_t) in[2] << 8) | ((uint32_t) in[3] << 0);
+}
+
+void NetWriteBigEndian32(uint8_t *out, uint32_t value) {
+	out[0] = value >> 24, out[1] = value >> 16, out[2] = value >> 8, out[3] = value >> 0;
+}
+
+void NetTCPParseOptions(TCPReceivedData *data, const uint8_t *options, size_t optionsBytes) {
+	uintptr_t position = 0;
+
+	while (position < optionsBytes) {
+		uint8_t kind = options[position];
+
+		if (kind == TCP_OPTION_END) {
+			break;
+		} else if (kind == TCP_OPTION_NOP) {
+			position++;
+			continue;
+		}
+
+		if (position + 2 > optionsBytes || options[position + 1] < 2 || position + options[position + 1] > optionsBytes) {
+			KernelLog(LOG_ERROR, "Networking", "bad packet", "Malformed TCP option %d.\n", kind);
+			break;
+		}
+
+		uint8_t length = options[position + 1];
+		const uint8_t *option = options + position + 2;
+
+		if (kind == TCP_OPTION_MAXIMUM_SEGMENT_SIZE && length == 4) {
+			data->maximumSegmentSize = ((uint16_t) option[0] << 8) | option[1];
+		} else if (kind == TCP_OPTION_WINDOW_SCALE && length == 3) {
+			data->hasWindowScale = true;
+			data->windowScale = MinimumInteger(option[0], TCP_MAXIMUM_WINDOW_SCALE);
+		} else if (kind == TCP_OPTION_SACK_PERMITTED && length == 2) {
+			data->sackPermitted = true;
+		} else if (kind == TCP_OPTION_TIMESTAMP && length == 10) {
+			data->hasTimestamp = true;
+			data->timestampValue = NetReadBigEndian32(option + 0);
+			data->timestampEcho = NetReadBigEndian32(option + 4);
+		} else if (kind == TCP_OPTION_SACK && length >= 10 && (length - 2) % 8 == 0) {
+			for (uintptr_t i = 0; i < (length - 2) / 8u && data->sackBlockCount < TCP_MAXIMUM_SACK_BLOCKS; i++) {
+				data->sackBlocks[data->sackBlockCount][0] = NetReadBigEndian32(option + i * 8 + 0);
+				data->sackBlocks[data->sackBlockCount][1] = NetReadBigEndian32(option + i * 8 + 4);
+				data->sackBlockCount++;
+			}
+		}
+
+		position += length;
+	}
+}
+
 void NetTCPReceive(NetInterface *interface, EsBuffer *buffer, const IPHeader *ip, const EthernetHeader *ethernet) {
 	// Validate the TCP header.
 
@@ -784,30 +1036,25 @@ void NetTCPReceive(NetInterface *interface, EsBuffer *buffer, const IPHeader *ip
 		return;
 	}
 
-	if (tcp->CalculateChecksum(buffer->bytes - tcpPosition) != tcp->checksum) {
+	if (!interface->loopback && tcp->CalculateChecksum(buffer->bytes - tcpPosition) != tcp->checksum) {
 		KernelLog(LOG_ERROR, "Networking", "bad packet", "TCP header has incorrect checksum.\n");
 		return;
 	}
 
-	if (!buffer->Read((headerDWORDs - 5) * sizeof(uint32_t))) {
+	size_t optionsBytes = (headerDWORDs - 5) * sizeof(uint32_t);
+	const uint8_t *options = (const uint8_t *) buffer->Read(optionsBytes);
+
+	if (!options) {
 		KernelLog(LOG_ERROR, "Networking", "bad packet", "TCP header is shorter than expected.\n");
 		return;
 	}
 
 	uint32_t segmentLength = buffer->bytes - buffer->position;
 
-	// If a task exists at the destination port, send it the segment.
-	// TODO Locking on getting the task.
+	// If there's a connection for the segment, send it the segment.
 
-	NetTCPConnectionTask *task = nullptr;
-	uint16_t destinationPort = SwapBigEndian16(tcp->destinationPort);
-
-	if (destinationPort >= TCP_PORT_BASE 
-			&& destinationPort < TCP_PORT_BASE + MAX_TCP_TASKS
-			&& (networking.tcpTasks[destinationPort - TCP_PORT_BASE] & 1)) {
-		task = (NetTCPConnectionTask *) (networking.tcpTasks[destinationPort - TCP_PORT_BASE] & ~1);
-		OpenHandleToObject(task, KERNEL_OBJECT_CONNECTION);
-	}
+	NetConnection *connection = NetTCPConnectionFind(*(const uint32_t *) &ip->sourceAddress, 
+			SwapBigEndian16(tcp->sourcePort), SwapBigEndian16(tcp->destinationPort));
 
 	TCPReceivedData _data = {};
 	_data.ethernet = ethernet;
@@ -818,11 +1065,12 @@ void NetTCPReceive(NetInterface *interface, EsBuffer *buffer, const IPHeader *ip
 	_data.segment = buffer->Read(segmentLength);
 	_data.sequenceNumber = SwapBigEndian32(tcp->sequenceNumber);
 	_data.ackNumber = SwapBigEndian32(tcp->ackNumber);
+	NetTCPParseOptions(&_data, options, optionsBytes);
 	TCPReceivedData *data = &_data;
 
-	if (task) {
-		task->callback(task, data);
-		CloseHandleToObject(task, KERNEL_OBJECT_CONNECTION);
+	if (connection) {
+		connection->task.callback(&connection->task, data);
+		CloseHandleToObject(connection, KERNEL_OBJECT_CONNECTION);
 		return;
 	}
 
@@ -840,13 +1088,11 @@ void NetTCPReceive(NetInterface *interface, EsBuffer *buffer, const IPHeader *ip
 
 		tcpReply->sourcePort = tcp->destinationPort;
 		tcpReply->destinationPort = tcp->sourcePort;
-		tcpReply->flags = SwapBigEndian16(TCP_RST | ~(flags & TCP_ACK) | (5 << 12 /* header is 5 DWORDs */));
+		tcpReply->flags = SwapBigEndian16(TCP_RST | (~flags & TCP_ACK) | (5 << 12 /* header is 5 DWORDs */));
 		tcpReply->sequenceNumber = (flags & TCP_ACK) ? tcp->ackNumber : 0;
-		tcpReply->ackNumber = (flags & TCP_ACK) ? 0 : SwapBigEndian32(SwapBigEndian32(tcp->sequenceNumber) + segmentLength);
-
-		if (!NetTransmit(interface, &buffer, NET_PACKET_ETHERNET)) {
-			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
-		}
+		tcpReply->ackNumber = (flags & TCP_ACK) ? 0 : SwapBigEndian32(SwapBigEndian32(tcp->sequenceNumber) + segmentLength
+				+ ((flags & TCP_SYN) ? 1 : 0) + ((flags & TCP_FIN) ? 1 : 0));
+		NetTransmit(interface, &buffer, NET_PACKET_ETHERNET); // Don't care about errors.
 	}
 }
 
@@ -868,7 +1114,7 @@ void NetUDPReceive(NetInterface *interface, EsBuffer *buffer) {
 		return;
 	}
 
-	if (udp->CalculateChecksum() != udp->checksum) { // NOTE Don't compute the checksum until the length field has been validated!
+	if (!interface->loopback && udp->CalculateChecksum() != udp->checksum) { // NOTE Don't compute the checksum until the length field has been validated!
 		KernelLog(LOG_ERROR, "Networking", "bad packet", "Incorrect checksum in UDP header.\n");
 		return;
 	}
@@ -921,14 +1167,15 @@ void NetIPReceive(NetInterface *interface, EsBuffer *buffer, const EthernetHeade
 		return;
 	}
 
-	if (interface->hasIP && EsMemoryCompare(&interface->ipAddress, &ip->destinationAddress, 4) 
-			&& EsMemoryCompare(&broadcastIP, &ip->destinationAddress, 4)) {
+	if (interface->loopback ? ip->destinationAddress.d[0] != 127 /* the loopback interface owns 127.0.0.0/8 */
+			: (interface->hasIP && EsMemoryCompare(&interface->ipAddress, &ip->destinationAddress, 4) 
+				&& EsMemoryCompare(&broadcastIP, &ip->destinationAddress, 4))) {
 		KernelLog(LOG_ERROR, "Networking", "ignored packet", "Destination IP address mismatch (%d.%d.%d.%d).\n", 
 				ip->destinationAddress.d[0], ip->destinationAddress.d[1], ip->destinationAddress.d[2], ip->destinationAddress.d[3]);
 		return;
 	}
 
-	if (ip->CalculateHeaderChecksum() != ip->headerChecksum) {
+	if (!interface->loopback && ip->CalculateHeaderChecksum() != ip->headerChecksum) {
 		KernelLog(LOG_ERROR, "Networking", "bad packet", "Incorrect checksum in IP header.\n");
 		return;
 	}
@@ -1058,6 +1305,73 @@ void NetInterfaceSetConnected(NetInterface *interface, bool connected) {
 	}
 }
 
+bool NetDomainNameCacheMatch(NetDomainNameCacheEntry *entry, const char *name, size_t nameBytes) {
+	if (entry->nameBytes != nameBytes) {
+		return false;
+	}
+
+	for (uintptr_t i = 0; i < nameBytes; i++) {
+		if (EsCRTtolower(entry->name[i]) != EsCRTtolower(name[i])) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool NetDomainNameCacheLookup(const char *name, size_t nameBytes, EsAddress *address) {
+	if (!networking.dnsCache) return false;
+	bool found = false;
+	uint64_t timeMs = KGetTimeInMs();
+	KMutexAcquire(&networking.dnsCacheMutex);
+
+	for (uintptr_t i = 0; i < DNS_CACHE_ENTRIES; i++) {
+		NetDomainNameCacheEntry *entry = &networking.dnsCache[i];
+
+		if (entry->expiresMs > timeMs && NetDomainNameCacheMatch(entry, name, nameBytes)) {
+			address->ipv4 = entry->ipv4;
+			entry->lastUsedMs = timeMs;
+			found = true;
+			break;
+		}
+	}
+
+	KMutexRelease(&networking.dnsCacheMutex);
+	return found;
+}
+
+void NetDomainNameCacheInsert(const char *name, size_t nameBytes, uint32_t ipv4, uint32_t timeToLive) {
+	if (!networking.dnsCache || !timeToLive || nameBytes > ES_DOMAIN_NAME_MAX_LENGTH) return;
+	uint64_t timeMs = KGetTimeInMs();
+	KMutexAcquire(&networking.dnsCacheMutex);
+
+	// Replace the existing entry for the name, or an expired entry, or the least recently used entry.
+
+	NetDomainNameCacheEntry *replace = &networking.dnsCache[0];
+
+	for (uintptr_t i = 0; i < DNS_CACHE_ENTRIES; i++) {
+		NetDomainNameCacheEntry *entry = &networking.dnsCache[i];
+
+		if (entry->expiresMs && NetDomainNameCacheMatch(entry, name, nameBytes)) {
+			replace = entry;
+			break;
+		} else if (entry->expiresMs <= timeMs) {
+			if (replace->expiresMs > timeMs) replace = entry;
+		} else if (replace->expiresMs > timeMs && entry->lastUsedMs < replace->lastUsedMs) {
+			replace = entry;
+		}
+	}
+
+	uint64_t timeToLiveMs = (uint64_t) timeToLive * 1000;
+	EsMemoryCopy(replace->name, name, nameBytes);
+	replace->nameBytes = nameBytes;
+	replace->ipv4 = ipv4;
+	replace->lastUsedMs = timeMs;
+	replace->expiresMs = timeMs + (timeToLiveMs < DNS_CACHE_MAXIMUM_TTL_MS ? timeToLiveMs : DNS_CACHE_MAXIMUM_TTL_MS);
+
+	KMutexRelease(&networking.dnsCacheMutex);
+}
+
 void NetDomainNameResolve(NetTask *_task, void *_buffer) {
 	EsBuffer *buffer = (EsBuffer *) _buffer;
 	NetDomainNameResolveTask *task = (NetDomainNameResolveTask *) _task;
@@ -1233,6 +1547,7 @@ void NetDomainNameResolve(NetTask *_task, void *_buffer) {
 				}
 
 				EsMemoryCopy(&task->address->ipv4, data, 4);
+				task->timeToLive = SwapBigEndian32(*timeToLive);
 				foundAddress = true;
 				break;
 			}
@@ -1246,6 +1561,8 @@ void NetDomainNameResolve(NetTask *_task, void *_buffer) {
 		if (!foundAddress) {
 			KernelLog(LOG_ERROR, "Networking", "bad packet", "Could not find IP address in DNS packet.\n");
 			error = ES_ERROR_UNKNOWN;
+		} else if (error == ES_SUCCESS) {
+			NetDomainNameCacheInsert(task->name, task->nameBytes, task->address->ipv4, task->timeToLive);
 		}
 
 		NetTaskComplete(task, error);
@@ -1336,11 +1653,7 @@ void NetEchoRequest(NetTask *_task, void *_buffer) {
 }
 
 bool NetTCPIsBetween(uint32_t low, uint32_t value, uint32_t high) {
-	if (low <= high) {
-		return low <= value && value <= high;
-	} else {
-		return high <= value && value <= low;
-	}
+	return value - low <= high - low; // Sequence numbers wrap around.
 }
 
 bool NetTCPIsLessThan(uint32_t left, uint32_t right) {
@@ -1393,210 +1706,851 @@ bool NetTCPAllocateTaskIndex(NetTask *task) {
 	return true;
 }
 
-bool NetConnectionTransmitData(NetConnection *connection) {
-	// TODO Send segments as a NetTask, so that they can be retransmitted.
+uintptr_t NetTCPConnectionHash(uint32_t remoteAddress, uint16_t remotePort, uint16_t localPort) {
+	uint32_t hash = (remoteAddress ^ ((uint32_t) remotePort << 16) ^ localPort) * 0x9E3779B1;
+	return hash >> (32 - TCP_CONNECTION_HASH_BITS);
+}
 
-	NetTCPConnectionTask *task = &connection->task;
-	NetInterface *interface = task->interface;
-	KWriterLockAssertShared(&interface->connectionLock);
+void NetTCPConnectionRemove(NetConnection *connection) {
+	KWriterLockTake(&networking.tcpConnectionsLock, K_LOCK_EXCLUSIVE);
 
-	bool sent = false;
+	if (connection->hashed) {
+		uintptr_t bucket = NetTCPConnectionHash(connection->hashRemoteAddress, connection->hashRemotePort, connection->hashLocalPort);
+		NetConnection **link = &networking.tcpConnections[bucket];
+		while (*link != connection) link = &(*link)->hashNext;
+		*link = connection->hashNext;
+		connection->hashNext = nullptr;
+		connection->hashed = false;
+	}
 
-	while (connection->sendReadPointer != connection->sendWritePointer) {
-		uintptr_t bytesAvailable = connection->sendWritePointer - connection->sendReadPointer;
+	KWriterLockReturn(&networking.tcpConnectionsLock, K_LOCK_EXCLUSIVE);
+}
 
-		if (connection->sendReadPointer > connection->sendWritePointer) {
-			bytesAvailable += connection->sendBufferBytes;
-		}
+void NetTCPConnectionInsert(NetConnection *connection) {
+	// (Re)insert the connection under its current address, once it has a port.
 
-		uintptr_t maximumBytesPerSegment = 1000; // TODO Parse the maximum segment size option.
-		uintptr_t bytesToSendInSegment = MinimumInteger(maximumBytesPerSegment, bytesAvailable);
+	NetTCPConnectionRemove(connection);
+	KWriterLockTake(&networking.tcpConnectionsLock, K_LOCK_EXCLUSIVE);
 
-		const void *data1 = connection->sendBuffer + connection->sendReadPointer;
-		const void *data2 = connection->sendBuffer;
-		size_t dataBytes1 = bytesToSendInSegment;
-		size_t dataBytes2 = 0;
+	bool listening = connection->task.listening;
+	connection->hashRemoteAddress = listening ? 0 : connection->address.ipv4;
+	connection->hashRemotePort = listening ? 0 : connection->address.port;
+	connection->hashLocalPort = connection->task.index + TCP_PORT_BASE;
 
-		if (connection->sendReadPointer + bytesToSendInSegment > connection->sendBufferBytes) {
-			dataBytes1 = connection->sendBufferBytes - connection->sendReadPointer;
-			dataBytes2 = bytesToSendInSegment - dataBytes1;
-		}
+	uintptr_t bucket = NetTCPConnectionHash(connection->hashRemoteAddress, connection->hashRemotePort, connection->hashLocalPort);
+	connection->hashNext = networking.tcpConnections[bucket];
+	networking.tcpConnections[bucket] = connection;
+	connection->hashed = true;
 
-		EsBuffer buffer = NetTransmitBufferGet();
+	KWriterLockReturn(&networking.tcpConnectionsLock, K_LOCK_EXCLUSIVE);
+}
 
-		if (buffer.error) { 
-			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES); 
-			return true;
+NetConnection *NetTCPConnectionFind(uint32_t remoteAddress, uint16_t remotePort, uint16_t localPort) {
+	// Find the connection a segment belongs to, and open a handle to it.
+	// The task keeps a handle to the connection while it's in the table, so we can open our own while holding the lock.
+
+	NetConnection *connection = nullptr;
+	KWriterLockTake(&networking.tcpConnectionsLock, K_LOCK_SHARED);
+
+	for (uintptr_t listening = 0; listening < 2 && !connection; listening++) {
+		// If there's no connection to the remote port, look for one listening on the local port.
+		if (listening) remoteAddress = remotePort = 0;
+		connection = networking.tcpConnections[NetTCPConnectionHash(remoteAddress, remotePort, localPort)];
+
+		while (connection && (connection->hashRemoteAddress != remoteAddress 
+					|| connection->hashRemotePort != remotePort || connection->hashLocalPort != localPort)) {
+			connection = connection->hashNext;
 		}
+	}
 
-		EthernetHeader *ethernet = (EthernetHeader *) buffer.Write(nullptr, sizeof(EthernetHeader));
-		ETHERNET_HEADER(ethernet, ETHERNET_TYPE_IPV4, task->destinationMAC);
-		IPHeader *ip = (IPHeader *) buffer.Write(nullptr, sizeof(IPHeader));
-		IP_HEADER(ip, *(KIPAddress *) &connection->address.ipv4, IP_PROTOCOL_TCP);
-		TCPHeader *tcp = (TCPHeader *) buffer.Write(nullptr, sizeof(TCPHeader));
-		buffer.Write(data1, dataBytes1);
-		buffer.Write(data2, dataBytes2);
-	
-		if (buffer.error) {
-			KernelPanic("NetConnectionTransmitData - Network interface buffer size too small.\n");
+	if (connection) OpenHandleToObject(connection, KERNEL_OBJECT_CONNECTION);
+	KWriterLockReturn(&networking.tcpConnectionsLock, K_LOCK_SHARED);
+	return connection;
+}
+
+size_t NetConnectionQueuedBytes(NetConnection *connection) {
+	// The data in the send buffer that the server hasn't acknowledged yet, whether or not we've sent it.
+	return (connection->sendWritePointer + connection->sendBufferBytes - connection->sendReadPointer) % connection->sendBufferBytes;
+}
+
+uint64_t NetTCPPersistTimeout(NetTCPConnectionTask *task) {
+	uint64_t timeout = (uint64_t) task->retransmissionTimeout << (task->persistProbes < 16 ? task->persistProbes : 16);
+	return timeout > TCP_MAXIMUM_RTO_MS ? TCP_MAXIMUM_RTO_MS : timeout;
+}
+
+void NetTCPTimerArm(uint64_t *timeMs, uint64_t delayMs) {
+	*timeMs = KGetTimeInMs() + delayMs;
+	KEventSet(&networking.tcpTimerEvent, true /* maybe already set */);
+}
+
+size_t NetTCPWriteOptions(NetConnection *connection, uint16_t flags, uint8_t *options) {
+	NetTCPConnectionTask *task = &connection->task;
+	size_t position = 0;
+
+	if (flags & TCP_SYN) {
+		options[position++] = TCP_OPTION_MAXIMUM_SEGMENT_SIZE;
+		options[position++] = 4;
+		options[position++] = TCP_MAXIMUM_SEGMENT_SIZE >> 8;
+		options[position++] = TCP_MAXIMUM_SEGMENT_SIZE & 0xFF;
+
+		if (task->windowScaleEnabled) {
+			options[position++] = TCP_OPTION_NOP;
+			options[position++] = TCP_OPTION_WINDOW_SCALE;
+			options[position++] = 3;
+			options[position++] = task->receiveWindowScale;
 		}
-	
-		ip->totalLength = ByteSwap16(buffer.position - sizeof(*ethernet));
-		ip->flagsAndFragmentOffset = SwapBigEndian16(1 << 14 /* do not fragment */);
-		ip->headerChecksum = ip->CalculateHeaderChecksum();
-	
-		tcp->sourcePort = SwapBigEndian16(task->index + TCP_PORT_BASE);
-		tcp->destinationPort = SwapBigEndian16(connection->address.port);
-		tcp->flags = SwapBigEndian16(TCP_ACK | (5 << 12 /* header is 5 DWORDs */));
-		tcp->sequenceNumber = SwapBigEndian32(task->sendNext);
-		tcp->ackNumber = SwapBigEndian32(task->receiveNext);
-		tcp->window = SwapBigEndian16(task->receiveWindow);
 
-		if (!NetTransmit(interface, &buffer, NET_PACKET_ETHERNET)) {
-			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
-			return true;
+		if (task->sackEnabled) {
+			options[position++] = TCP_OPTION_NOP;
+			options[position++] = TCP_OPTION_NOP;
+			options[position++] = TCP_OPTION_SACK_PERMITTED;
+			options[position++] = 2;
 		}
+	}
 
-		sent = true;
-		connection->sendReadPointer = (connection->sendReadPointer + bytesToSendInSegment) % connection->sendBufferBytes;
-		task->sendNext += bytesToSendInSegment;
+	if (task->timestampsEnabled) {
+		options[position++] = TCP_OPTION_NOP;
+		options[position++] = TCP_OPTION_NOP;
+		options[position++] = TCP_OPTION_TIMESTAMP;
+		options[position++] = 10;
+		NetWriteBigEndian32(options + position, (uint32_t) KGetTimeInMs()), position += 4;
+		NetWriteBigEndian32(options + position, (flags & TCP_ACK) ? task->timestampRecent : 0), position += 4;
 	}
 
-	return sent;
-}
+	Array<Range, K_CORE> *ranges = &connection->receivedData.ranges;
 
-bool NetConnectionUpdateReceiveWindow(NetConnection *connection) {
-	NetTCPConnectionTask *task = &connection->task;
-	uint16_t oldReceiveWindow = task->receiveWindow;
+	if (task->sackEnabled && (flags & TCP_ACK) && (~flags & TCP_SYN) && ranges->Length()) {
+		// Report the out-of-order data we're holding, starting with the block containing the most recent segment (RFC 2018).
 
-	if (connection->receiveReadPointer == connection->receiveWritePointer) {
-		task->receiveWindow = MinimumInteger(0xF000, connection->receiveBufferBytes - 1);
-	} else if (connection->receiveReadPointer < connection->receiveWritePointer) {
-		task->receiveWindow = MinimumInteger(0xF000, connection->receiveReadPointer - connection->receiveWritePointer + connection->receiveBufferBytes);
-	} else {
-		task->receiveWindow = MinimumInteger(0xF000, connection->receiveReadPointer - connection->receiveWritePointer);
+		size_t blockCount = (TCP_MAXIMUM_OPTION_BYTES - position - 4) / 8;
+		if (blockCount > ranges->Length()) blockCount = ranges->Length();
+		Range *first = connection->receivedData.Find(task->recentOutOfOrderSequence - task->receiveNext, false);
+		if (!first) first = &(*ranges)[0];
+
+		options[position++] = TCP_OPTION_NOP;
+		options[position++] = TCP_OPTION_NOP;
+		options[position++] = TCP_OPTION_SACK;
+		options[position++] = 2 + 8 * blockCount;
+
+		NetWriteBigEndian32(options + position, task->receiveNext + first->from), position += 4;
+		NetWriteBigEndian32(options + position, task->receiveNext + first->to), position += 4;
+
+		for (uintptr_t i = 0, written = 1; written < blockCount; i++) {
+			Range *range = &(*ranges)[i];
+			if (range == first) continue;
+			NetWriteBigEndian32(options + position, task->receiveNext + range->from), position += 4;
+			NetWriteBigEndian32(options + position, task->receiveNext + range->to), position += 4;
+			written++;
+		}
 	}
 
-	EsPrint("ORW: %d; RW: %d; RRP: %d; RWP: %d; RBB: %d\n", oldReceiveWindow, task->receiveWindow, 
-			connection->receiveReadPointer, connection->receiveWritePointer, connection->receiveBufferBytes);
+	return position;
+}
 
-	return oldReceiveWindow != task->receiveWindow;
+size_t NetTCPSegmentPayloadMaximum(NetConnection *connection) {
+	// The maximum segment size doesn't include the options, so they take space away from the data (RFC 6691).
+	uint8_t options[TCP_MAXIMUM_OPTION_BYTES];
+	return connection->task.sendMaximumSegmentSize - NetTCPWriteOptions(connection, TCP_ACK, options);
 }
 
-void NetConnectionNotify(NetConnection *connection, uintptr_t sendWritePointer, uintptr_t receiveReadPointer) {
+bool NetTCPTransmit(NetConnection *connection, uint16_t flags, uint32_t sequenceNumber, size_t dataBytes) {
+	// Sends a segment with the options negotiated for the connection. 
+	// The data is taken from the send buffer, at the position corresponding to the sequence number.
+
 	NetTCPConnectionTask *task = &connection->task;
 	NetInterface *interface = task->interface;
-	KWriterLockTake(&interface->connectionLock, K_LOCK_SHARED);
-	KMutexAcquire(&connection->mutex);
+	KWriterLockAssertShared(&interface->connectionLock);
 
-	connection->sendWritePointer = sendWritePointer % connection->sendBufferBytes;
-	connection->receiveReadPointer = receiveReadPointer % connection->receiveBufferBytes;
+	EsBuffer buffer = NetTransmitBufferGet();
+
+	if (buffer.error) {
+		return false;
+	}
 
-	bool receiveWindowModified = NetConnectionUpdateReceiveWindow(connection);
+	uint8_t options[TCP_MAXIMUM_OPTION_BYTES];
+	size_t optionsBytes = NetTCPWriteOptions(connection, flags, options);
 
-	if (task->step == TCP_STEP_ESTABLISHED
-			&& !NetConnectionTransmitData(connection)
-			&& receiveWindowModified) {
-		// ACK the new window size.
+	EthernetHeader *ethernet = (EthernetHeader *) buffer.Write(nullptr, sizeof(EthernetHeader));
+	ETHERNET_HEADER(ethernet, ETHERNET_TYPE_IPV4, task->destinationMAC);
+	IPHeader *ip = (IPHeader *) buffer.Write(nullptr, sizeof(IPHeader));
+	IP_HEADER(ip, *(KIPAddress *) &connection->address.ipv4, IP_PROTOCOL_TCP);
+	TCPHeader *tcp = (TCPHeader *) buffer.Write(nullptr, sizeof(TCPHeader));
+	buffer.Write(options, optionsBytes);
 
-		EsBuffer buffer = NetTransmitBufferGet();
+	if (dataBytes) {
+		uintptr_t offset = (connection->sendReadPointer + (sequenceNumber - task->sendUnacknowledged)) % connection->sendBufferBytes;
+		size_t dataBytes1 = connection->sendBufferBytes - offset;
+		if (dataBytes1 > dataBytes) dataBytes1 = dataBytes;
+		buffer.Write(connection->sendBuffer + offset, dataBytes1);
+		buffer.Write(connection->sendBuffer, dataBytes - dataBytes1);
+	}
 
-		if (buffer.error) { 
-			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES); 
-		} else {
-			EthernetHeader *ethernet = (EthernetHeader *) buffer.Write(nullptr, sizeof(EthernetHeader));
-			ETHERNET_HEADER(ethernet, ETHERNET_TYPE_IPV4, task->destinationMAC);
-			IPHeader *ip = (IPHeader *) buffer.Write(nullptr, sizeof(IPHeader));
-			IP_HEADER(ip, *(KIPAddress *) &connection->address.ipv4, IP_PROTOCOL_TCP);
-			TCPHeader *tcp = (TCPHeader *) buffer.Write(nullptr, sizeof(TCPHeader));
-
-			if (buffer.error) {
-				KernelPanic("NetConnectionNotify - Network interface buffer size too small.\n");
-			}
+	if (buffer.error) {
+		KernelPanic("NetTCPTransmit - Network interface buffer size too small.\n");
+	}
 
-			ip->totalLength = ByteSwap16(buffer.position - sizeof(*ethernet));
-			ip->flagsAndFragmentOffset = SwapBigEndian16(1 << 14 /* do not fragment */);
-			ip->headerChecksum = ip->CalculateHeaderChecksum();
+	ip->totalLength = ByteSwap16(buffer.position - sizeof(*ethernet));
+	ip->flagsAndFragmentOffset = SwapBigEndian16(1 << 14 /* do not fragment */);
 
-			tcp->sourcePort = SwapBigEndian16(task->index + TCP_PORT_BASE);
-			tcp->destinationPort = SwapBigEndian16(connection->address.port);
-			tcp->flags = SwapBigEndian16(TCP_ACK | (5 << 12 /* header is 5 DWORDs */));
-			tcp->sequenceNumber = SwapBigEndian32(task->sendNext);
-			tcp->ackNumber = SwapBigEndian32(task->receiveNext);
-			tcp->window = SwapBigEndian16(task->receiveWindow);
+	// The window in a SYN segment is never scaled.
+	uint32_t window = (flags & TCP_SYN) ? (task->receiveWindow > 0xFFFF ? 0xFFFF : task->receiveWindow) 
+		: (task->receiveWindow >> task->receiveWindowScale);
 
-			if (!NetTransmit(interface, &buffer, NET_PACKET_ETHERNET)) {
-				NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
-			}
+	tcp->sourcePort = SwapBigEndian16(task->index + TCP_PORT_BASE);
+	tcp->destinationPort = SwapBigEndian16(connection->address.port);
+	tcp->flags = SwapBigEndian16(flags | ((5 + optionsBytes / 4) << 12 /* header DWORDs */));
+	tcp->sequenceNumber = SwapBigEndian32(sequenceNumber);
+	tcp->ackNumber = (flags & TCP_ACK) ? SwapBigEndian32(task->receiveNext) : 0;
+	tcp->window = SwapBigEndian16(window);
+
+	uint32_t end = sequenceNumber + dataBytes + ((flags & (TCP_SYN | TCP_FIN)) ? 1 : 0);
+
+	if ((~flags & TCP_RST) && NetTCPIsLessThan(task->sendMaximum, end)) {
+		task->sendMaximum = end;
+	}
+
+	if (flags & TCP_ACK) {
+		// Every segment we send carries the ACK, so there's no need to send a separate one.
+		task->lastACKSent = task->receiveNext;
+		task->advertisedWindow = (flags & TCP_SYN) ? window : (window << task->receiveWindowScale);
+		task->segmentsSinceACK = 0;
+		task->delayedACKTimeMs = 0;
+	}
+
+	return NetTransmit(interface, &buffer, NET_PACKET_ETHERNET);
+}
+
+void NetTCPUpdateRTT(NetTCPConnectionTask *task, uint32_t rtt) {
+	// Update the retransmission timeout from a RTT measurement (RFC 6298).
+
+	if (rtt > TCP_MAXIMUM_RTO_MS) {
+		return; // The server echoed a bad timestamp.
+	}
+
+	if (!task->rttMeasured) {
+		task->rttMeasured = true;
+		task->smoothedRTT = rtt;
+		task->rttVariance = rtt / 2;
+	} else {
+		uint32_t difference = task->smoothedRTT > rtt ? task->smoothedRTT - rtt : rtt - task->smoothedRTT;
+		task->rttVariance = (3 * task->rttVariance + difference) / 4;
+		task->smoothedRTT = (7 * task->smoothedRTT + rtt) / 8;
+	}
+
+	uint32_t timeout = task->smoothedRTT + MaximumInteger(TCP_TIMER_TICK_MS, 4 * task->rttVariance);
+	task->retransmissionTimeout = ClampInteger(TCP_MINIMUM_RTO_MS, TCP_MAXIMUM_RTO_MS, timeout); // Both terms are at most TCP_MAXIMUM_RTO_MS.
+}
+
+uint64_t NetTCPCubeRoot(uint64_t x) {
+	uint64_t y = 0;
+
+	for (int shift = 63; shift >= 0; shift -= 3) {
+		y += y;
+		uint64_t b = 3 * y * (y + 1) + 1;
+
+		if ((x >> shift) >= b) {
+			x -= b << shift;
+			y++;
 		}
 	}
 
-	KMutexRelease(&connection->mutex);
-	KWriterLockReturn(&interface->connectionLock, K_LOCK_SHARED);
+	return y;
 }
 
-void NetTCPConnection(NetTask *_task, void *_data) {
-	TCPReceivedData *data = (TCPReceivedData *) _data;
-	NetTCPConnectionTask *task = (NetTCPConnectionTask *) _task;
-	NetInterface *interface = task->interface;
-	NetConnection *connection = EsContainerOf(NetConnection, task, task);
+void NetTCPCongestionInitialise(NetTCPConnectionTask *task) {
+	uint32_t mss = task->sendMaximumSegmentSize;
+	task->congestionWindow = MinimumInteger(10 * mss, MaximumInteger(2 * mss, 14600)); // RFC 6928.
+	task->slowStartThreshold = 0xFFFFFFFF;
+	task->cubicMaximumWindow = 0;
+	task->cubicEpochStartMs = 0;
+}
 
-	if (task->completed) {
-		NetTCPFreeTaskIndex(task->index);
-		CloseHandleToObject(connection, KERNEL_OBJECT_CONNECTION);
+void NetTCPCongestionOnACK(NetTCPConnectionTask *task, uint32_t bytesAcknowledged) {
+	uint32_t mss = task->sendMaximumSegmentSize;
+
+	if (task->congestionWindow < task->slowStartThreshold) {
+		// Slow start, with appropriate byte counting (RFC 3465).
+		task->congestionWindow += bytesAcknowledged < mss ? bytesAcknowledged : mss;
 		return;
 	}
 
-	KMutexAcquire(&connection->mutex);
-	EsDefer(KMutexRelease(&connection->mutex));
+	// Congestion avoidance follows the CUBIC function W(t) = C * (t - K)^3 + W_max, with C = 0.4 and beta = 0.7.
+	// Times are in milliseconds, and windows are in bytes.
 
-	if (task->step == 0) {
-		if (!NetARPLookup(task, interface->routerIP, &task->destinationMAC)) {
-			return;
-		}
+	uint64_t timeMs = KGetTimeInMs();
 
-		if (!NetTCPAllocateTaskIndex(task)) {
-			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
-			return;
+	if (!task->cubicEpochStartMs) {
+		task->cubicEpochStartMs = timeMs;
+		task->cubicRenoWindow = task->congestionWindow;
+
+		if (task->congestionWindow < task->cubicMaximumWindow) {
+			// K = cbrt((W_max - cwnd) / C).
+			task->cubicK = NetTCPCubeRoot((uint64_t) (task->cubicMaximumWindow - task->congestionWindow) * 2500000000 / mss);
+			task->cubicOrigin = task->cubicMaximumWindow;
+		} else {
+			task->cubicK = 0;
+			task->cubicOrigin = task->congestionWindow;
 		}
+	}
 
-		EsBuffer buffer = NetTransmitBufferGet();
+	int64_t t = (int64_t) (timeMs - task->cubicEpochStartMs + task->smoothedRTT) - (int64_t) task->cubicK;
+	t = ClampIntptr(-65535, 65535, t); // Prevent overflow below.
+	int64_t target = (int64_t) task->cubicOrigin + 4 * t * t * t * mss / 10000000000;
 
-		if (buffer.error) {
-			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
-			return;
-		}
+	// In the Reno-friendly region, grow by alpha = 3 * (1 - beta) / (1 + beta) segments per RTT.
+	task->cubicRenoWindow += (uint64_t) 9 * mss * bytesAcknowledged / (17 * (uint64_t) task->congestionWindow);
+	if (target < task->cubicRenoWindow) target = task->cubicRenoWindow;
 
-		task->initialSend = (uint32_t) EsRandomU64() & 0x0FFFFFFF;
-		task->sendUnacknowledged = task->initialSend;
-		task->sendNext = task->initialSend + 1;
-		task->step = TCP_STEP_SYN_SENT;
+	if (target > (int64_t) task->congestionWindow * 3 / 2) target = (int64_t) task->congestionWindow * 3 / 2;
+	if (target <= task->congestionWindow) return;
 
-		EthernetHeader *ethernet = (EthernetHeader *) buffer.Write(nullptr, sizeof(EthernetHeader)); 
-		ETHERNET_HEADER(ethernet, ETHERNET_TYPE_IPV4, task->destinationMAC); 
-		IPHeader *ip = (IPHeader *) buffer.Write(nullptr, sizeof(IPHeader)); 
-		KIPAddress destinationIP = {};
-		EsMemoryCopy(&destinationIP, &connection->address.ipv4, sizeof(KIPAddress));
-		IP_HEADER(ip, destinationIP, IP_PROTOCOL_TCP);
-		TCPHeader *tcp = (TCPHeader *) buffer.Write(nullptr, sizeof(TCPHeader));
+	uint64_t increase = (uint64_t) (target - task->congestionWindow) * bytesAcknowledged / task->congestionWindow;
+	task->congestionWindow = increase > 0x40000000 - task->congestionWindow ? 0x40000000 : task->congestionWindow + increase;
+}
 
-		if (buffer.error) {
-			KernelPanic("NetTCPConnection - Network interface buffer size too small.\n");
-		}
+void NetTCPCongestionOnLoss(NetTCPConnectionTask *task, bool timeout) {
+	uint32_t mss = task->sendMaximumSegmentSize;
+	uint32_t window = task->congestionWindow;
 
-		ip->totalLength = ByteSwap16(buffer.position - sizeof(*ethernet)); 
-		ip->flagsAndFragmentOffset = SwapBigEndian16(1 << 14 /* do not fragment */); 
+	// Fast convergence: if the window didn't reach the previous maximum, leave some bandwidth for newer flows.
+	task->cubicMaximumWindow = window < task->cubicMaximumWindow ? (uint64_t) window * 17 / 20 : window;
+	task->cubicEpochStartMs = 0;
+	task->slowStartThreshold = (uint64_t) window * 7 / 10 > 2 * mss ? (uint64_t) window * 7 / 10 : 2 * mss;
+	task->congestionWindow = timeout ? mss : task->slowStartThreshold;
+}
 
-		tcp->window = SwapBigEndian16(task->receiveWindow);
-		tcp->flags = SwapBigEndian16(TCP_SYN | (5 << 12 /* header is 5 DWORDs */));
-		tcp->sourcePort = SwapBigEndian16(task->index + TCP_PORT_BASE);
-		tcp->destinationPort = SwapBigEndian16(connection->address.port);
-		tcp->sequenceNumber = SwapBigEndian32(task->initialSend);
+uint32_t NetTCPScoreboardBytes(NetTCPConnectionTask *task, uint32_t from, uint32_t to) {
+	// Count the bytes between from and to that the server has SACKed.
+	// The ranges are compared relative to sendUnacknowledged, so that wrapping sequence numbers are ordered correctly.
 
-		if (!NetTransmit(interface, &buffer, NET_PACKET_ETHERNET)) {
-			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
+	uint32_t base = task->sendUnacknowledged, bytes = 0;
+
+	for (uintptr_t i = 0; i < task->scoreboardCount; i++) {
+		uint32_t start = task->scoreboard[i].from - base, end = task->scoreboard[i].to - base;
+		if (start < from - base) start = from - base;
+		if (end > to - base) end = to - base;
+		if (start < end) bytes += end - start;
+	}
+
+	return bytes;
+}
+
+void NetTCPScoreboardUpdate(NetTCPConnectionTask *task, const TCPReceivedData *data) {
+	// Merge the segment's SACK blocks into the scoreboard, and remove the ranges that have been cumulatively acknowledged.
+
+	uint32_t base = task->sendUnacknowledged;
+	uint32_t ranges[TCP_SCOREBOARD_SIZE + TCP_MAXIMUM_SACK_BLOCKS][2];
+	uintptr_t count = 0;
+
+	for (uintptr_t i = 0; i < (uintptr_t) task->scoreboardCount + data->sackBlockCount; i++) {
+		bool old = i < task->scoreboardCount;
+		uint32_t from = old ? task->scoreboard[i].from : data->sackBlocks[i - task->scoreboardCount][0];
+		uint32_t to = old ? task->scoreboard[i].to : data->sackBlocks[i - task->scoreboardCount][1];
+
+		if (!NetTCPIsLessThan(base, to) || NetTCPIsLessThan(task->sendMaximum, to) || !NetTCPIsLessThan(from, to)) {
+			continue; // The range has been acknowledged, or is invalid.
 		}
-	} else if (task->step == TCP_STEP_SYN_SENT) {
+
+		from = NetTCPIsLessThan(from, base) ? 0 : from - base;
+		to -= base;
+
+		uintptr_t j = count++;
+
+		for (; j && ranges[j - 1][0] > from; j--) {
+			ranges[j][0] = ranges[j - 1][0];
+			ranges[j][1] = ranges[j - 1][1];
+		}
+
+		ranges[j][0] = from, ranges[j][1] = to;
+	}
+
+	task->scoreboardCount = 0;
+
+	for (uintptr_t i = 0; i < count; i++) {
+		if (task->scoreboardCount && ranges[i][0] <= task->scoreboard[task->scoreboardCount - 1].to - base) {
+			uint32_t *to = &task->scoreboard[task->scoreboardCount - 1].to;
+			if (*to - base < ranges[i][1]) *to = ranges[i][1] + base;
+		} else if (task->scoreboardCount < TCP_SCOREBOARD_SIZE) {
+			task->scoreboard[task->scoreboardCount].from = ranges[i][0] + base;
+			task->scoreboard[task->scoreboardCount].to = ranges[i][1] + base;
+			task->scoreboardCount++;
+		}
+	}
+}
+
+uint32_t NetTCPBytesInFlight(NetTCPConnectionTask *task) {
+	// Estimate how much data is still in the network (the "pipe" of RFC 6675).
+	// SACKed data has left the network, and during recovery, holes below the highest SACK that we haven't retransmitted yet are presumed lost.
+
+	uint32_t outstanding = task->sendNext - task->sendUnacknowledged;
+	uint32_t sacked = NetTCPScoreboardBytes(task, task->sendUnacknowledged, task->sendNext);
+	uint32_t lost = 0;
+
+	if (task->inRecovery && task->scoreboardCount) {
+		uint32_t from = NetTCPIsLessThan(task->retransmitNext, task->sendUnacknowledged) ? task->sendUnacknowledged : task->retransmitNext;
+		uint32_t to = task->scoreboard[task->scoreboardCount - 1].to;
+		if (NetTCPIsLessThan(task->sendNext, to)) to = task->sendNext;
+		if (NetTCPIsLessThan(from, to)) lost = to - from - NetTCPScoreboardBytes(task, from, to);
+	}
+
+	return outstanding > sacked + lost ? outstanding - sacked - lost : 0;
+}
+
+bool NetTCPRetransmitLost(NetConnection *connection) {
+	// Retransmit the segments presumed lost during fast recovery. 
+	// With SACK, these are the holes below the highest SACKed data; otherwise, it's the segment at sendUnacknowledged (RFC 6582).
+	// Returns false if a segment couldn't be sent.
+
+	NetTCPConnectionTask *task = &connection->task;
+	size_t payloadMaximum = NetTCPSegmentPayloadMaximum(connection);
+	uint32_t dataEnd = task->sendUnacknowledged + NetConnectionQueuedBytes(connection);
+	uint32_t limit = task->scoreboardCount ? task->scoreboard[task->scoreboardCount - 1].to : task->sendUnacknowledged + payloadMaximum;
+	if (NetTCPIsLessThan(dataEnd, limit)) limit = dataEnd;
+	if (NetTCPIsLessThan(task->sendNext, limit)) limit = task->sendNext;
+
+	while (true) {
+		uint32_t sequence = NetTCPIsLessThan(task->retransmitNext, task->sendUnacknowledged) ? task->sendUnacknowledged : task->retransmitNext;
+		uint32_t holeEnd = limit;
+
+		for (uintptr_t i = 0; i < task->scoreboardCount; i++) {
+			if (NetTCPIsLessThanOrEqual(task->scoreboard[i].to, sequence)) {
+				continue;
+			} else if (NetTCPIsLessThanOrEqual(task->scoreboard[i].from, sequence)) {
+				sequence = task->scoreboard[i].to;
+			} else {
+				if (NetTCPIsLessThan(task->scoreboard[i].from, holeEnd)) holeEnd = task->scoreboard[i].from;
+				break;
+			}
+		}
+
+		if (!NetTCPIsLessThan(sequence, holeEnd)) {
+			break;
+		}
+
+		// The first hole is always retransmitted, so that recovery makes progress when the window is full.
+		if (sequence != task->sendUnacknowledged && NetTCPBytesInFlight(task) >= task->congestionWindow) {
+			break;
+		}
+
+		size_t bytes = holeEnd - sequence < payloadMaximum ? holeEnd - sequence : payloadMaximum;
+
+		if (!NetTCPTransmit(connection, TCP_ACK, sequence, bytes)) {
+			return false;
+		}
+
+		task->retransmitNext = sequence + bytes;
+		task->rttTiming = false;
+	}
+
+	return true;
+}
+
+bool NetConnectionTransmitData(NetConnection *connection) {
+	// Send as much new data as the server's window and the congestion window allow, followed by the FIN once it's queued.
+	// Returns true if anything was sent, or if the task was completed with an error.
+
+	NetTCPConnectionTask *task = &connection->task;
+	NetInterface *interface = task->interface;
+	KWriterLockAssertShared(&interface->connectionLock);
+
+	if (task->sendUnacknowledged == task->initialSend) {
+		return false; // Our SYN hasn't been acknowledged yet.
+	}
+
+	bool sent = false;
+	size_t payloadMaximum = NetTCPSegmentPayloadMaximum(connection);
+	size_t queuedBytes = NetConnectionQueuedBytes(connection);
+
+	while (true) {
+		uint32_t outstanding = task->sendNext - task->sendUnacknowledged;
+
+		if (outstanding >= queuedBytes) {
+			break;
+		}
+
+		size_t unsentBytes = queuedBytes - outstanding;
+		int64_t usable = (int64_t) task->sendWindow - outstanding;
+		int64_t congestionUsable = (int64_t) task->congestionWindow - NetTCPBytesInFlight(task);
+		if (usable > congestionUsable) usable = congestionUsable;
+		size_t bytes = unsentBytes < payloadMaximum ? unsentBytes : payloadMaximum;
+
+		if (usable <= 0) {
+			break;
+		} else if ((int64_t) bytes > usable) {
+			// Avoid sending small segments into a small window (RFC 1122).
+			if (outstanding && usable < task->sendWindow / 2) break;
+			bytes = usable;
+		}
+
+		bool newData = task->sendNext == task->sendMaximum;
+
+		if (!NetTCPTransmit(connection, TCP_ACK | (bytes == unsentBytes ? TCP_PSH : 0), task->sendNext, bytes)) {
+			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
+			return true;
+		}
+
+		if (newData && !task->rttTiming && !task->timestampsEnabled) {
+			task->rttTiming = true;
+			task->rttSequence = task->sendNext + bytes;
+			task->rttStartMs = KGetTimeInMs();
+		}
+
+		task->sendNext += bytes;
+		sent = true;
+	}
+
+	if ((task->step == TCP_STEP_FIN_WAIT_1 || task->step == TCP_STEP_CLOSING || task->step == TCP_STEP_LAST_ACK) 
+			&& task->sendNext == task->finSequence) {
+		if (!NetTCPTransmit(connection, TCP_FIN | TCP_ACK, task->finSequence, 0)) {
+			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
+			return true;
+		}
+
+		task->sendNext++;
+		sent = true;
+	}
+
+	if (!task->retransmitTimeMs && (task->sendUnacknowledged != task->sendMaximum || task->sendNext - task->sendUnacknowledged < queuedBytes)) {
+		// Start the retransmission timer, or if the server's window is closed, the persist timer.
+		NetTCPTimerArm(&task->retransmitTimeMs, task->persisting ? NetTCPPersistTimeout(task) : task->retransmissionTimeout);
+	}
+
+	return sent;
+}
+
+bool NetConnectionUpdateReceiveWindow(NetConnection *connection) {
+	// Returns true if the window has opened enough since it was last advertised that the server should be told.
+
+	NetTCPConnectionTask *task = &connection->task;
+	size_t window;
+
+	// One byte of the ring buffer is always kept free, so that a full buffer can be told apart from an empty one.
+
+	if (connection->receiveReadPointer <= connection->receiveWritePointer) {
+		window = connection->receiveReadPointer - connection->receiveWritePointer + connection->receiveBufferBytes - 1;
+	} else {
+		window = connection->receiveReadPointer - connection->receiveWritePointer - 1;
+	}
+
+	size_t maximumWindow = (size_t) 0xFFFF << task->receiveWindowScale;
+	task->receiveWindow = window > maximumWindow ? maximumWindow : window;
+
+	// Only advertise an increase of at least two segments or half the buffer, to avoid silly window syndrome (RFC 1122).
+	size_t threshold = connection->receiveBufferBytes / 2 < 2 * TCP_MAXIMUM_SEGMENT_SIZE ? connection->receiveBufferBytes / 2 : 2 * TCP_MAXIMUM_SEGMENT_SIZE;
+	return task->receiveWindow >= task->advertisedWindow + threshold;
+}
+
+void NetConnectionNotify(NetConnection *connection, uintptr_t sendWritePointer, uintptr_t receiveReadPointer) {
+	NetTCPConnectionTask *task = &connection->task;
+	NetInterface *interface = task->interface;
+	KWriterLockTake(&interface->connectionLock, K_LOCK_SHARED);
+	KMutexAcquire(&connection->mutex);
+
+	connection->sendWritePointer = sendWritePointer % connection->sendBufferBytes;
+	connection->receiveReadPointer = receiveReadPointer % connection->receiveBufferBytes;
+
+	bool receiveWindowOpened = NetConnectionUpdateReceiveWindow(connection);
+
+	if ((task->step == TCP_STEP_ESTABLISHED || task->step == TCP_STEP_CLOSE_WAIT)
+			&& !NetConnectionTransmitData(connection)
+			&& receiveWindowOpened) {
+		// ACK the new window size.
+
+		if (!NetTCPTransmit(connection, TCP_ACK, task->sendNext, 0)) {
+			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
+		}
+	}
+
+	KMutexRelease(&connection->mutex);
+	KWriterLockReturn(&interface->connectionLock, K_LOCK_SHARED);
+}
+
+void NetTCPNegotiateOptions(NetConnection *connection, TCPReceivedData *data) {
+	// Called when the server's SYN arrives. Options are only used if both sides offered them.
+
+	NetTCPConnectionTask *task = &connection->task;
+
+	task->sendMaximumSegmentSize = ClampInteger(TCP_MAXIMUM_OPTION_BYTES + 24, TCP_MAXIMUM_SEGMENT_SIZE, 
+			data->maximumSegmentSize ? data->maximumSegmentSize : TCP_DEFAULT_SEGMENT_SIZE);
+	task->windowScaleEnabled = task->windowScaleEnabled && data->hasWindowScale;
+	task->sendWindowScale = task->windowScaleEnabled ? data->windowScale : 0;
+	if (!task->windowScaleEnabled) task->receiveWindowScale = 0;
+	task->timestampsEnabled = task->timestampsEnabled && data->hasTimestamp;
+	task->timestampRecent = data->timestampValue;
+	task->sackEnabled = task->sackEnabled && data->sackPermitted;
+
+	NetTCPCongestionInitialise(task);
+	NetConnectionUpdateReceiveWindow(connection);
+}
+
+bool NetTCPProcessACK(NetConnection *connection, TCPReceivedData *data) {
+	// Process the acknowledgement number, window and SACK blocks of a segment, and retransmit lost data during recovery.
+	// Returns false if the rest of the segment should be ignored.
+
+	NetTCPConnectionTask *task = &connection->task;
+	uint32_t window = (uint32_t) SwapBigEndian16(data->tcp->window) << task->sendWindowScale;
+
+	if (NetTCPIsLessThan(task->sendMaximum, data->ackNumber)) {
+		// The server acknowledged data we haven't sent.
+
+		if (!NetTCPTransmit(connection, TCP_ACK, task->sendNext, 0)) {
+			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
+		}
+
+		return false;
+	}
+
+	if (NetTCPIsLessThan(task->sendUnacknowledged, data->ackNumber)) {
+		uint32_t bytesAcknowledged = data->ackNumber - task->sendUnacknowledged;
+		uint32_t dataBytesAcknowledged = bytesAcknowledged - (task->sendUnacknowledged == task->initialSend ? 1 /* SYN */ : 0);
+		size_t queuedBytes = NetConnectionQueuedBytes(connection);
+		if (dataBytesAcknowledged > queuedBytes) dataBytesAcknowledged = queuedBytes /* FIN */;
+
+		connection->sendReadPointer = (connection->sendReadPointer + dataBytesAcknowledged) % connection->sendBufferBytes;
+		task->sendUnacknowledged = data->ackNumber;
+		task->duplicateACKs = 0;
+		task->retransmissions = 0;
+
+		if (NetTCPIsLessThan(task->sendNext, task->sendUnacknowledged)) {
+			task->sendNext = task->sendUnacknowledged; // After a timeout, the server may already have some of the data we're resending.
+		}
+
+		// Timestamps give a RTT measurement with every ACK. 
+		// Otherwise, one segment at a time is timed, ignoring retransmissions (Karn's algorithm).
+
+		if (task->timestampsEnabled && data->hasTimestamp && data->timestampEcho) {
+			NetTCPUpdateRTT(task, (uint32_t) KGetTimeInMs() - data->timestampEcho);
+		} else if (task->rttTiming && NetTCPIsLessThanOrEqual(task->rttSequence, data->ackNumber)) {
+			NetTCPUpdateRTT(task, KGetTimeInMs() - task->rttStartMs);
+		}
+
+		if (task->rttTiming && NetTCPIsLessThanOrEqual(task->rttSequence, data->ackNumber)) {
+			task->rttTiming = false;
+		}
+
+		if (task->sackEnabled) {
+			NetTCPScoreboardUpdate(task, data);
+		}
+
+		if (task->inRecovery && !NetTCPIsLessThan(task->sendUnacknowledged, task->recoveryPoint)) {
+			task->inRecovery = false;
+		} else if (!task->inRecovery) {
+			NetTCPCongestionOnACK(task, bytesAcknowledged);
+		}
+
+		if (task->sendUnacknowledged == task->sendMaximum) {
+			task->retransmitTimeMs = 0;
+		} else {
+			NetTCPTimerArm(&task->retransmitTimeMs, task->retransmissionTimeout);
+		}
+	} else {
+		if (task->sackEnabled) {
+			NetTCPScoreboardUpdate(task, data);
+		}
+
+		// ACKs of window probes are not duplicate ACKs.
+		if (data->ackNumber == task->sendUnacknowledged && !data->segmentLength && (~data->flags & (TCP_SYN | TCP_FIN))
+				&& task->sendUnacknowledged != task->sendMaximum && window == task->sendWindow && !task->persisting) {
+			task->duplicateACKs++;
+		}
+	}
+
+	// Don't update the window using old packets.
+	if (NetTCPIsLessThan(task->sendWL1, data->sequenceNumber) 
+			|| (task->sendWL1 == data->sequenceNumber && NetTCPIsLessThanOrEqual(task->sendWL2, data->ackNumber))) {
+		task->sendWindow = window;
+		task->sendWL1 = data->sequenceNumber;
+		task->sendWL2 = data->ackNumber;
+	}
+
+	if (task->persisting && task->sendWindow) {
+		// The window has opened. Anything past the first unacknowledged byte was dropped while it was closed, so resend from there.
+		task->persisting = false;
+		task->persistProbes = 0;
+		task->sendNext = task->sendUnacknowledged;
+		task->retransmitTimeMs = 0;
+	}
+
+	if (!task->inRecovery && task->sendUnacknowledged != task->sendMaximum
+			&& (task->duplicateACKs >= TCP_DUPLICATE_ACK_THRESHOLD 
+				|| (task->sackEnabled && NetTCPScoreboardBytes(task, task->sendUnacknowledged, task->sendMaximum) 
+					> (TCP_DUPLICATE_ACK_THRESHOLD - 1) * task->sendMaximumSegmentSize))) {
+		// Enter fast recovery.
+		task->inRecovery = true;
+		task->recoveryPoint = task->sendMaximum;
+		task->retransmitNext = task->sendUnacknowledged;
+		task->rttTiming = false;
+		NetTCPCongestionOnLoss(task, false);
+	}
+
+	if (task->inRecovery && !NetTCPRetransmitLost(connection)) {
+		NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
+		return false;
+	}
+
+	return true;
+}
+
+void NetTCPRetransmitTimeout(NetConnection *connection) {
+	NetTCPConnectionTask *task = &connection->task;
+	task->retransmitTimeMs = 0;
+	task->rttTiming = false; // Karn's algorithm.
+
+	if (task->step >= TCP_STEP_ESTABLISHED && !task->sendWindow && NetConnectionQueuedBytes(connection)) {
+		// The server's window is closed. Probe it with the first unacknowledged byte, in case we missed the window update.
+		// The server acknowledges probes even though it drops them, so they are not counted as retransmissions.
+
+		task->persisting = true;
+
+		if (!NetTCPTransmit(connection, TCP_ACK, task->sendUnacknowledged, 1)) {
+			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
+			return;
+		}
+
+		if (task->sendNext == task->sendUnacknowledged) {
+			task->sendNext++; // So that an ACK of the probe byte is accepted.
+		}
+
+		if (task->persistProbes != 0xFF) task->persistProbes++;
+		NetTCPTimerArm(&task->retransmitTimeMs, NetTCPPersistTimeout(task));
+		return;
+	}
+
+	if (task->sendUnacknowledged == task->sendMaximum) {
+		return;
+	}
+
+	// Back off the timer.
+	task->retransmissionTimeout = task->retransmissionTimeout * 2 > TCP_MAXIMUM_RTO_MS ? TCP_MAXIMUM_RTO_MS : task->retransmissionTimeout * 2;
+
+	if (++task->retransmissions > TCP_MAXIMUM_RETRANSMISSIONS) {
+		NetTaskComplete(task, ES_ERROR_TIMEOUT_REACHED);
+		return;
+	}
+
+	if (task->step == TCP_STEP_SYN_SENT || task->step == TCP_STEP_SYN_RECEIVED) {
+		uint16_t flags = task->step == TCP_STEP_SYN_SENT ? TCP_SYN : (TCP_SYN | TCP_ACK);
+
+		if (!NetTCPTransmit(connection, flags, task->initialSend, 0)) {
+			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
+			return;
+		}
+
+		NetTCPTimerArm(&task->retransmitTimeMs, task->retransmissionTimeout);
+		return;
+	}
+
+	// Drop to a single segment, forget the SACK information since the server is allowed to discard SACKed data,
+	// and go back to resend from the first unacknowledged byte (RFC 5681 and RFC 2018).
+
+	NetTCPCongestionOnLoss(task, true);
+	task->inRecovery = false;
+	task->duplicateACKs = 0;
+	task->scoreboardCount = 0;
+	task->sendNext = task->sendUnacknowledged;
+	NetConnectionTransmitData(connection);
+}
+
+void NetTCPConnection(NetTask *_task, void *_data) {
+	TCPReceivedData *data = (TCPReceivedData *) _data;
+	NetTCPConnectionTask *task = (NetTCPConnectionTask *) _task;
+	NetInterface *interface = task->interface;
+	NetConnection *connection = EsContainerOf(NetConnection, task, task);
+
+	if (task->completed) {
+		if (data) {
+			return; // The segment was looked up before the connection was removed from the table.
+		}
+
+		NetTCPConnectionRemove(connection);
+		NetTCPFreeTaskIndex(task->index);
+		CloseHandleToObject(connection, KERNEL_OBJECT_CONNECTION);
+		return;
+	}
+
+	KMutexAcquire(&connection->mutex);
+	EsDefer(KMutexRelease(&connection->mutex));
+
+	if (task->step == 0 && !data) {
+		if (interface->loopback || task->listening) {
+			// The destination MAC address is the interface's own, or it will be taken from the client's SYN.
+			task->destinationMAC = interface->macAddress;
+		} else if (!NetARPLookup(task, interface->routerIP, &task->destinationMAC)) {
+			return;
+		} else if (!connection->applicationHandles) {
+			NetTaskComplete(task, ES_SUCCESS); // The application closed the connection while we were waiting for the ARP reply.
+			return;
+		}
+
+		if (!NetTCPAllocateTaskIndex(task)) {
+			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
+			return;
+		}
+
+		NetTCPConnectionInsert(connection);
+
+		if (task->listening) {
+			return; // Wait for a SYN.
+		}
+
+		task->initialSend = (uint32_t) EsRandomU64() & 0x0FFFFFFF;
+		task->sendUnacknowledged = task->initialSend;
+		task->sendNext = task->initialSend + 1;
+		task->sendMaximum = task->initialSend;
+		task->step = TCP_STEP_SYN_SENT;
+
+		task->rttTiming = true;
+		task->rttSequence = task->sendNext;
+		task->rttStartMs = KGetTimeInMs();
+
+		if (!NetTCPTransmit(connection, TCP_SYN, task->initialSend, 0)) {
+			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
+			return;
+		}
+
+		NetTCPTimerArm(&task->retransmitTimeMs, task->retransmissionTimeout);
+	} else if (task->step == 0) {
+		if (!task->listening || (data->flags & TCP_RST)) {
+			return;
+		} else if (data->flags & TCP_ACK) {
+			EsBuffer buffer = NetTransmitBufferGet();
+			if (buffer.error) return;
+			TCP_PREPARE_REPLY(nullptr, 0, nullptr, 0);
+			tcpReply->flags = SwapBigEndian16(TCP_RST | (5 << 12 /* header is 5 DWORDs */));
+			tcpReply->sequenceNumber = data->tcp->ackNumber;
+			NetTransmit(interface, &buffer, NET_PACKET_ETHERNET); // Don't care about errors.
+		} else if (data->flags & TCP_SYN) {
+			// Accept the connection. From now on, the listening connection only exchanges segments with this client.
+
+			connection->address.ipv4 = *(uint32_t *) &data->ip->sourceAddress;
+			connection->address.port = SwapBigEndian16(data->tcp->sourcePort);
+			task->destinationMAC = data->ethernet->sourceMAC;
+			task->listening = false;
+			NetTCPConnectionInsert(connection);
+
+			task->initialReceive = data->sequenceNumber;
+			task->receiveNext = data->sequenceNumber + 1;
+			NetTCPNegotiateOptions(connection, data);
+
+			task->initialSend = (uint32_t) EsRandomU64() & 0x0FFFFFFF;
+			task->sendUnacknowledged = task->initialSend;
+			task->sendNext = task->initialSend + 1;
+			task->sendMaximum = task->initialSend;
+			task->sendWindow = SwapBigEndian16(data->tcp->window); // The window in a SYN segment is never scaled.
+			task->step = TCP_STEP_SYN_RECEIVED;
+
+			task->rttTiming = true;
+			task->rttSequence = task->sendNext;
+			task->rttStartMs = KGetTimeInMs();
+
+			if (!NetTCPTransmit(connection, TCP_SYN | TCP_ACK, task->initialSend, 0)) {
+				NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
+				return;
+			}
+
+			NetTCPTimerArm(&task->retransmitTimeMs, task->retransmissionTimeout);
+		}
+	} else if (task->step == TCP_STEP_SYN_SENT) {
 		if ((data->flags & TCP_ACK) && !NetTCPIsBetween(task->sendUnacknowledged, data->ackNumber, task->sendNext)) {
 			if (data->flags & TCP_RST) return;
 			EsBuffer buffer = NetTransmitBufferGet();
@@ -1610,18 +2564,44 @@ void NetTCPConnection(NetTask *_task, void *_data) {
 		} else if (data->flags & TCP_SYN) {
 			task->initialReceive = data->sequenceNumber;
 			task->receiveNext = data->sequenceNumber + 1;
+			NetTCPNegotiateOptions(connection, data);
 
 			if (data->flags & TCP_ACK) {
+				if (task->timestampsEnabled && data->timestampEcho) {
+					NetTCPUpdateRTT(task, (uint32_t) KGetTimeInMs() - data->timestampEcho);
+				} else if (task->rttTiming) {
+					NetTCPUpdateRTT(task, KGetTimeInMs() - task->rttStartMs);
+				}
+
 				task->sendUnacknowledged = data->ackNumber;
+				task->sendWindow = SwapBigEndian16(data->tcp->window); // The window in a SYN segment is never scaled.
+				task->sendWL1 = data->sequenceNumber;
+				task->sendWL2 = data->ackNumber;
+				task->rttTiming = false;
+				task->retransmitTimeMs = 0;
+				task->retransmissions = 0;
 				task->step = TCP_STEP_ESTABLISHED;
-				TCP_MAKE_STANDARD_REPLY(TCP_ACK);
-				NetConnectionTransmitData(connection);
+
+				if (!NetConnectionTransmitData(connection)) {
+					TCP_MAKE_STANDARD_REPLY(TCP_ACK);
+				}
 			} else {
 				task->step = TCP_STEP_SYN_RECEIVED;
-				TCP_MAKE_STANDARD_REPLY(TCP_SYN | TCP_ACK);
+
+				if (!NetTCPTransmit(connection, TCP_SYN | TCP_ACK, task->initialSend, 0)) {
+					NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
+				}
 			}
 		}
 	} else {
+		// Reject old duplicate segments using their timestamps (PAWS, RFC 7323).
+
+		if (task->timestampsEnabled && data->hasTimestamp && (~data->flags & TCP_RST)
+				&& NetTCPIsLessThan(data->timestampValue, task->timestampRecent)) {
+			TCP_MAKE_STANDARD_REPLY(TCP_ACK);
+			return;
+		}
+
 		bool acceptable = NetTCPIsBetween(task->receiveNext, data->sequenceNumber, task->receiveNext + task->receiveWindow - 1);
 
 		if (!data->segmentLength && !task->receiveWindow) {
@@ -1639,6 +2619,10 @@ void NetTCPConnection(NetTask *_task, void *_data) {
 			return;
 		}
 
+		if (task->timestampsEnabled && data->hasTimestamp && NetTCPIsLessThanOrEqual(data->sequenceNumber, task->lastACKSent)) {
+			task->timestampRecent = data->timestampValue;
+		}
+
 		{
 			// Truncate segments that are partially outside the window.
 			// TODO Test this!
@@ -1662,47 +2646,44 @@ void NetTCPConnection(NetTask *_task, void *_data) {
 			} else {
 				NetTaskComplete(task, ES_SUCCESS);
 			}
+
+			return;
 		} else if (data->flags & TCP_SYN) {
 			TCP_MAKE_STANDARD_REPLY(TCP_RST);
 			NetTaskComplete(task, ES_ERROR_CONNECTION_RESET);
+			return;
 		} else if (data->flags & TCP_ACK) {
 			if (task->step == TCP_STEP_SYN_RECEIVED) {
-				if (NetTCPIsBetween(task->sendUnacknowledged, data->ackNumber, task->sendNext)) {
+				if (NetTCPIsBetween(task->sendUnacknowledged + 1, data->ackNumber, task->sendNext)) {
+					if (task->timestampsEnabled && data->timestampEcho) {
+						NetTCPUpdateRTT(task, (uint32_t) KGetTimeInMs() - data->timestampEcho);
+					} else if (task->rttTiming) {
+						NetTCPUpdateRTT(task, KGetTimeInMs() - task->rttStartMs);
+					}
+
 					task->step = TCP_STEP_ESTABLISHED;
+					task->rttTiming = false;
 					task->sendUnacknowledged = data->ackNumber;
-					task->sendWindow = SwapBigEndian16(data->tcp->window);
-					TCP_MAKE_STANDARD_REPLY(TCP_ACK);
-					NetConnectionTransmitData(connection);
+					task->sendWindow = (uint32_t) SwapBigEndian16(data->tcp->window) << task->sendWindowScale;
+					task->sendWL1 = data->sequenceNumber;
+					task->sendWL2 = data->ackNumber;
+					task->retransmitTimeMs = 0;
+					task->retransmissions = 0;
 				} else {
 					task->sendNext = data->ackNumber;
 					task->receiveNext = 0;
 					TCP_MAKE_STANDARD_REPLY(TCP_RST);
 					return;
 				}
-			} else if (task->step == TCP_STEP_LAST_ACK) {
-				if (NetTCPIsLessThanOrEqual(task->finSequence, task->sendUnacknowledged)) {
-					NetTaskComplete(task, ES_SUCCESS);
-				}
 			} else {
-				if (NetTCPIsBetween(task->sendUnacknowledged + 1, data->ackNumber, task->sendNext)) {
-					task->sendUnacknowledged = data->ackNumber;
-
-					// Don't update the window using old packets.
-					if (NetTCPIsLessThan(task->sendWL1, data->sequenceNumber) 
-							|| (task->sendWL1 == data->sequenceNumber && NetTCPIsLessThanOrEqual(task->sendWL2, data->ackNumber))) {
-						task->sendWindow = SwapBigEndian16(data->tcp->window);
-						task->sendWL1 = data->sequenceNumber;
-						task->sendWL2 = data->ackNumber;
-					}
-				} else if (NetTCPIsLessThanOrEqual(data->ackNumber, task->sendUnacknowledged)) {
-					TCP_MAKE_STANDARD_REPLY(TCP_ACK);
+				if (!NetTCPProcessACK(connection, data)) {
 					return;
 				}
 
-				if (NetTCPIsLessThanOrEqual(task->finSequence, task->sendUnacknowledged)) {
+				if (NetTCPIsLessThan(task->finSequence, task->sendUnacknowledged)) {
 					if (task->step == TCP_STEP_FIN_WAIT_1) {
 						task->step = TCP_STEP_FIN_WAIT_2;
-					} else if (task->step == TCP_STEP_CLOSING) { 
+					} else if (task->step == TCP_STEP_CLOSING || task->step == TCP_STEP_LAST_ACK) { 
 						NetTaskComplete(task, ES_SUCCESS);
 						return;
 					}
@@ -1710,6 +2691,8 @@ void NetTCPConnection(NetTask *_task, void *_data) {
 			}
 		}
 
+		bool acknowledgeNow = false;
+
 		if (task->step >= TCP_STEP_ESTABLISHED && task->step <= TCP_STEP_FIN_WAIT_2 && data->segmentLength) {
 			uint32_t start = data->sequenceNumber - task->receiveNext;
 			uint32_t end = data->sequenceNumber + data->segmentLength - task->receiveNext;
@@ -1745,6 +2728,10 @@ void NetTCPConnection(NetTask *_task, void *_data) {
 					NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
 					return;
 				}
+
+				// Immediately send a duplicate ACK for out-of-order data, so the server can detect the loss (RFC 5681).
+				task->recentOutOfOrderSequence = data->sequenceNumber;
+				acknowledgeNow = true;
 			} else {
 				uintptr_t advanceBy = end;
 
@@ -1753,15 +2740,17 @@ void NetTCPConnection(NetTask *_task, void *_data) {
 				}
 
 				if (connection->receivedData.ranges.Length()) {
-					if (connection->receivedData.ranges.Length()
+					while (connection->receivedData.ranges.Length()
 							&& connection->receivedData.ranges[0].from <= advanceBy) {
-						advanceBy = connection->receivedData.ranges[0].to;
+						// The segment filled a hole, so ACK immediately.
+						if (advanceBy < connection->receivedData.ranges[0].to) advanceBy = connection->receivedData.ranges[0].to;
 						connection->receivedData.ranges.Delete(0);
+						acknowledgeNow = true;
 					}
 
 					for (uintptr_t i = 0; i < connection->receivedData.ranges.Length(); i++) {
-						connection->receivedData.ranges[0].from -= advanceBy;
-						connection->receivedData.ranges[0].to -= advanceBy;
+						connection->receivedData.ranges[i].from -= advanceBy;
+						connection->receivedData.ranges[i].to -= advanceBy;
 					}
 
 					connection->receivedData.Validate();
@@ -1771,26 +2760,104 @@ void NetTCPConnection(NetTask *_task, void *_data) {
 				connection->receiveWritePointer = (connection->receiveWritePointer + advanceBy) % connection->receiveBufferBytes;
 				NetConnectionUpdateReceiveWindow(connection);
 
-				TCP_MAKE_STANDARD_REPLY(TCP_ACK);
+				// ACK every second segment; otherwise, the ACK is delayed so it can be merged with a reply (RFC 1122).
+				if (++task->segmentsSinceACK >= 2) acknowledgeNow = true;
 			}
 		}
 
 		if (data->flags & TCP_FIN) {
-			task->receiveNext = data->sequenceNumber + 1;
+			task->receiveNext = data->sequenceNumber + data->segmentLength + 1;
 			TCP_MAKE_STANDARD_REPLY(TCP_ACK);
 
 			if (task->step == TCP_STEP_SYN_RECEIVED || task->step == TCP_STEP_ESTABLISHED) {
 				task->step = TCP_STEP_CLOSE_WAIT;
 			} else if (task->step == TCP_STEP_FIN_WAIT_1) {
-				if (NetTCPIsLessThanOrEqual(task->finSequence, task->sendUnacknowledged)) {
+				if (NetTCPIsLessThan(task->finSequence, task->sendUnacknowledged)) {
 					NetTaskComplete(task, ES_SUCCESS);
+					return;
 				} else {
 					task->step = TCP_STEP_CLOSING;
 				}
 			} else if (task->step == TCP_STEP_FIN_WAIT_2) {
 				NetTaskComplete(task, ES_SUCCESS);
+				return;
+			}
+		}
+
+		// Send any data the ACK made room for; the ACK for this segment is merged into it.
+
+		bool sent = task->step >= TCP_STEP_ESTABLISHED && NetConnectionTransmitData(connection);
+
+		if (task->completed || sent) {
+			return;
+		} else if (acknowledgeNow) {
+			TCP_MAKE_STANDARD_REPLY(TCP_ACK);
+		} else if (task->segmentsSinceACK && !task->delayedACKTimeMs) {
+			NetTCPTimerArm(&task->delayedACKTimeMs, TCP_DELAYED_ACK_MS);
+		}
+	}
+}
+
+void NetTCPTimerProcess(NetConnection *connection, bool *armed) {
+	NetTCPConnectionTask *task = &connection->task;
+	NetInterface *interface = task->interface;
+	KWriterLockTake(&interface->connectionLock, K_LOCK_SHARED);
+	KMutexAcquire(&connection->mutex);
+
+	uint64_t timeMs = KGetTimeInMs();
+
+	if (!task->completed && task->delayedACKTimeMs && task->delayedACKTimeMs <= timeMs) {
+		if (!NetTCPTransmit(connection, TCP_ACK, task->sendNext, 0)) {
+			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
+		}
+	}
+
+	if (!task->completed && task->retransmitTimeMs && task->retransmitTimeMs <= timeMs) {
+		NetTCPRetransmitTimeout(connection);
+	}
+
+	if (!task->completed && (task->delayedACKTimeMs || task->retransmitTimeMs)) {
+		*armed = true;
+	}
+
+	KMutexRelease(&connection->mutex);
+	KWriterLockReturn(&interface->connectionLock, K_LOCK_SHARED);
+}
+
+void NetTCPTimerThread(uintptr_t) {
+	// Deliver the delayed ACK and retransmission timers of the TCP connections.
+	// The thread sleeps until a timer is armed, and then polls every TCP_TIMER_TICK_MS until none remain.
+
+	uint64_t timeoutMs = ES_WAIT_NO_TIMEOUT;
+	Array<NetConnection *, K_FIXED> connections = {};
+
+	while (true) {
+		KEventWait(&networking.tcpTimerEvent, timeoutMs);
+		bool armed = false;
+
+		// Take a handle to every connection in the table, since their timers can't be processed with the table locked.
+
+		KWriterLockTake(&networking.tcpConnectionsLock, K_LOCK_SHARED);
+
+		for (uintptr_t i = 0; i < (1 << TCP_CONNECTION_HASH_BITS); i++) {
+			for (NetConnection *connection = networking.tcpConnections[i]; connection; connection = connection->hashNext) {
+				if (connections.Add(connection)) {
+					OpenHandleToObject(connection, KERNEL_OBJECT_CONNECTION);
+				} else {
+					armed = true; // Try again on the next tick.
+				}
 			}
 		}
+
+		KWriterLockReturn(&networking.tcpConnectionsLock, K_LOCK_SHARED);
+
+		for (uintptr_t i = 0; i < connections.Length(); i++) {
+			NetTCPTimerProcess(connections[i], &armed);
+			CloseHandleToObject(connections[i], KERNEL_OBJECT_CONNECTION);
+		}
+
+		connections.SetLength(0);
+		timeoutMs = armed ? TCP_TIMER_TICK_MS : ES_WAIT_NO_TIMEOUT;
 	}
 }
 
@@ -2006,7 +3073,7 @@ void NetTaskBegin(NetTask *task) {
 			NetInterface *interface = EsContainerOf(NetInterface, item, item);
 			KWriterLockTake(&interface->connectionLock, K_LOCK_SHARED);
 
-			if (interface->connected && interface->hasIP) {
+			if (interface->connected && interface->hasIP && !interface->loopback) {
 				task->interface = interface;
 				break;
 			}
@@ -2020,17 +3087,20 @@ void NetTaskBegin(NetTask *task) {
 		KWriterLockTake(&task->interface->connectionLock, K_LOCK_SHARED);
 	}
 
+	task->index = 0xFFFF;
+
 	if (!task->interface) {
 		NetTaskComplete(task, ES_ERROR_NO_CONNECTED_NETWORK_INTERFACES);
 	} else {
-		task->index = 0xFFFF;
 		task->callback(task, nullptr);
 		KWriterLockReturn(&task->interface->connectionLock, K_LOCK_SHARED);
 	}
 }
 
 void NetTaskComplete(NetTask *task, EsError error) {
-	KWriterLockAssertShared(&task->interface->connectionLock);
+	if (task->interface) {
+		KWriterLockAssertShared(&task->interface->connectionLock);
+	}
 
 	if (task->completed) {
 		KernelPanic("NetTaskComplete - Task already completed.\n");
@@ -2049,8 +3119,6 @@ void NetConnectionDestroy(NetConnection *connection) {
 }
 
 NetConnection *NetConnectionOpen(EsAddress *address, size_t sendBufferBytes, size_t receiveBufferBytes, uint32_t flags) {
-	(void) flags;
-
 	NetConnection *connection = (NetConnection *) EsHeapAllocate(sizeof(NetConnection), true, K_FIXED);
 
 	if (!connection) {
@@ -2060,7 +3128,8 @@ NetConnection *NetConnectionOpen(EsAddress *address, size_t sendBufferBytes, siz
 	connection->sendBufferBytes = sendBufferBytes;
 	connection->receiveBufferBytes = receiveBufferBytes;
 	connection->address = *address;
-	connection->handles = 2;
+	connection->handles = 2; // One for the application, and one for the task (closed once it completes).
+	connection->applicationHandles = 1;
 
 	connection->bufferRegion = MMSharedCreateRegion(sendBufferBytes + receiveBufferBytes, true);
 
@@ -2072,70 +3141,64 @@ NetConnection *NetConnectionOpen(EsAddress *address, size_t sendBufferBytes, siz
 	connection->sendBuffer = (uint8_t *) MMMapShared(kernelMMSpace, connection->bufferRegion, 0, sendBufferBytes + receiveBufferBytes);
 	connection->receiveBuffer = connection->sendBuffer + sendBufferBytes;
 
-	connection->task.callback = NetTCPConnection;
-	connection->task.receiveWindow = MinimumInteger(receiveBufferBytes - 1, 0xF000);
-	NetTaskBegin(&connection->task);
+	NetTCPConnectionTask *task = &connection->task;
+	task->callback = NetTCPConnection;
+	task->listening = flags & ES_CONNECTION_OPEN_LISTEN;
+	task->windowScaleEnabled = task->timestampsEnabled = task->sackEnabled = true;
+	task->sendMaximumSegmentSize = TCP_DEFAULT_SEGMENT_SIZE;
+	task->retransmissionTimeout = TCP_INITIAL_RTO_MS;
+
+	while (task->receiveWindowScale < TCP_MAXIMUM_WINDOW_SCALE && ((receiveBufferBytes - 1) >> task->receiveWindowScale) > 0xFFFF) {
+		task->receiveWindowScale++;
+	}
+
+	if (((KIPAddress *) &address->ipv4)->d[0] == 127 && networking.loopback) {
+		task->interface = networking.loopback;
+	}
+
+	NetConnectionUpdateReceiveWindow(connection);
+	NetTaskBegin(task);
+
+	if (task->listening && !task->completed) {
+		// Tell the caller which port to connect to.
+		address->ipv4 = *(uint32_t *) &task->interface->ipAddress;
+		address->port = task->index + TCP_PORT_BASE;
+	}
 
 	return connection;
 }
 
 void NetConnectionClose(NetConnection *connection) {
-	bool destroy = false;
+	// Called when the application closes its last handle to the connection.
+	// The connection is destroyed once the task completes and closes its handle.
 
 	NetTCPConnectionTask *task = &connection->task;
 	NetInterface *interface = task->interface;
+
+	if (!interface) {
+		return; // NetTaskBegin couldn't find an interface, so the task has already completed.
+	}
+
 	KWriterLockTake(&interface->connectionLock, K_LOCK_SHARED);
 	KMutexAcquire(&connection->mutex);
-	connection->handles++; // Prevent NetTaskComplete from destroying the connection.
 
 	if (task->completed) {
-		destroy = true;
+		// Nothing to do.
+	} else if ((task->step == 0 && task->listening) || task->step == TCP_STEP_SYN_SENT) {
+		// No connection has been established yet, so it can be abandoned.
+		NetTaskComplete(task, ES_SUCCESS);
 	} else if (task->step == TCP_STEP_SYN_RECEIVED || task->step == TCP_STEP_ESTABLISHED || task->step == TCP_STEP_CLOSE_WAIT) {
-		// Send a FIN packet.
-
-		EsBuffer buffer = NetTransmitBufferGet();
-
-		if (buffer.error) { 
-			NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES); 
-		} else {
-			EthernetHeader *ethernet = (EthernetHeader *) buffer.Write(nullptr, sizeof(EthernetHeader));
-			ETHERNET_HEADER(ethernet, ETHERNET_TYPE_IPV4, task->destinationMAC);
-			IPHeader *ip = (IPHeader *) buffer.Write(nullptr, sizeof(IPHeader));
-			IP_HEADER(ip, *(KIPAddress *) &connection->address.ipv4, IP_PROTOCOL_TCP);
-			TCPHeader *tcp = (TCPHeader *) buffer.Write(nullptr, sizeof(TCPHeader));
-
-			if (buffer.error) {
-				KernelPanic("NetConnectionClose - Network interface buffer size too small.\n");
-			}
-
-			ip->totalLength = ByteSwap16(buffer.position - sizeof(*ethernet));
-			ip->flagsAndFragmentOffset = SwapBigEndian16(1 << 14 /* do not fragment */);
-			ip->headerChecksum = ip->CalculateHeaderChecksum();
-
-			tcp->sourcePort = SwapBigEndian16(task->index + TCP_PORT_BASE);
-			tcp->destinationPort = SwapBigEndian16(connection->address.port);
-			tcp->flags = SwapBigEndian16(TCP_FIN | TCP_ACK | (5 << 12 /* header is 5 DWORDs */));
-			tcp->sequenceNumber = SwapBigEndian32(task->sendNext);
-			tcp->ackNumber = SwapBigEndian32(task->receiveNext);
-			tcp->window = SwapBigEndian16(task->receiveWindow);
-
-			task->finSequence = task->sendNext;
-			task->sendNext++;
-			task->step = TCP_STEP_FIN_WAIT_1;
+		// Queue a FIN after the remaining data in the send buffer.
+		// It's sent once all the data has been sent, and retransmitted along with it.
 
-			if (!NetTransmit(interface, &buffer, NET_PACKET_ETHERNET)) {
-				NetTaskComplete(task, ES_ERROR_INSUFFICIENT_RESOURCES);
-			}
-		}
+		task->finSequence = task->sendUnacknowledged + NetConnectionQueuedBytes(connection) 
+			+ (task->sendUnacknowledged == task->initialSend ? 1 /* SYN */ : 0);
+		task->step = task->step == TCP_STEP_CLOSE_WAIT ? TCP_STEP_LAST_ACK : TCP_STEP_FIN_WAIT_1;
+		NetConnectionTransmitData(connection);
 	}
 
-	connection->handles--;
 	KMutexRelease(&connection->mutex);
 	KWriterLockReturn(&interface->connectionLock, K_LOCK_SHARED);
-
-	if (destroy) {
-		NetConnectionDestroy(connection);
-	}
 }
 
 void KRegisterNetInterface(NetInterface *interface) {
@@ -2152,16 +3215,81 @@ void KRegisterNetInterface(NetInterface *interface) {
 	interface->addressSetupTask.callback = NetAddressSetup;
 }
 
-void NetInitialise(KDevice *) {
+bool NetLoopbackTransmit(NetInterface *_interface, void *dataVirtual, uintptr_t, size_t dataBytes) {
+	NetLoopbackInterface *interface = (NetLoopbackInterface *) _interface;
+	KMutexAcquire(&interface->queueMutex);
+	bool queued = interface->queue.Add({ dataVirtual, dataBytes });
+	KMutexRelease(&interface->queueMutex);
+	if (queued) KEventSet(&interface->queueEvent, true /* maybe already set */);
+	return queued;
+}
+
+void NetLoopbackThread(uintptr_t argument) {
+	NetLoopbackInterface *interface = (NetLoopbackInterface *) argument;
+	Array<NetLoopbackPacket, K_FIXED> packets = {};
+
+	while (true) {
+		KEventWait(&interface->queueEvent);
+
+		// Take all the queued packets at once, so that tasks can keep transmitting while they're received.
+		KMutexAcquire(&interface->queueMutex);
+		Array<NetLoopbackPacket, K_FIXED> swap = interface->queue;
+		interface->queue = packets;
+		packets = swap;
+		KMutexRelease(&interface->queueMutex);
+
+		for (uintptr_t i = 0; i < packets.Length(); i++) {
+			NetInterfaceReceive(interface, (const uint8_t *) packets[i].data, packets[i].bytes, NET_PACKET_ETHERNET);
+			NetTransmitBufferReturn(packets[i].data);
+		}
+
+		packets.SetLength(0);
+	}
+}
+
+void NetLoopbackRegister(KDevice *parent) {
+	NetLoopbackInterface *interface = (NetLoopbackInterface *) KDeviceCreate("Loopback", parent, sizeof(NetLoopbackInterface));
+	if (!interface) return;
+
+	interface->transmit = NetLoopbackTransmit;
+	interface->loopback = true;
+	interface->queueEvent.autoReset = true;
+
+	if (!KThreadCreate("NetLoopback", NetLoopbackThread, (uintptr_t) interface)) {
+		KernelLog(LOG_ERROR, "Networking", "loopback thread", "Could not create the loopback interface's thread.\n");
+		return;
+	}
+
+	KRegisterNetInterface(interface);
+
+	// The loopback interface is always connected, and doesn't need DHCP.
+	KWriterLockTake(&interface->connectionLock, K_LOCK_EXCLUSIVE);
+	interface->ipAddress = { 127, 0, 0, 1 };
+	interface->connected = interface->hasIP = true;
+	KWriterLockReturn(&interface->connectionLock, K_LOCK_EXCLUSIVE);
+
+	networking.loopback = interface;
+}
+
+void NetInitialise(KDevice *parent) {
 	networking.udpTaskBitset.Initialise(MAX_UDP_TASKS);
 	networking.udpTaskBitset.PutAll();
 	ArenaInitialise(&networking.transmitBufferPool, 1048576, 2048);
 
+	networking.dnsCache = (NetDomainNameCacheEntry *) EsHeapAllocate(DNS_CACHE_ENTRIES * sizeof(NetDomainNameCacheEntry), true, K_FIXED);
+	networking.transmitBufferCaches = (NetTransmitBufferCache *) EsHeapAllocate(KGetCPUCount() * sizeof(NetTransmitBufferCache), true, K_FIXED);
+	if (networking.transmitBufferCaches) networking.transmitBufferCacheCount = KGetCPUCount();
+
 	networking.tcpTaskLRU = networking.tcpTaskMRU = 0xFFFF;
 
 	for (uintptr_t i = 0; i < MAX_TCP_TASKS; i++) {
 		NetTCPFreeTaskIndex(i, true);
 	}
+
+	networking.tcpTimerEvent.autoReset = true;
+	KThreadCreate("NetTCPTimer", NetTCPTimerThread);
+
+	NetLoopbackRegister(parent);
 }
 
 KDriver driverNetworking = {
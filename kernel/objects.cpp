@@ -22,26 +22,120 @@ struct ConstantBuffer {
 struct Pipe {
 #define PIPE_READER (1)
 #define PIPE_WRITER (2)
-#define PIPE_BUFFER_SIZE (256)
 #define PIPE_CLOSED (0)
 
-	volatile char buffer[PIPE_BUFFER_SIZE]; // TODO Make this 4KB?
+#define PIPE_INITIAL_CAPACITY (K_PAGE_SIZE)
+#define PIPE_DEFAULT_MAXIMUM_CAPACITY (16 * K_PAGE_SIZE)
+#define PIPE_MAXIMUM_CAPACITY (256 * K_PAGE_SIZE) // The upper limit for SetMaximumCapacity.
+#define PIPE_MAXIMUM_VECTORS (1024) // The most vectors a single vectored read or write can pass.
+
+	// The buffer is allocated in pages when the pipe is first written to,
+	// and is doubled in size when a writer finds it full, up to the maximum capacity.
+	uint8_t *buffer; 
+	size_t capacity, maximumCapacity; // If maximumCapacity is 0, then PIPE_DEFAULT_MAXIMUM_CAPACITY is used.
+
 	volatile size_t writers, readers;
 	volatile uintptr_t writePosition, readPosition, unreadData;
 	KEvent canWrite, canRead;
 	KMutex mutex;
 
-	size_t Access(void *buffer, size_t bytes, bool write, bool userBlockRequest);
+	// If cancel is given, then the access stops waiting for the pipe once the event is set.
+	size_t Access(void *buffer, size_t bytes, bool write, bool userBlockRequest, KEvent *cancel = nullptr);
+	size_t AccessVectored(const EsPipeVector *vectors, size_t vectorCount, bool write, bool userBlockRequest, KEvent *cancel = nullptr);
+	ptrdiff_t Splice(KNode *file, EsFileOffset offset, size_t bytes, bool toFile, bool userBlockRequest); // Returns the number of bytes moved, or an error.
+	bool SetMaximumCapacity(size_t bytes);
+	void Destroy();
+
+	bool Grow(size_t bytesToWrite);
+	void CopyVectors(const EsPipeVector *vectors, uintptr_t *vectorIndex, uintptr_t *vectorOffset, uintptr_t position, size_t bytes, bool write);
+	bool Wait(bool write, bool userBlockRequest, KEvent *cancel = nullptr); // Returns false if the thread is being terminated, or the access was cancelled.
+};
+
+bool PipePinVectors(MMSpace *space, const EsPipeVector *vectors, struct MMRegion **regions, size_t vectorCount, bool write); // If write is true, the buffers will be written into.
+void PipeUnpinVectors(MMSpace *space, struct MMRegion **regions, size_t vectorCount);
+
+struct IORing {
+#define IO_RING_MAXIMUM_ENTRIES (4096) // The maximum capacity of the submission queue.
+
+	// The queues, mapped into the kernel's address space.
+	// The application can modify the header at any time, so the kernel keeps its own copy of its positions, 
+	// and the positions it reads from the header are only used after being masked by the capacity.
+	MMSharedRegion *region;
+	_EsIORingHeader *header;
+	EsIORequest *submissions;
+	EsIOCompletion *completions;
+	uint32_t submissionCapacity, completionCapacity;
+	uint32_t submissionHead, completionTail;
+
+	// A request is only taken from the submission queue if there will be space for its completion,
+	// so that requests never have to wait for the application to remove completions.
+	size_t inProgress;
+
+	KEvent *event; // Set when a completion is added. The application has its own handle to the event.
+	MMSpace *space; // Requests are run in the address space of the process that created the ring.
+
+	// Each request in progress holds a handle to the ring, opened with IO_RING_REQUEST_HANDLE.
+	// When the application's handles are all closed (for example, because the process terminated),
+	// the cancel event is set, so that requests blocked on pipes complete instead of holding their worker forever.
+#define IO_RING_REQUEST_HANDLE (1)
+	volatile size_t handles, applicationHandles;
+	KEvent cancel;
+	size_t workers; // The number of worker threads running requests from this ring. Protected by ioRingWorkers.mutex.
+
+	KMutex mutex; // Protects the completion queue and inProgress.
+	KMutex enterMutex; // Protects the submission queue.
+
+	uintptr_t Enter(struct Process *process, bool *fatal); // Returns the number of requests started, or an error. If a request is invalid, a fatal error is returned.
+	void Complete(EsGeneric context, intptr_t result);
+	void Destroy();
+};
+
+struct IORingOperation {
+	IORing *ring;
+	EsIORequest request;
+	Handle handle; // The object the request operates on; closed when the request completes.
+	struct MMRegion *region; // The request's buffer, pinned until the request completes.
+	LinkedItem<IORingOperation> item;
+};
+
+struct IORingWorkers {
+#define IO_RING_MAXIMUM_WORKERS (16)
+#define IO_RING_MAXIMUM_WORKERS_PER_RING (4)
+
+	// Requests are run on a pool of kernel threads, which is grown when a request is queued and all the threads are busy.
+	// Pipe requests may block for a long time, so there needs to be more than one thread.
+	// A ring may only use a few of the threads at once, so that one process blocking on pipes can't starve the others.
+	LinkedList<IORingOperation> queue;
+	size_t threadCount, idleThreadCount;
+	KEvent available; // Set when the queue is not empty.
+	KMutex mutex;
 };
 
+IORing *IORingCreate(MMSpace *space, size_t entries, void **userAddress); // Returns the ring with one handle open, or null on failure.
+
+IORingWorkers ioRingWorkers;
+
 struct MessageQueue {
 	bool SendMessage(void *target, EsMessage *message); // Returns false if the message queue is full.
 	bool SendMessage(_EsMessageWithObject *message); // Returns false if the message queue is full.
 	bool GetMessage(_EsMessageWithObject *message);
-
-#define MESSAGE_QUEUE_MAX_LENGTH (4096)
-	Array<_EsMessageWithObject, K_FIXED> messages;
-
+	size_t GetMessages(_EsMessageWithObject *messages, size_t maximumCount); // Returns the number of messages removed from the queue.
+	void *CreateRing(MMSpace *space); // Returns the address of the ring in the space, or null on failure.
+	void ResetNotEmptyEventIfEmpty();
+	bool IsPinged();
+	void Free();
+
+#define MESSAGE_QUEUE_MAX_LENGTH (4096) // Must be a power of 2.
+#define MESSAGE_QUEUE_INITIAL_CAPACITY (16)
+
+	// A ring buffer, indexed by the message's sequence number modulo the capacity.
+	// The capacity is doubled when the buffer is full, up to MESSAGE_QUEUE_MAX_LENGTH.
+	_EsMessageWithObject *messages;
+	size_t capacity;
+	uintptr_t readPosition, writePosition;
+
+	// The sequence number plus one of the most recent message of each mergeable type.
+	// The message is still in the queue only if this is greater than readPosition.
 	uintptr_t mouseMovedMessage, 
 		  windowResizedMessage, 
 		  eyedropResultMessage,
@@ -49,6 +143,22 @@ struct MessageQueue {
 
 	bool pinged;
 
+	// If the application has created a shared message ring, messages are written directly into it,
+	// and the application can receive them without a system call.
+	// If the ring fills up, messages are put into the ring buffer above instead, until the application has emptied it.
+#define MESSAGE_RING_CAPACITY (256) // Must be a power of 2.
+	MMSharedRegion *ringRegion;
+	_EsMessageRing *ring;
+	_EsMessageRingEntry *ringEntries;
+	uint32_t ringWritePosition; // The kernel's copy; the application could modify ring->writePosition.
+	uint32_t ringMouseMovedMessage, // The sequence number plus one of the most recent message of each mergeable type in the ring.
+		 ringWindowResizedMessage,
+		 ringEyedropResultMessage,
+		 ringKeyRepeatMessage,
+		 ringPingMessage;
+
+	bool SendMessageToRing(_EsMessageWithObject *message); // Returns false if the ring is full.
+
 	KMutex mutex;
 	KEvent notEmpty;
 };
@@ -58,17 +168,21 @@ size_t totalHandleCount;
 struct HandleTableL2 {
 #define HANDLE_TABLE_L2_ENTRIES (256)
 	Handle t[HANDLE_TABLE_L2_ENTRIES];
+	volatile uint32_t readers[HANDLE_TABLE_L2_ENTRIES]; // The number of threads resolving each handle without the lock.
 };
 
 struct HandleTableL1 {
 #define HANDLE_TABLE_L1_ENTRIES (256)
-	HandleTableL2 *t[HANDLE_TABLE_L1_ENTRIES];
+	HandleTableL2 *volatile t[HANDLE_TABLE_L1_ENTRIES]; // L2 tables are only freed when the handle table is destroyed.
 	uint16_t u[HANDLE_TABLE_L1_ENTRIES];
 };
 
 struct HandleTable {
+	// ResolveHandle does not take the lock, so that system calls from different threads don't contend.
+	// Instead, it increments the handle's reader count while it opens its own handle to the object;
+	// CloseHandle clears the handle, and then waits for the reader count to drop to zero before closing the object.
 	HandleTableL1 l1r;
-	KMutex lock;
+	KMutex lock; // Taken to modify the table.
 	struct Process *process;
 	bool destroyed;
 	uint32_t handleCount;
@@ -97,10 +211,6 @@ void InitialiseObjectManager();
 
 #ifdef IMPLEMENTATION
 
-// A lock used to change the handle count on several objects.
-// TODO Make changing handle count lockless wherever possible?
-KMutex objectHandleCountChange;
-
 // TODO Use uint64_t for handle counts, or restrict OpenHandleToObject to some maximum (...but most callers don't check if OpenHandleToObject succeeds).
 
 bool OpenHandleToObject(void *object, KernelObjectType type, uint32_t flags) {
@@ -108,11 +218,7 @@ bool OpenHandleToObject(void *object, KernelObjectType type, uint32_t flags) {
 
 	switch (type) {
 		case KERNEL_OBJECT_EVENT: {
-			KMutexAcquire(&objectHandleCountChange);
-			KEvent *event = (KEvent *) object;
-			if (!event->handles) hadNoHandles = true;
-			else event->handles++;
-			KMutexRelease(&objectHandleCountChange);
+			hadNoHandles = 0 == __sync_fetch_and_add(&((KEvent *) object)->handles, 1);
 		} break;
 
 		case KERNEL_OBJECT_PROCESS: {
@@ -124,11 +230,7 @@ bool OpenHandleToObject(void *object, KernelObjectType type, uint32_t flags) {
 		} break;
 
 		case KERNEL_OBJECT_SHMEM: {
-			MMSharedRegion *region = (MMSharedRegion *) object;
-			KMutexAcquire(&region->mutex);
-			if (!region->handles) hadNoHandles = true;
-			else region->handles++;
-			KMutexRelease(&region->mutex);
+			hadNoHandles = 0 == __sync_fetch_and_add(&((MMSharedRegion *) object)->handles, 1);
 		} break;
 
 		case KERNEL_OBJECT_WINDOW: {
@@ -143,11 +245,7 @@ bool OpenHandleToObject(void *object, KernelObjectType type, uint32_t flags) {
 		} break;
 
 		case KERNEL_OBJECT_CONSTANT_BUFFER: {
-			ConstantBuffer *buffer = (ConstantBuffer *) object;
-			KMutexAcquire(&objectHandleCountChange);
-			if (!buffer->handles) hadNoHandles = true;
-			else buffer->handles++;
-			KMutexRelease(&objectHandleCountChange);
+			hadNoHandles = 0 == __sync_fetch_and_add(&((ConstantBuffer *) object)->handles, 1);
 		} break;
 
 #ifdef ENABLE_POSIX_SUBSYSTEM
@@ -187,12 +285,19 @@ bool OpenHandleToObject(void *object, KernelObjectType type, uint32_t flags) {
 		case KERNEL_OBJECT_CONNECTION: {
 			NetConnection *connection = (NetConnection *) object;
 			hadNoHandles = 0 == __sync_fetch_and_add(&connection->handles, 1);
+			if (flags & NET_CONNECTION_APPLICATION_HANDLE) __sync_fetch_and_add(&connection->applicationHandles, 1);
 		} break;
 
 		case KERNEL_OBJECT_DEVICE: {
 			KDeviceOpenHandle((KDevice *) object, flags);
 		} break;
 
+		case KERNEL_OBJECT_IO_RING: {
+			IORing *ring = (IORing *) object;
+			hadNoHandles = 0 == __sync_fetch_and_add(&ring->handles, 1);
+			if (~flags & IO_RING_REQUEST_HANDLE) __sync_fetch_and_add(&ring->applicationHandles, 1);
+		} break;
+
 		default: {
 			KernelPanic("OpenHandleToObject - Cannot open object of type %x.\n", type);
 		} break;
@@ -236,36 +341,30 @@ void CloseHandleToObject(void *object, KernelObjectType type, uint32_t flags) {
 
 		case KERNEL_OBJECT_EVENT: {
 			KEvent *event = (KEvent *) object;
-			KMutexAcquire(&objectHandleCountChange);
-			bool destroy = event->handles == 1;
-			event->handles--;
-			KMutexRelease(&objectHandleCountChange);
+			uintptr_t previous = __sync_fetch_and_sub(&event->handles, 1);
+			if (!previous) KernelPanic("CloseHandleToObject - Event %x has no handles.\n", event);
 
-			if (destroy) {
+			if (previous == 1) {
 				EsHeapFree(event, sizeof(KEvent), K_FIXED);
 			}
 		} break;
 
 		case KERNEL_OBJECT_CONSTANT_BUFFER: {
 			ConstantBuffer *buffer = (ConstantBuffer *) object;
-			KMutexAcquire(&objectHandleCountChange);
-			bool destroy = buffer->handles == 1;
-			buffer->handles--;
-			KMutexRelease(&objectHandleCountChange);
+			uintptr_t previous = __sync_fetch_and_sub(&buffer->handles, 1);
+			if (!previous) KernelPanic("CloseHandleToObject - ConstantBuffer %x has no handles.\n", buffer);
 
-			if (destroy) {
+			if (previous == 1) {
 				EsHeapFree(object, sizeof(ConstantBuffer) + buffer->bytes, buffer->isPaged ? K_PAGED : K_FIXED);
 			}
 		} break;
 
 		case KERNEL_OBJECT_SHMEM: {
 			MMSharedRegion *region = (MMSharedRegion *) object;
-			KMutexAcquire(&region->mutex);
-			bool destroy = region->handles == 1;
-			region->handles--;
-			KMutexRelease(&region->mutex);
+			uintptr_t previous = __sync_fetch_and_sub(&region->handles, 1);
+			if (!previous) KernelPanic("CloseHandleToObject - MMSharedRegion %x has no handles.\n", region);
 
-			if (destroy) {
+			if (previous == 1) {
 				MMSharedDestroyRegion(region);
 			}
 		} break;
@@ -339,21 +438,38 @@ void CloseHandleToObject(void *object, KernelObjectType type, uint32_t flags) {
 			KMutexRelease(&pipe->mutex);
 
 			if (destroy) {
-				EsHeapFree(pipe, sizeof(Pipe), K_PAGED);
+				pipe->Destroy();
 			}
 		} break;
 
 		case KERNEL_OBJECT_CONNECTION: {
 			NetConnection *connection = (NetConnection *) object;
+
+			if ((flags & NET_CONNECTION_APPLICATION_HANDLE) && 1 == __sync_fetch_and_sub(&connection->applicationHandles, 1)) {
+				NetConnectionClose(connection);
+			}
+
 			unsigned previous = __sync_fetch_and_sub(&connection->handles, 1);
 			if (!previous) KernelPanic("CloseHandleToObject - NetConnection %x has no handles.\n", connection);
-			if (previous == 1) NetConnectionClose(connection);
+			if (previous == 1) NetConnectionDestroy(connection);
 		} break;
 
 		case KERNEL_OBJECT_DEVICE: {
 			KDeviceCloseHandle((KDevice *) object, flags);
 		} break;
 
+		case KERNEL_OBJECT_IO_RING: {
+			IORing *ring = (IORing *) object;
+			unsigned previous = __sync_fetch_and_sub(&ring->handles, 1);
+			if (!previous) KernelPanic("CloseHandleToObject - IORing %x has no handles.\n", ring);
+
+			if (~flags & IO_RING_REQUEST_HANDLE) {
+				if (1 == __sync_fetch_and_sub(&ring->applicationHandles, 1)) KEventSet(&ring->cancel);
+			}
+
+			if (previous == 1) ring->Destroy();
+		} break;
+
 		default: {
 			KernelPanic("CloseHandleToObject - Cannot close object of type %x.\n", type);
 		} break;
@@ -396,16 +512,24 @@ bool HandleTable::CloseHandle(EsHandle handle) {
 	HandleTableL1 *l1 = &l1r;
 	HandleTableL2 *l2 = l1->t[handle / HANDLE_TABLE_L2_ENTRIES];
 	if (!l2) { KMutexRelease(&lock); return false; }
-	Handle *_handle = l2->t + (handle % HANDLE_TABLE_L2_ENTRIES);
+	uintptr_t index = handle % HANDLE_TABLE_L2_ENTRIES;
+	Handle *_handle = l2->t + index;
 	KernelObjectType type = _handle->type;
 	uint64_t flags = _handle->flags;
 	void *object = _handle->object;
 	if (!object) { KMutexRelease(&lock); return false; }
-	EsMemoryZero(_handle, sizeof(Handle));
+	_handle->object = nullptr; // Clear the object first, so that ResolveHandle sees the handle as closed.
+	__sync_synchronize();
+	_handle->flags = 0;
+	_handle->type = COULD_NOT_RESOLVE_HANDLE;
 	l1->u[handle / HANDLE_TABLE_L2_ENTRIES]--;
 	handleCount--;
 	KMutexRelease(&lock);
 
+	// Wait for threads that read the object before the handle was cleared to open their own handles to it.
+	// (The slot might be reused in the meantime, in which case we may also wait for readers of the new handle.)
+	while (l2->readers[index]) KYield();
+
 	__sync_fetch_and_sub(&totalHandleCount, 1);
 	CloseHandleToObject(object, type, flags);
 	return true;
@@ -446,24 +570,41 @@ uint8_t HandleTable::ResolveHandle(Handle *outHandle, EsHandle inHandle, KernelO
 		return RESOLVE_HANDLE_FAILED;
 	}
 
-	KMutexAcquire(&lock);
-	EsDefer(KMutexRelease(&lock));
-
 	HandleTableL2 *l2 = l1r.t[inHandle / HANDLE_TABLE_L2_ENTRIES];
 	if (!l2) return RESOLVE_HANDLE_FAILED;
 
-	Handle *_handle = l2->t + (inHandle % HANDLE_TABLE_L2_ENTRIES);
+	uintptr_t index = inHandle % HANDLE_TABLE_L2_ENTRIES;
+	volatile Handle *_handle = l2->t + index;
+	uint8_t result = RESOLVE_HANDLE_FAILED;
+	__sync_fetch_and_add(&l2->readers[index], 1);
+
+	while (true) {
+		Handle handle;
+		handle.object = _handle->object;
+		__sync_synchronize();
+		handle.type = _handle->type;
+		handle.flags = _handle->flags;
+		__sync_synchronize();
+
+		if (handle.object != _handle->object) {
+			// The handle was closed and the slot reused while we were reading it.
+			continue;
+		}
 
-	if ((_handle->type & typeMask) && (_handle->object)) {
-		// Open a handle to the object so that it can't be destroyed while the system call is still using it.
-		// The handle is closed in the KObject's destructor.
-		if (OpenHandleToObject(_handle->object, _handle->type, _handle->flags)) {
-			*outHandle = *_handle;
-			return RESOLVE_HANDLE_NORMAL;
+		if ((handle.type & typeMask) && (handle.object)) {
+			// Open a handle to the object so that it can't be destroyed while the system call is still using it.
+			// The handle is closed in the KObject's destructor.
+			if (OpenHandleToObject(handle.object, handle.type, handle.flags)) {
+				*outHandle = handle;
+				result = RESOLVE_HANDLE_NORMAL;
+			}
 		}
+
+		break;
 	}
 
-	return RESOLVE_HANDLE_FAILED;
+	__sync_fetch_and_sub(&l2->readers[index], 1);
+	return result;
 }
 
 // TODO Switch the order of flags and type, so that the default value of flags can be 0.
@@ -501,7 +642,7 @@ EsHandle HandleTable::OpenHandle(void *object, uint32_t flags, KernelObjectType
 
 		if (l1Index == HANDLE_TABLE_L1_ENTRIES) goto error;
 
-		if (!l1->t[l1Index]) l1->t[l1Index] = (HandleTableL2 *) EsHeapAllocate(sizeof(HandleTableL2), true, K_FIXED);
+		if (!l1->t[l1Index]) l1->t[l1Index] = (HandleTableL2 *) EsHeapAllocate(sizeof(HandleTableL2), true, K_FIXED); // Zeroed before it is published.
 		HandleTableL2 *l2 = l1->t[l1Index];
 		if (!l2) goto error;
 		uintptr_t l2Index = HANDLE_TABLE_L2_ENTRIES;
@@ -519,7 +660,10 @@ EsHandle HandleTable::OpenHandle(void *object, uint32_t flags, KernelObjectType
 
 		if (l2Index == HANDLE_TABLE_L2_ENTRIES)	KernelPanic("HandleTable::OpenHandle - Unexpected lack of free handles.\n");
 		Handle *_handle = l2->t + l2Index;
-		*_handle = handle;
+		_handle->flags = handle.flags;
+		_handle->type = handle.type;
+		__sync_synchronize();
+		_handle->object = handle.object; // Set the object last, since ResolveHandle reads it first.
 
 		__sync_fetch_and_add(&totalHandleCount, 1);
 
@@ -548,7 +692,16 @@ void HandleTable::Destroy() {
 
 		for (uintptr_t k = 0; k < HANDLE_TABLE_L2_ENTRIES; k++) {
 			Handle *handle = &l1->t[i]->t[k];
-			if (handle->object) CloseHandleToObject(handle->object, handle->type, handle->flags);
+			void *object = handle->object;
+			if (!object) continue;
+			handle->object = nullptr;
+			__sync_synchronize();
+			while (l1->t[i]->readers[k]) KYield();
+			CloseHandleToObject(object, handle->type, handle->flags);
+		}
+
+		for (uintptr_t k = 0; k < HANDLE_TABLE_L2_ENTRIES; k++) {
+			while (l1->t[i]->readers[k]) KYield();
 		}
 
 		EsHeapFree(l1->t[i], 0, K_FIXED);
@@ -570,107 +723,268 @@ EsHandle ConstantBufferCreate(K_USER_BUFFER const void *data, size_t bytes, Proc
 	return object ? process->handleTable.OpenHandle(object, 0, KERNEL_OBJECT_CONSTANT_BUFFER) : ES_INVALID_HANDLE; 
 }
 
-size_t Pipe::Access(void *_buffer, size_t bytes, bool write, bool user) {
-	size_t amount = 0;
+bool Pipe::Wait(bool write, bool userBlockRequest, KEvent *cancel) {
 	Thread *currentThread = GetCurrentThread();
-	// EsPrint("--> %z %d\n", write ? "Write" : "Read", bytes);
+	if (userBlockRequest) currentThread->terminatableState = THREAD_USER_BLOCK_REQUEST;
+
+	if (cancel) {
+		KEvent *events[] = { write ? &canWrite : &canRead, cancel };
+		KEventWaitMultiple(events, 2);
+		if (KEventPoll(cancel)) return false;
+	} else {
+		KEventWait(write ? &canWrite : &canRead, ES_WAIT_NO_TIMEOUT);
+	}
+
+	if (userBlockRequest) {
+		currentThread->terminatableState = THREAD_IN_SYSCALL;
+		if (currentThread->terminating) return false;
+	}
+
+	return true;
+}
+
+bool Pipe::Grow(size_t bytesToWrite) {
+	KMutexAssertLocked(&mutex);
+
+	size_t maximum = maximumCapacity ?: PIPE_DEFAULT_MAXIMUM_CAPACITY;
+
+	if (capacity >= maximum) {
+		return false;
+	}
+
+	size_t newCapacity = capacity ? capacity * 2 : PIPE_INITIAL_CAPACITY;
+	while (newCapacity < unreadData + bytesToWrite && newCapacity < maximum) newCapacity *= 2;
+	if (newCapacity > maximum) newCapacity = maximum;
+
+	uint8_t *newBuffer = (uint8_t *) EsHeapAllocate(newCapacity, false, K_PAGED);
+
+	if (!newBuffer) {
+		return false;
+	}
+
+	// Move the unread data to the start of the new buffer.
+	size_t firstPart = capacity - readPosition < unreadData ? capacity - readPosition : unreadData;
+	if (firstPart) EsMemoryCopy(newBuffer, buffer + readPosition, firstPart);
+	if (unreadData - firstPart) EsMemoryCopy(newBuffer + firstPart, buffer, unreadData - firstPart);
+
+	EsHeapFree(buffer, capacity, K_PAGED);
+	buffer = newBuffer;
+	capacity = newCapacity;
+	readPosition = 0;
+	writePosition = unreadData;
+	return true;
+}
+
+bool Pipe::SetMaximumCapacity(size_t bytes) {
+	if (bytes > PIPE_MAXIMUM_CAPACITY) {
+		return false;
+	}
+
+	bytes = bytes < PIPE_INITIAL_CAPACITY ? PIPE_INITIAL_CAPACITY : RoundUp(bytes, (size_t) K_PAGE_SIZE);
+
+	KMutexAcquire(&mutex);
+	EsDefer(KMutexRelease(&mutex));
+
+	if (bytes < capacity) {
+		// The buffer is never shrunk.
+		return false;
+	}
+
+	maximumCapacity = bytes;
+	if (capacity < maximumCapacity) KEventSet(&canWrite, true);
+	return true;
+}
+
+void Pipe::Destroy() {
+	EsHeapFree(buffer, capacity, K_PAGED);
+	EsHeapFree(this, sizeof(Pipe), K_PAGED);
+}
+
+void Pipe::CopyVectors(const EsPipeVector *vectors, uintptr_t *vectorIndex, uintptr_t *vectorOffset, uintptr_t position, size_t bytes, bool write) {
+	// Copy between the vectors and the ring buffer, starting at the given position in the ring buffer.
+	// Vectors with a null buffer are skipped over; this is used to discard data when reading.
 
 	while (bytes) {
-		if (user) currentThread->terminatableState = THREAD_USER_BLOCK_REQUEST;
+		const EsPipeVector *vector = vectors + *vectorIndex;
+		size_t count = vector->bytes - *vectorOffset;
+		if (count > bytes) count = bytes;
+		if (count > capacity - position) count = capacity - position;
+
+		if (vector->buffer && write) {
+			EsMemoryCopy(buffer + position, (const uint8_t *) vector->buffer + *vectorOffset, count);
+		} else if (vector->buffer) {
+			EsMemoryCopy((uint8_t *) vector->buffer + *vectorOffset, buffer + position, count);
+		}
 
-		if (write) {
-			// Wait until we can write to  the pipe.
-			KEventWait(&canWrite, ES_WAIT_NO_TIMEOUT);
-		} else {
-			// Wait until we can read from the pipe.
-			KEventWait(&canRead, ES_WAIT_NO_TIMEOUT);
+		position = (position + count) % capacity;
+		bytes -= count;
+		*vectorOffset += count;
+
+		if (*vectorOffset == vector->bytes) {
+			*vectorIndex += 1;
+			*vectorOffset = 0;
 		}
+	}
+}
+
+size_t Pipe::Access(void *_buffer, size_t bytes, bool write, bool user, KEvent *cancel) {
+	EsPipeVector vector = { _buffer, bytes };
+	return AccessVectored(&vector, 1, write, user, cancel);
+}
 
-		if (user) {
-			currentThread->terminatableState = THREAD_IN_SYSCALL;
-			if (currentThread->terminating) goto done;
+size_t Pipe::AccessVectored(const EsPipeVector *vectors, size_t vectorCount, bool write, bool user, KEvent *cancel) {
+	size_t amount = 0, bytes = 0;
+	uintptr_t vectorIndex = 0, vectorOffset = 0;
+
+	for (uintptr_t i = 0; i < vectorCount; i++) {
+		bytes += vectors[i].bytes;
+	}
+
+	while (bytes) {
+		if (!Wait(write, user, cancel)) {
+			break;
 		}
 
 		KMutexAcquire(&mutex);
 		EsDefer(KMutexRelease(&mutex));
 
 		if (write) {
-			// EsPrint("Write:\n");
+			if (capacity - unreadData < bytes && !Grow(bytes) && !capacity) {
+				// The buffer couldn't be allocated.
+				break;
+			}
 
-			size_t spaceAvailable = PIPE_BUFFER_SIZE - unreadData;
+			size_t spaceAvailable = capacity - unreadData;
 			size_t toWrite = bytes > spaceAvailable ? spaceAvailable : bytes;
 
-			size_t spaceAvailableRight = PIPE_BUFFER_SIZE - writePosition;
-			size_t toWriteRight = toWrite > spaceAvailableRight ? spaceAvailableRight : toWrite;
-			size_t toWriteLeft = toWrite - toWriteRight;
-
-			// EsPrint("\tunread: %d; wp: %d\n", unreadData, writePosition);
-			// EsPrint("\t%d, %d, %d, %d, %d\n", spaceAvailable, spaceAvailableRight, toWrite, toWriteRight, toWriteLeft);
-
-			if (_buffer) EsMemoryCopy((uint8_t *) buffer + writePosition, _buffer, toWriteRight);
-			if (_buffer) EsMemoryCopy((uint8_t *) buffer, (uint8_t *) _buffer + toWriteRight, toWriteLeft);
-
-			writePosition += toWrite;
-			writePosition %= PIPE_BUFFER_SIZE;
-			unreadData += toWrite;
-			bytes -= toWrite;
-			if (_buffer) _buffer = (uint8_t *) _buffer + toWrite;
-			amount += toWrite;
-
-			KEventSet(&canRead, true);
+			if (toWrite) {
+				CopyVectors(vectors, &vectorIndex, &vectorOffset, writePosition, toWrite, true);
+				writePosition = (writePosition + toWrite) % capacity;
+				unreadData += toWrite;
+				bytes -= toWrite;
+				amount += toWrite;
+				KEventSet(&canRead, true);
+			}
 
 			if (!readers) {
-				// EsPrint("\tPipe closed\n");
 				// Nobody is reading from the pipe, so there's no point writing to it.
-				goto done;
-			} else	if (PIPE_BUFFER_SIZE == unreadData) {
-				KEventReset(&canWrite);
-				// EsPrint("\treset canWrite\n");
+				break;
+			} else if (unreadData == capacity) {
+				// Wait for the readers to make space. If the pipe can still grow, then it is grown on the next write.
+				if (capacity >= (maximumCapacity ?: PIPE_DEFAULT_MAXIMUM_CAPACITY) || !toWrite) KEventReset(&canWrite);
 			}
 		} else {
-			// EsPrint("Read:\n");
+			size_t toRead = bytes > unreadData ? unreadData : bytes;
+
+			if (toRead) {
+				CopyVectors(vectors, &vectorIndex, &vectorOffset, readPosition, toRead, false);
+				readPosition = (readPosition + toRead) % capacity;
+				unreadData -= toRead;
+				bytes -= toRead;
+				amount += toRead;
+				KEventSet(&canWrite, true);
+			}
 
-			size_t dataAvailable = unreadData;
-			size_t toRead = bytes > dataAvailable ? dataAvailable : bytes;
+			if (!writers) {
+				// Nobody is writing to the pipe, so there's no point reading from it.
+			} else if (!unreadData) {
+				KEventReset(&canRead);
+			}
 
-			size_t spaceAvailableRight = PIPE_BUFFER_SIZE - readPosition;
-			size_t toReadRight = toRead > spaceAvailableRight ? spaceAvailableRight : toRead;
-			size_t toReadLeft = toRead - toReadRight;
+			// Don't block when reading from pipes after the first chunk of data.
+			// TODO Change this behaviour?
+			break;
+		}
+	}
 
-			// EsPrint("\tunread: %d; rp: %d\n", unreadData, readPosition);
-			// EsPrint("\t%d, %d, %d, %d, %d\n", dataAvailable, spaceAvailableRight, toRead, toReadRight, toReadLeft);
+	return amount;
+}
 
-			if (_buffer) EsMemoryCopy(_buffer, (uint8_t *) buffer + readPosition, toReadRight);
-			if (_buffer) EsMemoryCopy((uint8_t *) _buffer + toReadRight, (uint8_t *) buffer, toReadLeft);
+ptrdiff_t Pipe::Splice(KNode *file, EsFileOffset offset, size_t bytes, bool toFile, bool user) {
+	// Move data directly between the pipe's buffer and the file cache.
+	// The pipe's mutex is held during the file access, so that the buffer cannot be reallocated.
 
-			readPosition += toRead;
-			readPosition %= PIPE_BUFFER_SIZE;
-			unreadData -= toRead;
-			bytes -= toRead;
-			if (_buffer) _buffer = (uint8_t *) _buffer + toRead;
-			amount += toRead;
+	size_t amount = 0;
 
-			KEventSet(&canWrite, true);
+	while (bytes) {
+		if (!Wait(!toFile, user)) {
+			break;
+		}
 
-			if (!writers) {
-				// Nobody is writing to the pipe, so there's no point reading from it.
-				// EsPrint("\tPipe closed\n");
-				goto done;
-			} else if (!unreadData) {
+		KMutexAcquire(&mutex);
+		EsDefer(KMutexRelease(&mutex));
+
+		if (toFile) {
+			size_t toMove = bytes > unreadData ? unreadData : bytes;
+			if (toMove > capacity - readPosition) toMove = capacity - readPosition;
+
+			if (toMove) {
+				ptrdiff_t result = FSFileWriteSync(file, buffer + readPosition, offset + amount, toMove, ES_FLAGS_DEFAULT);
+				if (ES_CHECK_ERROR(result)) return amount ?: result;
+				readPosition = (readPosition + result) % capacity;
+				unreadData -= result;
+				bytes -= result;
+				amount += result;
+				KEventSet(&canWrite, true);
+			}
+
+			if (!unreadData) {
+				if (!writers) break;
 				KEventReset(&canRead);
 			}
+		} else {
+			if (capacity - unreadData < bytes && !Grow(bytes) && !capacity) {
+				break;
+			}
 
-			// Don't block when reading from pipes after the first chunk of data.
-			// TODO Change this behaviour?
-			goto done;
+			size_t toMove = capacity - unreadData;
+			if (toMove > bytes) toMove = bytes;
+			if (toMove > capacity - writePosition) toMove = capacity - writePosition;
+
+			if (toMove) {
+				ptrdiff_t result = FSFileReadSync(file, buffer + writePosition, offset + amount, toMove, ES_FLAGS_DEFAULT);
+				if (ES_CHECK_ERROR(result)) return amount ?: result;
+				if (!result) break; // End of file.
+				writePosition = (writePosition + result) % capacity;
+				unreadData += result;
+				bytes -= result;
+				amount += result;
+				KEventSet(&canRead, true);
+			}
+
+			if (!readers) {
+				break;
+			} else if (unreadData == capacity) {
+				if (capacity >= (maximumCapacity ?: PIPE_DEFAULT_MAXIMUM_CAPACITY) || !toMove) KEventReset(&canWrite);
+			}
 		}
 	}
 
-	done:;
-	// EsPrint("<-- %d (%d remaining, %z)\n", amount, bytes, write ? "Write" : "Read");
 	return amount;
 }
 
+bool PipePinVectors(MMSpace *space, const EsPipeVector *vectors, MMRegion **regions, size_t vectorCount, bool write) {
+	for (uintptr_t i = 0; i < vectorCount; i++) {
+		regions[i] = vectors[i].buffer && vectors[i].bytes ? MMFindAndPinRegion(space, (uintptr_t) vectors[i].buffer, vectors[i].bytes) : nullptr;
+
+		if ((!regions[i] && vectors[i].buffer && vectors[i].bytes) 
+				|| (regions[i] && write && (regions[i]->flags & MM_REGION_READ_ONLY) && (~regions[i]->flags & MM_REGION_COPY_ON_WRITE))) {
+			PipeUnpinVectors(space, regions, i + 1);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void PipeUnpinVectors(MMSpace *space, MMRegion **regions, size_t vectorCount) {
+	for (uintptr_t i = 0; i < vectorCount; i++) {
+		if (regions[i]) {
+			MMUnpinRegion(space, regions[i]);
+		}
+	}
+}
+
 bool MessageQueue::SendMessage(void *object, EsMessage *_message) {
 	// TODO Remove unnecessary copy.
 	_EsMessageWithObject message = { object, *_message };
@@ -683,24 +997,47 @@ bool MessageQueue::SendMessage(_EsMessageWithObject *_message) {
 	KMutexAcquire(&mutex);
 	EsDefer(KMutexRelease(&mutex));
 
-	if (messages.Length() == MESSAGE_QUEUE_MAX_LENGTH) {
+	if (ring && readPosition == writePosition && SendMessageToRing(_message)) {
+		KEventSet(&notEmpty, true);
+		return true;
+	}
+
+	if (writePosition - readPosition == MESSAGE_QUEUE_MAX_LENGTH) {
 		KernelLog(LOG_ERROR, "Messages", "message dropped", "Message of type %d and target %x has been dropped because queue %x was full.\n",
 				_message->message.type, _message->object, this);
 		return false;
 	}
 
+	if (writePosition - readPosition == capacity) {
+		// Grow the ring buffer.
+		// Messages keep their sequence numbers, so the merge indices remain valid.
+		size_t newCapacity = capacity ? capacity * 2 : MESSAGE_QUEUE_INITIAL_CAPACITY;
+		_EsMessageWithObject *newMessages = (_EsMessageWithObject *) EsHeapAllocate(newCapacity * sizeof(_EsMessageWithObject), false, K_FIXED);
+
+		if (!newMessages) {
+			return false;
+		}
+
+		for (uintptr_t i = readPosition; i != writePosition; i++) {
+			newMessages[i & (newCapacity - 1)] = messages[i & (capacity - 1)];
+		}
+
+		EsHeapFree(messages, capacity * sizeof(_EsMessageWithObject), K_FIXED);
+		messages = newMessages;
+		capacity = newCapacity;
+	}
+
 #define MERGE_MESSAGES(variable, change) \
 	do { \
-		if (variable && messages[variable - 1].object == _message->object) { \
-			if (change) EsMemoryCopy(&messages[variable - 1], _message, sizeof(_EsMessageWithObject)); \
-		} else if (messages.AddPointer(_message)) { \
-			variable = messages.Length(); \
+		if (variable > readPosition && messages[(variable - 1) & (capacity - 1)].object == _message->object) { \
+			if (change) EsMemoryCopy(&messages[(variable - 1) & (capacity - 1)], _message, sizeof(_EsMessageWithObject)); \
 		} else { \
-			return false; \
+			messages[writePosition++ & (capacity - 1)] = *_message; \
+			variable = writePosition; \
 		} \
 	} while (0)
 
-	// NOTE Don't forget to update GetMessage with the merged messages!
+	// NOTE Don't forget to update GetMessages with the merged messages!
 
 	if (_message->message.type == ES_MSG_MOUSE_MOVED) {
 		MERGE_MESSAGES(mouseMovedMessage, true);
@@ -711,9 +1048,7 @@ bool MessageQueue::SendMessage(_EsMessageWithObject *_message) {
 	} else if (_message->message.type == ES_MSG_KEY_DOWN && _message->message.keyboard.repeat) {
 		MERGE_MESSAGES(keyRepeatMessage, false);
 	} else {
-		if (!messages.AddPointer(_message)) {
-			return false;
-		}
+		messages[writePosition++ & (capacity - 1)] = *_message;
 
 		if (_message->message.type == ES_MSG_PING) {
 			pinged = true;
@@ -725,29 +1060,414 @@ bool MessageQueue::SendMessage(_EsMessageWithObject *_message) {
 	return true;
 }
 
-bool MessageQueue::GetMessage(_EsMessageWithObject *_message) {
+size_t MessageQueue::GetMessages(_EsMessageWithObject *output, size_t maximumCount) {
 	KMutexAcquire(&mutex);
 	EsDefer(KMutexRelease(&mutex));
 
-	if (!messages.Length()) {
-		return false;
-	}
+	size_t count = writePosition - readPosition;
+	if (count > maximumCount) count = maximumCount;
 
-	*_message = messages[0];
-	messages.Delete(0);
+	if (!count) {
+		return 0;
+	}
 
-	if (mouseMovedMessage)    mouseMovedMessage--;
-	if (windowResizedMessage) windowResizedMessage--;
-	if (eyedropResultMessage) eyedropResultMessage--;
-	if (keyRepeatMessage)     keyRepeatMessage--;
+	for (uintptr_t i = 0; i < count; i++) {
+		output[i] = messages[(readPosition + i) & (capacity - 1)];
+	}
 
+	// The merge indices are sequence numbers, so they do not need to be adjusted.
+	readPosition += count;
 	pinged = false;
 
-	if (!messages.Length()) {
+	if (readPosition == writePosition) {
 		KEventReset(&notEmpty);
 	}
 
+	return count;
+}
+
+bool MessageQueue::SendMessageToRing(_EsMessageWithObject *_message) {
+	KMutexAssertLocked(&mutex);
+
+	// The application modifies the read position, so it can't be trusted.
+	// If it is invalid, the ring is treated as full.
+	uint32_t ringReadPosition = ring->readPosition;
+	uint32_t count = ringWritePosition - ringReadPosition;
+
+	if (count >= MESSAGE_RING_CAPACITY) {
+		return false;
+	}
+
+	uint32_t *mergeWith = nullptr;
+	bool change = true;
+
+	// NOTE Keep this consistent with the merged messages in SendMessage.
+
+	if (_message->message.type == ES_MSG_MOUSE_MOVED) {
+		mergeWith = &ringMouseMovedMessage;
+	} else if (_message->message.type == ES_MSG_WINDOW_RESIZED) {
+		mergeWith = &ringWindowResizedMessage;
+	} else if (_message->message.type == ES_MSG_EYEDROP_REPORT) {
+		mergeWith = &ringEyedropResultMessage;
+	} else if (_message->message.type == ES_MSG_KEY_DOWN && _message->message.keyboard.repeat) {
+		mergeWith = &ringKeyRepeatMessage;
+		change = false;
+	}
+
+	if (mergeWith && *mergeWith && (uint32_t) (*mergeWith - 1 - ringReadPosition) < count) {
+		// The previous message is still in the ring.
+		// Merge with it, unless the application has already started reading it.
+		_EsMessageRingEntry *entry = &ringEntries[(*mergeWith - 1) & (MESSAGE_RING_CAPACITY - 1)];
+
+		if (entry->message.object == _message->object 
+				&& __sync_bool_compare_and_swap(&entry->state, ES_MESSAGE_RING_ENTRY_READY, ES_MESSAGE_RING_ENTRY_WRITING)) {
+			if (change) EsMemoryCopy(&entry->message, _message, sizeof(_EsMessageWithObject));
+			__sync_synchronize();
+			entry->state = ES_MESSAGE_RING_ENTRY_READY;
+			return true;
+		}
+	}
+
+	_EsMessageRingEntry *entry = &ringEntries[ringWritePosition & (MESSAGE_RING_CAPACITY - 1)];
+	EsMemoryCopy(&entry->message, _message, sizeof(_EsMessageWithObject));
+	entry->state = ES_MESSAGE_RING_ENTRY_READY;
+	__sync_synchronize();
+	ring->writePosition = ++ringWritePosition;
+
+	if (mergeWith) {
+		*mergeWith = ringWritePosition;
+	} else if (_message->message.type == ES_MSG_PING) {
+		ringPingMessage = ringWritePosition;
+	}
+
 	return true;
 }
 
+void *MessageQueue::CreateRing(MMSpace *space) {
+	KMutexAcquire(&mutex);
+	EsDefer(KMutexRelease(&mutex));
+
+	if (ring) {
+		return nullptr;
+	}
+
+	size_t bytes = sizeof(_EsMessageRing) + MESSAGE_RING_CAPACITY * sizeof(_EsMessageRingEntry);
+	MMSharedRegion *region = MMSharedCreateRegion(bytes, true);
+
+	if (!region) {
+		return nullptr;
+	}
+
+	_EsMessageRing *kernelRing = (_EsMessageRing *) MMMapShared(kernelMMSpace, region, 0, bytes, MM_REGION_FIXED);
+	void *userRing = kernelRing ? MMMapShared(space, region, 0, bytes) : nullptr;
+
+	if (!userRing) {
+		if (kernelRing) MMFree(kernelMMSpace, kernelRing);
+		CloseHandleToObject(region, KERNEL_OBJECT_SHMEM);
+		return nullptr;
+	}
+
+	EsMemoryZero(kernelRing, bytes);
+	kernelRing->capacity = MESSAGE_RING_CAPACITY;
+	kernelRing->entriesOffset = sizeof(_EsMessageRing);
+
+	ringRegion = region;
+	ring = kernelRing;
+	ringEntries = (_EsMessageRingEntry *) ((uint8_t *) kernelRing + kernelRing->entriesOffset);
+
+	return userRing;
+}
+
+void MessageQueue::ResetNotEmptyEventIfEmpty() {
+	// When the ring is used, the application doesn't call GetMessages,
+	// so it needs to reset the event before it waits.
+
+	KMutexAcquire(&mutex);
+
+	if (readPosition == writePosition && (!ring || ring->readPosition == ringWritePosition)) {
+		KEventReset(&notEmpty);
+	}
+
+	KMutexRelease(&mutex);
+}
+
+bool MessageQueue::IsPinged() {
+	if (pinged) {
+		return true;
+	} else if (!ring || !ringPingMessage) {
+		return false;
+	} else {
+		uint32_t ringReadPosition = ring->readPosition;
+		return (uint32_t) (ringPingMessage - 1 - ringReadPosition) < (uint32_t) (ringWritePosition - ringReadPosition);
+	}
+}
+
+bool MessageQueue::GetMessage(_EsMessageWithObject *_message) {
+	return GetMessages(_message, 1) == 1;
+}
+
+void MessageQueue::Free() {
+	EsHeapFree(messages, capacity * sizeof(_EsMessageWithObject), K_FIXED);
+	messages = nullptr;
+	capacity = readPosition = writePosition = 0;
+	mouseMovedMessage = windowResizedMessage = eyedropResultMessage = keyRepeatMessage = 0;
+
+	if (ring) {
+		MMFree(kernelMMSpace, ring);
+		CloseHandleToObject(ringRegion, KERNEL_OBJECT_SHMEM);
+		ring = nullptr;
+		ringEntries = nullptr;
+		ringRegion = nullptr;
+	}
+}
+
+IORing *IORingCreate(MMSpace *space, size_t entries, void **userAddress) {
+	if (!entries || entries > IO_RING_MAXIMUM_ENTRIES) {
+		return nullptr;
+	}
+
+	uint32_t submissionCapacity = 1;
+	while (submissionCapacity < entries) submissionCapacity <<= 1;
+	uint32_t completionCapacity = submissionCapacity * 2;
+
+	size_t submissionsOffset = RoundUp(sizeof(_EsIORingHeader), (size_t) 16);
+	size_t completionsOffset = submissionsOffset + submissionCapacity * sizeof(EsIORequest);
+	size_t bytes = completionsOffset + completionCapacity * sizeof(EsIOCompletion);
+
+	IORing *ring = (IORing *) EsHeapAllocate(sizeof(IORing), true, K_FIXED);
+	KEvent *event = (KEvent *) EsHeapAllocate(sizeof(KEvent), true, K_FIXED);
+	MMSharedRegion *region = ring && event ? MMSharedCreateRegion(bytes, true) : nullptr;
+	_EsIORingHeader *header = region ? (_EsIORingHeader *) MMMapShared(kernelMMSpace, region, 0, bytes, MM_REGION_FIXED) : nullptr;
+	*userAddress = header ? MMMapShared(space, region, 0, bytes) : nullptr;
+
+	if (!(*userAddress)) {
+		if (header) MMFree(kernelMMSpace, header);
+		if (region) CloseHandleToObject(region, KERNEL_OBJECT_SHMEM);
+		EsHeapFree(event, sizeof(KEvent), K_FIXED);
+		EsHeapFree(ring, sizeof(IORing), K_FIXED);
+		return nullptr;
+	}
+
+	EsMemoryZero(header, bytes);
+	header->submissionCapacity = submissionCapacity;
+	header->completionCapacity = completionCapacity;
+	header->submissionsOffset = submissionsOffset;
+	header->completionsOffset = completionsOffset;
+
+	event->handles = 1;
+	event->autoReset = true;
+
+	ring->region = region;
+	ring->header = header;
+	ring->submissions = (EsIORequest *) ((uint8_t *) header + submissionsOffset);
+	ring->completions = (EsIOCompletion *) ((uint8_t *) header + completionsOffset);
+	ring->submissionCapacity = submissionCapacity;
+	ring->completionCapacity = completionCapacity;
+	ring->event = event;
+	ring->space = space;
+	ring->handles = 1;
+	ring->applicationHandles = 1;
+	MMSpaceOpenReference(space);
+
+	return ring;
+}
+
+void IORing::Destroy() {
+	MMFree(kernelMMSpace, header);
+	CloseHandleToObject(region, KERNEL_OBJECT_SHMEM);
+	CloseHandleToObject(event, KERNEL_OBJECT_EVENT);
+	MMSpaceCloseReference(space);
+	EsHeapFree(this, sizeof(IORing), K_FIXED);
+}
+
+void IORing::Complete(EsGeneric context, intptr_t result) {
+	KMutexAcquire(&mutex);
+	EsIOCompletion *completion = completions + (completionTail & (completionCapacity - 1));
+	completion->context = context;
+	completion->result = result;
+	__sync_synchronize();
+	header->completionTail = ++completionTail;
+	inProgress--;
+	KMutexRelease(&mutex);
+
+	KEventSet(event, true /* maybe already set */);
+}
+
+void IORingOperationRun(IORingOperation *operation) {
+	IORing *ring = operation->ring;
+	EsIORequest *request = &operation->request;
+	uint32_t accessFlags = operation->region && (operation->region->flags & MM_REGION_FILE) ? FS_FILE_ACCESS_USER_BUFFER_MAPPED : 0;
+	intptr_t result = 0;
+
+	ThreadSetTemporaryAddressSpace(ring->space);
+
+	if (KEventPoll(&ring->cancel)) {
+		// The application closed the ring before the request was started.
+		result = ES_ERROR_CANCELLED;
+	} else if (request->type == ES_IO_REQUEST_FILE_READ) {
+		result = FSFileReadSync((KNode *) operation->handle.object, request->buffer, request->offset, request->bytes, accessFlags);
+	} else if (request->type == ES_IO_REQUEST_FILE_WRITE) {
+		result = FSFileWriteSync((KNode *) operation->handle.object, request->buffer, request->offset, request->bytes, accessFlags);
+	} else if (request->type == ES_IO_REQUEST_DIRECTORY_ENUMERATE) {
+		EsDirectoryEnumerateCookie cookie = {};
+		result = FSDirectoryEnumerate((KNode *) operation->handle.object, (K_USER_BUFFER EsDirectoryChild *) request->buffer, 
+				request->bytes / sizeof(EsDirectoryChild), &cookie, ES_FLAGS_DEFAULT);
+	} else if (request->type == ES_IO_REQUEST_PIPE_READ || request->type == ES_IO_REQUEST_PIPE_WRITE) {
+		result = ((Pipe *) operation->handle.object)->Access(request->buffer, request->bytes, 
+				request->type == ES_IO_REQUEST_PIPE_WRITE, false /* not a user block request */, &ring->cancel);
+	}
+
+	ThreadSetTemporaryAddressSpace(nullptr);
+
+	if (operation->region) MMUnpinRegion(ring->space, operation->region);
+	CloseHandleToObject(operation->handle.object, operation->handle.type, operation->handle.flags);
+	ring->Complete(request->context, result);
+
+	KMutexAcquire(&ioRingWorkers.mutex);
+	ring->workers--;
+	// Another request from this ring may have been waiting for this thread's slot.
+	if (ioRingWorkers.queue.count) KEventSet(&ioRingWorkers.available, true /* maybe already set */);
+	KMutexRelease(&ioRingWorkers.mutex);
+
+	CloseHandleToObject(ring, KERNEL_OBJECT_IO_RING, IO_RING_REQUEST_HANDLE);
+	EsHeapFree(operation, sizeof(IORingOperation), K_FIXED);
+}
+
+IORingOperation *IORingWorkersTake() {
+	KMutexAssertLocked(&ioRingWorkers.mutex);
+
+	// Take the first request whose ring has not reached its limit of worker threads.
+	LinkedItem<IORingOperation> *item = ioRingWorkers.queue.firstItem;
+
+	while (item) {
+		IORingOperation *operation = item->thisItem;
+
+		if (operation->ring->workers < IO_RING_MAXIMUM_WORKERS_PER_RING) {
+			ioRingWorkers.queue.Remove(item);
+			operation->ring->workers++;
+			return operation;
+		}
+
+		item = item->nextItem;
+	}
+
+	return nullptr;
+}
+
+void IORingWorkerThread(uintptr_t) {
+	while (true) {
+		KMutexAcquire(&ioRingWorkers.mutex);
+
+		IORingOperation *operation;
+
+		while (!(operation = IORingWorkersTake())) {
+			KEventReset(&ioRingWorkers.available);
+			ioRingWorkers.idleThreadCount++;
+			KMutexRelease(&ioRingWorkers.mutex);
+			KEventWait(&ioRingWorkers.available);
+			KMutexAcquire(&ioRingWorkers.mutex);
+			ioRingWorkers.idleThreadCount--;
+		}
+
+		KMutexRelease(&ioRingWorkers.mutex);
+
+		IORingOperationRun(operation);
+	}
+}
+
+void IORingWorkersQueue(IORingOperation *operation) {
+	KMutexAcquire(&ioRingWorkers.mutex);
+	ioRingWorkers.queue.InsertEnd(&operation->item);
+
+	if (ioRingWorkers.idleThreadCount < ioRingWorkers.queue.count && ioRingWorkers.threadCount < IO_RING_MAXIMUM_WORKERS) {
+		if (KThreadCreate("IORingWorker", IORingWorkerThread)) {
+			ioRingWorkers.threadCount++;
+		} else {
+			KernelLog(LOG_ERROR, "Objects", "could not create worker", "IORingWorkersQueue - Could not create a worker thread.\n");
+		}
+	}
+
+	KEventSet(&ioRingWorkers.available, true /* maybe already set */);
+	KMutexRelease(&ioRingWorkers.mutex);
+}
+
+uintptr_t IORing::Enter(Process *process, bool *fatal) {
+	KMutexAcquire(&enterMutex);
+	EsDefer(KMutexRelease(&enterMutex));
+	size_t started = 0;
+	*fatal = false;
+
+	while (true) {
+		KMutexAcquire(&mutex);
+		uint32_t submissionTail = header->submissionTail;
+		uint32_t completionsQueued = completionTail - header->completionHead;
+		bool available = submissionHead != submissionTail && inProgress + completionsQueued < completionCapacity;
+		EsIORequest request = submissions[submissionHead & (submissionCapacity - 1)];
+		KMutexRelease(&mutex);
+
+		if (!available) {
+			return started;
+		}
+
+		IORingOperation *operation = (IORingOperation *) EsHeapAllocate(sizeof(IORingOperation), true, K_FIXED);
+
+		if (!operation) {
+			// Leave the request in the submission queue.
+			return started ? started : ES_ERROR_INSUFFICIENT_RESOURCES;
+		}
+
+		// Validate the request, in the same way as the synchronous system calls.
+
+		bool isFileRequest = request.type == ES_IO_REQUEST_FILE_READ || request.type == ES_IO_REQUEST_FILE_WRITE;
+		bool isDirectoryRequest = request.type == ES_IO_REQUEST_DIRECTORY_ENUMERATE;
+		bool isPipeRequest = request.type == ES_IO_REQUEST_PIPE_READ || request.type == ES_IO_REQUEST_PIPE_WRITE;
+		bool writesBuffer = request.type == ES_IO_REQUEST_FILE_READ || isDirectoryRequest || request.type == ES_IO_REQUEST_PIPE_READ;
+		uintptr_t error = ES_SUCCESS;
+
+		if (!isFileRequest && !isDirectoryRequest && !isPipeRequest) {
+			error = ES_FATAL_ERROR_OUT_OF_RANGE;
+		} else if (RESOLVE_HANDLE_NORMAL != process->handleTable.ResolveHandle(&operation->handle, request.handle, 
+					isPipeRequest ? KERNEL_OBJECT_PIPE : KERNEL_OBJECT_NODE)) {
+			error = ES_FATAL_ERROR_INVALID_HANDLE;
+			operation->handle.object = nullptr;
+		} else if ((isFileRequest || isDirectoryRequest) 
+				&& ((KNode *) operation->handle.object)->directoryEntry->type != (isFileRequest ? ES_NODE_FILE : ES_NODE_DIRECTORY)) {
+			error = ES_FATAL_ERROR_INCORRECT_NODE_TYPE;
+		} else if ((request.type == ES_IO_REQUEST_FILE_WRITE && !(operation->handle.flags & (ES_FILE_WRITE_SHARED | ES_FILE_WRITE)))
+				|| (request.type == ES_IO_REQUEST_PIPE_READ && (~operation->handle.flags & PIPE_READER))
+				|| (request.type == ES_IO_REQUEST_PIPE_WRITE && (~operation->handle.flags & PIPE_WRITER))) {
+			error = ES_FATAL_ERROR_INCORRECT_FILE_ACCESS;
+		} else if (request.bytes && (request.buffer || request.type != ES_IO_REQUEST_PIPE_READ)) {
+			// Null buffers are allowed for pipe reads, to discard the data.
+			operation->region = MMFindAndPinRegion(space, (uintptr_t) request.buffer, request.bytes);
+
+			if (!operation->region || (writesBuffer && (operation->region->flags & MM_REGION_READ_ONLY) 
+						&& (~operation->region->flags & MM_REGION_COPY_ON_WRITE))) {
+				error = ES_FATAL_ERROR_INVALID_BUFFER;
+			}
+		}
+
+		if (error != (uintptr_t) ES_SUCCESS) {
+			if (operation->region) MMUnpinRegion(space, operation->region);
+			if (operation->handle.object) CloseHandleToObject(operation->handle.object, operation->handle.type, operation->handle.flags);
+			EsHeapFree(operation, sizeof(IORingOperation), K_FIXED);
+			*fatal = true;
+			return error;
+		}
+
+		submissionHead++;
+		header->submissionHead = submissionHead;
+		KMutexAcquire(&mutex);
+		inProgress++;
+		KMutexRelease(&mutex);
+
+		OpenHandleToObject(this, KERNEL_OBJECT_IO_RING, IO_RING_REQUEST_HANDLE);
+		operation->ring = this;
+		operation->request = request;
+		operation->item.thisItem = operation;
+		IORingWorkersQueue(operation);
+		started++;
+	}
+}
+
 #endif
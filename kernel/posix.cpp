@@ -25,6 +25,11 @@ struct POSIXFile {
 	int type;
 };
 
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ (1031)
+#define F_GETPIPE_SZ (1032)
+#endif
+
 namespace POSIX { 
 	uintptr_t DoSyscall(_EsPOSIXSyscall syscall, uintptr_t *userStackPointer); 
 	KMutex forkMutex;
@@ -89,6 +94,29 @@ namespace POSIX {
 		}
 	}
 
+	intptr_t AccessPipeVectored(MMSpace *space, Pipe *pipe, const struct iovec *iovecs, size_t count, bool write) {
+		// Pass all the vectors to the pipe at once, 
+		// so that a short read doesn't block waiting for data for the later vectors.
+
+		EsPipeVector *vectors = (EsPipeVector *) EsHeapAllocate(count * sizeof(EsPipeVector), false, K_FIXED);
+		if (!vectors) return -ENOMEM;
+		EsDefer(EsHeapFree(vectors, count * sizeof(EsPipeVector), K_FIXED));
+		MMRegion **regions = (MMRegion **) EsHeapAllocate(count * sizeof(MMRegion *), false, K_FIXED);
+		if (!regions) return -ENOMEM;
+		EsDefer(EsHeapFree(regions, count * sizeof(MMRegion *), K_FIXED));
+
+		for (uintptr_t i = 0; i < count; i++) {
+			vectors[i].buffer = iovecs[i].iov_base;
+			vectors[i].bytes = iovecs[i].iov_len;
+			if (!vectors[i].buffer && vectors[i].bytes) return -EFAULT;
+		}
+
+		if (!PipePinVectors(space, vectors, regions, count, !write)) return -EFAULT;
+		size_t result = pipe->AccessVectored(vectors, count, write, true);
+		PipeUnpinVectors(space, regions, count);
+		return result;
+	}
+
 	intptr_t Read(POSIXFile *file, K_USER_BUFFER void *base, size_t length, bool baseMappedToFile) {
 		if (!length) return 0;
 
@@ -345,6 +373,14 @@ namespace POSIX {
 					// Duplicate with FD_CLOEXEC set.
 					OpenHandleToObject(file, KERNEL_OBJECT_POSIX_FD, FD_CLOEXEC);
 					return handleTable->OpenHandle(fd.object, FD_CLOEXEC, fd.type) ?: -ENFILE;
+				} else if (syscall.arguments[1] == F_GETPIPE_SZ) {
+					if (file->type != POSIX_FILE_PIPE) return -EBADF;
+					return file->pipe->maximumCapacity ?: PIPE_DEFAULT_MAXIMUM_CAPACITY;
+				} else if (syscall.arguments[1] == F_SETPIPE_SZ) {
+					if (file->type != POSIX_FILE_PIPE) return -EBADF;
+					if (syscall.arguments[2] < 0) return -EINVAL;
+					if (!file->pipe->SetMaximumCapacity(syscall.arguments[2])) return -EBUSY;
+					return file->pipe->maximumCapacity;
 				} else {
 					KernelPanic("POSIX::DoSyscall - Unimplemented fcntl %d.\n", syscall.arguments[1]);
 				}
@@ -406,6 +442,10 @@ namespace POSIX {
 				EsMemoryCopy(vectors, (void *) syscall.arguments[1], syscall.arguments[2] * sizeof(struct iovec));
 				EsDefer(EsHeapFree(vectors, syscall.arguments[2] * sizeof(struct iovec), K_FIXED));
 
+				if (file->type == POSIX_FILE_PIPE && !fromKernel) {
+					return AccessPipeVectored(currentVMM, file->pipe, vectors, syscall.arguments[2], false);
+				}
+
 				size_t bytesRead = 0;
 
 				for (uintptr_t i = 0; i < (uintptr_t) syscall.arguments[2]; i++) {
@@ -446,6 +486,10 @@ namespace POSIX {
 					return -EACCES;
 				}
 
+				if (file->type == POSIX_FILE_PIPE && !fromKernel) {
+					return AccessPipeVectored(currentVMM, file->pipe, vectors, syscall.arguments[2], true);
+				}
+
 				for (uintptr_t i = 0; i < (uintptr_t) syscall.arguments[2]; i++) {
 					if (!vectors[i].iov_len) continue;
 					// EsPrint("writev %d: %x/%d\n", i, vectors[i].iov_base, vectors[i].iov_len);
@@ -707,7 +751,8 @@ namespace POSIX {
 						return -ENOMEM;
 					}
 
-					size_t count = FSDirectoryEnumerate(file->node, buffer, bufferSize);
+					EsDirectoryEnumerateCookie cookie = {};
+					size_t count = FSDirectoryEnumerate(file->node, buffer, bufferSize, &cookie, ES_DIRECTORY_ENUMERATE_NAMES_ONLY);
 
 					if (ES_CHECK_ERROR(count)) {
 						EsHeapFree(buffer, sizeof(EsDirectoryChild) * bufferSize, K_FIXED);
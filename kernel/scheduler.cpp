@@ -106,7 +106,10 @@ struct Thread {
 	volatile bool receivedYieldIPI; // Used to terminate a thread executing on a different processor.
 
 	union {
-		KMutex *volatile mutex;
+		struct {
+			KMutex *volatile mutex;
+			Thread *mutexOwner; // The owner when the thread was put in the blockedThreads list; its blockedThreadPriorities were incremented.
+		};
 
 		struct {
 			KWriterLock *volatile writerLock;
@@ -203,8 +206,8 @@ struct Scheduler {
 	void CreateProcessorThreads(CPULocalStorage *local);
 	void AddActiveThread(Thread *thread, bool start /* put it at the start of the active list */); // Add an active thread into the queue.
 	void MaybeUpdateActiveList(Thread *thread); // After changing the priority of a thread, call this to move it to the correct active thread queue if needed.
-	void NotifyObject(LinkedList<Thread> *blockedThreads, bool unblockAll, Thread *previousMutexOwner = nullptr);
-	void UnblockThread(Thread *unblockedThread, Thread *previousMutexOwner = nullptr);
+	void NotifyObject(LinkedList<Thread> *blockedThreads, bool unblockAll);
+	void UnblockThread(Thread *unblockedThread);
 	Thread *PickThread(CPULocalStorage *local); // Pick the next thread to execute.
 	int8_t GetThreadEffectivePriority(Thread *thread);
 
@@ -989,7 +992,7 @@ void ProcessRemove(Process *process) {
 
 	// Free all the remaining messages in the message queue.
 	// This is done after closing all handles, since closing handles can generate messages.
-	process->messageQueue.messages.Free();
+	process->messageQueue.Free();
 
 	if (process->blockShutdown) {
 		if (1 == __sync_fetch_and_sub(&scheduler.blockShutdownProcessCount, 1)) {
@@ -1216,9 +1219,14 @@ void Scheduler::Yield(InterruptContext *context) {
 	else if (local->currentThread->state == THREAD_WAITING_MUTEX) {
 		KMutex *mutex = local->currentThread->blocking.mutex;
 
-		if (!keepThreadAlive && mutex->owner) {
-			mutex->owner->blockedThreadPriorities[local->currentThread->priority]++;
-			MaybeUpdateActiveList(mutex->owner);
+		// The owner can be cleared without the dispatch spinlock, so only read it once.
+		// If it is cleared after this, KMutexRelease will see the waiterCount and notify the blockedThreads list.
+		Thread *owner = mutex->owner;
+
+		if (!keepThreadAlive && owner && owner != local->currentThread /* the mutex may have been handed to this thread */) {
+			owner->blockedThreadPriorities[local->currentThread->priority]++;
+			MaybeUpdateActiveList(owner);
+			local->currentThread->blocking.mutexOwner = owner;
 			mutex->blockedThreads.InsertEnd(&local->currentThread->item);
 		} else {
 			local->currentThread->state = THREAD_ACTIVE;
@@ -2,7 +2,30 @@
 // It is released under the terms of the MIT license -- see LICENSE.md.
 // Written by: nakst.
 
-#ifdef IMPLEMENTATION
+#ifndef IMPLEMENTATION
+
+// Address-keyed wait queues, used to implement user mode synchronisation primitives.
+// Waiters are keyed by their address space and the virtual address of the futex word.
+
+struct FutexWaiter {
+	MMSpace *space;
+	uintptr_t address;
+	KEvent event;
+	LinkedItem<FutexWaiter> item;
+};
+
+struct FutexBucket {
+	KMutex mutex;
+	LinkedList<FutexWaiter> waiters;
+};
+
+#define FUTEX_BUCKET_COUNT (256)
+FutexBucket futexBuckets[FUTEX_BUCKET_COUNT];
+
+EsError FutexWait(MMSpace *space, uintptr_t address, uint32_t expectedValue, uintptr_t timeoutMs, bool *invalidAddress);
+size_t FutexWake(MMSpace *space, uintptr_t address, size_t count);
+
+#else
 
 void KSpinlockAcquire(KSpinlock *spinlock) {
 	if (scheduler.panic) return;
@@ -94,6 +117,8 @@ void KSpinlockAssertLocked(KSpinlock *spinlock) {
 	}
 }
 
+#define K_MUTEX_SPIN_ITERATIONS (4000) // How long to spin waiting for an executing owner to release a mutex before blocking.
+
 #ifdef DEBUG_BUILD
 bool _KMutexAcquire(KMutex *mutex, const char *cMutexString, const char *cFile, int line) {
 #else
@@ -127,48 +152,62 @@ bool KMutexAcquire(KMutex *mutex) {
 	}
 
 	while (true) {
+		// If the mutex is free, take it without going through the scheduler.
+		if (!__sync_val_compare_and_swap(&mutex->owner, nullptr, currentThread)) break;
+
+		if (!GetLocalStorage() || !GetLocalStorage()->schedulerReady) {
+			continue;
+		}
+
+		if (currentThread->state != THREAD_ACTIVE) {
+			KernelPanic("KWaitMutex - Attempting to wait on a mutex in a non-active thread.\n");
+		}
+
+		// Is the owner of this mutex executing?
+		// If so, it will probably release the mutex soon, so spin for a while before blocking.
 		KSpinlockAcquire(&scheduler.dispatchSpinlock);
-		Thread *old = mutex->owner;
-		if (!old) mutex->owner = currentThread;
+		Thread *owner = mutex->owner;
+		bool spin = owner && owner->executing;
 		KSpinlockRelease(&scheduler.dispatchSpinlock);
-		if (!old) break;
-
-		__sync_synchronize();
 
-		if (GetLocalStorage() && GetLocalStorage()->schedulerReady) {
-			if (currentThread->state != THREAD_ACTIVE) {
-				KernelPanic("KWaitMutex - Attempting to wait on a mutex in a non-active thread.\n");
+		if (spin) {
+			for (uintptr_t i = 0; i < K_MUTEX_SPIN_ITERATIONS && mutex->owner == owner; i++) {
+				__sync_synchronize();
 			}
 
-			currentThread->blocking.mutex = mutex;
-			__sync_synchronize();
+			if (mutex->owner != owner) {
+				continue;
+			}
+		}
 
-			// Instead of spinning on the lock, 
-			// let's tell the scheduler to not schedule this thread
-			// until it's released.
-			currentThread->state = THREAD_WAITING_MUTEX;
+		// Tell the scheduler to not schedule this thread until the mutex is released.
+		// The waiterCount must be incremented before the scheduler checks the owner; see KMutexRelease.
+		__sync_fetch_and_add(&mutex->waiterCount, 1);
+		currentThread->blocking.mutex = mutex;
+		__sync_synchronize();
+		currentThread->state = THREAD_WAITING_MUTEX;
 
-			KSpinlockAcquire(&scheduler.dispatchSpinlock);
-			// Is the owner of this mutex executing?
-			// If not, there's no point in spinning on it.
-			bool spin = mutex && mutex->owner && mutex->owner->executing;
-			KSpinlockRelease(&scheduler.dispatchSpinlock);
+		if (mutex->owner && mutex->owner != currentThread) {
+			ProcessorFakeTimerInterrupt();
+		}
 
-			if (!spin && currentThread->blocking.mutex->owner) {
-				ProcessorFakeTimerInterrupt();
-			}
+		// Early exit if this is a user request to block the thread and the thread is terminating.
+		while ((!currentThread->terminating || currentThread->terminatableState != THREAD_USER_BLOCK_REQUEST) 
+				&& mutex->owner && mutex->owner != currentThread) {
+			currentThread->state = THREAD_WAITING_MUTEX;
+		}
 
-			// Early exit if this is a user request to block the thread and the thread is terminating.
-			while ((!currentThread->terminating || currentThread->terminatableState != THREAD_USER_BLOCK_REQUEST) && mutex->owner) {
-				currentThread->state = THREAD_WAITING_MUTEX;
-			}
+		currentThread->state = THREAD_ACTIVE;
+		__sync_fetch_and_sub(&mutex->waiterCount, 1);
 
-			currentThread->state = THREAD_ACTIVE;
+		if (mutex->owner == currentThread) {
+			// The releasing thread handed the mutex to us.
+			break;
+		}
 
-			if (currentThread->terminating && currentThread->terminatableState == THREAD_USER_BLOCK_REQUEST) {
-				// We didn't acquire the mutex because the thread is terminating.
-				return false;
-			}
+		if (currentThread->terminating && currentThread->terminatableState == THREAD_USER_BLOCK_REQUEST) {
+			// We didn't acquire the mutex because the thread is terminating.
+			return false;
 		}
 	}
 
@@ -218,25 +257,53 @@ void KMutexRelease(KMutex *mutex) {
 
 	KMutexAssertLocked(mutex);
 	Thread *currentThread = GetCurrentThread();
-	KSpinlockAcquire(&scheduler.dispatchSpinlock);
+	Thread *expectedOwner = currentThread ?: (Thread *) 1;
+	volatile bool preempt = false;
 
-#ifdef DEBUG_BUILD
-	// EsPrint("$%x:%x:0\n", owner, id);
-#endif
+	if (!mutex->waiterCount) {
+		// No threads are waiting, so release the mutex without going through the scheduler.
+		Thread *temp = __sync_val_compare_and_swap(&mutex->owner, expectedOwner, nullptr);
+		if (expectedOwner != temp) KernelPanic("KMutex::Release - Invalid owner thread (%x, expected %x).\n", temp, currentThread);
+		__sync_synchronize();
 
-	if (currentThread) {
-		Thread *temp = __sync_val_compare_and_swap(&mutex->owner, currentThread, nullptr);
-		if (currentThread != temp) KernelPanic("KMutex::Release - Invalid owner thread (%x, expected %x).\n", temp, currentThread);
-	} else mutex->owner = nullptr;
+		if (mutex->waiterCount) {
+			// A thread started waiting before seeing the mutex was released.
+			// It may have already been put in the blockedThreads list, so wake it up to try again.
+			KSpinlockAcquire(&scheduler.dispatchSpinlock);
+			preempt = mutex->blockedThreads.count;
+			if (scheduler.started) scheduler.NotifyObject(&mutex->blockedThreads, true);
+			KSpinlockRelease(&scheduler.dispatchSpinlock);
+		}
+	} else {
+		KSpinlockAcquire(&scheduler.dispatchSpinlock);
+		LinkedItem<Thread> *firstItem = mutex->blockedThreads.firstItem;
+
+		if (scheduler.started && firstItem) {
+			// Hand the mutex directly to the first blocked thread, so that it cannot be taken by a spinning thread in the meantime.
+			// The remaining blocked threads are now waiting on the new owner, so move their priorities to it.
+			Thread *newOwner = firstItem->thisItem;
+			Thread *temp = __sync_val_compare_and_swap(&mutex->owner, expectedOwner, newOwner);
+			if (expectedOwner != temp) KernelPanic("KMutex::Release - Invalid owner thread (%x, expected %x).\n", temp, currentThread);
+			scheduler.UnblockThread(newOwner);
+
+			for (LinkedItem<Thread> *item = mutex->blockedThreads.firstItem; item; item = item->nextItem) {
+				Thread *thread = item->thisItem;
+				thread->blocking.mutexOwner->blockedThreadPriorities[thread->priority]--;
+				newOwner->blockedThreadPriorities[thread->priority]++;
+				scheduler.MaybeUpdateActiveList(thread->blocking.mutexOwner);
+				thread->blocking.mutexOwner = newOwner;
+			}
 
-	volatile bool preempt = mutex->blockedThreads.count;
+			scheduler.MaybeUpdateActiveList(newOwner);
+			preempt = true;
+		} else {
+			Thread *temp = __sync_val_compare_and_swap(&mutex->owner, expectedOwner, nullptr);
+			if (expectedOwner != temp) KernelPanic("KMutex::Release - Invalid owner thread (%x, expected %x).\n", temp, currentThread);
+		}
 
-	if (scheduler.started) {
-		// NOTE We unblock all waiting threads, because of how blockedThreadPriorities works.
-		scheduler.NotifyObject(&mutex->blockedThreads, true, currentThread); 
+		KSpinlockRelease(&scheduler.dispatchSpinlock);
 	}
 
-	KSpinlockRelease(&scheduler.dispatchSpinlock);
 	__sync_synchronize();
 
 #ifdef DEBUG_BUILD
@@ -695,26 +762,104 @@ uintptr_t KEventWaitMultiple(KEvent **events, size_t count) {
 	return -1; // Exited from termination.
 }
 
-void Scheduler::UnblockThread(Thread *unblockedThread, Thread *previousMutexOwner) {
-	KSpinlockAssertLocked(&dispatchSpinlock);
+FutexBucket *FutexGetBucket(MMSpace *space, uintptr_t address) {
+	uintptr_t hash = (address >> 2) ^ ((uintptr_t) space >> 6);
+	hash ^= hash >> 11;
+	return &futexBuckets[hash % FUTEX_BUCKET_COUNT];
+}
 
-	if (unblockedThread->state == THREAD_WAITING_MUTEX) {
-		if (unblockedThread->item.list) {
-			// If we get here from KMutex::Release -> Scheduler::NotifyObject -> Scheduler::UnblockedThread,
-			// the mutex owner has already been cleared to nullptr, so use the previousMutexOwner parameter.
-			// But if we get here from Scheduler::TerminateThread, the mutex wasn't released;
-			// rather, the waiting thread was unblocked as it is in the WAIT system call, but needs to terminate.
+EsError FutexWait(MMSpace *space, uintptr_t address, uint32_t expectedValue, uintptr_t timeoutMs, bool *invalidAddress) {
+	FutexBucket *bucket = FutexGetBucket(space, address);
+	FutexWaiter waiter = {};
+	waiter.space = space;
+	waiter.address = address;
+	waiter.item.thisItem = &waiter;
+	*invalidAddress = false;
 
-			if (!previousMutexOwner) {
-				KMutex *mutex = EsContainerOf(KMutex, blockedThreads, unblockedThread->item.list);
+	// The value must be compared with the bucket locked,
+	// so that a wake issued after another thread modifies the value cannot be missed.
 
-				if (&mutex->blockedThreads != unblockedThread->item.list) {
-					KernelPanic("Scheduler::UnblockThread - Unblocked thread %x was not in a mutex blockedThreads list.\n", 
-							unblockedThread);
-				}
+	KMutexAcquire(&bucket->mutex);
 
-				previousMutexOwner = mutex->owner;
-			}
+	uint32_t value;
+
+	if (!MMArchSafeCopy((uintptr_t) &value, address, sizeof(uint32_t))) {
+		KMutexRelease(&bucket->mutex);
+		*invalidAddress = true;
+		return ES_ERROR_UNKNOWN;
+	}
+
+	if (value != expectedValue) {
+		KMutexRelease(&bucket->mutex);
+		return ES_ERROR_FUTEX_VALUE_CHANGED;
+	}
+
+	bucket->waiters.InsertEnd(&waiter.item);
+	KMutexRelease(&bucket->mutex);
+
+	KEvent *events[2] = { &waiter.event };
+	size_t eventCount = 1;
+	KTimer timer = {};
+
+	if (timeoutMs != (uintptr_t) ES_WAIT_NO_TIMEOUT) {
+		KTimerSet(&timer, timeoutMs);
+		events[eventCount++] = &timer.event;
+	}
+
+	Thread *thread = GetCurrentThread();
+	thread->terminatableState = THREAD_USER_BLOCK_REQUEST;
+	KEventWaitMultiple(events, eventCount);
+	thread->terminatableState = THREAD_IN_SYSCALL;
+
+	if (timeoutMs != (uintptr_t) ES_WAIT_NO_TIMEOUT) {
+		KTimerRemove(&timer);
+	}
+
+	// If we are still on the list, then we were not woken.
+	// The waker removes us from the list before setting the event, so checking this with the bucket locked is sufficient.
+
+	KMutexAcquire(&bucket->mutex);
+	bool woken = !waiter.item.list;
+	if (!woken) bucket->waiters.Remove(&waiter.item);
+	KMutexRelease(&bucket->mutex);
+
+	return woken ? ES_SUCCESS : ES_ERROR_TIMEOUT_REACHED;
+}
+
+size_t FutexWake(MMSpace *space, uintptr_t address, size_t count) {
+	FutexBucket *bucket = FutexGetBucket(space, address);
+	size_t woken = 0;
+
+	KMutexAcquire(&bucket->mutex);
+
+	LinkedItem<FutexWaiter> *item = bucket->waiters.firstItem;
+
+	while (item && woken < count) {
+		LinkedItem<FutexWaiter> *next = item->nextItem;
+		FutexWaiter *waiter = item->thisItem;
+
+		if (waiter->space == space && waiter->address == address) {
+			bucket->waiters.Remove(item);
+			KEventSet(&waiter->event);
+			woken++;
+		}
+
+		item = next;
+	}
+
+	KMutexRelease(&bucket->mutex);
+
+	return woken;
+}
+
+void Scheduler::UnblockThread(Thread *unblockedThread) {
+	KSpinlockAssertLocked(&dispatchSpinlock);
+
+	if (unblockedThread->state == THREAD_WAITING_MUTEX) {
+		if (unblockedThread->item.list) {
+			// The mutex may have been released (or handed to another thread) since the thread started blocking,
+			// so use the owner that was recorded when the thread was put in the blockedThreads list.
+			Thread *previousMutexOwner = unblockedThread->blocking.mutexOwner;
 
 			if (!previousMutexOwner->blockedThreadPriorities[unblockedThread->priority]) {
 				KernelPanic("Scheduler::UnblockThread - blockedThreadPriorities was zero (%x/%x).\n", 
@@ -762,7 +907,7 @@ void Scheduler::UnblockThread(Thread *unblockedThread, Thread *previousMutexOwne
 	// TODO If any processors are idleing, send them a yield IPI.
 }
 
-void Scheduler::NotifyObject(LinkedList<Thread> *blockedThreads, bool unblockAll, Thread *previousMutexOwner) {
+void Scheduler::NotifyObject(LinkedList<Thread> *blockedThreads, bool unblockAll) {
 	KSpinlockAssertLocked(&dispatchSpinlock);
 
 	LinkedItem<Thread> *unblockedItem = blockedThreads->firstItem;
@@ -775,7 +920,7 @@ void Scheduler::NotifyObject(LinkedList<Thread> *blockedThreads, bool unblockAll
 	do {
 		LinkedItem<Thread> *nextUnblockedItem = unblockedItem->nextItem;
 		Thread *unblockedThread = unblockedItem->thisItem;
-		UnblockThread(unblockedThread, previousMutexOwner);
+		UnblockThread(unblockedThread);
 		unblockedItem = nextUnblockedItem;
 	} while (unblockAll && unblockedItem);
 }
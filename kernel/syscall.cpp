@@ -255,18 +255,42 @@ SYSCALL_IMPLEMENT(ES_SYSCALL_EYEDROP_START) {
 }
 
 SYSCALL_IMPLEMENT(ES_SYSCALL_MESSAGE_GET) {
-	_EsMessageWithObject message;
-	EsMemoryZero(&message, sizeof(_EsMessageWithObject));
+	// argument0 points to an array of argument1 messages; if argument1 is 0, a single message is received.
+	// Messages are copied out in small batches, so that the queue isn't locked while accessing user memory.
 
-	if (currentProcess->messageQueue.GetMessage(&message)) {
-		SYSCALL_WRITE(argument0, &message, sizeof(_EsMessageWithObject));
-		SYSCALL_RETURN(ES_SUCCESS, false);
+#define MESSAGE_GET_BATCH_SIZE (4)
+	_EsMessageWithObject messages[MESSAGE_GET_BATCH_SIZE];
+	size_t maximumCount = argument1 ? argument1 : 1;
+	size_t received = 0;
+
+	if (maximumCount > SYSCALL_BUFFER_LIMIT / sizeof(_EsMessageWithObject)) {
+		SYSCALL_RETURN(ES_FATAL_ERROR_OUT_OF_RANGE, true);
+	}
+
+	while (received < maximumCount) {
+		size_t count = maximumCount - received;
+		if (count > MESSAGE_GET_BATCH_SIZE) count = MESSAGE_GET_BATCH_SIZE;
+		count = currentProcess->messageQueue.GetMessages(messages, count);
+		if (!count) break;
+		SYSCALL_WRITE(argument0 + received * sizeof(_EsMessageWithObject), messages, count * sizeof(_EsMessageWithObject));
+		received += count;
+	}
+
+	if (received) {
+		SYSCALL_RETURN(received, false);
 	} else {
 		SYSCALL_RETURN(ES_ERROR_NO_MESSAGES_AVAILABLE, false);
 	}
 }
 
+SYSCALL_IMPLEMENT(ES_SYSCALL_MESSAGE_RING_CREATE) {
+	void *address = currentProcess->messageQueue.CreateRing(currentVMM);
+	if (!address) SYSCALL_RETURN(ES_ERROR_INSUFFICIENT_RESOURCES, false);
+	SYSCALL_RETURN((uintptr_t) address, false);
+}
+
 SYSCALL_IMPLEMENT(ES_SYSCALL_MESSAGE_WAIT) {
+	currentProcess->messageQueue.ResetNotEmptyEventIfEmpty();
 	currentThread->terminatableState = THREAD_USER_BLOCK_REQUEST;
 	KEventWait(&currentProcess->messageQueue.notEmpty, argument0 /* timeout */);
 	currentThread->terminatableState = THREAD_IN_SYSCALL;
@@ -631,6 +655,8 @@ SYSCALL_IMPLEMENT(ES_SYSCALL_VOLUME_GET_INFORMATION) {
 	information.flags = fileSystem->volumeFlags;
 	information.installationIdentifier = fileSystem->installationIdentifier;
 	information.identifier = fileSystem->identifier;
+	information.metadataCacheHits = fileSystem->cacheSpace.readHits;
+	information.metadataCacheMisses = fileSystem->cacheSpace.readMisses;
 
 	SYSCALL_WRITE(argument1, &information, sizeof(EsVolumeInformation));
 	SYSCALL_RETURN(ES_SUCCESS, false);
@@ -801,6 +827,25 @@ SYSCALL_IMPLEMENT(ES_SYSCALL_EVENT_RESET) {
 	SYSCALL_RETURN(ES_SUCCESS, false);
 }
 
+SYSCALL_IMPLEMENT(ES_SYSCALL_FUTEX_WAIT) {
+	if ((argument0 & (sizeof(uint32_t) - 1)) || !MMArchIsBufferInUserRange(argument0, sizeof(uint32_t))) {
+		SYSCALL_RETURN(ES_FATAL_ERROR_INVALID_BUFFER, true);
+	}
+
+	bool invalidAddress;
+	EsError error = FutexWait(currentVMM, argument0, argument1, argument2, &invalidAddress);
+	if (invalidAddress) SYSCALL_RETURN(ES_FATAL_ERROR_INVALID_BUFFER, true);
+	SYSCALL_RETURN(error, false);
+}
+
+SYSCALL_IMPLEMENT(ES_SYSCALL_FUTEX_WAKE) {
+	if ((argument0 & (sizeof(uint32_t) - 1)) || !MMArchIsBufferInUserRange(argument0, sizeof(uint32_t))) {
+		SYSCALL_RETURN(ES_FATAL_ERROR_INVALID_BUFFER, true);
+	}
+
+	SYSCALL_RETURN(FutexWake(currentVMM, argument0, argument1), false);
+}
+
 SYSCALL_IMPLEMENT(ES_SYSCALL_SLEEP) {
 	KTimer timer = {};
 #ifdef ES_BITS_64
@@ -1184,7 +1229,13 @@ SYSCALL_IMPLEMENT(ES_SYSCALL_DIRECTORY_ENUMERATE) {
 	if (argument2 > SYSCALL_BUFFER_LIMIT / sizeof(EsDirectoryChild)) SYSCALL_RETURN(ES_FATAL_ERROR_INVALID_BUFFER, true);
 	SYSCALL_BUFFER(argument1, argument2 * sizeof(EsDirectoryChild), 1, true /* write */);
 
-	SYSCALL_RETURN(FSDirectoryEnumerate(node, (K_USER_BUFFER EsDirectoryChild *) argument1, argument2), false);
+	// If argument3 is set, it points to a _EsDirectoryEnumeratePage, and the enumeration resumes from its cookie.
+	// Otherwise, the enumeration starts at the first child.
+	_EsDirectoryEnumeratePage page = {};
+	if (argument3) SYSCALL_READ(&page, argument3, sizeof(page));
+	ptrdiff_t result = FSDirectoryEnumerate(node, (K_USER_BUFFER EsDirectoryChild *) argument1, argument2, &page.cookie, page.flags);
+	if (argument3 && result >= 0) SYSCALL_WRITE(argument3, &page.cookie, sizeof(page.cookie));
+	SYSCALL_RETURN(result, false);
 }
 
 SYSCALL_IMPLEMENT(ES_SYSCALL_FILE_CONTROL) {
@@ -1225,6 +1276,19 @@ SYSCALL_IMPLEMENT(ES_SYSCALL_FILE_CONTROL) {
 		if (error == ES_SUCCESS) {
 			SYSCALL_WRITE(argument2, &identifier, sizeof(EsUniqueIdentifier));
 		}
+	} else if (argument1 == ES_FILE_CONTROL_GET_EXTENT_COUNT) {
+		uint64_t extentCount = 0;
+		KWriterLockTake(&file->writerLock, K_LOCK_SHARED);
+
+		if (file->fileSystem->countExtents) {
+			error = file->fileSystem->countExtents(file, &extentCount);
+		}
+
+		KWriterLockReturn(&file->writerLock, K_LOCK_SHARED);
+
+		if (error == ES_SUCCESS) {
+			SYSCALL_WRITE(argument2, &extentCount, sizeof(uint64_t));
+		}
 	}
 
 	SYSCALL_RETURN(error, false);
@@ -1250,6 +1314,39 @@ SYSCALL_IMPLEMENT(ES_SYSCALL_BATCH) {
 	SYSCALL_RETURN(ES_SUCCESS, false);
 }
 
+SYSCALL_IMPLEMENT(ES_SYSCALL_IO_RING_CREATE) {
+	if (!argument0 || argument0 > IO_RING_MAXIMUM_ENTRIES) SYSCALL_RETURN(ES_FATAL_ERROR_OUT_OF_RANGE, true);
+
+	void *address;
+	IORing *ring = IORingCreate(currentVMM, argument0, &address);
+	if (!ring) SYSCALL_RETURN(ES_ERROR_INSUFFICIENT_RESOURCES, false);
+
+	EsIORing output = {};
+	output.header = (_EsIORingHeader *) address;
+	output.submissions = (EsIORequest *) ((uint8_t *) address + ring->header->submissionsOffset);
+	output.completions = (EsIOCompletion *) ((uint8_t *) address + ring->header->completionsOffset);
+	OpenHandleToObject(ring->event, KERNEL_OBJECT_EVENT);
+	output.event = currentProcess->handleTable.OpenHandle(ring->event, 0, KERNEL_OBJECT_EVENT);
+	output.handle = currentProcess->handleTable.OpenHandle(ring, 0, KERNEL_OBJECT_IO_RING);
+
+	if (output.event == ES_INVALID_HANDLE || output.handle == ES_INVALID_HANDLE) {
+		if (output.event != ES_INVALID_HANDLE) currentProcess->handleTable.CloseHandle(output.event);
+		if (output.handle != ES_INVALID_HANDLE) currentProcess->handleTable.CloseHandle(output.handle);
+		MMFree(currentVMM, address);
+		SYSCALL_RETURN(ES_ERROR_INSUFFICIENT_RESOURCES, false);
+	}
+
+	SYSCALL_WRITE(argument1, &output, sizeof(EsIORing));
+	SYSCALL_RETURN(ES_SUCCESS, false);
+}
+
+SYSCALL_IMPLEMENT(ES_SYSCALL_IO_RING_ENTER) {
+	SYSCALL_HANDLE(argument0, KERNEL_OBJECT_IO_RING, ring, IORing);
+	bool fatal;
+	uintptr_t result = ring->Enter(currentProcess, &fatal);
+	SYSCALL_RETURN(result, fatal);
+}
+
 SYSCALL_IMPLEMENT(ES_SYSCALL_CONSTANT_BUFFER_READ) {
 	SYSCALL_HANDLE(argument0, KERNEL_OBJECT_CONSTANT_BUFFER, buffer, ConstantBuffer);
 	if (!argument1) SYSCALL_RETURN(buffer->bytes, false);
@@ -1271,7 +1368,7 @@ SYSCALL_IMPLEMENT(ES_SYSCALL_PROCESS_GET_STATE) {
 #ifdef PAUSE_ON_USERLAND_CRASH
 		| (process->pausedFromCrash ? ES_PROCESS_STATE__PAUSED_FROM_CRASH : 0)
 #endif
-		| (process->messageQueue.pinged ? ES_PROCESS_STATE__PINGED : 0);
+		| (process->messageQueue.IsPinged() ? ES_PROCESS_STATE__PINGED : 0);
 
 	SYSCALL_WRITE(argument1, &state, sizeof(EsProcessState));
 	SYSCALL_RETURN(ES_SUCCESS, false);
@@ -1518,6 +1615,65 @@ SYSCALL_IMPLEMENT(ES_SYSCALL_PIPE_WRITE) {
 	SYSCALL_RETURN(pipe->Access((void *) argument1, argument2, true, true), false);
 }
 
+SYSCALL_IMPLEMENT(ES_SYSCALL_PIPE_READ_VECTORED) {
+	if (!argument2) SYSCALL_RETURN(0, false);
+	if (argument2 > PIPE_MAXIMUM_VECTORS) SYSCALL_RETURN(ES_FATAL_ERROR_OUT_OF_RANGE, true);
+	SYSCALL_HANDLE_2(argument0, KERNEL_OBJECT_PIPE, _pipe);
+	Pipe *pipe = (Pipe *) _pipe.object;
+	if ((~_pipe.flags & PIPE_READER)) SYSCALL_RETURN(ES_FATAL_ERROR_INCORRECT_FILE_ACCESS, true);
+
+	EsPipeVector *vectors;
+	SYSCALL_READ_HEAP(vectors, argument1, argument2 * sizeof(EsPipeVector));
+	MMRegion **regions = (MMRegion **) EsHeapAllocate(argument2 * sizeof(MMRegion *), false, K_FIXED);
+	if (!regions) SYSCALL_RETURN(ES_ERROR_INSUFFICIENT_RESOURCES, false);
+	EsDefer(EsHeapFree(regions, argument2 * sizeof(MMRegion *), K_FIXED));
+	if (!PipePinVectors(currentVMM, vectors, regions, argument2, true)) SYSCALL_RETURN(ES_FATAL_ERROR_INVALID_BUFFER, true);
+	size_t result = pipe->AccessVectored(vectors, argument2, false, true);
+	PipeUnpinVectors(currentVMM, regions, argument2);
+	SYSCALL_RETURN(result, false);
+}
+
+SYSCALL_IMPLEMENT(ES_SYSCALL_PIPE_WRITE_VECTORED) {
+	if (!argument2) SYSCALL_RETURN(0, false);
+	if (argument2 > PIPE_MAXIMUM_VECTORS) SYSCALL_RETURN(ES_FATAL_ERROR_OUT_OF_RANGE, true);
+	SYSCALL_HANDLE_2(argument0, KERNEL_OBJECT_PIPE, _pipe);
+	Pipe *pipe = (Pipe *) _pipe.object;
+	if ((~_pipe.flags & PIPE_WRITER)) SYSCALL_RETURN(ES_FATAL_ERROR_INCORRECT_FILE_ACCESS, true);
+
+	EsPipeVector *vectors;
+	SYSCALL_READ_HEAP(vectors, argument1, argument2 * sizeof(EsPipeVector));
+	MMRegion **regions = (MMRegion **) EsHeapAllocate(argument2 * sizeof(MMRegion *), false, K_FIXED);
+	if (!regions) SYSCALL_RETURN(ES_ERROR_INSUFFICIENT_RESOURCES, false);
+	EsDefer(EsHeapFree(regions, argument2 * sizeof(MMRegion *), K_FIXED));
+
+	for (uintptr_t i = 0; i < argument2; i++) {
+		// Data can't be discarded when writing.
+		if (!vectors[i].buffer && vectors[i].bytes) SYSCALL_RETURN(ES_FATAL_ERROR_INVALID_BUFFER, true);
+	}
+
+	if (!PipePinVectors(currentVMM, vectors, regions, argument2, false)) SYSCALL_RETURN(ES_FATAL_ERROR_INVALID_BUFFER, true);
+	size_t result = pipe->AccessVectored(vectors, argument2, true, true);
+	PipeUnpinVectors(currentVMM, regions, argument2);
+	SYSCALL_RETURN(result, false);
+}
+
+SYSCALL_IMPLEMENT(ES_SYSCALL_PIPE_SPLICE) {
+	if (!argument3) SYSCALL_RETURN(0, false);
+	SYSCALL_HANDLE_2(argument0, KERNEL_OBJECT_PIPE, _pipe);
+	SYSCALL_HANDLE_2(argument1, KERNEL_OBJECT_NODE, file);
+	Pipe *pipe = (Pipe *) _pipe.object;
+	KNode *node = (KNode *) file.object;
+	bool toFile = _pipe.flags & PIPE_READER;
+
+	if (node->directoryEntry->type != ES_NODE_FILE) {
+		SYSCALL_RETURN(ES_FATAL_ERROR_INCORRECT_NODE_TYPE, true);
+	} else if (toFile && !(file.flags & (ES_FILE_WRITE_SHARED | ES_FILE_WRITE))) {
+		SYSCALL_RETURN(ES_FATAL_ERROR_INCORRECT_FILE_ACCESS, true);
+	}
+
+	SYSCALL_RETURN(pipe->Splice(node, argument2, argument3, toFile, true), false);
+}
+
 SYSCALL_IMPLEMENT(ES_SYSCALL_DOMAIN_NAME_RESOLVE) {
 	SYSCALL_PERMISSION(ES_PERMISSION_NETWORKING);
 
@@ -1531,6 +1687,11 @@ SYSCALL_IMPLEMENT(ES_SYSCALL_DOMAIN_NAME_RESOLVE) {
 	EsAddress address;
 	EsMemoryZero(&address, sizeof(EsAddress));
 
+	if (NetDomainNameCacheLookup(domainName, argument1, &address)) {
+		SYSCALL_WRITE(argument2, &address, sizeof(EsAddress));
+		SYSCALL_RETURN(ES_SUCCESS, false);
+	}
+
 	KEvent completeEvent = {};
 
 	NetDomainNameResolveTask task = {};
@@ -1604,13 +1765,13 @@ SYSCALL_IMPLEMENT(ES_SYSCALL_CONNECTION_OPEN) {
 	connection.receiveBuffer = connection.sendBuffer + connection.sendBufferBytes;
 
 	if (!connection.sendBuffer) {
-		CloseHandleToObject(netConnection, KERNEL_OBJECT_CONNECTION);
+		CloseHandleToObject(netConnection, KERNEL_OBJECT_CONNECTION, NET_CONNECTION_APPLICATION_HANDLE);
 		SYSCALL_RETURN(ES_ERROR_INSUFFICIENT_RESOURCES, false);
 	}
 
 	connection.error = ES_SUCCESS;
 
-	connection.handle = currentProcess->handleTable.OpenHandle(netConnection, 0, KERNEL_OBJECT_CONNECTION); 
+	connection.handle = currentProcess->handleTable.OpenHandle(netConnection, NET_CONNECTION_APPLICATION_HANDLE, KERNEL_OBJECT_CONNECTION); 
 
 	SYSCALL_WRITE(argument0, &connection, sizeof(EsConnection));
 	SYSCALL_RETURN(ES_SUCCESS, false);
@@ -1733,6 +1894,10 @@ SYSCALL_IMPLEMENT(ES_SYSCALL_DEBUG_COMMAND) {
 		statistics.countFreePages = pmm.countFreePages;
 		statistics.countStandbyPages = pmm.countStandbyPages;
 		statistics.countActivePages = pmm.countActivePages;
+		statistics.loadedNodes = fs.loadedNodes;
+		statistics.loadedDirectoryEntries = fs.loadedDirectoryEntries;
+		statistics.fileSystemObjectBytes = fs.objectBytes;
+		statistics.maximumFileSystemObjectBytes = FS_OBJECT_BYTES_MAXIMUM();
 		SYSCALL_WRITE(argument1, &statistics, sizeof(statistics));
 	}
 
@@ -5,11 +5,16 @@
 struct Arena {
 	// Arenas are not thread-safe!
 	// You can use different arenas in different threads, though.
-	void *firstEmptySlot, *firstBlock;
+	void *firstEmptySlot;
 	size_t slotsPerBlock, slotSize, blockSize;
+
+	// The data of each block is aligned to blockAlignment, and starts with a pointer to its ArenaBlock,
+	// so that ArenaFree can find the block from the address of a slot.
+	// The first headerSlots slots of each block hold this pointer, and are never allocated.
+	size_t blockAlignment, headerSlots;
 };
 
-void *ArenaAllocate(Arena *arena, bool zero); // Not thread-safe.
+void *ArenaAllocate(Arena *arena, bool zero); // Not thread-safe. Returns nullptr if a new block could not be allocated.
 void ArenaFree(Arena *arena, void *pointer); // Not thread-safe.
 void ArenaInitialise(Arena *arena, size_t blockSize, size_t itemSize);
 
@@ -22,27 +27,18 @@ struct ArenaBlock {
 	struct Arena *arena;
 	size_t usedSlots;
 	uint8_t *data;
-	ArenaBlock *nextBlock;
+	void *reservation; // The memory reserved to find an aligned address for data.
 };
 
 void ArenaFree(Arena *arena, void *pointer) {
 	if (!pointer) return;
 
-	ArenaBlock **blockReference = (ArenaBlock **) &arena->firstBlock;
-	ArenaBlock *block = (ArenaBlock *) arena->firstBlock;
-
-	while (true) {
-		if (block->data <= (uint8_t *) pointer && block->data + arena->blockSize > (uint8_t *) pointer) {
-			break;
-		}
-
-		blockReference = &block->nextBlock;
-		block = block->nextBlock;
-		EsAssert(block);
-	}
+	uint8_t *data = (uint8_t *) ((uintptr_t) pointer & ~(arena->blockAlignment - 1));
+	ArenaBlock *block = *(ArenaBlock **) data;
+	EsAssert(block->data == data && block->arena == arena);
 
 	uintptr_t indexInBlock = ((uint8_t *) pointer - block->data) / arena->slotSize; 
-	EsAssert(indexInBlock < arena->slotsPerBlock);
+	EsAssert(indexInBlock >= arena->headerSlots && indexInBlock < arena->slotsPerBlock);
 	ArenaSlot *slot = (ArenaSlot *) (block + 1) + indexInBlock;
 	EsAssert(slot->indexInBlock == indexInBlock);
 	
@@ -52,20 +48,18 @@ void ArenaFree(Arena *arena, void *pointer) {
 	slot->previousEmpty = (ArenaSlot **) &arena->firstEmptySlot;
 	
 	if (!(--block->usedSlots)) {
-		ArenaSlot *slot = (ArenaSlot *) (block + 1);
+		ArenaSlot *slot = (ArenaSlot *) (block + 1) + arena->headerSlots;
 		
-		for (uintptr_t i = 0; i < arena->slotsPerBlock; i++, slot++) {
+		for (uintptr_t i = arena->headerSlots; i < arena->slotsPerBlock; i++, slot++) {
 			if (slot->nextEmpty) slot->nextEmpty->previousEmpty = slot->previousEmpty;
 			*slot->previousEmpty = slot->nextEmpty;
 		}
 		
-		*blockReference = block->nextBlock;
-
 #ifdef KERNEL
-		MMFree(kernelMMSpace, block->data);
+		MMFree(kernelMMSpace, block->reservation);
 		EsHeapFree(block, 0, K_FIXED);
 #else
-		EsMemoryUnreserve(block->data);
+		EsMemoryUnreserve(block->reservation);
 		EsHeapFree(block);
 #endif
 	}
@@ -75,27 +69,35 @@ void *ArenaAllocate(Arena *arena, bool zero) {
 	if (!arena->firstEmptySlot) {
 #ifdef KERNEL
 		ArenaBlock *block = (ArenaBlock *) EsHeapAllocate(arena->slotsPerBlock * sizeof(ArenaSlot) + sizeof(ArenaBlock), false, K_FIXED);
-		block->data = (uint8_t *) MMStandardAllocate(kernelMMSpace, arena->blockSize, ES_FLAGS_DEFAULT, nullptr, true /* commitAll */);
+		if (!block) return nullptr;
+		block->data = (uint8_t *) MMStandardAllocateAligned(kernelMMSpace, arena->blockSize, arena->blockAlignment, ES_FLAGS_DEFAULT, &block->reservation);
+		if (!block->data) { EsHeapFree(block, 0, K_FIXED); return nullptr; }
 #else
 		ArenaBlock *block = (ArenaBlock *) EsHeapAllocate(arena->slotsPerBlock * sizeof(ArenaSlot) + sizeof(ArenaBlock), false);
-		block->data = (uint8_t *) EsMemoryReserve(arena->blockSize, ES_MEMORY_PROTECTION_READ_WRITE); 
+		if (!block) return nullptr;
+
+		// Reserve enough space to contain an aligned block, and only commit the block.
+		size_t commitBytes = (arena->blockSize + ES_PAGE_SIZE - 1) & ~(ES_PAGE_SIZE - 1);
+		block->reservation = EsMemoryReserve(commitBytes + arena->blockAlignment - ES_PAGE_SIZE, ES_MEMORY_PROTECTION_READ_WRITE, ES_FLAGS_DEFAULT);
+		if (!block->reservation) { EsHeapFree(block); return nullptr; }
+		block->data = (uint8_t *) (((uintptr_t) block->reservation + arena->blockAlignment - 1) & ~(arena->blockAlignment - 1));
+		if (!EsMemoryCommit(block->data, commitBytes)) { EsMemoryUnreserve(block->reservation); EsHeapFree(block); return nullptr; }
 #endif
 
+		*(ArenaBlock **) block->data = block;
 		ArenaSlot *slots = (ArenaSlot *) (block + 1);
 		
-		for (uintptr_t i = 0; i < arena->slotsPerBlock; i++) {
+		for (uintptr_t i = arena->headerSlots; i < arena->slotsPerBlock; i++) {
 			ArenaSlot *slot = slots + i;
 			slot->indexInBlock = i;
 			slot->nextEmpty = i == arena->slotsPerBlock - 1 ? (ArenaSlot *) arena->firstEmptySlot : (slot + 1);
-			slot->previousEmpty = i ? &slot[-1].nextEmpty : (ArenaSlot **) &arena->firstEmptySlot;
+			slot->previousEmpty = i != arena->headerSlots ? &slot[-1].nextEmpty : (ArenaSlot **) &arena->firstEmptySlot;
 		}
 		
 		block->arena = arena;
 		block->usedSlots = 0;
-		block->nextBlock = (ArenaBlock *) arena->firstBlock;
 
-		arena->firstEmptySlot = slots;
-		arena->firstBlock = block;
+		arena->firstEmptySlot = slots + arena->headerSlots;
 	}
 	
 	ArenaSlot *slot = (ArenaSlot *) arena->firstEmptySlot;
@@ -112,7 +114,10 @@ void *ArenaAllocate(Arena *arena, bool zero) {
 void ArenaInitialise(Arena *arena, size_t blockSize, size_t itemSize) {
 	EsAssert(!arena->slotSize && itemSize);
 	arena->slotSize = itemSize;
+	arena->headerSlots = (sizeof(ArenaBlock *) + itemSize - 1) / itemSize;
 	arena->slotsPerBlock = blockSize / arena->slotSize;
-	if (arena->slotsPerBlock < 32) arena->slotsPerBlock = 32;
+	if (arena->slotsPerBlock < 32 + arena->headerSlots) arena->slotsPerBlock = 32 + arena->headerSlots;
 	arena->blockSize = arena->slotsPerBlock * arena->slotSize;
+	arena->blockAlignment = ES_PAGE_SIZE;
+	while (arena->blockAlignment < arena->blockSize) arena->blockAlignment <<= 1;
 }
@@ -315,6 +315,30 @@ AVLItem<T> *TreeFind(AVLTree<T> *tree, AVLKey key, TreeSearchMode mode) {
 	return TreeFindRecursive(tree, tree->root, &key, mode);
 }
 
+template <class T>
+AVLItem<T> *TreeFirst(AVLTree<T> *tree) {
+	AVLItem<T> *item = tree->root;
+	while (item && item->children[0]) item = item->children[0];
+	return item;
+}
+
+template <class T>
+AVLItem<T> *TreeNext(AVLItem<T> *item) {
+	// Returns the item with the next largest key, or null if this is the last item.
+
+	if (item->children[1]) {
+		item = item->children[1];
+		while (item->children[0]) item = item->children[0];
+		return item;
+	}
+
+	while (item->parent && item->parent->children[1] == item) {
+		item = item->parent;
+	}
+
+	return item->parent;
+}
+
 template <class T>
 int TreeGetBalance(AVLItem<T> *item) {
 	if (!item) return 0;
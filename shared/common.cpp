@@ -1708,65 +1708,69 @@ void EsSpinlockRelease(EsSpinlock *spinlock) {
 
 #ifndef KERNEL
 
-void EsMutexAcquire(EsMutex *mutex) {
-	bool acquired = false;
+// The mutex state is 0 when released, 1 when acquired, and 2 when acquired and there may be threads waiting on the futex.
+// Acquiring and releasing an uncontended mutex does not enter the kernel.
 
-	while (true) {
-		EsSpinlockAcquire(&mutex->spinlock);
+#define ES_MUTEX_SPIN_ITERATIONS (100)
 
-		if (mutex->event == ES_INVALID_HANDLE) {
-			mutex->event = EsEventCreate(false);
-		}
+static void EsMutexAcquireContended(EsMutex *mutex) {
+	// Mark the mutex as contended, so that the owner will wake us when it releases the mutex.
+	while (__atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE)) {
+		EsSyscall(ES_SYSCALL_FUTEX_WAIT, (uintptr_t) &mutex->state, 2, ES_WAIT_NO_TIMEOUT, 0);
+	}
+}
 
-		if (mutex->state == 0) {
-			acquired = true;
-			mutex->state = 1;
-		} 
+void EsMutexAcquire(EsMutex *mutex) {
+	if (__sync_bool_compare_and_swap(&mutex->state, 0, 1)) {
+		return;
+	}
+
+	// The mutex is usually only held briefly, so spin for a short while before blocking.
+
+	for (uintptr_t i = 0; i < ES_MUTEX_SPIN_ITERATIONS; i++) {
+		uint32_t state = mutex->state;
 
-		if (acquired) {
-			// TODO Test this.
-			EsSpinlockRelease(&mutex->spinlock);
+		if (state == 2) {
+			break;
+		} else if (state == 0 && __sync_bool_compare_and_swap(&mutex->state, 0, 1)) {
 			return;
 		}
+	}
 
-		__sync_fetch_and_add(&mutex->queued, 1); 
-		EsEventReset(mutex->event);
-		EsSpinlockRelease(&mutex->spinlock);
-		EsWaitSingle(mutex->event);
-		__sync_fetch_and_sub(&mutex->queued, 1);
-	} 
+	EsMutexAcquireContended(mutex);
 }
 
 void EsMutexRelease(EsMutex *mutex) {
-	volatile bool queued = false;
-
-	EsSpinlockAcquire(&mutex->spinlock);
+	uint32_t state = __atomic_exchange_n(&mutex->state, 0, __ATOMIC_RELEASE);
 
-	if (!mutex->state) {
+	if (!state) {
 		EsPanic("EsMutexRelease - Mutex not acquired.");
+	} else if (state == 2) {
+		EsSyscall(ES_SYSCALL_FUTEX_WAKE, (uintptr_t) &mutex->state, 1, 0, 0);
 	}
+}
 
-	mutex->state = 0;
+void EsMutexDestroy(EsMutex *mutex) {
+	EsAssert(!mutex->state);
+}
 
-	if (mutex->queued) {
-		queued = true;
-		EsEventSet(mutex->event);
-	}
+bool EsConditionVariableWait(EsConditionVariable *variable, EsMutex *mutex, uintptr_t timeoutMs) {
+	// If the variable is notified between releasing the mutex and waiting, the sequence number will have changed,
+	// and the futex wait will return immediately.
+	uint32_t sequence = variable->sequence;
+	EsMutexRelease(mutex);
+	EsError error = EsSyscall(ES_SYSCALL_FUTEX_WAIT, (uintptr_t) &variable->sequence, sequence, timeoutMs, 0);
 
-	EsSpinlockRelease(&mutex->spinlock);
+	// Other threads woken by the same notification will be competing for the mutex,
+	// so it must be acquired in the contended state to make sure they are woken when we release it.
+	EsMutexAcquireContended(mutex);
 
-	if (queued) {
-		EsSchedulerYield();
-	}
+	return error != ES_ERROR_TIMEOUT_REACHED;
 }
 
-void EsMutexDestroy(EsMutex *mutex) {
-	EsAssert(!mutex->state && !mutex->queued && !mutex->spinlock.state);
-
-	if (mutex->event != ES_INVALID_HANDLE) {
-		EsHandleClose(mutex->event);
-		mutex->event = ES_INVALID_HANDLE;
-	}
+void EsConditionVariableNotify(EsConditionVariable *variable, bool all) {
+	__sync_fetch_and_add(&variable->sequence, 1);
+	EsSyscall(ES_SYSCALL_FUTEX_WAKE, (uintptr_t) &variable->sequence, all ? (uintptr_t) -1 : 1, 0, 0);
 }
 
 #endif
@@ -9,7 +9,6 @@
 // 		Journal.
 // 		Inline b-tree.
 // 		Further data indirection. 
-// 		Hash collisions. (Probably just remove index and enumerate directory contents instead?)
 
 #ifndef KERNEL
 
@@ -35,7 +34,9 @@ typedef struct EsUniqueIdentifier {
 
 #define ESFS_BOOT_SUPER_BLOCK_SIZE 			(8192)			// The bootloader and superblock take up 16KB.
 #define ESFS_DRIVE_MINIMUM_SIZE 			(1048576)		// The minimum drive size that can be formatted.
-#define ESFS_DRIVER_VERSION 				(10)			// The current driver version.
+#define ESFS_DRIVER_VERSION 				(12)			// The current driver version.
+#define ESFS_UNWRITTEN_EXTENTS_VERSION			(11)			// The driver version that added unwritten extents.
+#define ESFS_INDEX_COLLISIONS_VERSION			(12)			// The driver version that added index keys shared by several entries.
 #define ESFS_MAXIMUM_VOLUME_NAME_LENGTH 		(32)			// The volume name limit.
 
 #define ESFS_CORE_NODE_KERNEL				(0)			// The kernel core node.
@@ -57,8 +58,11 @@ typedef struct EsUniqueIdentifier {
 #define ESFS_INDIRECTION_DIRECT				(1)			// The data is stored in the attribute.
 #define ESFS_INDIRECTION_L1				(2)			// The attribute contains a extent list that points to the data.
 
+#define ESFS_EXTENT_UNWRITTEN				(1 << 6)		// Set in an extent's header byte if its blocks have not been written, and should read as zeroes.
+
 #define ESFS_INDEX_MAX_DEPTH				(16)			// The maximum depth of the index tree. I'd be surprised if this gets past 8.
 #define ESFS_VERTEX_KEY(vertex, key) 			((IndexKey *) ((uint8_t *) vertex + vertex->offset) + key)
+#define ESFS_INDEX_KEY_COLLISION			(1 << 0)		// Set in a key's indexFlags if more than one entry in the directory has its hash.
 
 typedef struct Attribute {
 	/*  0 */ uint16_t type;						// Attribute type.
@@ -95,7 +99,8 @@ typedef struct AttributeData {
 	/* 32 */ uint8_t data[1];					// The data or extent list.
 
 	// Format of each extent in the extent list:
-	//       uint8_t offsetSize : 3, countSize : 3, unused : 2;	// The size of the offset and count fields in bytes - 1.
+	//       uint8_t offsetSize : 3, countSize : 3, 		// The size of the offset and count fields in bytes - 1.
+	//               unwritten : 1, unused : 1;			// See ESFS_EXTENT_UNWRITTEN.
 	//       uint8_t offset[offsetSize + 1];			// The first block in the extent, expressed as a signed offset from the start 
 	//       							       of the previous extent in the list, or from 0 for the first extent. Big endian.
 	//       uint8_t count[countSize + 1];				// The number of blocks encompassed by the extent. Big endian.
@@ -130,7 +135,7 @@ typedef struct GroupDescriptor {
 typedef struct DirectoryEntryReference {
 	/*  0 */ uint64_t block;					// The block containing the directory entry.
 	/*  8 */ uint32_t offsetIntoBlock;				// Offset into the block to find the directory entry.
-	/* 12 */ uint32_t _unused;					// Unused.
+	/* 12 */ uint32_t indexFlags;				// Only used in IndexKeys; zero elsewhere. See ESFS_INDEX_KEY_COLLISION.
 } DirectoryEntryReference;
 
 typedef struct IndexKey {
@@ -139,6 +144,8 @@ typedef struct IndexKey {
 									// All keys in the child should be less than this key.
 									// This is the only valid field in the +1 key.
 	/* 16 */ DirectoryEntryReference data;				// The directory entry this key refers to.
+									// If the key has ESFS_INDEX_KEY_COLLISION set, this is one of the entries with the hash,
+									// and the directory must be searched for the others.
 } IndexKey;
 
 typedef struct IndexVertex {
@@ -336,13 +343,14 @@ void GenerateUniqueIdentifier(EsUniqueIdentifier *u, bool random) {
 
 IndexKey *InsertKeyIntoVertex(uint64_t newKey, IndexVertex *vertex) {
 	// Find where in this vertex we should insert the key.
+	// The keys are sorted, so binary search for the first key greater than the new key.
 
-	int position;
+	int position = 0, end = vertex->count;
 
-	for (position = 0; position < vertex->count; position++) {
-		if (newKey < ESFS_VERTEX_KEY(vertex, position)->value) {
-			break;
-		}
+	while (position < end) {
+		int middle = position + (end - position) / 2;
+		if (newKey < ESFS_VERTEX_KEY(vertex, middle)->value) end = middle;
+		else position = middle + 1;
 	}
 
 	// Insert the key.
@@ -513,6 +521,7 @@ bool AccessNode(DirectoryEntry *node, void *buffer, uint64_t offsetIntoFile, uin
 	// Find the extent.
 
 	uint8_t *extents = ((uint8_t *) dataAttribute + dataAttribute->dataOffset);
+	bool unwritten = false;
 
 	{
 		uint64_t position = 0, blockInFile = 0, extentStart = 0;
@@ -522,6 +531,7 @@ bool AccessNode(DirectoryEntry *node, void *buffer, uint64_t offsetIntoFile, uin
 
 		for (uint64_t i = 0; i < dataAttribute->count; i++) {
 			uint64_t extentCount = 0;
+			unwritten = extents[position] & ESFS_EXTENT_UNWRITTEN;
 			DecodeExtent(&extentStart, &extentCount, extents, &position, dataAttribute->size - dataAttribute->dataOffset);
 			if (decoded < (int) i) {
 				decoded = i;
@@ -542,7 +552,12 @@ bool AccessNode(DirectoryEntry *node, void *buffer, uint64_t offsetIntoFile, uin
 
 	uint8_t blockBuffer[superblock.blockSize];
 
-	if (read || count != superblock.blockSize) {
+	// Only the kernel driver creates unwritten extents, so writing to them is not supported here.
+	assert(read || !unwritten);
+
+	if (unwritten) {
+		memset(blockBuffer, 0, superblock.blockSize);
+	} else if (read || count != superblock.blockSize) {
 		if (!ReadBlock(block, 1, blockBuffer)) {
 			return false;
 		}
@@ -737,7 +752,8 @@ void NewDirectoryEntry(DirectoryEntry *entry, uint8_t nodeType, EsUniqueIdentifi
 }
 
 bool AddNode(const char *name, uint8_t nodeType, DirectoryEntry *outputEntry, DirectoryEntryReference *outputReference, 
-		DirectoryEntryReference directoryReference, EsUniqueIdentifier contentType) {
+		DirectoryEntryReference directoryReference, EsUniqueIdentifier contentType, IndexKey *deferredKey) {
+	// If deferredKey is set, the node is not added to the index; instead, its key is returned to be passed to BuildIndex.
 	// Log("add %s to %s\n", name, path);
 
 	// Step 1: Resize the directory so that it can fit another directory entry.
@@ -784,7 +800,11 @@ bool AddNode(const char *name, uint8_t nodeType, DirectoryEntry *outputEntry, Di
 	uint64_t newKey = CalculateCRC64(name, strlen(name), 0);
 	// Log("adding file '%s' to index...\n", name);
 
-	{
+	if (deferredKey) {
+		memset(deferredKey, 0, sizeof(IndexKey));
+		deferredKey->value = newKey;
+		deferredKey->data = reference;
+	} else {
 		// Find the leaf to insert the key into.
 
 		uint8_t buffer[superblock.blockSize];
@@ -815,10 +835,14 @@ bool AddNode(const char *name, uint8_t nodeType, DirectoryEntry *outputEntry, Di
 
 		while (true) {
 			for (int i = 0; i < vertex->count; i++) {
-				if (ESFS_VERTEX_KEY(vertex, i)->value == newKey) {
-					// The key is already in the tree.
-					Log("The file already exists.");
-					EsFSError();
+				IndexKey *key = ESFS_VERTEX_KEY(vertex, i);
+
+				if (key->value == newKey) {
+					// Another entry has the same hash. Mark the key so that the driver searches the directory.
+					key->data.indexFlags |= ESFS_INDEX_KEY_COLLISION;
+					vertex->checksum = 0; vertex->checksum = CalculateCRC32(vertex, superblock.blockSize, 0);
+					if (!WriteBlock(blocks[depth], 1, vertex)) return false;
+					goto indexed;
 				}
 			}
 
@@ -953,6 +977,7 @@ bool AddNode(const char *name, uint8_t nodeType, DirectoryEntry *outputEntry, Di
 		if (!WriteBlock(blocks[depth], 1, vertex)) return false;
 	}
 
+	indexed:;
 	if (outputEntry) *outputEntry = entry;
 	if (outputReference) *outputReference = reference;
 
@@ -1038,6 +1063,94 @@ void Read(char *target, DirectoryEntryReference parentDirectory) {
 #endif
 
 #ifndef INSTALLER
+int CompareIndexKeys(const void *_left, const void *_right) {
+	const IndexKey *left = (const IndexKey *) _left, *right = (const IndexKey *) _right;
+	return left->value < right->value ? -1 : left->value > right->value ? 1 : 0;
+}
+
+bool BuildIndex(DirectoryEntryReference directoryReference, IndexKey *keys /* stb_ds array; sorted in place */) {
+	// Build the index of a directory with no index from the keys of all its entries at once.
+	// Each level is written left to right with the keys shared evenly between its vertices,
+	// and the keys separating the vertices are moved up to make the level above.
+
+	size_t keyCount = arrlenu(keys);
+	if (!keyCount) return true;
+
+	qsort(keys, keyCount, sizeof(IndexKey), CompareIndexKeys);
+
+	// Merge keys with the same hash.
+
+	size_t mergedCount = 0;
+
+	for (uintptr_t i = 0; i < keyCount; i++) {
+		if (mergedCount && keys[mergedCount - 1].value == keys[i].value) {
+			keys[mergedCount - 1].data.indexFlags |= ESFS_INDEX_KEY_COLLISION;
+		} else {
+			keys[mergedCount++] = keys[i];
+		}
+	}
+
+	keyCount = mergedCount;
+
+	// Leave every vertex at least one key short of maxCount, since vertices are split when they become full.
+
+	uint16_t maxCount = (superblock.blockSize - ESFS_INDEX_KEY_OFFSET) / sizeof(IndexKey) - 1 /* +1 key */;
+	size_t keysPerVertexLimit = maxCount - 1;
+
+	uint8_t buffer[superblock.blockSize];
+	IndexVertex *vertex = (IndexVertex *) buffer;
+	IndexKey *levelKeys = keys;
+	uint64_t *children = NULL; // The vertices of the level below; children[i] is the child of levelKeys[i].
+	uint64_t rootBlock = 0;
+
+	while (!rootBlock) {
+		size_t vertexCount = (keyCount + 1 + keysPerVertexLimit) / (keysPerVertexLimit + 1);
+		size_t keysInVertices = keyCount - (vertexCount - 1); // The rest separate the vertices.
+		IndexKey *separators = NULL;
+		uint64_t *vertices = NULL;
+		uintptr_t position = 0;
+
+		for (uintptr_t i = 0; i < vertexCount; i++) {
+			uint16_t count = keysInVertices / vertexCount + (i < keysInVertices % vertexCount ? 1 : 0);
+
+			memset(buffer, 0, superblock.blockSize);
+			memcpy(vertex->signature, ESFS_INDEX_VERTEX_SIGNATURE, 4);
+			vertex->offset = ESFS_INDEX_KEY_OFFSET;
+			vertex->maxCount = maxCount;
+			vertex->count = count;
+
+			for (uintptr_t j = 0; j <= count; j++) {
+				IndexKey *key = ESFS_VERTEX_KEY(vertex, j);
+				if (j != count) *key = levelKeys[position + j];
+				key->child = children ? children[position + j] : 0;
+			}
+
+			uint64_t block, _unused;
+			if (!AllocateExtent(1, &block, &_unused)) return false;
+			vertex->checksum = 0; vertex->checksum = CalculateCRC32(vertex, superblock.blockSize, 0);
+			if (!WriteBlock(block, 1, vertex)) return false;
+			arrput(vertices, block);
+
+			if (i != vertexCount - 1) arrput(separators, levelKeys[position + count]);
+			position += count + 1;
+		}
+
+		if (vertexCount == 1) rootBlock = vertices[0];
+		if (levelKeys != keys) arrfree(levelKeys);
+		arrfree(children);
+		levelKeys = separators, children = vertices, keyCount = vertexCount - 1;
+	}
+
+	arrfree(children);
+
+	DirectoryEntry directory;
+	if (!ReadDirectoryEntryReference(directoryReference, &directory)) return false;
+	AttributeDirectory *directoryAttribute = (AttributeDirectory *) FindAttribute(&directory, ESFS_ATTRIBUTE_DIRECTORY);
+	assert(!directoryAttribute->indexRootBlock);
+	directoryAttribute->indexRootBlock = rootBlock;
+	return WriteDirectoryEntryReference(directoryReference, &directory);
+}
+
 typedef struct ImportNode {
 	const char *name, *path;
 	struct ImportNode *children;
@@ -1048,6 +1161,13 @@ typedef struct ImportNode {
 int64_t Import(ImportNode node, DirectoryEntryReference parentDirectory) {
 	uint64_t totalSize = 0;
 
+	// If the directory has no index yet, build it once all the children have been added.
+
+	DirectoryEntry parent;
+	if (!ReadDirectoryEntryReference(parentDirectory, &parent)) return -1;
+	bool buildIndex = !((AttributeDirectory *) FindAttribute(&parent, ESFS_ATTRIBUTE_DIRECTORY))->indexRootBlock;
+	IndexKey *keys = NULL, key;
+
 	for (uintptr_t i = 0; i < arrlenu(node.children); i++) {
 		if (node.children[i].isFile) {
 			size_t fileLength;
@@ -1061,10 +1181,13 @@ int64_t Import(ImportNode node, DirectoryEntryReference parentDirectory) {
 				DirectoryEntryReference reference;
 				DirectoryEntry entry;
 
-				if (!AddNode(node.children[i].name, ESFS_NODE_TYPE_FILE, &entry, &reference, parentDirectory, node.children[i].contentType)) {
+				if (!AddNode(node.children[i].name, ESFS_NODE_TYPE_FILE, &entry, &reference, parentDirectory, 
+							node.children[i].contentType, buildIndex ? &key : NULL)) {
 					return -1;
 				}
 
+				if (buildIndex) arrput(keys, key);
+
 				if (!ResizeNode(&entry, fileLength)) {
 					return -1;
 				}
@@ -1083,7 +1206,9 @@ int64_t Import(ImportNode node, DirectoryEntryReference parentDirectory) {
 			}
 		} else {
 			DirectoryEntryReference reference;
-			if (!AddNode(node.children[i].name, ESFS_NODE_TYPE_DIRECTORY, NULL, &reference, parentDirectory, node.children[i].contentType)) return -1;
+			if (!AddNode(node.children[i].name, ESFS_NODE_TYPE_DIRECTORY, NULL, &reference, parentDirectory, 
+						node.children[i].contentType, buildIndex ? &key : NULL)) return -1;
+			if (buildIndex) arrput(keys, key);
 			int64_t size = Import(node.children[i], reference);
 			if (size == -1) return -1;
 			DirectoryEntry directory; 
@@ -1095,6 +1220,8 @@ int64_t Import(ImportNode node, DirectoryEntryReference parentDirectory) {
 		}
 	}
 
+	if (buildIndex && !BuildIndex(parentDirectory, keys)) return -1;
+	arrfree(keys);
 	return totalSize;
 }
 #endif
@@ -56,3 +56,25 @@ struct FATDirectoryEntry {
 	uint16_t firstClusterLow;
 	uint32_t fileSizeBytes;
 } ES_STRUCT_PACKED;
+
+struct FATLongNameEntry {
+	// Stored before the short name entry, in reverse order.
+	uint8_t order; // Starts at 1. The first entry stored is ORed with 0x40.
+	uint16_t name1[5];
+	uint8_t attributes; // Always 0x0F.
+	uint8_t type;
+	uint8_t checksum; // Of the short name.
+	uint16_t name2[6];
+	uint16_t firstClusterLow; // Always 0.
+	uint16_t name3[2];
+} ES_STRUCT_PACKED;
+
+struct FATFSInformation {
+	uint32_t signature1; // 0x41615252
+	uint8_t _unused0[480];
+	uint32_t signature2; // 0x61417272
+	uint32_t freeClusters; // 0xFFFFFFFF if unknown.
+	uint32_t nextFreeCluster;
+	uint8_t _unused1[12];
+	uint32_t signature3; // 0xAA550000
+} ES_STRUCT_PACKED;
@@ -165,18 +165,18 @@ bool BuildAPIDependencies() {
 		ParseDependencies("bin/dependency_files/api_header.d", "API Header", false);
 	}
 
-	if (CallSystem("bin/script ports/port.script portName=musl targetName=" TARGET_NAME " toolchainPrefix=" TOOLCHAIN_PREFIX)) return false;
+	if (CallSystem("bin/script --bytecode-image=bin/port.script.image ports/port.script portName=musl targetName=" TARGET_NAME " toolchainPrefix=" TOOLCHAIN_PREFIX)) return false;
 
 	if (CallSystem(TOOLCHAIN_PREFIX "-gcc -c desktop/crt1.c -o cross/lib/gcc/" TOOLCHAIN_PREFIX "/" GCC_VERSION "/crt1.o")) return false;
 	if (CallSystem(TOOLCHAIN_PREFIX "-gcc -c desktop/crtglue.c -o cross/lib/gcc/" TOOLCHAIN_PREFIX "/" GCC_VERSION "/crtglue.o")) return false;
 
 	if (IsOptionEnabled("Dependency.FreeTypeAndHarfBuzz")) {
-		if (CallSystem("bin/script ports/port.script portName=freetype targetName=" TARGET_NAME " toolchainPrefix=" TOOLCHAIN_PREFIX)) return false;
-		if (CallSystem("bin/script ports/port.script portName=harfbuzz targetName=" TARGET_NAME " toolchainPrefix=" TOOLCHAIN_PREFIX)) return false;
+		if (CallSystem("bin/script --bytecode-image=bin/port.script.image ports/port.script portName=freetype targetName=" TARGET_NAME " toolchainPrefix=" TOOLCHAIN_PREFIX)) return false;
+		if (CallSystem("bin/script --bytecode-image=bin/port.script.image ports/port.script portName=harfbuzz targetName=" TARGET_NAME " toolchainPrefix=" TOOLCHAIN_PREFIX)) return false;
 	}
 
 	if (IsOptionEnabled("Flag.ENABLE_POSIX_SUBSYSTEM")) {
-		if (CallSystem("bin/script ports/port.script portName=busybox targetName=" TARGET_NAME " toolchainPrefix=" TOOLCHAIN_PREFIX)) return false;
+		if (CallSystem("bin/script --bytecode-image=bin/port.script.image ports/port.script portName=busybox targetName=" TARGET_NAME " toolchainPrefix=" TOOLCHAIN_PREFIX)) return false;
 	}
 
 	if (CallSystem("cp -p kernel/module.h root/Applications/POSIX/include")) return false;
@@ -204,7 +204,7 @@ void OutputStartOfBuildINI(FILE *f, bool forceDebugBuildOff) {
 			"linker_scripts=util/\n"
 			"crt_objects=bin/Object Files/\n"
 			"compiler_objects=%s/../lib/gcc/" TOOLCHAIN_PREFIX "/" GCC_VERSION "\n"
-			"\n[general]\nsystem_build=1\nminimal_rebuild=1\ncolored_output=%d\nthread_count=%d\n"
+			"\n[general]\nsystem_build=1\nminimal_rebuild=1\ncompile_cache=1\ncolored_output=%d\nthread_count=%d\n"
 			"target=" TARGET_NAME "\nskip_header_generation=1\nverbose=%d\ncommon_compile_flags=",
 			compilerPath, getenv("TMPDIR") ?: "",
 			compilerPath, compilerPath, compilerPath, compilerPath, compilerPath, compilerPath,
@@ -1099,7 +1099,7 @@ void DoCommand(const char *l) {
 		LoadOptions();
 		Compile(COMPILE_FOR_EMULATOR, atoi(GetOptionString("Emulator.PrimaryDriveMB")), NULL);
 	} else if (0 == strcmp(l, "build-cross")) {
-		CallSystem("bin/script ports/port.script portName=gcc buildCross=true targetName=" TARGET_NAME " toolchainPrefix=" TOOLCHAIN_PREFIX);
+		CallSystem("bin/script --bytecode-image=bin/port.script.image ports/port.script portName=gcc buildCross=true targetName=" TARGET_NAME " toolchainPrefix=" TOOLCHAIN_PREFIX);
 		printf("Please restart the build system.\n");
 		exit(0);
 	} else if (0 == strcmp(l, "build-utilities") || 0 == strcmp(l, "u")) {
@@ -1360,6 +1360,9 @@ void DoCommand(const char *l) {
 		RunTests(-1);
 	} else if (0 == memcmp(l, "run-test ", 9)) {
 		RunTests(atoi(l + 9));
+	} else if (0 == strcmp(l, "esfs-index-test")) {
+		BUILD_UTILITY("esfs2_index_test", "", "");
+		CallSystem("bin/esfs2_index_test");
 	} else if (0 == strcmp(l, "setup-pre-built-toolchain")) {
 		CallSystem("mv bin/source cross");
 		CallSystem("mkdir -p cross/bin2");
@@ -1409,6 +1412,7 @@ void DoCommand(const char *l) {
 		printf("ascii <string>                    - Convert a string to a list of ASCII codepoints.\n");
 		printf("a2l <executable>                  - Translate addresses to lines.\n");
 		printf("make-crash-report                 - Make a crash report.\n");
+		printf("esfs-index-test                   - Check the directory indices made by the image builder.\n");
 	} else {
 		printf("Unrecognised command '%s'. Enter 'help' to get a list of commands.\n", l);
 	}
@@ -123,6 +123,7 @@ time_t time(time_t *timer) { (void) timer; return 0; } // TODO.
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include <utime.h>
 
 #ifdef PARALLEL_BUILD
 #include <pthread.h>
@@ -229,13 +230,15 @@ char *executeEnvironment[3] = {
 #define ExecuteForApp(application, ...) if (!application->error && ExecuteWithOutput(&application->output, __VA_ARGS__)) application->error = true
 #define ArgString(x) NULL, x
 
-int _Execute(char **output, const char *executable, ...) {
-	char *argv[64];
-	char *copies[64];
-	size_t copyCount = 0;
-	va_list argList;
-	va_start(argList, executable);
+#ifdef OS_ESSENCE
+#define ExecuteForAppCached ExecuteForApp
+#else
+// For compile and link commands; the output file is reused from the compile cache if the inputs are unchanged.
+#define ExecuteForAppCached(application, ...) if (!application->error && _ExecuteCached(&application->output, __VA_ARGS__, NULL, NULL)) application->error = true
+#endif
 
+size_t ExecuteParseArguments(char **argv, char **copies, const char *executable, va_list argList) {
+	size_t copyCount = 0;
 	argv[0] = (char *) executable;
 
 	for (uintptr_t i = 1; i <= 64; i++) {
@@ -279,8 +282,10 @@ int _Execute(char **output, const char *executable, ...) {
 		}
 	}
 
-	va_end(argList);
+	return copyCount;
+}
 
+int ExecuteArguments(char **output, char **argv) {
 	if (verbose) {
 		for (uintptr_t i = 0; i < 64; i++) {
 			if (!argv[i]) break;
@@ -306,7 +311,7 @@ int _Execute(char **output, const char *executable, ...) {
 			close(stdoutPipe[1]);
 		}
 
-		execve(executable, argv, executeEnvironment);
+		execve(argv[0], argv, executeEnvironment);
 		_exit(-1);
 	} else if (pid > 0) {
 		if (output) {
@@ -340,6 +345,19 @@ int _Execute(char **output, const char *executable, ...) {
 		Log("(status = %d)\n", status);
 	}
 
+	return status;
+}
+
+int _Execute(char **output, const char *executable, ...) {
+	char *argv[64];
+	char *copies[64];
+	va_list argList;
+	va_start(argList, executable);
+	size_t copyCount = ExecuteParseArguments(argv, copies, executable, argList);
+	va_end(argList);
+
+	int status = ExecuteArguments(output, argv);
+
 	for (uintptr_t i = 0; i < copyCount; i++) {
 		free(copies[i]);
 	}
@@ -360,34 +378,44 @@ void DeleteFile(const char *path) {
 	unlink(path);
 }
 
-void CopyFile(const char *oldPath, const char *newPath, bool quietError) {
+bool CopyFile(const char *oldPath, const char *newPath, bool quietError) {
 	File source = FileOpen(oldPath, 'r');
-	File destination = FileOpen(newPath, 'w');
 
 	if (source.error) {
-		if (quietError) return;
+		if (quietError) return false;
 		Log("Error: Could not open file '%s' as a copy source.\n", oldPath);
 		__sync_fetch_and_or(&encounteredErrors, 1);
-		return;
+		return false;
 	}
 
+	File destination = FileOpen(newPath, 'w');
+
 	if (destination.error) {
-		if (quietError) return;
+		FileClose(source);
+		if (quietError) return false;
 		Log("Error: Could not open file '%s' as a copy destination.\n", newPath);
 		__sync_fetch_and_or(&encounteredErrors, 1);
-		return;
+		return false;
 	}
 
 	char buffer[4096];
+	bool success = true;
 
 	while (true) {
 		size_t bytesRead = FileRead(source, sizeof(buffer), buffer);
 		if (!bytesRead) break;
-		FileWrite(destination, bytesRead, buffer);
+		if (FileWrite(destination, bytesRead, buffer) != bytesRead) { success = false; break; }
 	}
 
 	FileClose(source);
 	FileClose(destination);
+
+	if (!success && !quietError) {
+		Log("Error: Could not write to file '%s'.\n", newPath);
+		__sync_fetch_and_or(&encounteredErrors, 1);
+	}
+
+	return success;
 }
 
 void MoveFile(const char *oldPath, const char *newPath) {
@@ -407,6 +435,278 @@ bool FileExists(const char *path) {
 #endif
 }
 
+#ifndef OS_ESSENCE
+// The compile cache stores the output of compile and link commands in bin/compile_cache, keyed by a hash of:
+// the command line, the size and modification time of the tool, and either the preprocessed source (for compiles),
+// or the contents of every input file and -l library (for links). Since the preprocessed source includes all the headers,
+// this covers generated headers such as the kernel configuration.
+// Entries are touched when used, and the least recently used are evicted once the cache exceeds COMPILE_CACHE_MAXIMUM_BYTES.
+
+#define COMPILE_CACHE_MAXIMUM_BYTES (1024 * 1024 * 1024)
+
+bool useCompileCache;
+volatile size_t compileCacheHits, compileCacheMisses;
+volatile uintptr_t compileCacheTemporaryID;
+
+uint64_t CompileCacheHashFile(const char *path, uint64_t hash) {
+	size_t bytes;
+	void *data = LoadFile(path, &bytes);
+	if (!data) return hash;
+	hash = CalculateCRC64(data, bytes, hash);
+	hash = CalculateCRC64(&bytes, sizeof(bytes), hash);
+	free(data);
+	return hash;
+}
+
+uint64_t CompileCacheHashLibrary(char **argv, const char *name, uint64_t hash) {
+	// Find the library the linker would use for -l<name>: first in the -L directories, then in the compiler's search path.
+
+	const char *extensions[] = { ".so", ".a" };
+	char path[4096];
+	bool found = false;
+
+	for (uintptr_t i = 1; argv[i] && !found; i++) {
+		if (memcmp(argv[i], "-L", 2)) continue;
+		const char *directory = argv[i][2] ? argv[i] + 2 : argv[i + 1];
+		if (!directory) break;
+
+		for (uintptr_t j = 0; j < sizeof(extensions) / sizeof(extensions[0]); j++) {
+			struct stat s;
+			snprintf(path, sizeof(path), "%s/lib%s%s", directory, name, extensions[j]);
+			if (stat(path, &s) || !S_ISREG(s.st_mode)) continue;
+			hash = CalculateCRC64(path, strlen(path), hash);
+			hash = CompileCacheHashFile(path, hash);
+			found = true;
+		}
+	}
+
+	for (uintptr_t j = 0; j < sizeof(extensions) / sizeof(extensions[0]) && !found; j++) {
+		// The compiler prints the name unchanged if it can't find the file.
+		char argument[256];
+		snprintf(argument, sizeof(argument), "-print-file-name=lib%s%s", name, extensions[j]);
+		char *arguments[] = { argv[0], argument, NULL };
+		char *output = NULL;
+
+		if (!ExecuteArguments(&output, arguments) && arrlenu(output) && arrlenu(output) < sizeof(path)) {
+			memcpy(path, output, arrlenu(output));
+			path[arrlenu(output)] = 0;
+			if (path[arrlenu(output) - 1] == '\n') path[arrlenu(output) - 1] = 0;
+
+			struct stat s;
+
+			if (strchr(path, '/') && !stat(path, &s) && S_ISREG(s.st_mode)) {
+				hash = CalculateCRC64(path, strlen(path), hash);
+				hash = CompileCacheHashFile(path, hash);
+				found = true;
+			}
+		}
+
+		arrfree(output);
+	}
+
+	return hash;
+}
+
+bool CompileCacheKey(char **argv, const char *outputPath, uint64_t *key) {
+	uint64_t hash = 0;
+	bool isCompile = argv[0] == toolchainNasm;
+
+	for (uintptr_t i = 0; argv[i]; i++) {
+		hash = CalculateCRC64(argv[i], strlen(argv[i]) + 1, hash);
+		if (0 == strcmp(argv[i], "-c")) isCompile = true;
+	}
+
+	struct stat s;
+	if (stat(argv[0], &s)) return false;
+	hash = CalculateCRC64(&s.st_size, sizeof(s.st_size), hash);
+	hash = CalculateCRC64(&s.st_mtime, sizeof(s.st_mtime), hash);
+
+	if (isCompile) {
+		// Run the preprocessor with the same arguments, writing to the pipe instead of the output file.
+		// This also writes the dependency file, which is needed even if the object file comes from the cache.
+
+		char *preprocessArguments[66];
+		uintptr_t count = 0;
+
+		for (uintptr_t i = 0; argv[i]; i++) {
+			if (0 == strcmp(argv[i], "-o") && argv[i + 1]) i++;
+			else preprocessArguments[count++] = argv[i];
+		}
+
+		preprocessArguments[count++] = (char *) "-E";
+		preprocessArguments[count] = NULL;
+
+		char *preprocessed = NULL;
+		int status = ExecuteArguments(&preprocessed, preprocessArguments);
+		if (!status) hash = CalculateCRC64(preprocessed, arrlenu(preprocessed), hash);
+		arrfree(preprocessed);
+		if (status) return false; // Let the compiler report the error.
+	} else {
+		for (uintptr_t i = 1; argv[i]; i++) {
+			if (0 == memcmp(argv[i], "-l", 2)) {
+				const char *name = argv[i][2] ? argv[i] + 2 : argv[i + 1];
+				if (name) hash = CompileCacheHashLibrary(argv, name, hash);
+				continue;
+			}
+
+			if (0 == strcmp(argv[i], outputPath) || stat(argv[i], &s) || !S_ISREG(s.st_mode)) continue;
+			hash = CompileCacheHashFile(argv[i], hash);
+		}
+	}
+
+	*key = hash;
+	return true;
+}
+
+int _ExecuteCached(char **output, const char *executable, ...) {
+	char *argv[64];
+	char *copies[64];
+	va_list argList;
+	va_start(argList, executable);
+	size_t copyCount = ExecuteParseArguments(argv, copies, executable, argList);
+	va_end(argList);
+
+	const char *outputPath = NULL;
+
+	for (uintptr_t i = 0; argv[i]; i++) {
+		if (0 == strcmp(argv[i], "-o")) {
+			outputPath = argv[i + 1];
+		}
+	}
+
+	uint64_t key;
+	char cachePath[256], logPath[256];
+	bool cacheable = useCompileCache && outputPath && CompileCacheKey(argv, outputPath, &key);
+	int status = 0;
+
+	if (cacheable) {
+		snprintf(cachePath, sizeof(cachePath), "bin/compile_cache/%016lx", (unsigned long) key);
+		snprintf(logPath, sizeof(logPath), "bin/compile_cache/%016lx.log", (unsigned long) key);
+	}
+
+	if (cacheable && FileExists(cachePath) && CopyFile(cachePath, outputPath, true)) {
+		// If the copy fails, run the command as if the entry was missing.
+		__sync_fetch_and_add(&compileCacheHits, 1);
+		utime(cachePath, NULL); // Mark the entry as recently used.
+
+		if (verbose) {
+			Log("(compile cache hit for '%s')\n", outputPath);
+		}
+
+		// Replay the warnings from the original compile.
+		size_t logBytes;
+		char *log = (char *) LoadFile(logPath, &logBytes);
+
+		if (log && output) {
+			size_t previousLength = arrlenu(*output);
+			arrsetlen(*output, previousLength + logBytes);
+			memcpy(*output + previousLength, log, logBytes);
+		}
+
+		free(log);
+	} else {
+		char *commandOutput = NULL;
+		status = ExecuteArguments(&commandOutput, argv);
+
+		if (cacheable) {
+			__sync_fetch_and_add(&compileCacheMisses, 1);
+		}
+
+		if (cacheable && !status) {
+			if (arrlenu(commandOutput)) {
+				File f = FileOpen(logPath, 'w');
+
+				if (f.ready) {
+					FileWrite(f, arrlenu(commandOutput), commandOutput);
+					FileClose(f);
+				}
+			}
+
+			// Copy to a temporary file first, so that other build threads never see a partial entry.
+			char temporaryPath[256];
+			snprintf(temporaryPath, sizeof(temporaryPath), "bin/compile_cache/temp_%d", 
+					(int) __sync_fetch_and_add(&compileCacheTemporaryID, 1));
+
+			if (CopyFile(outputPath, temporaryPath, true)) {
+				MoveFile(temporaryPath, cachePath);
+			} else {
+				DeleteFile(temporaryPath);
+			}
+		}
+
+		if (output && arrlenu(commandOutput)) {
+			size_t previousLength = arrlenu(*output);
+			arrsetlen(*output, previousLength + arrlenu(commandOutput));
+			memcpy(*output + previousLength, commandOutput, arrlenu(commandOutput));
+		}
+
+		arrfree(commandOutput);
+	}
+
+	for (uintptr_t i = 0; i < copyCount; i++) {
+		free(copies[i]);
+	}
+
+	if (status) __sync_fetch_and_or(&encounteredErrors, 1);
+	return status;
+}
+
+typedef struct CompileCacheEntry {
+	char name[32];
+	time_t lastUsed;
+	off_t bytes;
+} CompileCacheEntry;
+
+int CompileCacheCompareEntries(const void *_left, const void *_right) {
+	const CompileCacheEntry *left = (const CompileCacheEntry *) _left, *right = (const CompileCacheEntry *) _right;
+	return left->lastUsed < right->lastUsed ? -1 : left->lastUsed > right->lastUsed ? 1 : 0;
+}
+
+void CompileCacheTrim() {
+	// Remove the least recently used entries until the cache fits in COMPILE_CACHE_MAXIMUM_BYTES.
+	// An entry's log is counted with it, and removed with it.
+
+	DIR *d = opendir("bin/compile_cache");
+	if (!d) return;
+
+	CompileCacheEntry *entries = NULL;
+	uint64_t totalBytes = 0;
+	struct dirent *dir;
+	char path[256];
+
+	while ((dir = readdir(d))) {
+		struct stat s;
+		snprintf(path, sizeof(path), "bin/compile_cache/%s", dir->d_name);
+		if (dir->d_name[0] == '.' || stat(path, &s) || !S_ISREG(s.st_mode)) continue;
+		totalBytes += s.st_size;
+
+		if (!strchr(dir->d_name, '.') && strlen(dir->d_name) < sizeof(entries[0].name)) {
+			CompileCacheEntry entry = { .lastUsed = s.st_mtime, .bytes = s.st_size };
+			strcpy(entry.name, dir->d_name);
+			arrput(entries, entry);
+		}
+	}
+
+	closedir(d);
+
+	if (totalBytes > COMPILE_CACHE_MAXIMUM_BYTES) {
+		qsort(entries, arrlenu(entries), sizeof(CompileCacheEntry), CompileCacheCompareEntries);
+
+		for (uintptr_t i = 0; i < arrlenu(entries) && totalBytes > COMPILE_CACHE_MAXIMUM_BYTES; i++) {
+			struct stat s;
+			snprintf(path, sizeof(path), "bin/compile_cache/%s.log", entries[i].name);
+			if (!stat(path, &s)) totalBytes -= s.st_size;
+			DeleteFile(path);
+			snprintf(path, sizeof(path), "bin/compile_cache/%s", entries[i].name);
+			DeleteFile(path);
+			totalBytes -= entries[i].bytes;
+		}
+	}
+
+	arrfree(entries);
+}
+#endif
+
 #ifndef OS_ESSENCE
 EsUniqueIdentifier MatchFileContentType(const char *pathBuffer) {
 	FILE *f = fopen(pathBuffer, "rb");
@@ -683,12 +983,12 @@ void BuildDesktop(Application *application) {
 	char buffer[4096];
 
 	snprintf(buffer, sizeof(buffer), "arch/%s/api.s", target);
-	ExecuteForApp(application, toolchainNasm, buffer, "-MD", "bin/dependency_files/api1.d", "-o", "bin/Object Files/api1.o", ArgString(commonAssemblyFlags));
-	ExecuteForApp(application, toolchainCXX, "-MD", "-MF", "bin/dependency_files/api2.d", "-c", "desktop/api.cpp", "-o", "bin/Object Files/api2.o", 
+	ExecuteForAppCached(application, toolchainNasm, buffer, "-MD", "bin/dependency_files/api1.d", "-o", "bin/Object Files/api1.o", ArgString(commonAssemblyFlags));
+	ExecuteForAppCached(application, toolchainCXX, "-MD", "-MF", "bin/dependency_files/api2.d", "-c", "desktop/api.cpp", "-o", "bin/Object Files/api2.o", 
 			ArgString(commonCompileFlags), ArgString(desktopProfilingFlags));
-	ExecuteForApp(application, toolchainCXX, "-MD", "-MF", "bin/dependency_files/api3.d", "-c", "desktop/posix.cpp", "-o", "bin/Object Files/api3.o", 
+	ExecuteForAppCached(application, toolchainCXX, "-MD", "-MF", "bin/dependency_files/api3.d", "-c", "desktop/posix.cpp", "-o", "bin/Object Files/api3.o", 
 			ArgString(commonCompileFlags));
-	ExecuteForApp(application, toolchainCC, "-o", "bin/Desktop", "bin/Object Files/crti.o", "bin/Object Files/crtbegin.o", 
+	ExecuteForAppCached(application, toolchainCC, "-o", "bin/Desktop", "bin/Object Files/crti.o", "bin/Object Files/crtbegin.o", 
 			"bin/Object Files/api1.o", "bin/Object Files/api2.o", "bin/Object Files/api3.o", "bin/Object Files/crtend.o", "bin/Object Files/crtn.o", 
 			ArgString(apiLinkFlags1), ArgString(apiLinkFlags2), ArgString(apiLinkFlags3));
 	ExecuteForApp(application, toolchainStrip, "-o", "bin/Stripped Executables/Desktop", "--strip-all", "bin/Desktop");
@@ -776,7 +1076,7 @@ void BuildApplication(Application *application) {
 			const char *languageFlags = isC ? cCompileFlags : cppCompileFlags;
 			const char *compiler = isC ? toolchainCC : toolchainCXX;
 
-			ExecuteForApp(application, compiler, "-MD", "-MF", dependencyFile, "-o", objectFile, "-c", source, 
+			ExecuteForAppCached(application, compiler, "-MD", "-MF", dependencyFile, "-o", objectFile, "-c", source, 
 					ArgString(languageFlags), ArgString(application->compileFlags), ArgString(cstdlibFlags));
 		}
 
@@ -784,9 +1084,9 @@ void BuildApplication(Application *application) {
 		objectFiles[objectFilesPosition] = 0;
 
 		if (application->withCStdLib) {
-			ExecuteForApp(application, toolchainCC, "-o", symbolFile, ArgString(objectFiles), ArgString(application->linkFlags));
+			ExecuteForAppCached(application, toolchainCC, "-o", symbolFile, ArgString(objectFiles), ArgString(application->linkFlags));
 		} else {
-			ExecuteForApp(application, toolchainCC, "-o", symbolFile, 
+			ExecuteForAppCached(application, toolchainCC, "-o", symbolFile, 
 					"-Wl,--start-group", ArgString(application->linkFlags), crti, crtbegin, ArgString(objectFiles), crtend, crtn, "-Wl,--end-group", 
 					ArgString(applicationLinkFlags), "-T", linkerScript);
 		}
@@ -980,7 +1280,7 @@ void BuildModule(Application *application) {
 	snprintf(dependencyFile, sizeof(dependencyFile), "bin/dependency_files/%s.d", application->name);
 
 	assert(arrlenu(application->sources) == 1);
-	ExecuteForApp(application, toolchainCXX, "-MD", "-MF", dependencyFile, "-c", application->sources[0], "-o", 
+	ExecuteForAppCached(application, toolchainCXX, "-MD", "-MF", dependencyFile, "-c", application->sources[0], "-o", 
 			output, ArgString(cppCompileFlags), ArgString(kernelCompileFlags), ArgString(commonCompileFlags), 
 			application->builtin ? "-DBUILTIN_MODULE" : "-DKERNEL_MODULE");
 
@@ -1150,9 +1450,9 @@ void LinkKernel() {
 void BuildKernel(Application *application) {
 	char buffer[4096];
 	snprintf(buffer, sizeof(buffer), "arch/%s/kernel.s", target);
-	ExecuteForApp(application, toolchainNasm, "-MD", "bin/dependency_files/kernel2.d", buffer, "-o", "bin/Object Files/kernel_arch.o", ArgString(commonAssemblyFlags));
+	ExecuteForAppCached(application, toolchainNasm, "-MD", "bin/dependency_files/kernel2.d", buffer, "-o", "bin/Object Files/kernel_arch.o", ArgString(commonAssemblyFlags));
 	snprintf(buffer, sizeof(buffer), "-DARCH_KERNEL_SOURCE=<arch/%s/kernel.cpp>", target);
-	ExecuteForApp(application, toolchainCXX, "-MD", "-MF", "bin/dependency_files/kernel.d", "-c", "kernel/main.cpp", "-o", "bin/Object Files/kernel.o", 
+	ExecuteForAppCached(application, toolchainCXX, "-MD", "-MF", "bin/dependency_files/kernel.d", "-c", "kernel/main.cpp", "-o", "bin/Object Files/kernel.o", 
 			ArgString(kernelCompileFlags), ArgString(cppCompileFlags), ArgString(commonCompileFlags), buffer);
 	if (application->error) __sync_fetch_and_or(&encounteredErrorsInKernelModules, 1);
 }
@@ -1415,6 +1715,10 @@ int main(int argc, char **argv) {
 					systemBuild = !!atoi(s.value);
 				} else if (0 == strcmp(s.key, "minimal_rebuild")) {
 					minimalRebuild = !!atoi(s.value);
+#ifndef OS_ESSENCE
+				} else if (0 == strcmp(s.key, "compile_cache")) {
+					useCompileCache = !!atoi(s.value);
+#endif
 				} else if (0 == strcmp(s.key, "optimise")) {
 					if (atoi(s.value)) {
 						strcat(commonCompileFlags, " -O2 ");
@@ -1547,6 +1851,9 @@ int main(int argc, char **argv) {
 	MakeDirectory("bin/Object Files");
 	MakeDirectory("bin/Stripped Executables");
 	MakeDirectory("bin/generated_code");
+#ifndef OS_ESSENCE
+	if (useCompileCache) MakeDirectory("bin/compile_cache");
+#endif
 
 	if (systemBuild) {
 		MakeDirectory("root");
@@ -1712,6 +2019,17 @@ int main(int argc, char **argv) {
 			Log(".\n");
 		}
 
+#ifndef OS_ESSENCE
+		if (compileCacheHits || compileCacheMisses) {
+			Log("Compile cache: %d hit%s, %d miss%s.\n", (int) compileCacheHits, compileCacheHits == 1 ? "" : "s", 
+					(int) compileCacheMisses, compileCacheMisses == 1 ? "" : "es");
+		}
+
+		if (compileCacheMisses) {
+			CompileCacheTrim();
+		}
+#endif
+
 		for (uintptr_t i = 0; i < arrlenu(applications); i++) {
 			if (applications[i].skipped) {
 				continue;
@@ -1772,6 +2090,9 @@ int main(int argc, char **argv) {
 
 	uint8_t _encounteredErrors = encounteredErrors;
 	encounteredErrors = false;
+#ifndef OS_ESSENCE
+	compileCacheHits = compileCacheMisses = 0;
+#endif
 
 #ifdef PARALLEL_BUILD
 	applicationsIndex = 0;
@@ -0,0 +1,354 @@
+// This file is part of the Essence operating system.
+// It is released under the terms of the MIT license -- see LICENSE.md.
+
+// Checks the directory indices made by the image builder in shared/esfs2.h.
+// A volume is formatted in memory, and directories of various sizes are imported, so that their indices are built with BuildIndex.
+// Some of the directories are then extended one key at a time with AddNode, like directories that already have an index.
+// Every index is walked, checking the order of its keys, the depth of its leaves, the occupancy of its vertices,
+// and that each key refers to an entry with its hash, marked with ESFS_INDEX_KEY_COLLISION if the hash is shared.
+// Run with "esfs-index-test" in the build system.
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define Log(...) fprintf(stderr, __VA_ARGS__)
+#define EsFileOffset uint64_t
+#define EsFSError() exit(1)
+
+#include "../shared/crc.h"
+#define DEPENDENCIES_FILE "bin/dependency_files/dependencies.ini"
+#include "build_common.h"
+#include "../shared/esfs2.h"
+
+#define DRIVE_SIZE (256 * 1024 * 1024)
+#define COLLISION_SUFFIX_BYTES (16)
+
+uint8_t *drive;
+int failureCount;
+
+#define CHECK(x, ...) do { if (!(x)) { Log("Failed check '" #x "': " __VA_ARGS__); Log("\n"); failureCount++; return false; } } while (0)
+
+bool ReadBlock(uint64_t block, uint64_t count, void *buffer) {
+	if ((block + count) * blockSize > DRIVE_SIZE) return false;
+	memcpy(buffer, drive + block * blockSize, count * blockSize);
+	return true;
+}
+
+bool WriteBlock(uint64_t block, uint64_t count, void *buffer) {
+	if ((block + count) * blockSize > DRIVE_SIZE) return false;
+	memcpy(drive + block * blockSize, buffer, count * blockSize);
+	return true;
+}
+
+bool WriteBytes(uint64_t offset, uint64_t count, void *buffer) {
+	if (offset + count > DRIVE_SIZE) return false;
+	memcpy(drive + offset, buffer, count);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////
+
+uint8_t collisionDifferences[2][COLLISION_SUFFIX_BYTES];
+
+void FindCollisionDifferences() {
+	// For inputs of a fixed length, CRC-64 is affine: the hashes of S and S ^ D only differ by a linear function of D.
+	// Find two differences D in the kernel of that function which only change the low 5 bits of each byte,
+	// so that names ending in the suffixes '@@..@' ^ D all have the same hash and stay printable.
+
+	struct { uint64_t value; uint8_t combination[COLLISION_SUFFIX_BYTES]; } basis[64] = {};
+	uint8_t base[COLLISION_SUFFIX_BYTES];
+	memset(base, '@', sizeof(base));
+	uint64_t baseHash = CalculateCRC64(base, sizeof(base), 0);
+	uintptr_t found = 0;
+
+	for (uintptr_t i = 0; i < COLLISION_SUFFIX_BYTES * 5 && found < 2; i++) {
+		uint8_t combination[COLLISION_SUFFIX_BYTES] = {};
+		combination[i / 5] = 1 << (i % 5);
+		base[i / 5] ^= combination[i / 5];
+		uint64_t value = CalculateCRC64(base, sizeof(base), 0) ^ baseHash;
+		base[i / 5] ^= combination[i / 5];
+		bool independent = false;
+
+		for (int bit = 63; bit >= 0; bit--) {
+			if (~value & ((uint64_t) 1 << bit)) continue;
+
+			if (!basis[bit].value) {
+				basis[bit].value = value;
+				memcpy(basis[bit].combination, combination, sizeof(combination));
+				independent = true;
+				break;
+			}
+
+			value ^= basis[bit].value;
+			for (uintptr_t j = 0; j < COLLISION_SUFFIX_BYTES; j++) combination[j] ^= basis[bit].combination[j];
+		}
+
+		if (!independent) {
+			memcpy(collisionDifferences[found++], combination, sizeof(combination));
+		}
+	}
+
+	assert(found == 2);
+}
+
+char *CollisionName(uintptr_t group, uintptr_t member) {
+	// Members 0 to 3 of a group all have the same hash.
+
+	char suffix[COLLISION_SUFFIX_BYTES + 1] = {};
+
+	for (uintptr_t i = 0; i < COLLISION_SUFFIX_BYTES; i++) {
+		suffix[i] = '@' ^ ((member & 1) ? collisionDifferences[0][i] : 0) ^ ((member & 2) ? collisionDifferences[1][i] : 0);
+	}
+
+	char buffer[64];
+	snprintf(buffer, sizeof(buffer), "%d-%s", (int) group, suffix);
+	return strdup(buffer);
+}
+
+//////////////////////////////////////////////////////////////
+
+typedef struct TestDirectory {
+	const char *name;
+	size_t plainCount, collisionGroups; // Each collision group adds 3 entries with the same hash.
+
+	// Entries added with AddNode after the index was built.
+	// Added collision groups that were also imported add a fourth entry with the group's hash; the rest add 3 entries.
+	size_t addedPlainCount, addedCollisionGroups;
+
+	DirectoryEntryReference reference;
+} TestDirectory;
+
+char *PlainName(const char *prefix, uintptr_t index) {
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%s %d", prefix, (int) index);
+	return strdup(buffer);
+}
+
+bool FindChild(DirectoryEntryReference directoryReference, const char *name, DirectoryEntryReference *reference) {
+	DirectoryEntry directory, child;
+	if (!ReadDirectoryEntryReference(directoryReference, &directory)) return false;
+	AttributeDirectory *directoryAttribute = (AttributeDirectory *) FindAttribute(&directory, ESFS_ATTRIBUTE_DIRECTORY);
+
+	for (uintptr_t i = 0; i < directoryAttribute->childNodes; i++) {
+		if (!AccessNode(&directory, &child, sizeof(DirectoryEntry) * i, sizeof(DirectoryEntry), reference, true)) return false;
+		AttributeFilename *filename = (AttributeFilename *) FindAttribute(&child, ESFS_ATTRIBUTE_FILENAME);
+		if (filename->length == strlen(name) && 0 == memcmp(filename->filename, name, filename->length)) return true;
+	}
+
+	return false;
+}
+
+bool ReadChildNames(DirectoryEntryReference reference, char ***names) {
+	DirectoryEntry directory, child;
+	if (!ReadDirectoryEntryReference(reference, &directory)) return false;
+	AttributeDirectory *directoryAttribute = (AttributeDirectory *) FindAttribute(&directory, ESFS_ATTRIBUTE_DIRECTORY);
+
+	for (uintptr_t i = 0; i < directoryAttribute->childNodes; i++) {
+		if (!AccessNode(&directory, &child, sizeof(DirectoryEntry) * i, sizeof(DirectoryEntry), NULL, true)) return false;
+		AttributeFilename *filename = (AttributeFilename *) FindAttribute(&child, ESFS_ATTRIBUTE_FILENAME);
+		arrput(*names, strndup((const char *) filename->filename, filename->length));
+	}
+
+	return true;
+}
+
+bool CheckVertex(uint64_t block, uint64_t lowerBound, uint64_t upperBound, bool isRoot, uintptr_t depth,
+		intptr_t *leafDepth, char **names, uint64_t *hashes, uint8_t *keyFound) {
+	uint8_t buffer[superblock.blockSize];
+	CHECK(ReadBlock(block, 1, buffer), "block %d", (int) block);
+	IndexVertex *vertex = (IndexVertex *) buffer;
+
+	uint32_t checksum = vertex->checksum;
+	vertex->checksum = 0;
+	CHECK(checksum == CalculateCRC32(vertex, superblock.blockSize, 0), "block %d", (int) block);
+	CHECK(0 == memcmp(vertex->signature, ESFS_INDEX_VERTEX_SIGNATURE, 4), "block %d", (int) block);
+	CHECK(depth < ESFS_INDEX_MAX_DEPTH, "block %d", (int) block);
+
+	// Vertices are split when they become full, and merged when they drop below half full.
+
+	CHECK(vertex->count < vertex->maxCount, "block %d has %d keys", (int) block, vertex->count);
+	CHECK(isRoot || vertex->count >= (vertex->maxCount - 1) / 2, "block %d has %d keys", (int) block, vertex->count);
+	CHECK(vertex->count || isRoot, "block %d is empty", (int) block);
+
+	bool isLeaf = !ESFS_VERTEX_KEY(vertex, 0)->child;
+
+	if (isLeaf) {
+		if (*leafDepth == -1) *leafDepth = depth;
+		CHECK(*leafDepth == (intptr_t) depth, "leaves at depths %d and %d", (int) *leafDepth, (int) depth);
+	}
+
+	for (uintptr_t i = 0; i <= vertex->count; i++) {
+		IndexKey *key = ESFS_VERTEX_KEY(vertex, i);
+		CHECK(!key->child == isLeaf, "block %d key %d", (int) block, (int) i);
+		uint64_t keyLowerBound = i ? ESFS_VERTEX_KEY(vertex, i - 1)->value : lowerBound;
+		uint64_t keyUpperBound = i == vertex->count ? upperBound : key->value;
+
+		if (i != vertex->count) {
+			CHECK(key->value > keyLowerBound || (!i && !lowerBound), "block %d key %d is out of order", (int) block, (int) i);
+			CHECK(key->value < upperBound || upperBound == UINT64_MAX, "block %d key %d is out of order", (int) block, (int) i);
+
+			// Check the entry the key refers to, and count the entries with its hash.
+
+			DirectoryEntry entry;
+			CHECK(ReadDirectoryEntryReference(key->data, &entry), "block %d key %d", (int) block, (int) i);
+			AttributeFilename *filename = (AttributeFilename *) FindAttribute(&entry, ESFS_ATTRIBUTE_FILENAME);
+			CHECK(CalculateCRC64(filename->filename, filename->length, 0) == key->value, "block %d key %d", (int) block, (int) i);
+			size_t matches = 0;
+
+			for (uintptr_t j = 0; j < arrlenu(names); j++) {
+				if (hashes[j] == key->value) {
+					CHECK(!keyFound[j], "'%s' has more than one key", names[j]);
+					keyFound[j] = 1;
+					matches++;
+				}
+			}
+
+			CHECK(!!(key->data.indexFlags & ESFS_INDEX_KEY_COLLISION) == (matches > 1), "block %d key %d has %d entries",
+					(int) block, (int) i, (int) matches);
+		}
+
+		if (key->child && !CheckVertex(key->child, keyLowerBound, keyUpperBound, false, depth + 1, leafDepth, names, hashes, keyFound)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool CheckIndex(TestDirectory *test, size_t expectedChildren) {
+	char **names = NULL;
+	if (!ReadChildNames(test->reference, &names)) return false;
+	CHECK(arrlenu(names) == expectedChildren, "'%s' has %d children, expected %d", test->name, (int) arrlenu(names), (int) expectedChildren);
+
+	DirectoryEntry directory;
+	if (!ReadDirectoryEntryReference(test->reference, &directory)) return false;
+	AttributeDirectory *directoryAttribute = (AttributeDirectory *) FindAttribute(&directory, ESFS_ATTRIBUTE_DIRECTORY);
+	CHECK(!directoryAttribute->indexRootBlock == !expectedChildren, "'%s'", test->name);
+
+	uint8_t *keyFound = (uint8_t *) calloc(arrlenu(names) + 1, 1);
+	uint64_t *hashes = (uint64_t *) calloc(arrlenu(names) + 1, sizeof(uint64_t));
+	for (uintptr_t i = 0; i < arrlenu(names); i++) hashes[i] = CalculateCRC64(names[i], strlen(names[i]), 0);
+	intptr_t leafDepth = -1;
+	bool success = !directoryAttribute->indexRootBlock
+		|| CheckVertex(directoryAttribute->indexRootBlock, 0, UINT64_MAX, true, 0, &leafDepth, names, hashes, keyFound);
+
+	for (uintptr_t i = 0; success && i < arrlenu(names); i++) {
+		if (!keyFound[i]) {
+			Log("Failed check: '%s' in '%s' has no key.\n", names[i], test->name);
+			failureCount++;
+			success = false;
+		}
+	}
+
+	if (success) {
+		Log("'%s': %d entries, %d levels.\n", test->name, (int) arrlenu(names), (int) leafDepth + 1);
+	}
+
+	for (uintptr_t i = 0; i < arrlenu(names); i++) free(names[i]);
+	arrfree(names);
+	free(keyFound);
+	free(hashes);
+	return success;
+}
+
+//////////////////////////////////////////////////////////////
+
+int main() {
+	drive = (uint8_t *) calloc(DRIVE_SIZE, 1);
+	FindCollisionDifferences();
+
+	EsUniqueIdentifier installation = {};
+	uint8_t kernel[16] = {};
+	if (!Format(DRIVE_SIZE, "Index Test", installation, kernel, sizeof(kernel))) return 1;
+	if (!MountVolume()) return 1;
+
+	size_t maxCount = (superblock.blockSize - ESFS_INDEX_KEY_OFFSET) / sizeof(IndexKey) - 1 /* +1 key */;
+	size_t threeLevels = maxCount * maxCount; // Enough keys to need a third level, even with full vertices.
+
+	TestDirectory tests[] = {
+		{ .name = "empty" },
+		{ .name = "one", .plainCount = 1 },
+		{ .name = "root only", .plainCount = maxCount - 2 },
+		{ .name = "two vertices", .plainCount = maxCount - 1 },
+		{ .name = "two levels", .plainCount = maxCount * 4 },
+		{ .name = "three levels", .plainCount = threeLevels },
+		{ .name = "collisions", .plainCount = 2, .collisionGroups = 1 },
+		{ .name = "two levels, collisions", .plainCount = maxCount * 2, .collisionGroups = maxCount * 2 },
+		{ .name = "three levels, collisions", .plainCount = threeLevels, .collisionGroups = threeLevels / 4 },
+		{ .name = "extended", .plainCount = maxCount, .addedPlainCount = maxCount * 8, .addedCollisionGroups = maxCount },
+		{ .name = "extended, collisions", .plainCount = maxCount * 3, .collisionGroups = maxCount,
+			.addedPlainCount = maxCount * 3, .addedCollisionGroups = maxCount * 2 },
+		{ .name = "collide with built", .collisionGroups = maxCount * 3, .addedCollisionGroups = maxCount * 3 },
+	};
+
+	size_t testCount = sizeof(tests) / sizeof(tests[0]);
+
+	// Import the directories, so that BuildIndex makes their indices.
+	// The children are given in a scrambled order, since BuildIndex has to sort the keys.
+
+	ImportNode root = {};
+
+	for (uintptr_t i = 0; i < testCount; i++) {
+		ImportNode node = { .name = tests[i].name };
+		size_t count = tests[i].plainCount + tests[i].collisionGroups * 3;
+
+		for (uintptr_t j = 0; j < count; j++) {
+			uintptr_t k = (j * 7919) % count;
+			ImportNode child = {};
+			if (k < tests[i].plainCount) child.name = PlainName("plain", k);
+			else child.name = CollisionName((k - tests[i].plainCount) / 3, (k - tests[i].plainCount) % 3);
+			arrput(node.children, child);
+		}
+
+		arrput(root.children, node);
+	}
+
+	if (Import(root, superblock.root) == -1) return 1;
+
+	for (uintptr_t i = 0; i < testCount; i++) {
+		if (!FindChild(superblock.root, tests[i].name, &tests[i].reference)) return 1;
+		CheckIndex(tests + i, tests[i].plainCount + tests[i].collisionGroups * 3);
+	}
+
+	// Extend the directories one entry at a time, as for a directory that already has an index.
+
+	for (uintptr_t i = 0; i < testCount; i++) {
+		size_t count = tests[i].plainCount + tests[i].collisionGroups * 3;
+		if (!tests[i].addedPlainCount && !tests[i].addedCollisionGroups) continue;
+
+		for (uintptr_t j = 0; j < tests[i].addedPlainCount; j++) {
+			char *name = PlainName("added", j);
+			if (!AddNode(name, ESFS_NODE_TYPE_DIRECTORY, NULL, NULL, tests[i].reference, (EsUniqueIdentifier) {}, NULL)) return 1;
+			free(name);
+			count++;
+		}
+
+		for (uintptr_t j = 0; j < tests[i].addedCollisionGroups; j++) {
+			for (uintptr_t member = j < tests[i].collisionGroups ? 3 : 0; member < (j < tests[i].collisionGroups ? 4 : 3); member++) {
+				char *name = CollisionName(j, member);
+				if (!AddNode(name, ESFS_NODE_TYPE_DIRECTORY, NULL, NULL, tests[i].reference, (EsUniqueIdentifier) {}, NULL)) return 1;
+				free(name);
+				count++;
+			}
+		}
+
+		CheckIndex(tests + i, count);
+	}
+
+	UnmountVolume();
+
+	if (failureCount) {
+		Log("%d checks failed.\n", failureCount);
+		return 1;
+	}
+
+	Log("All checks passed.\n");
+	return 0;
+}
@@ -1297,6 +1297,7 @@ void OutputScript(Entry *root) {
 	// TODO Return values.
 	// TODO Structs, enums, etc.
 	// TODO matrix_shared
+	// TODO array_out
 
 	int skippedFunctions = 0, totalFunctions = 0;
 
@@ -1312,6 +1313,7 @@ void OutputScript(Entry *root) {
 
 				if (0 == strcmp(annotation->name, "native")
 						|| 0 == strcmp(annotation->name, "matrix_shared")
+						|| 0 == strcmp(annotation->name, "array_out")
 						|| 0 == strcmp(annotation->name, "todo")) {
 					skippedFunctions++;
 					goto skipRootEntry;
@@ -1786,6 +1788,7 @@ int AnalysisResolve(Entry *root, Entry e, Entry **unresolved, Entry *resolved, E
 		} else if (0 == strcmp(annotation->name, "heap_array_out")
 				|| 0 == strcmp(annotation->name, "heap_matrix_out")
 				|| 0 == strcmp(annotation->name, "array_in")
+				|| 0 == strcmp(annotation->name, "array_out")
 				|| 0 == strcmp(annotation->name, "matrix_in")
 				|| 0 == strcmp(annotation->name, "matrix_shared")) {
 			bool matrix = 0 == strcmp(annotation->name, "heap_matrix_out") 
@@ -262,9 +262,12 @@ typedef struct Tokenizer {
 
 typedef struct Scope {
 	struct Node **entries;
+	uint32_t *variableIndices; // The number of variable entries before each entry.
 	size_t entryCount;
 	size_t variableEntryCount;
 	size_t entriesAllocated;
+	uint32_t *hashSlots; // Indices into entries, plus one. Only used once the scope has SCOPE_HASH_MINIMUM_ENTRIES.
+	size_t hashSlotCount;
 	bool isRoot;
 } Scope;
 
@@ -308,6 +311,9 @@ typedef struct FunctionBuilder {
 	uintptr_t globalVariableOffset;
 	struct ImportData *importData; // Only valid during script loading.
 	Node *replResultType;
+	uint32_t *typeRelocations; // Offsets of the Node pointers embedded in data; used by bytecode images.
+	size_t typeRelocationCount;
+	size_t typeRelocationsAllocated;
 } FunctionBuilder;
 
 typedef struct BackTraceItem {
@@ -399,8 +405,42 @@ typedef struct CoroutineState {
 	uintptr_t parameterCount;
 	Value returnValue;
 	int returnValueType;
+
+	uint64_t profileExternalStart; // When the external coroutine was started, if profiling.
 } CoroutineState;
 
+typedef struct ProfileLine {
+	uint64_t instructions;
+	uint64_t time; // Wall time while this was the current line, including waiting on external coroutines.
+	uint64_t externalTime; // Time spent in external calls made from this line. Concurrent calls overlap.
+} ProfileLine;
+
+typedef struct ProfileStack {
+	uintptr_t firstFrame; // Index into framePool; the outermost function is first.
+	size_t frameCount;
+	uint64_t hash;
+	uint64_t time;
+} ProfileStack;
+
+typedef struct Profiler {
+	uint32_t *lineIndices; // The line number entry covering each byte of the function data.
+	ProfileLine *lines; // One for each line number entry.
+	ProfileStack *stacks;
+	size_t stackCount;
+	size_t stacksAllocated;
+	uint32_t *stackSlots; // Indices into stacks, plus one.
+	size_t stackSlotCount;
+	Token **framePool;
+	size_t framePoolCount;
+	size_t framePoolAllocated;
+	uint64_t lastTime;
+	uint32_t currentLine;
+	uintptr_t currentStack;
+	uint64_t currentCoroutineID;
+	uintptr_t currentDepth;
+	Token *currentFunction;
+} Profiler;
+
 typedef struct ExecutionContext {
 	Value *globalVariables;
 	bool *globalVariableIsManaged;
@@ -420,6 +460,8 @@ typedef struct ExecutionContext {
 	CoroutineState *unblockedCoroutines;
 	uint64_t lastCoroutineID;
 	uint32_t externalCoroutineCount;
+
+	Profiler *profiler; // Only set when profiling.
 } ExecutionContext;
 
 typedef struct ExternalFunction {
@@ -454,6 +496,8 @@ char **options;
 bool *optionsMatched;
 size_t optionCount;
 int debugBytecodeLevel;
+const char *bytecodeImagePath;
+const char *profileOutputPath;
 ImportData *importedModules;
 ImportData **importedModulesLink = &importedModules;
 
@@ -485,10 +529,13 @@ void PrintError3(const char *format, ...);
 void PrintError4(ExecutionContext *context, uint32_t instructionPointer, const char *format, ...);
 void PrintBackTrace(ExecutionContext *context, uint32_t instructionPointer, CoroutineState *c, const char *prefix);
 void *FileLoad(const char *path, size_t *length);
+bool FileSave(const char *path, const void *data, size_t bytes);
 CoroutineState *ExternalCoroutineWaitAny(ExecutionContext *context);
 void ExternalPassREPLResult(ExecutionContext *context, Value value);
 void *LibraryLoad(const char *name);
 void *LibraryGetAddress(void *library, const char *name);
+uint64_t TimeGetMonotonic(); // In nanoseconds.
+void ProfilerWriteOutput(ExecutionContext *context);
 
 // --------------------------------- Base module.
 
@@ -2381,28 +2428,102 @@ Node *ParseRoot(Tokenizer *tokenizer) {
 
 // --------------------------------- Scope management.
 
+// Scopes with more than a handful of entries (typically the root scopes of large scripts and modules)
+// are indexed with an open addressing hash table keyed by the identifier, so that lookups do not need to
+// compare against every entry. Small block scopes are searched linearly, which is faster for them.
+
+#define SCOPE_HASH_MINIMUM_ENTRIES (16)
+#define FNV1A_BASIS (0xCBF29CE484222325)
+
+uint64_t HashFNV1a(uint64_t hash, const void *key, size_t keyBytes) {
+	for (uintptr_t i = 0; i < keyBytes; i++) {
+		hash = (hash ^ ((const uint8_t *) key)[i]) * 0x100000001B3;
+	}
+
+	return hash;
+}
+
 bool ScopeIsVariableType(Node *node) {
 	return node->type == T_DECLARE || node->type == T_FUNCTION || node->type == T_ARGUMENT || node->type == T_PLACEHOLDER;
 }
 
-intptr_t ScopeLookupIndex(Node *node, Scope *scope, bool maybe, bool real /* if false, the variable index is returned */) {
-	uintptr_t j = 0;
+void ScopeHashInsert(Scope *scope, uintptr_t index) {
+	Token *token = &scope->entries[index]->token;
+	if (!token->textBytes) return; // Placeholders are never looked up.
+	uintptr_t slot = HashFNV1a(FNV1A_BASIS, token->text, token->textBytes) & (scope->hashSlotCount - 1);
 
-	for (uintptr_t i = 0; i < scope->entryCount; i++) {
-		if (scope->entries[i]->token.textBytes == node->token.textBytes
-				&& 0 == MemoryCompare(scope->entries[i]->token.text, node->token.text, node->token.textBytes)) {
-			if (!ScopeIsVariableType(scope->entries[i]) && !real) {
-				break;
-			}
+	while (scope->hashSlots[slot]) {
+		Token *existing = &scope->entries[scope->hashSlots[slot] - 1]->token;
 
-			return j;
+		if (existing->textBytes == token->textBytes && 0 == MemoryCompare(existing->text, token->text, token->textBytes)) {
+			return; // Lookups return the first matching entry.
 		}
 
-		if (ScopeIsVariableType(scope->entries[i]) || real) {
-			j++;
+		slot = (slot + 1) & (scope->hashSlotCount - 1);
+	}
+
+	scope->hashSlots[slot] = index + 1;
+}
+
+void ScopeAppendEntry(Scope *scope, Node *node) {
+	if (scope->entryCount == scope->entriesAllocated) {
+		scope->entriesAllocated = scope->entriesAllocated ? scope->entriesAllocated * 2 : 4;
+		scope->entries = (Node **) AllocateResize(scope->entries, sizeof(Node *) * scope->entriesAllocated);
+		scope->variableIndices = (uint32_t *) AllocateResize(scope->variableIndices, sizeof(uint32_t) * scope->entriesAllocated);
+	}
+
+	scope->variableIndices[scope->entryCount] = scope->variableEntryCount;
+	scope->entries[scope->entryCount++] = node;
+
+	if (ScopeIsVariableType(node)) {
+		scope->variableEntryCount++;
+	}
+
+	if (scope->entryCount >= SCOPE_HASH_MINIMUM_ENTRIES && scope->entryCount * 2 > scope->hashSlotCount) {
+		// Keep the load factor at most a half. The slot count is always a power of two.
+		scope->hashSlotCount = scope->hashSlotCount ? scope->hashSlotCount * 2 : SCOPE_HASH_MINIMUM_ENTRIES * 4;
+		scope->hashSlots = (uint32_t *) AllocateResize(scope->hashSlots, sizeof(uint32_t) * scope->hashSlotCount);
+		for (uintptr_t i = 0; i < scope->hashSlotCount; i++) scope->hashSlots[i] = 0;
+		for (uintptr_t i = 0; i < scope->entryCount; i++) ScopeHashInsert(scope, i);
+	} else if (scope->hashSlotCount) {
+		ScopeHashInsert(scope, scope->entryCount - 1);
+	}
+}
+
+intptr_t ScopeFindEntry(Scope *scope, const char *text, size_t textBytes) {
+	if (scope->hashSlotCount) {
+		uintptr_t slot = HashFNV1a(FNV1A_BASIS, text, textBytes) & (scope->hashSlotCount - 1);
+
+		while (scope->hashSlots[slot]) {
+			Token *token = &scope->entries[scope->hashSlots[slot] - 1]->token;
+
+			if (token->textBytes == textBytes && 0 == MemoryCompare(token->text, text, textBytes)) {
+				return scope->hashSlots[slot] - 1;
+			}
+
+			slot = (slot + 1) & (scope->hashSlotCount - 1);
+		}
+	} else {
+		for (uintptr_t i = 0; i < scope->entryCount; i++) {
+			if (scope->entries[i]->token.textBytes == textBytes
+					&& 0 == MemoryCompare(scope->entries[i]->token.text, text, textBytes)) {
+				return i;
+			}
 		}
 	}
 
+	return -1;
+}
+
+intptr_t ScopeLookupIndex(Node *node, Scope *scope, bool maybe, bool real /* if false, the variable index is returned */) {
+	intptr_t i = ScopeFindEntry(scope, node->token.text, node->token.textBytes);
+
+	if (i != -1 && real) {
+		return i;
+	} else if (i != -1 && ScopeIsVariableType(scope->entries[i])) {
+		return scope->variableIndices[i];
+	}
+
 	if (!maybe) {
 		Assert(false);
 	}
@@ -2417,18 +2538,16 @@ Node *ScopeLookup(Tokenizer *tokenizer, Node *node, bool maybe) {
 	while (ancestor) {
 		if (ancestor->scope != scope) {
 			scope = ancestor->scope;
+			intptr_t i = ScopeFindEntry(scope, node->token.text, node->token.textBytes);
 
-			for (uintptr_t i = 0; i < scope->entryCount; i++) {
-				if (scope->entries[i]->token.textBytes == node->token.textBytes
-						&& 0 == MemoryCompare(scope->entries[i]->token.text, node->token.text, node->token.textBytes)) {
-					if (node->referencesRootScope && scope->entries[i]->parent->type != T_ROOT) {
-						PrintError2(tokenizer, node, "The identifier '%.*s' is used before it is declared in this scope.\n", 
-								node->token.textBytes, node->token.text);
-						return NULL;
-					}
-
-					return scope->entries[i];
+			if (i != -1) {
+				if (node->referencesRootScope && scope->entries[i]->parent->type != T_ROOT) {
+					PrintError2(tokenizer, node, "The identifier '%.*s' is used before it is declared in this scope.\n", 
+							node->token.textBytes, node->token.text);
+					return NULL;
 				}
+
+				return scope->entries[i];
 			}
 		}
 
@@ -2449,28 +2568,26 @@ bool ScopeCheckNotAlreadyUsed(Tokenizer *tokenizer, Node *node) {
 	while (ancestor) {
 		if (ancestor->scope != scope) {
 			scope = ancestor->scope;
-
-			for (uintptr_t i = 0; i < scope->entryCount; i++) {
-				if (scope->entries[i]->token.textBytes == node->token.textBytes
-						&& 0 == MemoryCompare(scope->entries[i]->token.text, node->token.text, node->token.textBytes)
-						&& (!scope->isRoot || node->scope == scope)
-						&& scope->entries[i]->type != T_PLACEHOLDER) {
-					PrintError2(tokenizer, node, "The identifier '%.*s' was already used in this scope.\n", 
-							node->token.textBytes, node->token.text);
-
-					if (scope->entries[i]->type == T_INLINE) {
-						if (scope->entries[i]->importData->pathBytes == 15 
-								&& 0 == MemoryCompare(scope->entries[i]->importData->path, "__base_module__", scope->entries[i]->importData->pathBytes)) {
-							PrintDebug("It was declared in base library module.\n", 
-									scope->entries[i]->importData->path);
-						} else {
-							PrintDebug("It was imported inline from the module '%s'.\n", 
-									scope->entries[i]->importData->path);
-						}
+			intptr_t i = ScopeFindEntry(scope, node->token.text, node->token.textBytes);
+
+			if (i != -1
+					&& (!scope->isRoot || node->scope == scope)
+					&& scope->entries[i]->type != T_PLACEHOLDER) {
+				PrintError2(tokenizer, node, "The identifier '%.*s' was already used in this scope.\n", 
+						node->token.textBytes, node->token.text);
+
+				if (scope->entries[i]->type == T_INLINE) {
+					if (scope->entries[i]->importData->pathBytes == 15 
+							&& 0 == MemoryCompare(scope->entries[i]->importData->path, "__base_module__", scope->entries[i]->importData->pathBytes)) {
+						PrintDebug("It was declared in base library module.\n", 
+								scope->entries[i]->importData->path);
+					} else {
+						PrintDebug("It was imported inline from the module '%s'.\n", 
+								scope->entries[i]->importData->path);
 					}
-
-					return false;
 				}
+
+				return false;
 			}
 		}
 
@@ -2487,20 +2604,11 @@ bool ScopeAddEntry(Tokenizer *tokenizer, Scope *scope, Node *node) {
 
 	node->scope = scope;
 
-	if (scope->entryCount == scope->entriesAllocated) {
-		scope->entriesAllocated = scope->entriesAllocated ? scope->entriesAllocated * 2 : 4;
-		scope->entries = (Node **) AllocateResize(scope->entries, sizeof(Node *) * scope->entriesAllocated);
-	}
-
 	if (!ScopeCheckNotAlreadyUsed(tokenizer, node)) {
 		return false;
 	}
 
-	scope->entries[scope->entryCount++] = node;
-
-	if (ScopeIsVariableType(node)) {
-		scope->variableEntryCount++;
-	}
+	ScopeAppendEntry(scope, node);
 
 	// Set this here before type checking occurs, 
 	// so that all the declarations in the scope already have their expression type set.
@@ -2512,6 +2620,8 @@ bool ScopeAddEntry(Tokenizer *tokenizer, Scope *scope, Node *node) {
 void ASTFreeScopes(Node *node) {
 	if (node && node->scope) {
 		node->scope->entries = (Node **) AllocateResize(node->scope->entries, 0);
+		node->scope->variableIndices = (uint32_t *) AllocateResize(node->scope->variableIndices, 0);
+		node->scope->hashSlots = (uint32_t *) AllocateResize(node->scope->hashSlots, 0);
 
 		Node *child = node->firstChild;
 
@@ -3748,6 +3858,16 @@ void FunctionBuilderAppend(FunctionBuilder *builder, const void *buffer, size_t
 	builder->dataBytes += bytes;
 }
 
+void FunctionBuilderAppendType(FunctionBuilder *builder, Node *type) {
+	if (builder->typeRelocationCount == builder->typeRelocationsAllocated) {
+		builder->typeRelocationsAllocated = 2 * builder->typeRelocationsAllocated + 4;
+		builder->typeRelocations = (uint32_t *) AllocateResize(builder->typeRelocations, builder->typeRelocationsAllocated * sizeof(uint32_t));
+	}
+
+	builder->typeRelocations[builder->typeRelocationCount++] = builder->dataBytes;
+	FunctionBuilderAppend(builder, &type, sizeof(type));
+}
+
 void FunctionBuilderAddLineNumber(FunctionBuilder *builder, Node *node) {
 	if (builder->lineNumberCount == builder->lineNumbersAllocated) {
 		builder->lineNumbersAllocated = 2 * builder->lineNumbersAllocated + 4;
@@ -3755,6 +3875,7 @@ void FunctionBuilderAddLineNumber(FunctionBuilder *builder, Node *node) {
 	}
 
 	Node *ancestor = node;
+	builder->lineNumbers[builder->lineNumberCount].function = NULL;
 
 	while (ancestor) {
 		if (ancestor->type == T_FUNCTION) {
@@ -3792,36 +3913,28 @@ bool FunctionBuilderVariable(Tokenizer *tokenizer, FunctionBuilder *builder, Nod
 				index += scope->variableEntryCount;
 			}
 
-			uintptr_t j = 0;
+			intptr_t i = index == -1 ? ScopeFindEntry(scope, node->token.text, node->token.textBytes) : -1;
 
-			for (uintptr_t i = 0; i < scope->entryCount; i++) {
-				if (scope->entries[i]->token.textBytes == node->token.textBytes
-						&& 0 == MemoryCompare(scope->entries[i]->token.text, node->token.text, node->token.textBytes)
-						&& index == -1) {
-					index = j;
-					builder->isPersistentVariable = scope->entries[i]->isPersistentVariable;
-
-					if (scope->entries[i]->type == T_INLINE) {
-						index = scope->entries[i]->inlineImportVariableIndex;
-						Assert(index != -1);
-						globalVariableOffset = scope->entries[i]->importData->globalVariableOffset;
-						inlineImport = true;
-					} else if (scope->entries[i]->type == T_INTTYPE_CONSTANT) {
-						isIntConstant = true;
-						bool error = false;
-						intConstantValue.i = ASTEvaluateIntConstant(tokenizer, scope->entries[i]->firstChild, &error);
-						if (error) return false;
-					}
+			if (i != -1) {
+				index = scope->variableIndices[i];
+				builder->isPersistentVariable = scope->entries[i]->isPersistentVariable;
 
-					if (scope->entries[i]->type != T_DECLARE && forAssignment) {
-						PrintError2(tokenizer, node, "A value cannot be assigned to this. "
-								"Try putting a variable name here.\n");
-						return false;
-					}
+				if (scope->entries[i]->type == T_INLINE) {
+					index = scope->entries[i]->inlineImportVariableIndex;
+					Assert(index != -1);
+					globalVariableOffset = scope->entries[i]->importData->globalVariableOffset;
+					inlineImport = true;
+				} else if (scope->entries[i]->type == T_INTTYPE_CONSTANT) {
+					isIntConstant = true;
+					bool error = false;
+					intConstantValue.i = ASTEvaluateIntConstant(tokenizer, scope->entries[i]->firstChild, &error);
+					if (error) return false;
 				}
 
-				if (ScopeIsVariableType(scope->entries[i])) {
-					j++;
+				if (scope->entries[i]->type != T_DECLARE && forAssignment) {
+					PrintError2(tokenizer, node, "A value cannot be assigned to this. "
+							"Try putting a variable name here.\n");
+					return false;
 				}
 			}
 		}
@@ -4287,7 +4400,7 @@ bool FunctionBuilderRecurse(Tokenizer *tokenizer, Node *node, FunctionBuilder *b
 		FunctionBuilderAppend(builder, &node->operationType, sizeof(node->operationType));
 
 		if (node->operationType == T_OP_CAST) {
-			FunctionBuilderAppend(builder, &node->expressionType, sizeof(node->expressionType));
+			FunctionBuilderAppendType(builder, node->expressionType);
 		}
 
 		return true;
@@ -4404,7 +4517,7 @@ bool FunctionBuilderRecurse(Tokenizer *tokenizer, Node *node, FunctionBuilder *b
 	} else if (node->type == T_ANYTYPE_CAST) {
 		FunctionBuilderAddLineNumber(builder, node);
 		FunctionBuilderAppend(builder, &node->type, sizeof(node->type));
-		FunctionBuilderAppend(builder, &node->firstChild->expressionType, sizeof(node->firstChild->expressionType));
+		FunctionBuilderAppendType(builder, node->firstChild->expressionType);
 	} else if (node->type == T_ASSERT) {
 		FunctionBuilderAddLineNumber(builder, node);
 
@@ -4598,6 +4711,7 @@ bool ASTGenerate(Tokenizer *tokenizer, Node *root, ExecutionContext *context) {
 
 				void *address = LibraryGetAddress(child->token.module->library, name);
 				if (!address) return false;
+				FunctionBuilderAddLineNumber(context->functionData, child);
 				uint8_t b = T_LIBCALL;
 				FunctionBuilderAppend(context->functionData, &b, sizeof(b));
 				FunctionBuilderAppend(context->functionData, &address, sizeof(address));
@@ -4627,6 +4741,7 @@ bool ASTGenerate(Tokenizer *tokenizer, Node *root, ExecutionContext *context) {
 					return false;
 				}
 
+				FunctionBuilderAddLineNumber(context->functionData, child);
 				FunctionBuilderAppend(context->functionData, &b, sizeof(b));
 				FunctionBuilderAppend(context->functionData, &index, sizeof(index));
 			} else {
@@ -4648,6 +4763,157 @@ bool ASTGenerate(Tokenizer *tokenizer, Node *root, ExecutionContext *context) {
 	return true;
 }
 
+// --------------------------------- Profiling.
+
+// When profiling, every executed instruction is attributed to the line number entry covering it.
+// Wall time is measured between consecutive instructions, so time spent blocked in an external call
+// (or waiting for an external coroutine) is charged to the line that made it. The time is also accumulated
+// for each distinct stack of functions, for producing flame graphs.
+
+#define PROFILER_NO_LINE (0xFFFFFFFF)
+
+void ProfilerStart(ExecutionContext *context) {
+	FunctionBuilder *builder = context->functionData;
+	Profiler *profiler = (Profiler *) AllocateResize(NULL, sizeof(Profiler));
+	Profiler empty = { 0 };
+	*profiler = empty;
+	profiler->lineIndices = (uint32_t *) AllocateResize(NULL, sizeof(uint32_t) * builder->dataBytes + 1);
+	profiler->lines = (ProfileLine *) AllocateResize(NULL, sizeof(ProfileLine) * builder->lineNumberCount + 1);
+	profiler->currentLine = PROFILER_NO_LINE;
+
+	// Line numbers are added in the order the code is generated, so they are sorted by instruction pointer.
+	uint32_t line = PROFILER_NO_LINE;
+
+	for (uintptr_t i = 0, j = 0; i < builder->dataBytes; i++) {
+		while (j < builder->lineNumberCount && builder->lineNumbers[j].instructionPointer <= i) line = j++;
+		profiler->lineIndices[i] = line;
+	}
+
+	for (uintptr_t i = 0; i < builder->lineNumberCount; i++) {
+		ProfileLine zero = { 0 };
+		profiler->lines[i] = zero;
+	}
+
+	context->profiler = profiler;
+	profiler->lastTime = TimeGetMonotonic();
+}
+
+void ProfilerFree(ExecutionContext *context) {
+	Profiler *profiler = context->profiler;
+	if (!profiler) return;
+	AllocateResize(profiler->lineIndices, 0);
+	AllocateResize(profiler->lines, 0);
+	AllocateResize(profiler->stacks, 0);
+	AllocateResize(profiler->stackSlots, 0);
+	AllocateResize(profiler->framePool, 0);
+	AllocateResize(profiler, 0);
+	context->profiler = NULL;
+}
+
+Token *ProfilerFunctionAt(ExecutionContext *context, uintptr_t instructionPointer) {
+	if (instructionPointer >= context->functionData->dataBytes) return NULL;
+	uint32_t line = context->profiler->lineIndices[instructionPointer];
+	return line == PROFILER_NO_LINE ? NULL : context->functionData->lineNumbers[line].function;
+}
+
+uintptr_t ProfilerFindStack(Profiler *profiler, uintptr_t firstFrame, size_t frameCount) {
+	uint64_t hash = HashFNV1a(FNV1A_BASIS, profiler->framePool + firstFrame, frameCount * sizeof(Token *));
+
+	if (profiler->stackCount * 2 >= profiler->stackSlotCount) {
+		profiler->stackSlotCount = profiler->stackSlotCount ? profiler->stackSlotCount * 2 : 256;
+		profiler->stackSlots = (uint32_t *) AllocateResize(profiler->stackSlots, sizeof(uint32_t) * profiler->stackSlotCount);
+		for (uintptr_t i = 0; i < profiler->stackSlotCount; i++) profiler->stackSlots[i] = 0;
+
+		for (uintptr_t i = 0; i < profiler->stackCount; i++) {
+			uintptr_t slot = profiler->stacks[i].hash & (profiler->stackSlotCount - 1);
+			while (profiler->stackSlots[slot]) slot = (slot + 1) & (profiler->stackSlotCount - 1);
+			profiler->stackSlots[slot] = i + 1;
+		}
+	}
+
+	uintptr_t slot = hash & (profiler->stackSlotCount - 1);
+
+	while (profiler->stackSlots[slot]) {
+		ProfileStack *stack = &profiler->stacks[profiler->stackSlots[slot] - 1];
+
+		if (stack->hash == hash && stack->frameCount == frameCount 
+				&& 0 == MemoryCompare(profiler->framePool + stack->firstFrame, profiler->framePool + firstFrame, frameCount * sizeof(Token *))) {
+			profiler->framePoolCount = firstFrame; // The frames are already stored.
+			return profiler->stackSlots[slot] - 1;
+		}
+
+		slot = (slot + 1) & (profiler->stackSlotCount - 1);
+	}
+
+	if (profiler->stackCount == profiler->stacksAllocated) {
+		profiler->stacksAllocated = profiler->stacksAllocated * 2 + 64;
+		profiler->stacks = (ProfileStack *) AllocateResize(profiler->stacks, sizeof(ProfileStack) * profiler->stacksAllocated);
+	}
+
+	ProfileStack *stack = &profiler->stacks[profiler->stackCount];
+	stack->firstFrame = firstFrame;
+	stack->frameCount = frameCount;
+	stack->hash = hash;
+	stack->time = 0;
+	profiler->stackSlots[slot] = ++profiler->stackCount;
+	return profiler->stackCount - 1;
+}
+
+void ProfilerCharge(Profiler *profiler) {
+	uint64_t time = TimeGetMonotonic();
+
+	if (profiler->currentLine != PROFILER_NO_LINE) {
+		profiler->lines[profiler->currentLine].time += time - profiler->lastTime;
+		profiler->stacks[profiler->currentStack].time += time - profiler->lastTime;
+	}
+
+	profiler->lastTime = time;
+	profiler->currentLine = PROFILER_NO_LINE;
+}
+
+void ProfilerStep(ExecutionContext *context, uintptr_t instructionPointer) {
+	Profiler *profiler = context->profiler;
+	ProfilerCharge(profiler);
+	profiler->currentLine = profiler->lineIndices[instructionPointer];
+	if (profiler->currentLine == PROFILER_NO_LINE) return;
+	profiler->lines[profiler->currentLine].instructions++;
+
+	Token *function = context->functionData->lineNumbers[profiler->currentLine].function;
+	CoroutineState *c = context->c;
+
+	if (profiler->stackCount && c->id == profiler->currentCoroutineID 
+			&& c->backTracePointer == profiler->currentDepth && function == profiler->currentFunction) {
+		return;
+	}
+
+	// The stack has changed, so find its entry.
+
+	uintptr_t minimum = c->startedByAsync ? 1 : 0;
+	size_t frameCount = c->backTracePointer - minimum + 1;
+
+	if (profiler->framePoolCount + frameCount > profiler->framePoolAllocated) {
+		profiler->framePoolAllocated = profiler->framePoolAllocated * 2 + frameCount + 1024;
+		profiler->framePool = (Token **) AllocateResize(profiler->framePool, sizeof(Token *) * profiler->framePoolAllocated);
+	}
+
+	uintptr_t firstFrame = profiler->framePoolCount;
+
+	for (uintptr_t i = minimum; i < c->backTracePointer; i++) {
+		profiler->framePool[profiler->framePoolCount++] = ProfilerFunctionAt(context, c->backTrace[i].instructionPointer - 1);
+	}
+
+	profiler->framePool[profiler->framePoolCount++] = function;
+	profiler->currentStack = ProfilerFindStack(profiler, firstFrame, frameCount);
+	profiler->currentCoroutineID = c->id;
+	profiler->currentDepth = c->backTracePointer;
+	profiler->currentFunction = function;
+}
+
+void ProfilerAddExternalTime(ExecutionContext *context, uintptr_t instructionPointer, uint64_t time) {
+	uint32_t line = context->profiler->lineIndices[instructionPointer];
+	if (line != PROFILER_NO_LINE) context->profiler->lines[line].externalTime += time;
+}
+
 // --------------------------------- Main script execution.
 
 void HeapGarbageCollectMark(ExecutionContext *context, uintptr_t index) {
@@ -4898,6 +5164,10 @@ int ScriptExecuteFunction(uintptr_t instructionPointer, ExecutionContext *contex
 	while (true) {
 		uint8_t command = functionData[instructionPointer++];
 
+		if (context->profiler) {
+			ProfilerStep(context, instructionPointer - 1);
+		}
+
 		if (debugBytecodeLevel >= 1) {
 			PrintDebug("--> %d, %ld, %ld, %ld\n", command, instructionPointer - 1, context->c->id, context->c->stackPointer);
 			if (debugBytecodeLevel >= 2) PrintBackTrace(context, instructionPointer - 1, context->c, "");
@@ -6196,9 +6466,17 @@ int ScriptExecuteFunction(uintptr_t instructionPointer, ExecutionContext *contex
 
 				if (index < sizeof(externalFunctions) / sizeof(externalFunctions[0])) {
 					Value returnValue;
+					uint64_t profileStart = context->profiler ? TimeGetMonotonic() : 0;
 					int result = externalFunctions[index].callback(context, &returnValue);
 					if (result <= 0) return result;
 
+					if (context->profiler) {
+						uint64_t profileEnd = TimeGetMonotonic();
+						uint64_t start = context->c->externalCoroutine ? context->c->profileExternalStart : profileStart;
+						if (result == EXTCALL_START_COROUTINE) context->c->profileExternalStart = profileStart;
+						else ProfilerAddExternalTime(context, instructionPointer - 3, profileEnd - start);
+					}
+
 					if (result == EXTCALL_START_COROUTINE) {
 						context->externalCoroutineCount++;
 						context->c->externalCoroutine = true;
@@ -6675,9 +6953,523 @@ void ScriptFree(ExecutionContext *context) {
 	AllocateResize(context->globalVariableIsManaged, 0);
 	AllocateResize(context->functionData->lineNumbers, 0);
 	AllocateResize(context->functionData->data, 0);
+	AllocateResize(context->functionData->typeRelocations, 0);
 	AllocateResize(context->scriptPersistFile, 0);
 }
 
+// --------------------------------- Bytecode images.
+
+// A bytecode image stores everything ScriptLoad produces for a script and its imports: the function data, the line number table,
+// the initial global variables, and the root scope of each module with its types (which are still needed after loading,
+// for options, persistent variables and finding the start function). The hash of each module's source is recorded,
+// and the image is only used if all of them still match.
+
+#define IMAGE_SIGNATURE (0x43425345) // "ESBC"
+#define IMAGE_VERSION   (2) // Increment this whenever the bytecode or the image layout changes.
+#define IMAGE_NONE      (0xFFFFFFFF)
+
+#define IMAGE_NODE_PERSISTENT (1 << 0)
+#define IMAGE_NODE_OPTION     (1 << 1)
+#define IMAGE_NODE_EXTCALL    (1 << 2)
+
+typedef struct ImageBuffer {
+	uint8_t *data;
+	size_t bytes;
+	size_t allocated;
+	uintptr_t position;
+	bool error;
+} ImageBuffer;
+
+typedef struct ImageNodeList {
+	Node **nodes;
+	size_t count;
+	size_t allocated;
+} ImageNodeList;
+
+uint64_t ScriptImageEngineHash() {
+	// External functions are referenced by their index in the bytecode.
+	uint32_t layout[] = { IMAGE_VERSION, sizeof(Value), sizeof(Node *), sizeof(externalFunctions) / sizeof(externalFunctions[0]) };
+	uint64_t hash = HashFNV1a(FNV1A_BASIS, layout, sizeof(layout));
+
+	for (uintptr_t i = 0; i < sizeof(externalFunctions) / sizeof(externalFunctions[0]); i++) {
+		for (uintptr_t j = 0; true; j++) {
+			hash = HashFNV1a(hash, &externalFunctions[i].cName[j], 1);
+			if (!externalFunctions[i].cName[j]) break;
+		}
+	}
+
+	return hash;
+}
+
+uint32_t ImageModuleIndex(ImportData *module) {
+	uint32_t index = 0;
+
+	for (ImportData *item = importedModules; item; item = item->nextImport, index++) {
+		if (item == module) {
+			return index;
+		}
+	}
+
+	return IMAGE_NONE;
+}
+
+uint32_t ImageNodeListAdd(ImageNodeList *list, Node *node) {
+	if (!node) {
+		return IMAGE_NONE;
+	}
+
+	for (uintptr_t i = 0; i < list->count; i++) {
+		if (list->nodes[i] == node) {
+			return i;
+		}
+	}
+
+	if (list->count == list->allocated) {
+		list->allocated = 2 * list->allocated + 16;
+		list->nodes = (Node **) AllocateResize(list->nodes, list->allocated * sizeof(Node *));
+	}
+
+	uint32_t index = list->count;
+	list->nodes[list->count++] = node;
+
+	// Add the node before its children, so that cycles between struct types terminate.
+	Node *child = node->firstChild;
+
+	while (child) {
+		ImageNodeListAdd(list, child);
+		child = child->sibling;
+	}
+
+	return index;
+}
+
+void ImageWrite(ImageBuffer *image, const void *buffer, size_t bytes) {
+	if (image->bytes + bytes > image->allocated) {
+		image->allocated = 2 * image->allocated + bytes;
+		image->data = (uint8_t *) AllocateResize(image->data, image->allocated);
+	}
+
+	if (bytes) MemoryCopy(image->data + image->bytes, buffer, bytes);
+	image->bytes += bytes;
+}
+
+void ImageWrite8(ImageBuffer *image, uint8_t x) { ImageWrite(image, &x, sizeof(x)); }
+void ImageWrite32(ImageBuffer *image, uint32_t x) { ImageWrite(image, &x, sizeof(x)); }
+void ImageWrite64(ImageBuffer *image, uint64_t x) { ImageWrite(image, &x, sizeof(x)); }
+
+void ImageWriteToken(ImageBuffer *image, Token *token) {
+	ImageWrite32(image, ImageModuleIndex(token->module));
+	ImageWrite32(image, token->line);
+	ImageWrite32(image, token->textBytes);
+	ImageWrite(image, token->text, token->textBytes);
+}
+
+void ImageWriteNodeHeader(ImageBuffer *image, Node *node) {
+	ImageWrite8(image, node->type);
+	ImageWrite8(image, (node->isPersistentVariable ? IMAGE_NODE_PERSISTENT : 0) 
+			| (node->isOptionVariable ? IMAGE_NODE_OPTION : 0) | (node->isExternalCall ? IMAGE_NODE_EXTCALL : 0));
+	ImageWrite32(image, node->inlineImportVariableIndex);
+	ImageWriteToken(image, &node->token);
+}
+
+void ImageRead(ImageBuffer *image, void *buffer, size_t bytes) {
+	if (image->error || bytes > image->bytes - image->position) {
+		image->error = true;
+		for (uintptr_t i = 0; i < bytes; i++) ((uint8_t *) buffer)[i] = 0;
+	} else {
+		if (bytes) MemoryCopy(buffer, image->data + image->position, bytes);
+		image->position += bytes;
+	}
+}
+
+uint8_t ImageRead8(ImageBuffer *image) { uint8_t x; ImageRead(image, &x, sizeof(x)); return x; }
+uint32_t ImageRead32(ImageBuffer *image) { uint32_t x; ImageRead(image, &x, sizeof(x)); return x; }
+uint64_t ImageRead64(ImageBuffer *image) { uint64_t x; ImageRead(image, &x, sizeof(x)); return x; }
+
+uint32_t ImageReadCount(ImageBuffer *image) {
+	// Every counted item takes at least one byte, so anything larger than the remaining data is corrupt.
+	uint32_t count = ImageRead32(image);
+	if (count > image->bytes - image->position) image->error = true;
+	return image->error ? 0 : count;
+}
+
+void ImageReadToken(ImageBuffer *image, Token *token, ImportData **modules, uint32_t moduleCount) {
+	uint32_t module = ImageRead32(image);
+	token->module = module < moduleCount ? modules[module] : NULL;
+	token->line = ImageRead32(image);
+	token->textBytes = ImageReadCount(image);
+	char *text = (char *) AllocateFixed(token->textBytes);
+	ImageRead(image, text, token->textBytes);
+	token->text = text;
+}
+
+void ImageReadNodeHeader(ImageBuffer *image, Node *node, ImportData **modules, uint32_t moduleCount) {
+	node->type = ImageRead8(image);
+	uint8_t flags = ImageRead8(image);
+	node->isPersistentVariable = flags & IMAGE_NODE_PERSISTENT;
+	node->isOptionVariable = flags & IMAGE_NODE_OPTION;
+	node->isExternalCall = flags & IMAGE_NODE_EXTCALL;
+	node->inlineImportVariableIndex = ImageRead32(image);
+	ImageReadToken(image, &node->token, modules, moduleCount);
+}
+
+void ScriptImageSave(ExecutionContext *context) {
+	FunctionBuilder *builder = context->functionData;
+	uint32_t moduleCount = 0;
+
+	for (ImportData *module = importedModules; module; module = module->nextImport) {
+		if (module->library) {
+			// Library calls embed addresses that are only valid in this process.
+			return;
+		}
+
+		moduleCount++;
+	}
+
+	ImageBuffer image = { 0 };
+	ImageWrite32(&image, IMAGE_SIGNATURE);
+	ImageWrite64(&image, ScriptImageEngineHash());
+	ImageWrite32(&image, moduleCount);
+
+	for (ImportData *module = importedModules; module; module = module->nextImport) {
+		// The main module is always loaded last.
+		Assert(module->nextImport || module == context->mainModule);
+		ImageWrite32(&image, module->pathBytes);
+		ImageWrite(&image, module->path, module->pathBytes);
+		ImageWrite64(&image, HashFNV1a(FNV1A_BASIS, module->fileData, module->fileDataBytes));
+		ImageWrite32(&image, module->globalVariableOffset);
+	}
+
+	// Collect the types referenced by the root scopes and the bytecode.
+
+	ImageNodeList list = { 0 };
+
+	for (ImportData *module = importedModules; module; module = module->nextImport) {
+		for (uintptr_t i = 0; i < module->rootNode->scope->entryCount; i++) {
+			ImageNodeListAdd(&list, module->rootNode->scope->entries[i]->expressionType);
+		}
+	}
+
+	for (uintptr_t i = 0; i < builder->typeRelocationCount; i++) {
+		Node *type;
+		MemoryCopy(&type, builder->data + builder->typeRelocations[i], sizeof(type));
+		ImageNodeListAdd(&list, type);
+	}
+
+	ImageWrite32(&image, list.count);
+
+	for (uintptr_t i = 0; i < list.count; i++) {
+		ImageWriteNodeHeader(&image, list.nodes[i]);
+		uint32_t childCount = 0;
+		for (Node *child = list.nodes[i]->firstChild; child; child = child->sibling) childCount++;
+		ImageWrite32(&image, childCount);
+		for (Node *child = list.nodes[i]->firstChild; child; child = child->sibling) ImageWrite32(&image, ImageNodeListAdd(&list, child));
+	}
+
+	for (ImportData *module = importedModules; module; module = module->nextImport) {
+		Scope *scope = module->rootNode->scope;
+		ImageWrite32(&image, scope->entryCount);
+
+		for (uintptr_t i = 0; i < scope->entryCount; i++) {
+			ImageWriteNodeHeader(&image, scope->entries[i]);
+			ImageWrite32(&image, ImageNodeListAdd(&list, scope->entries[i]->expressionType));
+		}
+	}
+
+	// Only the function pointers are saved; everything else is zero until the options are parsed.
+
+	ImageWrite32(&image, context->globalVariableCount);
+	ImageWrite32(&image, builder->globalVariableOffset);
+
+	for (uintptr_t i = 0; i < context->globalVariableCount; i++) {
+		int64_t lambdaID = 0;
+
+		if (context->globalVariableIsManaged[i] && context->heap[context->globalVariables[i].i].type == T_FUNCPTR) {
+			lambdaID = context->heap[context->globalVariables[i].i].lambdaID;
+		}
+
+		ImageWrite8(&image, context->globalVariableIsManaged[i]);
+		ImageWrite64(&image, lambdaID);
+	}
+
+	ImageWrite32(&image, builder->dataBytes);
+	ImageWrite(&image, builder->data, builder->dataBytes);
+	ImageWrite32(&image, builder->typeRelocationCount);
+
+	for (uintptr_t i = 0; i < builder->typeRelocationCount; i++) {
+		Node *type;
+		MemoryCopy(&type, builder->data + builder->typeRelocations[i], sizeof(type));
+		ImageWrite32(&image, builder->typeRelocations[i]);
+		ImageWrite32(&image, ImageNodeListAdd(&list, type));
+	}
+
+	ImageWrite32(&image, builder->lineNumberCount);
+
+	for (uintptr_t i = 0; i < builder->lineNumberCount; i++) {
+		LineNumber *lineNumber = &builder->lineNumbers[i];
+		ImageWrite32(&image, ImageModuleIndex(lineNumber->importData));
+		ImageWrite32(&image, lineNumber->instructionPointer);
+		ImageWrite32(&image, lineNumber->lineNumber);
+
+		// Line numbers are generated one function at a time, so the function token rarely needs to be stored.
+		if (!lineNumber->function) {
+			ImageWrite8(&image, 0);
+		} else if (i && lineNumber->function == builder->lineNumbers[i - 1].function) {
+			ImageWrite8(&image, 1);
+		} else {
+			ImageWrite8(&image, 2);
+			ImageWriteToken(&image, lineNumber->function);
+		}
+	}
+
+	ImageWrite64(&image, HashFNV1a(FNV1A_BASIS, image.data, image.bytes));
+
+	if (!FileSave(bytecodeImagePath, image.data, image.bytes)) {
+		PrintDebug("\033[0;32mWarning: The bytecode image could not be written to '%s'.\033[0m\n", bytecodeImagePath);
+	}
+
+	AllocateResize(list.nodes, 0);
+	AllocateResize(image.data, 0);
+}
+
+bool ScriptImageLoadContents(ExecutionContext *context, ImageBuffer *image, ImportData **modules, uint32_t moduleCount) {
+	FunctionBuilder *builder = context->functionData;
+
+	// Read the types.
+
+	uint32_t nodeCount = ImageReadCount(image);
+	Node *nodes = (Node *) AllocateFixed(nodeCount * sizeof(Node));
+
+	for (uintptr_t i = 0; i < nodeCount && !image->error; i++) {
+		ImageReadNodeHeader(image, &nodes[i], modules, moduleCount);
+		uint32_t childCount = ImageReadCount(image);
+		Node *previous = NULL;
+
+		for (uintptr_t j = 0; j < childCount; j++) {
+			uint32_t index = ImageRead32(image);
+			if (index >= nodeCount) { image->error = true; break; }
+			if (previous) previous->sibling = &nodes[index];
+			else nodes[i].firstChild = &nodes[index];
+			previous = &nodes[index];
+		}
+	}
+
+	// Rebuild the root scopes.
+
+	Node **rootNodes = (Node **) AllocateFixed(moduleCount * sizeof(Node *));
+
+	for (uintptr_t i = 0; i < moduleCount && !image->error; i++) {
+		Node *root = rootNodes[i] = (Node *) AllocateFixed(sizeof(Node));
+		root->type = T_ROOT;
+		root->scope = (Scope *) AllocateFixed(sizeof(Scope));
+		root->scope->isRoot = true;
+		uint32_t entryCount = ImageReadCount(image);
+
+		for (uintptr_t j = 0; j < entryCount; j++) {
+			Node *entry = (Node *) AllocateFixed(sizeof(Node));
+			ImageReadNodeHeader(image, entry, modules, moduleCount);
+			uint32_t type = ImageRead32(image);
+			if (type != IMAGE_NONE && type >= nodeCount) image->error = true;
+			entry->firstChild = entry->expressionType = type < nodeCount ? &nodes[type] : NULL;
+			entry->parent = root;
+			entry->scope = root->scope;
+			ScopeAppendEntry(root->scope, entry);
+		}
+
+		modules[i]->rootNode = root;
+	}
+
+	// Read the global variables, the bytecode and the line numbers.
+
+	uint32_t globalVariableCount = ImageReadCount(image);
+	uint32_t globalVariableOffset = ImageRead32(image);
+	bool *globalVariableIsManaged = (bool *) AllocateResize(NULL, globalVariableCount * sizeof(bool) + 1);
+	int64_t *lambdaIDs = (int64_t *) AllocateResize(NULL, globalVariableCount * sizeof(int64_t) + 1);
+
+	for (uintptr_t i = 0; i < globalVariableCount; i++) {
+		globalVariableIsManaged[i] = ImageRead8(image);
+		lambdaIDs[i] = ImageRead64(image);
+	}
+
+	uint32_t dataBytes = ImageReadCount(image);
+	uint8_t *data = (uint8_t *) AllocateResize(NULL, dataBytes + 1);
+	ImageRead(image, data, dataBytes);
+
+	uint32_t typeRelocationCount = ImageReadCount(image);
+	uint32_t *typeRelocations = (uint32_t *) AllocateResize(NULL, typeRelocationCount * sizeof(uint32_t) + 1);
+
+	for (uintptr_t i = 0; i < typeRelocationCount; i++) {
+		typeRelocations[i] = ImageRead32(image);
+		uint32_t type = ImageRead32(image);
+
+		if (type >= nodeCount || typeRelocations[i] > dataBytes || dataBytes - typeRelocations[i] < sizeof(Node *)) {
+			image->error = true;
+			break;
+		}
+
+		Node *pointer = &nodes[type];
+		MemoryCopy(data + typeRelocations[i], &pointer, sizeof(pointer));
+	}
+
+	uint32_t lineNumberCount = ImageReadCount(image);
+	LineNumber *lineNumbers = (LineNumber *) AllocateResize(NULL, lineNumberCount * sizeof(LineNumber) + 1);
+
+	for (uintptr_t i = 0; i < lineNumberCount && !image->error; i++) {
+		uint32_t module = ImageRead32(image);
+		lineNumbers[i].importData = module < moduleCount ? modules[module] : NULL;
+		lineNumbers[i].instructionPointer = ImageRead32(image);
+		lineNumbers[i].lineNumber = ImageRead32(image);
+		uint8_t function = ImageRead8(image);
+
+		if (function == 0) {
+			lineNumbers[i].function = NULL;
+		} else if (function == 1 && i) {
+			lineNumbers[i].function = lineNumbers[i - 1].function;
+		} else if (function == 2) {
+			lineNumbers[i].function = (Token *) AllocateFixed(sizeof(Token));
+			ImageReadToken(image, lineNumbers[i].function, modules, moduleCount);
+		} else {
+			image->error = true;
+		}
+	}
+
+	if (image->error || image->position != image->bytes || globalVariableOffset > globalVariableCount) {
+		AllocateResize(globalVariableIsManaged, 0);
+		AllocateResize(lambdaIDs, 0);
+		AllocateResize(data, 0);
+		AllocateResize(typeRelocations, 0);
+		AllocateResize(lineNumbers, 0);
+		for (uintptr_t i = 0; i < moduleCount; i++) if (rootNodes[i]) ASTFreeScopes(rootNodes[i]);
+		return false;
+	}
+
+	// Everything was valid, so update the execution context.
+
+	builder->data = data;
+	builder->dataBytes = builder->dataAllocated = dataBytes;
+	builder->lineNumbers = lineNumbers;
+	builder->lineNumberCount = builder->lineNumbersAllocated = lineNumberCount;
+	builder->typeRelocations = typeRelocations;
+	builder->typeRelocationCount = builder->typeRelocationsAllocated = typeRelocationCount;
+	builder->globalVariableOffset = globalVariableOffset;
+
+	context->globalVariableCount = globalVariableCount;
+	context->globalVariableIsManaged = globalVariableIsManaged;
+	context->globalVariables = (Value *) AllocateResize(NULL, globalVariableCount * sizeof(Value) + 1);
+
+	for (uintptr_t i = 0; i < globalVariableCount; i++) {
+		// Zero everything before allocating, since HeapAllocate can start garbage collection.
+		context->globalVariables[i].i = 0;
+	}
+
+	for (uintptr_t i = 0; i < globalVariableCount; i++) {
+		if (lambdaIDs[i]) {
+			uintptr_t heapIndex = HeapAllocate(context);
+			context->heap[heapIndex].type = T_FUNCPTR;
+			context->heap[heapIndex].lambdaID = lambdaIDs[i];
+			context->globalVariables[i].i = heapIndex;
+		}
+	}
+
+	AllocateResize(lambdaIDs, 0);
+
+	for (uintptr_t i = 0; i < moduleCount; i++) {
+		*importedModulesLink = modules[i];
+		importedModulesLink = &modules[i]->nextImport;
+	}
+
+	return true;
+}
+
+bool ScriptImageLoad(ExecutionContext *context, ImportData *mainModule) {
+	ImageBuffer image = { 0 };
+	image.data = (uint8_t *) FileLoad(bytecodeImagePath, &image.bytes);
+
+	if (!image.data) {
+		return false;
+	}
+
+	uint64_t checksum = 0;
+
+	if (image.bytes >= sizeof(checksum)) {
+		image.bytes -= sizeof(checksum);
+		MemoryCopy(&checksum, image.data + image.bytes, sizeof(checksum));
+	}
+
+	if (checksum != HashFNV1a(FNV1A_BASIS, image.data, image.bytes)
+			|| ImageRead32(&image) != IMAGE_SIGNATURE || ImageRead64(&image) != ScriptImageEngineHash()) {
+		AllocateResize(image.data, 0);
+		return false;
+	}
+
+	// Check that none of the sources have changed.
+
+	uint32_t moduleCount = ImageReadCount(&image);
+	ImportData **modules = (ImportData **) AllocateResize(NULL, moduleCount * sizeof(ImportData *) + 1);
+	uintptr_t modulesLoaded = 0;
+	bool sourcesMatch = moduleCount && !image.error;
+
+	for (; modulesLoaded < moduleCount && sourcesMatch; modulesLoaded++) {
+		ImportData *module = modulesLoaded == moduleCount - 1 ? mainModule : (ImportData *) AllocateFixed(sizeof(ImportData));
+		size_t pathBytes = ImageReadCount(&image);
+		char *path = (char *) AllocateFixed(pathBytes + 1);
+		ImageRead(&image, path, pathBytes);
+		uint64_t hash = ImageRead64(&image);
+		module->globalVariableOffset = ImageRead32(&image);
+
+		if (image.error) {
+			sourcesMatch = false;
+			break;
+		} else if (module == mainModule) {
+			sourcesMatch = pathBytes == module->pathBytes && 0 == MemoryCompare(path, module->path, pathBytes);
+		} else if (pathBytes == 15 && 0 == MemoryCompare(path, "__base_module__", pathBytes)) {
+			module->fileData = baseModuleSource;
+			module->fileDataBytes = sizeof(baseModuleSource) - 1;
+		} else {
+			module->fileData = FileLoad(path, &module->fileDataBytes);
+			if (!module->fileData) { sourcesMatch = false; break; }
+		}
+
+		if (module != mainModule) {
+			module->path = path;
+			module->pathBytes = pathBytes;
+		}
+
+		modules[modulesLoaded] = module;
+		sourcesMatch = sourcesMatch && hash == HashFNV1a(FNV1A_BASIS, module->fileData, module->fileDataBytes);
+	}
+
+	bool success = sourcesMatch && ScriptImageLoadContents(context, &image, modules, moduleCount);
+
+	if (!success) {
+		for (uintptr_t i = 0; i < modulesLoaded; i++) {
+			if (modules[i] != mainModule && modules[i]->fileData != baseModuleSource) {
+				AllocateResize(modules[i]->fileData, 0);
+			}
+		}
+	}
+
+	AllocateResize(modules, 0);
+	AllocateResize(image.data, 0);
+	return success;
+}
+
+bool ScriptImageParseOptions(ExecutionContext *context) {
+	// ScriptLoad does this after generating the code for each module.
+	uintptr_t globalVariableOffset = context->functionData->globalVariableOffset;
+	bool success = true;
+
+	for (ImportData *module = importedModules; module && success; module = module->nextImport) {
+		context->rootNode = module->rootNode;
+		context->functionData->globalVariableOffset = module->globalVariableOffset;
+		success = ScriptParseOptions(context);
+	}
+
+	context->rootNode = NULL;
+	context->functionData->globalVariableOffset = globalVariableOffset;
+	return success;
+}
+
 // --------------------------------- Helpers.
 
 void LineNumberLookup(ExecutionContext *context, uint32_t instructionPointer, LineNumber *output) {
@@ -6770,7 +7562,27 @@ int ScriptExecuteFromFile(char *scriptPath, size_t scriptPathBytes, char *fileDa
 	context.c->previousCoroutineLink = &context.allCoroutines;
 	context.allCoroutines = context.c;
 
-	int result = ScriptLoad(tokenizer, &context, &importData, replMode) ? ScriptExecute(&context, &importData) : 1;
+	bool loaded;
+
+	if (bytecodeImagePath && !replMode && ScriptImageLoad(&context, &importData)) {
+		loaded = ScriptImageParseOptions(&context);
+	} else {
+		loaded = ScriptLoad(tokenizer, &context, &importData, replMode);
+		if (loaded && bytecodeImagePath && !replMode) ScriptImageSave(&context);
+	}
+
+	if (loaded && profileOutputPath) {
+		ProfilerStart(&context);
+	}
+
+	int result = loaded ? ScriptExecute(&context, &importData) : 1;
+
+	if (context.profiler) {
+		ProfilerCharge(context.profiler); // Account for the time of the last instruction.
+		ProfilerWriteOutput(&context);
+		ProfilerFree(&context);
+	}
+
 	ScriptFree(&context);
 
 	importedModules = NULL;
@@ -6840,6 +7652,23 @@ size_t fixedAllocationCurrentSize;
 sem_t externalCoroutineSemaphore;
 pthread_mutex_t externalCoroutineMutex;
 CoroutineState *externalCoroutineUnblockedList;
+CoroutineState **externalCoroutineUnblockedListTail = &externalCoroutineUnblockedList;
+
+typedef struct ShellJob {
+	struct ShellJob *nextJob;
+	CoroutineState *coroutine;
+	char *command;
+	char *workingDirectory; // If NULL, the command is run in the current working directory.
+	uint64_t id, queueTime, startTime;
+} ShellJob;
+
+pthread_mutex_t shellJobMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t shellJobAvailable = PTHREAD_COND_INITIALIZER;
+ShellJob *shellJobQueue, **shellJobQueueTail = &shellJobQueue;
+size_t shellJobWorkerCount, shellJobIdleWorkerCount;
+uint64_t shellJobNextID;
+size_t shellJobLimit; // Set by --jobs=; 0 means the number of processors.
+bool shellJobTimingEnabled; // Set by --log-job-times.
 
 bool systemShellLoggingEnabled = true;
 bool coloredOutput;
@@ -6883,9 +7712,11 @@ void MakeError(ExecutionContext *context, Value *returnValue, int error) {
 
 void ExternalCoroutineDone(CoroutineState *coroutine) {
 #ifdef __linux__
+	// Coroutines are resumed in the order their external work completed.
 	pthread_mutex_lock(&externalCoroutineMutex);
-	coroutine->nextExternalCoroutine = externalCoroutineUnblockedList;
-	externalCoroutineUnblockedList = coroutine;
+	coroutine->nextExternalCoroutine = NULL;
+	*externalCoroutineUnblockedListTail = coroutine;
+	externalCoroutineUnblockedListTail = &coroutine->nextExternalCoroutine;
 	pthread_mutex_unlock(&externalCoroutineMutex);
 	sem_post(&externalCoroutineSemaphore);
 #else
@@ -6893,14 +7724,114 @@ void ExternalCoroutineDone(CoroutineState *coroutine) {
 #endif
 }
 
-void *SystemShellExecuteThread(void *_coroutine) {
-	CoroutineState *coroutine = (CoroutineState *) _coroutine;
-	coroutine->externalCoroutineData.i = system((char *) coroutine->externalCoroutineData2) == 0;
-	free((char *) coroutine->externalCoroutineData2);
-	ExternalCoroutineDone(coroutine);
+#ifdef __linux__
+bool ShellJobRun(ShellJob *job) {
+	if (!job->workingDirectory) {
+		return system(job->command) == 0;
+	}
+
+	// Only async-signal-safe functions may be called in the child, since other workers may be running.
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		if (chdir(job->workingDirectory)) _exit(127);
+		execl("/bin/sh", "sh", "-c", job->command, (char *) NULL);
+		_exit(127);
+	} else if (pid < 0) {
+		PrintDebug("Unable to fork(), got pid = %d, errno = %d.\n", pid, errno);
+		return false;
+	}
+
+	int status;
+
+	if (waitpid(pid, &status, 0) != pid) {
+		perror("waitpid failed");
+		return false;
+	}
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void *ShellJobWorkerThread(void *_unused) {
+	(void) _unused;
+	pthread_mutex_lock(&shellJobMutex);
+
+	while (true) {
+		while (!shellJobQueue) {
+			shellJobIdleWorkerCount++;
+			pthread_cond_wait(&shellJobAvailable, &shellJobMutex);
+			shellJobIdleWorkerCount--;
+		}
+
+		ShellJob *job = shellJobQueue;
+		shellJobQueue = job->nextJob;
+		if (!shellJobQueue) shellJobQueueTail = &shellJobQueue;
+		pthread_mutex_unlock(&shellJobMutex);
+
+		job->startTime = TimeGetMonotonic();
+		job->coroutine->externalCoroutineData.i = ShellJobRun(job);
+
+		if (shellJobTimingEnabled) {
+			uint64_t endTime = TimeGetMonotonic();
+			fprintf(stderr, "Job %ld: queued %.1f ms, ran %.1f ms: %s\n", job->id, 
+					(job->startTime - job->queueTime) / 1000000.0, (endTime - job->startTime) / 1000000.0, job->command);
+		}
+
+		ExternalCoroutineDone(job->coroutine);
+		free(job->command);
+		free(job->workingDirectory);
+		free(job);
+		pthread_mutex_lock(&shellJobMutex);
+	}
+
 	return NULL;
 }
 
+bool ShellJobQueue(CoroutineState *coroutine, char *command, char *workingDirectory) {
+	// Takes ownership of the strings. The coroutine is resumed when the job completes.
+	// At most shellJobLimit jobs run at once; the rest wait in the queue in submission order.
+
+	ShellJob *job = (ShellJob *) calloc(1, sizeof(ShellJob));
+
+	if (!job) {
+		free(command);
+		free(workingDirectory);
+		return false;
+	}
+
+	job->coroutine = coroutine;
+	job->command = command;
+	job->workingDirectory = workingDirectory;
+	job->queueTime = TimeGetMonotonic();
+
+	if (!shellJobLimit) {
+		long processors = sysconf(_SC_NPROCESSORS_ONLN);
+		shellJobLimit = processors > 0 ? processors : 1;
+	}
+
+	pthread_mutex_lock(&shellJobMutex);
+	job->id = ++shellJobNextID;
+	*shellJobQueueTail = job;
+	shellJobQueueTail = &job->nextJob;
+
+	if (!shellJobIdleWorkerCount && shellJobWorkerCount < shellJobLimit) {
+		pthread_t thread;
+
+		if (!pthread_create(&thread, NULL, ShellJobWorkerThread, NULL)) {
+			pthread_detach(thread);
+			shellJobWorkerCount++;
+		}
+
+		Assert(shellJobWorkerCount); // The job would never run.
+	} else {
+		pthread_cond_signal(&shellJobAvailable);
+	}
+
+	pthread_mutex_unlock(&shellJobMutex);
+	return true;
+}
+#endif
+
 int ExternalSystemShellExecute(ExecutionContext *context, Value *returnValue) {
 	if (context->c->externalCoroutine) {
 		*returnValue = context->c->externalCoroutineData;
@@ -6912,15 +7843,13 @@ int ExternalSystemShellExecute(ExecutionContext *context, Value *returnValue) {
 
 	if (temporary) {
 		if (systemShellLoggingEnabled) PrintDebug("\033[0;32m%s\033[0m\n", temporary);
-		context->c->externalCoroutineData2 = temporary;
 #ifdef __linux__
-		pthread_t thread;
-		pthread_create(&thread, NULL, SystemShellExecuteThread, context->c);
-		pthread_detach(thread);
-		return EXTCALL_START_COROUTINE;
+		if (ShellJobQueue(context->c, temporary, NULL)) return EXTCALL_START_COROUTINE;
+		returnValue->i = 0;
+		return EXTCALL_RETURN_UNMANAGED;
 #else
-		SystemShellExecuteThread(context->c);
-		*returnValue = context->c->externalCoroutineData;
+		returnValue->i = system(temporary) == 0;
+		free(temporary);
 		return EXTCALL_RETURN_UNMANAGED;
 #endif
 	} else {
@@ -6930,23 +7859,6 @@ int ExternalSystemShellExecute(ExecutionContext *context, Value *returnValue) {
 	}
 }
 
-void *SystemShellExecuteWithWorkingDirectoryThread(void *_coroutine) {
-	CoroutineState *coroutine = (CoroutineState *) _coroutine;
-	int status;
-	pid_t p = waitpid(coroutine->externalCoroutineData.i, &status, 0);
-
-	if (p != coroutine->externalCoroutineData.i) {
-		fprintf(stderr, "waitpid returned %d\n", p);
-		perror("waitpid failed");
-		coroutine->externalCoroutineData.i = 0;
-	} else {
-		coroutine->externalCoroutineData.i = WEXITSTATUS(status) == 0;
-	}
-
-	ExternalCoroutineDone(coroutine);
-	return NULL;
-}
-
 int ExternalSystemShellExecuteWithWorkingDirectory(ExecutionContext *context, Value *returnValue) {
 	if (context->c->externalCoroutine) {
 		*returnValue = context->c->externalCoroutineData;
@@ -6958,31 +7870,12 @@ int ExternalSystemShellExecuteWithWorkingDirectory(ExecutionContext *context, Va
 	char *temporary = StringZeroTerminate(entryText, entryBytes);
 	if (!temporary) return EXTCALL_RETURN_MANAGED;
 	char *temporary2 = StringZeroTerminate(entry2Text, entry2Bytes);
-	if (!temporary2) return EXTCALL_RETURN_MANAGED;
+	if (!temporary2) { free(temporary); return EXTCALL_RETURN_MANAGED; }
 
 	if (systemShellLoggingEnabled) PrintDebug("\033[0;32m(%s) %s\033[0m\n", temporary, temporary2);
 	
 #ifdef __linux__
-	pid_t pid = fork();
-
-	if (pid == 0) {
-		Assert(chdir(temporary) == 0);
-		exit(system(temporary2));
-	} else if (pid < 0) {
-		PrintDebug("Unable to fork(), got pid = %d, errno = %d.\n", pid, errno);
-		returnValue->i = 0;
-	} 
-
-	free(temporary);
-	free(temporary2);
-
-	if (pid > 0) {
-		context->c->externalCoroutineData.i = pid;
-		pthread_t thread;
-		pthread_create(&thread, NULL, SystemShellExecuteWithWorkingDirectoryThread, context->c);
-		pthread_detach(thread);
-		return EXTCALL_START_COROUTINE;
-	}
+	if (ShellJobQueue(context->c, temporary2, temporary)) return EXTCALL_START_COROUTINE;
 #else
 	char *data = (char *) malloc(10000);
 
@@ -7665,6 +8558,7 @@ CoroutineState *ExternalCoroutineWaitAny(ExecutionContext *context) {
 	CoroutineState *unblocked = externalCoroutineUnblockedList;
 	Assert(unblocked);
 	externalCoroutineUnblockedList = unblocked->nextExternalCoroutine;
+	if (!externalCoroutineUnblockedList) externalCoroutineUnblockedListTail = &externalCoroutineUnblockedList;
 	unblocked->nextExternalCoroutine = NULL;
 	pthread_mutex_unlock(&externalCoroutineMutex);
 	return unblocked;
@@ -7899,6 +8793,14 @@ void *LibraryGetAddress(void *library, const char *name) {
 	return address;
 }
 
+bool FileSave(const char *path, const void *data, size_t bytes) {
+	FILE *file = fopen(path, "wb");
+	if (!file) return false;
+	bool success = fwrite(data, 1, bytes, file) == bytes;
+	if (fclose(file)) success = false;
+	return success;
+}
+
 void *FileLoad(const char *path, size_t *length) {
 	FILE *file = fopen(path, "rb");
 	if (!file) return NULL;
@@ -7917,6 +8819,157 @@ void *FileLoad(const char *path, size_t *length) {
 	return buffer;
 }
 
+uint64_t TimeGetMonotonic() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+typedef struct ProfileSummaryEntry {
+	ImportData *module;
+	Token *function;
+	uint32_t lineNumber;
+	uint64_t instructions, time, externalTime;
+} ProfileSummaryEntry;
+
+int ProfileSummaryCompareKeys(const void *_a, const void *_b) {
+	const ProfileSummaryEntry *a = (const ProfileSummaryEntry *) _a, *b = (const ProfileSummaryEntry *) _b;
+	if (a->module != b->module) return (uintptr_t) a->module < (uintptr_t) b->module ? -1 : 1;
+	if (a->function != b->function) return (uintptr_t) a->function < (uintptr_t) b->function ? -1 : 1;
+	return a->lineNumber < b->lineNumber ? -1 : a->lineNumber > b->lineNumber ? 1 : 0;
+}
+
+int ProfileSummaryCompareTimes(const void *_a, const void *_b) {
+	const ProfileSummaryEntry *a = (const ProfileSummaryEntry *) _a, *b = (const ProfileSummaryEntry *) _b;
+	return a->time > b->time ? -1 : a->time < b->time ? 1 : 0;
+}
+
+size_t ProfileSummaryMerge(ProfileSummaryEntry *entries, size_t count) {
+	qsort(entries, count, sizeof(ProfileSummaryEntry), ProfileSummaryCompareKeys);
+	size_t merged = 0;
+
+	for (uintptr_t i = 0; i < count; i++) {
+		if (merged && !ProfileSummaryCompareKeys(&entries[merged - 1], &entries[i])) {
+			entries[merged - 1].instructions += entries[i].instructions;
+			entries[merged - 1].time += entries[i].time;
+			entries[merged - 1].externalTime += entries[i].externalTime;
+		} else {
+			entries[merged++] = entries[i];
+		}
+	}
+
+	qsort(entries, merged, sizeof(ProfileSummaryEntry), ProfileSummaryCompareTimes);
+	return merged;
+}
+
+void ProfilerWriteFrame(FILE *file, Token *function) {
+	if (function) {
+		fprintf(file, "%.*s:%.*s", (int) function->module->pathBytes, function->module->path, 
+				(int) function->textBytes, function->text);
+	} else {
+		fprintf(file, "[unknown]");
+	}
+}
+
+void ProfilerWriteOutput(ExecutionContext *context) {
+	Profiler *profiler = context->profiler;
+	FunctionBuilder *builder = context->functionData;
+
+	// Write the stacks in the folded format, as accepted by flamegraph.pl and speedscope.
+
+	FILE *file = fopen(profileOutputPath, "wb");
+	uint64_t totalTime = 0;
+
+	if (!file) {
+		PrintError3("The profile could not be written to \"%s\".\n", profileOutputPath);
+	} 
+
+	for (uintptr_t i = 0; i < profiler->stackCount; i++) {
+		ProfileStack *stack = &profiler->stacks[i];
+		totalTime += stack->time;
+		if (!file || stack->time < 1000) continue;
+
+		for (uintptr_t j = 0; j < stack->frameCount; j++) {
+			if (j) fputc(';', file);
+			ProfilerWriteFrame(file, profiler->framePool[stack->firstFrame + j]);
+		}
+
+		fprintf(file, " %lu\n", (unsigned long) (stack->time / 1000));
+	}
+
+	if (file) fclose(file);
+
+	// Print a summary of the functions and lines with the highest self time.
+
+	size_t count = builder->lineNumberCount;
+	ProfileSummaryEntry *functions = (ProfileSummaryEntry *) calloc(count + 1, sizeof(ProfileSummaryEntry));
+	ProfileSummaryEntry *lines = (ProfileSummaryEntry *) calloc(count + 1, sizeof(ProfileSummaryEntry));
+
+	for (uintptr_t i = 0; i < count; i++) {
+		LineNumber *lineNumber = &builder->lineNumbers[i];
+		ProfileLine *line = &profiler->lines[i];
+		ProfileSummaryEntry entry = { lineNumber->importData, lineNumber->function, 0, line->instructions, line->time, line->externalTime };
+		functions[i] = entry;
+		entry.function = NULL;
+		entry.lineNumber = lineNumber->lineNumber;
+		lines[i] = entry;
+	}
+
+	size_t functionCount = ProfileSummaryMerge(functions, count);
+	size_t lineCount = ProfileSummaryMerge(lines, count);
+
+	fprintf(stderr, "Profiled %.3f ms; folded stacks written to \"%s\".\n", totalTime / 1000000.0, profileOutputPath);
+	fprintf(stderr, "%12s %12s %14s  %s\n", "self (ms)", "extern (ms)", "instructions", "function");
+
+	for (uintptr_t i = 0; i < functionCount && i < 20 && functions[i].instructions; i++) {
+		fprintf(stderr, "%12.3f %12.3f %14lu  ", functions[i].time / 1000000.0, functions[i].externalTime / 1000000.0, 
+				(unsigned long) functions[i].instructions);
+		ProfilerWriteFrame(stderr, functions[i].function);
+		fputc('\n', stderr);
+	}
+
+	fprintf(stderr, "%12s %12s %14s  %s\n", "self (ms)", "extern (ms)", "instructions", "line");
+
+	for (uintptr_t i = 0; i < lineCount && i < 20 && lines[i].instructions; i++) {
+		fprintf(stderr, "%12.3f %12.3f %14lu  %.*s:%d\n", lines[i].time / 1000000.0, lines[i].externalTime / 1000000.0, 
+				(unsigned long) lines[i].instructions, lines[i].module ? (int) lines[i].module->pathBytes : 9, 
+				lines[i].module ? lines[i].module->path : "[unknown]", lines[i].lineNumber);
+	}
+
+	free(functions);
+	free(lines);
+}
+
+int BenchmarkCompile(int count) {
+	// Generate a script with many globals and functions, each referencing several of the others,
+	// to measure how compile time scales with the size of the root scope.
+
+	size_t bufferAllocated = 256 * (count + 1);
+	char *buffer = (char *) malloc(bufferAllocated);
+	size_t position = 0;
+
+	for (int i = 0; i < count; i++) {
+		position += snprintf(buffer + position, bufferAllocated - position, "int global%d;\n", i);
+	}
+
+	for (int i = 0; i < count; i++) {
+		position += snprintf(buffer + position, bufferAllocated - position, 
+				"int Function%d(int x) { int y = x + global%d + global%d; return %s%d%s + y; }\n", 
+				i, i, (i * 7) % count, i ? "Function" : "", i ? i - 1 : 0, i ? "(y)" : "");
+	}
+
+	position += snprintf(buffer + position, bufferAllocated - position, "void Start() { global0 = 1; }\n");
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int result = ScriptExecuteFromFile("[benchmark]", 11, buffer, position, false);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double milliseconds = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+	fprintf(stderr, "Compiled %d globals and %d functions (%ld bytes) in %.2f ms.\n", count, count, position, milliseconds);
+	return result;
+}
+
 int main(int argc, char **argv) {
 	if (argc < 2) {
 		fprintf(stderr, "Usage: %s <engine options...> <path to script> <script options...>\n", argv[0]);
@@ -7930,6 +8983,7 @@ int main(int argc, char **argv) {
 	char *scriptPath = NULL;
 	char *evaluateString = NULL;
 	bool evaluateMode = false;
+	int benchmarkCompileCount = 0;
 
 	for (int i = 1; i < argc; i++) {
 		if (argv[i][0] != '-') {
@@ -7948,6 +9002,16 @@ int main(int argc, char **argv) {
 			startFunctionBytes = strlen(argv[i]) - 8;
 		} else if (0 == memcmp(argv[i], "--debug-bytecode=", 17)) {
 			debugBytecodeLevel = atoi(argv[i] + 17);
+		} else if (0 == memcmp(argv[i], "--bytecode-image=", 17)) {
+			bytecodeImagePath = argv[i] + 17;
+		} else if (0 == memcmp(argv[i], "--jobs=", 7)) {
+			shellJobLimit = atoi(argv[i] + 7);
+		} else if (0 == strcmp(argv[i], "--log-job-times")) {
+			shellJobTimingEnabled = true;
+		} else if (0 == memcmp(argv[i], "--profile=", 10)) {
+			profileOutputPath = argv[i] + 10;
+		} else if (0 == memcmp(argv[i], "--benchmark-compile=", 20)) {
+			benchmarkCompileCount = atoi(argv[i] + 20);
 		} else if (0 == strcmp(argv[i], "--evaluate") || 0 == strcmp(argv[i], "-e")) {
 			evaluateMode = true;
 		} else {
@@ -7956,6 +9020,14 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if (benchmarkCompileCount > 0) {
+		scriptSourceDirectory = (char *) malloc(2);
+		strcpy(scriptSourceDirectory, ".");
+		int result = BenchmarkCompile(benchmarkCompileCount);
+		free(scriptSourceDirectory);
+		return result;
+	}
+
 	if (!scriptPath && !evaluateString) {
 		fprintf(stderr, "Error: %s\n", evaluateMode ? "String to evaluate not specified." : "Path to script not specified.");
 		return 1;
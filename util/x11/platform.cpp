@@ -20,6 +20,9 @@
 #include <sys/statvfs.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/futex.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
@@ -461,22 +464,31 @@ uintptr_t _APISyscall(uintptr_t index, uintptr_t argument0, uintptr_t argument1,
 		Node *node = (Node *) HandleResolve(argument0, OBJECT_NODE);
 		ssize_t x = write(node->fd, (void *) argument1, argument2);
 		return x < 0 ? ES_ERROR_UNKNOWN : x;
+	} else if (index == ES_SYSCALL_PIPE_READ_VECTORED || index == ES_SYSCALL_PIPE_WRITE_VECTORED) {
+		// EsPipeVector has the same layout as struct iovec.
+		Node *node = (Node *) HandleResolve(argument0, OBJECT_NODE);
+		ssize_t x = index == ES_SYSCALL_PIPE_READ_VECTORED ? readv(node->fd, (const struct iovec *) argument1, argument2)
+			: writev(node->fd, (const struct iovec *) argument1, argument2);
+		return x < 0 ? ES_ERROR_UNKNOWN : x;
 	} else if (index == ES_SYSCALL_PRINT) {
 		fwrite((void *) argument0, 1, argument1, stderr);
 		return ES_SUCCESS;
 	} else if (index == ES_SYSCALL_MESSAGE_GET) {
-		bool gotMessage = false;
+		size_t maximumCount = argument1 ? argument1 : 1, count = 0;
 		pthread_mutex_lock(&messageQueueMutex);
 
-		if (messageQueue.Length()) {
+		while (messageQueue.Length() && count < maximumCount) {
 			sem_wait(&messagesAvailable);
-			*(_EsMessageWithObject *) argument0 = messageQueue.First();
+			((_EsMessageWithObject *) argument0)[count++] = messageQueue.First();
 			messageQueue.Delete(0);
-			gotMessage = true;
 		}
 
 		pthread_mutex_unlock(&messageQueueMutex);
-		return gotMessage ? ES_SUCCESS : ES_ERROR_NO_MESSAGES_AVAILABLE;
+		return count ? count : ES_ERROR_NO_MESSAGES_AVAILABLE;
+	} else if (index == ES_SYSCALL_IO_RING_CREATE) {
+		return ES_ERROR_UNSUPPORTED_FEATURE;
+	} else if (index == ES_SYSCALL_MESSAGE_RING_CREATE) {
+		return ES_ERROR_UNSUPPORTED_FEATURE; // Messages are received with ES_SYSCALL_MESSAGE_GET instead.
 	} else if (index == ES_SYSCALL_MESSAGE_WAIT) {
 		sem_wait(&messagesAvailable);
 		sem_post(&messagesAvailable);
@@ -727,6 +739,16 @@ uintptr_t _APISyscall(uintptr_t index, uintptr_t argument0, uintptr_t argument1,
 		assert(object->type == OBJECT_EVENT); // TODO Waiting on other object types.
 		Event *event = (Event *) object;
 		return EventWait(event, argument2) ? ES_ERROR_TIMEOUT_REACHED : 0;
+	} else if (index == ES_SYSCALL_FUTEX_WAIT) {
+		struct timespec timeout = { (time_t) (argument2 / 1000), (long) (argument2 % 1000) * 1000000 };
+		long result = syscall(SYS_futex, (uint32_t *) argument0, FUTEX_WAIT_PRIVATE, (uint32_t) argument1, 
+				argument2 == (uintptr_t) ES_WAIT_NO_TIMEOUT ? nullptr : &timeout, nullptr, 0);
+		if (result == -1 && errno == EAGAIN) return ES_ERROR_FUTEX_VALUE_CHANGED;
+		if (result == -1 && errno == ETIMEDOUT) return ES_ERROR_TIMEOUT_REACHED;
+		return ES_SUCCESS;
+	} else if (index == ES_SYSCALL_FUTEX_WAKE) {
+		int count = argument1 > INT32_MAX ? INT32_MAX : argument1;
+		return syscall(SYS_futex, (uint32_t *) argument0, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
 	} else if (index == ES_SYSCALL_PROCESS_TERMINATE) {
 		exit(argument1);
 	} else if (index == ES_SYSCALL_PROCESS_CRASH) {